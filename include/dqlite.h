@@ -132,6 +132,75 @@ int dqlite_node_set_network_latency(dqlite_node *n,
  */
 int dqlite_node_set_failure_domain(dqlite_node *n, unsigned long long code);
 
+/**
+ * Let the node move database pages out of memory, to a sparse file in its data
+ * directory, once they haven't been used for @idle milliseconds, or when the
+ * pages that a database keeps in memory exceed @budget bytes. Zero disables
+ * either condition. See dqlite_vfs_enable_spill().
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_spill(dqlite_node *n, unsigned idle, size_t budget);
+
+/**
+ * Let the node compress the database pages that weren't used during the last
+ * @checkpoints checkpoints. See dqlite_vfs_enable_compression().
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_page_compression(dqlite_node *n, unsigned checkpoints);
+
+/**
+ * Let the node back database pages with transparent huge pages. See
+ * dqlite_vfs_enable_huge_pages().
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_enable_huge_pages(dqlite_node *n);
+
+/* Codecs for compressing snapshots. */
+#define DQLITE_SNAPSHOT_COMPRESSION_NONE 0
+#define DQLITE_SNAPSHOT_COMPRESSION_LZ4 1
+#define DQLITE_SNAPSHOT_COMPRESSION_ZSTD 2
+
+/**
+ * Let the node compress the content of the databases in the snapshots it takes
+ * with the given codec. Snapshots are not compressed by default.
+ *
+ * LZ4 is always available, while zstd is only available if dqlite was built
+ * with it: if it wasn't, DQLITE_ERROR is returned.
+ *
+ * Compressed snapshots can't be restored by nodes running a version of dqlite
+ * that doesn't know about them, so compression should only be enabled once all
+ * nodes of the cluster are upgraded.
+ *
+ * This function must be called before calling dqlite_node_start().
+ */
+int dqlite_node_set_snapshot_compression(dqlite_node *n, int codec);
+
+/**
+ * Counters of the snapshots of the node since it was created.
+ */
+struct dqlite_node_snapshot_stats
+{
+	unsigned long long taken;    /* Snapshots taken. */
+	unsigned long long pending;  /* Taken while a write was in progress. */
+	unsigned long long deferred; /* Attempts deferred by a write. */
+};
+
+/**
+ * Fill @stats with the counters of the snapshots of the node.
+ *
+ * Snapshots are taken while write transactions are in progress, as long as
+ * none of their frames were replicated yet. Transactions that replicated some
+ * already, because SQLite spilled dirty pages before committing, defer the
+ * snapshot to the next attempt.
+ *
+ * This function can be called at any time, also while the node is running.
+ */
+int dqlite_node_snapshot_stats(dqlite_node *n,
+			       struct dqlite_node_snapshot_stats *stats);
+
 /**
  * Start a dqlite node.
  *
@@ -241,4 +310,172 @@ int dqlite_vfs_commit(sqlite3_vfs *vfs,
 		      unsigned *page_numbers,
 		      void *frames);
 
+/**
+ * Same as @dqlite_vfs_commit, but without copying the content of the frames.
+ *
+ * The VFS takes ownership of the @frames buffer and uses it directly as backing
+ * storage for the new WAL frames. When the frames are not needed anymore (for
+ * example after a checkpoint), the @release callback is invoked with the given
+ * @arg argument, and the buffer can then be freed or reused. The content of the
+ * buffer must not be modified in the meantime.
+ *
+ * If this function fails, ownership of the buffer stays with the caller and
+ * @release is not invoked.
+ */
+int dqlite_vfs_commit_adopt(sqlite3_vfs *vfs,
+			    const char *filename,
+			    unsigned n,
+			    unsigned *page_numbers,
+			    void *frames,
+			    void (*release)(void *arg),
+			    void *arg);
+
+/**
+ * Same as @dqlite_vfs_poll, but return the frames as a single contiguous
+ * buffer of @len bytes, ready to be sent over the network as is. The buffer is
+ * laid out like the frames of a dqlite FRAMES command, with all integers in
+ * little endian order:
+ *
+ * - the number of frames, as a 32-bit integer;
+ * - the page size, as a 16-bit integer, where 1 stands for 65536;
+ * - 16 bits of padding;
+ * - the page number of each frame, as a 64-bit integer;
+ * - the content of each page.
+ *
+ * The buffer must be released with sqlite3_free(). If no write transaction
+ * was triggered, @buf is set to NULL and @len to zero.
+ */
+int dqlite_vfs_poll_batch(sqlite3_vfs *vfs,
+			  const char *filename,
+			  void **buf,
+			  size_t *len);
+
+/**
+ * Commit a write transaction whose frames are in a buffer laid out like the
+ * ones returned by @dqlite_vfs_poll_batch, for example as received from the
+ * network.
+ *
+ * If @release is NULL the content of the frames is copied, otherwise the VFS
+ * takes ownership of the buffer and uses it directly, as described for
+ * @dqlite_vfs_commit_adopt. Fails with DQLITE_MISUSE if the buffer is malformed
+ * or its page size doesn't match the one of the database, and with DQLITE_ERROR
+ * if there's no such database or it has no WAL open.
+ */
+int dqlite_vfs_commit_batch(sqlite3_vfs *vfs,
+			    const char *filename,
+			    void *buf,
+			    size_t len,
+			    void (*release)(void *arg),
+			    void *arg);
+
+/**
+ * Memory used by a database of a dqlite VFS and by its WAL, in bytes.
+ */
+struct dqlite_vfs_stats
+{
+	size_t pages;    /* Content of the database pages. */
+	size_t frames;   /* WAL frames and copies of pinned pages. */
+	size_t shm;      /* Shared memory regions of the WAL index. */
+	size_t overhead; /* Page index, frame arrays and file objects. */
+	size_t spilled;  /* Pages spilled to disk, not counted as memory. */
+	size_t mapped;   /* Pages read from a loaded image, not counted either. */
+	size_t compressed;   /* Compressed pages, included in @pages. */
+	size_t uncompressed; /* Size of the compressed pages when decompressed. */
+	unsigned long long compressed_reads; /* Reads of compressed pages. */
+	unsigned long long decompressed; /* Pages decompressed by reads/writes. */
+};
+
+/**
+ * Fill @stats with the memory used by the database with the given filename.
+ *
+ * The counters match the sizes of the underlying sqlite3_malloc()
+ * allocations. Pages and frames that are only kept alive by an ongoing
+ * snapshot are not counted.
+ *
+ * The compression ratio is @uncompressed / @compressed, and the read
+ * amplification of compressed pages is @decompressed / @compressed_reads.
+ */
+int dqlite_vfs_stats(sqlite3_vfs *vfs,
+		     const char *filename,
+		     struct dqlite_vfs_stats *stats);
+
+/**
+ * Limit the memory that each database of the VFS can use, as reported by
+ * dqlite_vfs_stats(), to @quota bytes. Zero, the default, means no limit.
+ *
+ * Once the quota is reached, SQLite writes of new WAL frames fail with
+ * SQLITE_FULL. Commits, checkpoints and snapshot restores are never refused,
+ * since they apply content that is already replicated, so the memory used by a
+ * database can temporarily exceed the quota.
+ */
+void dqlite_vfs_set_quota(sqlite3_vfs *vfs, size_t quota);
+
+/**
+ * Limit the memory used by the temporary files of the VFS, which SQLite uses
+ * for large sorts, temporary tables and statement journals, to @limit bytes.
+ *
+ * Temporary files are kept in memory until the limit is reached. After that,
+ * a temporary file that needs to grow is moved to disk. Zero puts all new
+ * temporary files on disk. The default is 16 MiB.
+ */
+void dqlite_vfs_set_temp_limit(sqlite3_vfs *vfs, size_t limit);
+
+/**
+ * Let the VFS move database pages that are not being used out of memory, to an
+ * unlinked sparse file created in the @dir directory.
+ *
+ * Pages are spilled in batches once they haven't been read or written for
+ * @idle milliseconds, as checked by dqlite_vfs_spill(), and as soon as the
+ * pages that a database keeps in memory exceed @budget bytes, least recently
+ * used first. Zero disables either condition. Spilled pages are read back into
+ * memory the next time they are accessed, and are reported by
+ * dqlite_vfs_stats() separately from memory.
+ *
+ * This function must be called at most once.
+ */
+int dqlite_vfs_enable_spill(sqlite3_vfs *vfs,
+			    const char *dir,
+			    unsigned idle,
+			    size_t budget);
+
+/**
+ * Spill the pages that weren't used for the idle period set with
+ * dqlite_vfs_enable_spill(). Applications should call this periodically.
+ */
+void dqlite_vfs_spill(sqlite3_vfs *vfs);
+
+/**
+ * Compress the database pages that weren't read or written during the last
+ * @checkpoints checkpoints, keeping them in memory. Zero, the default, disables
+ * compression of further pages.
+ *
+ * Reading a compressed page decompresses it into a small cache of recently used
+ * pages, while writing it decompresses the batch of pages it was compressed
+ * with. Fails with DQLITE_ERROR if dqlite was built without zlib support.
+ */
+int dqlite_vfs_enable_compression(sqlite3_vfs *vfs, unsigned checkpoints);
+
+/**
+ * Allocate database pages in 2 MiB regions backed by transparent huge pages,
+ * which makes random accesses to large databases cause fewer TLB misses.
+ *
+ * This affects pages allocated after the call. If the kernel doesn't support
+ * transparent huge pages, the regions use regular pages. Fails with
+ * DQLITE_ERROR if the platform has no support for them at all.
+ */
+int dqlite_vfs_enable_huge_pages(sqlite3_vfs *vfs);
+
+/**
+ * Replace the content of the database with the given filename, and drop its
+ * WAL, with the SQLite database file open at @fd, for example to bootstrap a
+ * node from a local copy of the database.
+ *
+ * The file is memory-mapped instead of being read, so the time this takes
+ * doesn't depend on its size: its pages are read straight from the mapping and
+ * are only copied into memory when written. The file must not be truncated or
+ * modified while the database uses it, but @fd can be closed right away.
+ * Mapped pages are reported by dqlite_vfs_stats() separately from memory.
+ */
+int dqlite_vfs_load_image(sqlite3_vfs *vfs, const char *filename, int fd);
+
 #endif /* DQLITE_H */
@@ -46,6 +46,7 @@ int config__init(struct config *c, dqlite_node_id id, const char *address)
 	c->logger.emit = loggerDefaultEmit;
 	c->failure_domain = 0;
 	c->weight = 0;
+	c->snapshot_compression = DQLITE_SNAPSHOT_COMPRESSION_NONE;
 	serial++;
 	return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
+#include <stdbool.h>
+
 #include "logger.h"
 
 /**
@@ -17,6 +19,7 @@ struct config
 	char name[256];                /* VFS/replication registriatio name */
 	unsigned long long failure_domain; /* User-provided failure domain */
 	unsigned long long int weight;     /* User-provided node weight */
+	unsigned snapshot_compression;     /* Codec of snapshot chunks */
 };
 
 /**
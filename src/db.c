@@ -50,6 +50,53 @@ int db__open_follower(struct db *db)
 	return 0;
 }
 
+/* Size of the page cache of connections that fetch pages from the VFS, in
+ * KiB. */
+#define DB__FETCH_CACHE_SIZE 128
+
+/* Size that the page cache of a connection must exceed before dirty pages are
+ * spilled to the WAL, in KiB. It matches the default page cache size of
+ * SQLite, so a smaller cache doesn't make transactions spill frames before
+ * they commit, which would replicate them as non-commit frames. */
+#define DB__CACHE_SPILL_SIZE 2000
+
+int db__enable_fetch(sqlite3 *conn, unsigned page_size, char **msg)
+{
+	char pragma[255];
+	sqlite3_int64 mmap_size = -1;
+	int rc;
+
+	/* The limit is SQLite's default maximum. */
+	rc = sqlite3_exec(conn, "PRAGMA mmap_size=2147418112", NULL, NULL, msg);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+
+	/* The VFS is never told about the limit if SQLite was built without
+	 * memory-mapped I/O, and then pages are still copied into the cache. */
+	rc = sqlite3_file_control(conn, "main", SQLITE_FCNTL_MMAP_SIZE,
+				  &mmap_size);
+	if (rc != SQLITE_OK || mmap_size <= 0) {
+		return SQLITE_OK;
+	}
+
+	/* Clean pages of the main file are not cached anymore, only pages read
+	 * from the WAL and pages being written are. */
+	sprintf(pragma, "PRAGMA cache_size=-%d", DB__FETCH_CACHE_SIZE);
+	rc = sqlite3_exec(conn, pragma, NULL, NULL, msg);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+	sprintf(pragma, "PRAGMA cache_spill=%u",
+		DB__CACHE_SPILL_SIZE * 1024 / page_size);
+	rc = sqlite3_exec(conn, pragma, NULL, NULL, msg);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+
+	return SQLITE_OK;
+}
+
 int db__create_tx(struct db *db, unsigned long long id, sqlite3 *conn)
 {
 	assert(db->tx == NULL);
@@ -108,6 +155,12 @@ static int open_follower_conn(const char *filename,
 		goto err_after_open;
 	}
 
+	/* Read database pages straight from the VFS. */
+	rc = db__enable_fetch(*conn, page_size, &msg);
+	if (rc != SQLITE_OK) {
+		goto err_after_open;
+	}
+
 	/* Set WAL replication. */
 	rc = sqlite3_wal_replication_follower(*conn, "main");
 	if (rc != SQLITE_OK) {
@@ -40,6 +40,13 @@ void db__close(struct db *db);
  */
 int db__open_follower(struct db *db);
 
+/**
+ * Let the given connection read database pages directly from the memory of the
+ * VFS instead of keeping copies in its page cache, and shrink the page cache
+ * accordingly. The @page_size is the one of the database.
+ */
+int db__enable_fetch(sqlite3 *conn, unsigned page_size, char **msg);
+
 /**
  * Create an initialize the matadata of a new write transaction against this
  * database.
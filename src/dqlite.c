@@ -29,3 +29,77 @@ int dqlite_vfs_commit(sqlite3_vfs *vfs,
 	return VfsCommit(vfs, filename, n, page_numbers, frames);
 }
 
+int dqlite_vfs_commit_adopt(sqlite3_vfs *vfs,
+			    const char *filename,
+			    unsigned n,
+			    unsigned *page_numbers,
+			    void *frames,
+			    void (*release)(void *arg),
+			    void *arg)
+{
+	return VfsCommitAdopt(vfs, filename, n, page_numbers, frames, release,
+			      arg);
+}
+
+int dqlite_vfs_poll_batch(sqlite3_vfs *vfs,
+			  const char *filename,
+			  void **buf,
+			  size_t *len)
+{
+	return VfsPollBatch(vfs, filename, buf, len);
+}
+
+int dqlite_vfs_commit_batch(sqlite3_vfs *vfs,
+			    const char *filename,
+			    void *buf,
+			    size_t len,
+			    void (*release)(void *arg),
+			    void *arg)
+{
+	return VfsCommitBatch(vfs, filename, buf, len, release, arg);
+}
+
+int dqlite_vfs_stats(sqlite3_vfs *vfs,
+		     const char *filename,
+		     struct dqlite_vfs_stats *stats)
+{
+	return VfsStats(vfs, filename, stats);
+}
+
+void dqlite_vfs_set_quota(sqlite3_vfs *vfs, size_t quota)
+{
+	VfsSetQuota(vfs, quota);
+}
+
+void dqlite_vfs_set_temp_limit(sqlite3_vfs *vfs, size_t limit)
+{
+	VfsSetTempLimit(vfs, limit);
+}
+
+int dqlite_vfs_enable_spill(sqlite3_vfs *vfs,
+			    const char *dir,
+			    unsigned idle,
+			    size_t budget)
+{
+	return VfsEnableSpill(vfs, dir, idle, budget);
+}
+
+void dqlite_vfs_spill(sqlite3_vfs *vfs)
+{
+	VfsSpill(vfs);
+}
+
+int dqlite_vfs_enable_compression(sqlite3_vfs *vfs, unsigned checkpoints)
+{
+	return VfsEnableCompression(vfs, checkpoints);
+}
+
+int dqlite_vfs_enable_huge_pages(sqlite3_vfs *vfs)
+{
+	return VfsEnableHugePages(vfs);
+}
+
+int dqlite_vfs_load_image(sqlite3_vfs *vfs, const char *filename, int fd)
+{
+	return VfsLoadImage(vfs, filename, fd);
+}
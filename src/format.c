@@ -2,6 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Whether vectorized implementations of the WAL checksum are available. */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FORMAT__CHECKSUM_X86
+#include <immintrin.h>
+#include <pthread.h>
+#endif
+
 #include <sqlite3.h>
 
 #include "./lib/assert.h"
@@ -122,6 +129,15 @@ void formatWalGetFramePageNumber(const uint8_t *header, unsigned *page_number)
 	*page_number = v;
 }
 
+void formatWalGetFrameDatabaseSize(const uint8_t *header, unsigned *n_pages)
+{
+	/* The database size is stored in the second 4 bytes of the header
+	 * (big-endian) */
+	uint32_t v;
+	formatGet32(header + 4, &v);
+	*n_pages = v;
+}
+
 void formatWalGetFrameChecksums(const uint8_t *header,
 				unsigned *checksum1,
 				unsigned *checksum2)
@@ -150,80 +166,336 @@ static void formatPut32(uint32_t v, uint8_t *buf)
 	buf[3] = (uint8_t)v;
 }
 
-/*
- * Generate or extend an 8 byte checksum based on the data in array data[] and
- * the initial values of in[0] and in[1] (or initial values of 0 and 0 if
- * in==NULL).
- *
- * The checksum is written back into out[] before returning.
- *
- * n must be a positive multiple of 8. */
-static void formatWalChecksumBytes(
-    bool native,        /* True for native byte-order, false for non-native */
-    uint8_t *data,      /* Content to be checksummed */
-    unsigned n,         /* Bytes of content in a[].  Must be a multiple of 8. */
-    const uint32_t *in, /* Initial checksum value input */
-    uint32_t *out       /* OUT: Final checksum value output */
-)
-{
-	uint32_t s1, s2;
-	uint32_t *cur = (uint32_t *)data;
-	uint32_t *end = (uint32_t *)&data[n];
+/* Number of 32-bit words in the largest buffer that can be checksummed. */
+#define FORMAT__CHECKSUM_MAX_WORDS (FORMAT__PAGE_SIZE_MAX / 4)
+
+/* Buffers shorter than this are always checksummed with the scalar
+ * implementation, since setting up the vectorized one doesn't pay off. */
+#define FORMAT__CHECKSUM_SIMD_MIN 64
 
-	if (in) {
-		s1 = in[0];
-		s2 = in[1];
+/* Read a word of a buffer being checksummed. */
+static uint32_t formatChecksumWord(bool native, const uint8_t *p)
+{
+	uint32_t v;
+	if (native) {
+		memcpy(&v, p, sizeof v);
 	} else {
-		s1 = s2 = 0;
+		formatGet32(p, &v);
 	}
+	return v;
+}
 
-	assert(n >= 8);
-	assert((n & 0x00000007) == 0);
-	assert(n <= 65536);
+/* Scalar implementation of the checksum algorithm used by SQLite for WAL
+ * frames and WAL index headers: extend the checksum @s with the @n bytes of
+ * @data, taking two 32-bit words at a time. */
+static void formatChecksumScalar(bool native,
+				 const uint8_t *data,
+				 unsigned n,
+				 uint32_t s[2])
+{
+	uint32_t s1 = s[0];
+	uint32_t s2 = s[1];
+	const uint8_t *cur = data;
+	const uint8_t *end = data + n;
 
 	if (native) {
 		do {
-			s1 += *cur++ + s2;
-			s2 += *cur++ + s1;
+			uint32_t d[2];
+			memcpy(d, cur, sizeof d);
+			s1 += d[0] + s2;
+			s2 += d[1] + s1;
+			cur += 8;
 		} while (cur < end);
 	} else {
 		do {
-			uint32_t d;
-			formatPut32(cur[0], (uint8_t *)&d);
-			s1 += d + s2;
-			formatPut32(cur[1], (uint8_t *)&d);
-			s2 += d + s1;
-			cur += 2;
+			s1 += formatChecksumWord(false, cur) + s2;
+			s2 += formatChecksumWord(false, cur + 4) + s1;
+			cur += 8;
 		} while (cur < end);
 	}
 
-	out[0] = s1;
-	out[1] = s2;
+	s[0] = s1;
+	s[1] = s2;
+}
+
+#if defined(FORMAT__CHECKSUM_X86)
+/* Each step of the checksum maps (s1, s2) to (s1 + s2 + x0, s1 + 2*s2 + x0 +
+ * x1), where x0 and x1 are the next two words. The recurrence is linear modulo
+ * 2^32, so the checksum of a buffer can be computed as a dot product between
+ * its words and a vector of coefficients, which only depend on the distance of
+ * each word from the end of the buffer, plus a term depending on the initial
+ * value of the checksum. Unlike the recurrence, a dot product can be
+ * vectorized.
+ *
+ * The coefficients of s1 and s2 for the words of an N-words long buffer are the
+ * last N entries of formatChecksumCoef[0] and formatChecksumCoef[1]. */
+static uint32_t formatChecksumCoef[2][FORMAT__CHECKSUM_MAX_WORDS];
+
+static pthread_once_t formatChecksumOnce = PTHREAD_ONCE_INIT;
+
+/* Fill the coefficients table. Going backward from the last word, x1 words
+ * contribute M^d * (0, 1) and x0 words contribute M^d * (1, 1), where M is the
+ * matrix of a single step and d the number of steps that follow. */
+static void formatChecksumCoefInit(void)
+{
+	uint32_t v[2] = {0, 1};
+	uint32_t u[2] = {1, 1};
+	unsigned i = FORMAT__CHECKSUM_MAX_WORDS;
+
+	while (i > 0) {
+		uint32_t t;
+
+		i--;
+		formatChecksumCoef[0][i] = v[0];
+		formatChecksumCoef[1][i] = v[1];
+		i--;
+		formatChecksumCoef[0][i] = u[0];
+		formatChecksumCoef[1][i] = u[1];
+
+		t = v[0];
+		v[0] = t + v[1];
+		v[1] = t + 2 * v[1];
+		t = u[0];
+		u[0] = t + u[1];
+		u[1] = t + 2 * u[1];
+	}
+}
+
+/* Complete the checksum of a buffer of @n_words words, given its initial value
+ * @s and the dot products @t1 and @t2 of the words with their coefficients.
+ *
+ * The coefficients of the first two words are M^(P-1) * (1, 1) and M^(P-1) *
+ * (0, 1), where P is the number of steps, so they also give the contribution
+ * M^P * s of the initial value. */
+static void formatChecksumFinish(unsigned n_words,
+				 uint32_t s[2],
+				 uint32_t t1,
+				 uint32_t t2)
+{
+	const uint32_t *k1 =
+	    formatChecksumCoef[0] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	const uint32_t *k2 =
+	    formatChecksumCoef[1] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	uint32_t p1 = s[0] * (k1[0] - k1[1]) + s[1] * k1[1];
+	uint32_t p2 = s[0] * (k2[0] - k2[1]) + s[1] * k2[1];
+
+	s[0] = p1 + p2 + t1;
+	s[1] = p1 + 2 * p2 + t2;
+}
+
+/* Add the contribution of the words of the buffer from @i to @n_words. */
+static void formatChecksumTail(bool native,
+			       const uint8_t *data,
+			       unsigned i,
+			       unsigned n_words,
+			       uint32_t *t1,
+			       uint32_t *t2)
+{
+	const uint32_t *k1 =
+	    formatChecksumCoef[0] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	const uint32_t *k2 =
+	    formatChecksumCoef[1] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+
+	for (; i < n_words; i++) {
+		uint32_t x = formatChecksumWord(native, data + 4 * i);
+		*t1 += x * k1[i];
+		*t2 += x * k2[i];
+	}
+}
+
+__attribute__((target("sse4.1"))) static uint32_t formatChecksumSumSse41(
+    __m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+/* SSE4.1 implementation, processing 4 words at a time. */
+__attribute__((target("sse4.1"))) static void formatChecksumSse41(
+    bool native,
+    const uint8_t *data,
+    unsigned n,
+    uint32_t s[2])
+{
+	unsigned n_words = n / 4;
+	const uint32_t *k1 =
+	    formatChecksumCoef[0] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	const uint32_t *k2 =
+	    formatChecksumCoef[1] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	const __m128i bswap =
+	    _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m128i acc1 = _mm_setzero_si128();
+	__m128i acc2 = _mm_setzero_si128();
+	uint32_t t1;
+	uint32_t t2;
+	unsigned i;
+
+	for (i = 0; i + 4 <= n_words; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(data + 4 * i));
+		if (!native) {
+			x = _mm_shuffle_epi8(x, bswap);
+		}
+		acc1 = _mm_add_epi32(
+		    acc1, _mm_mullo_epi32(
+			      x, _mm_loadu_si128((const __m128i *)(k1 + i))));
+		acc2 = _mm_add_epi32(
+		    acc2, _mm_mullo_epi32(
+			      x, _mm_loadu_si128((const __m128i *)(k2 + i))));
+	}
+
+	t1 = formatChecksumSumSse41(acc1);
+	t2 = formatChecksumSumSse41(acc2);
+	formatChecksumTail(native, data, i, n_words, &t1, &t2);
+	formatChecksumFinish(n_words, s, t1, t2);
+}
+
+__attribute__((target("avx2"))) static uint32_t formatChecksumSumAvx2(
+    __m256i v)
+{
+	__m128i w = _mm_add_epi32(_mm256_castsi256_si128(v),
+				  _mm256_extracti128_si256(v, 1));
+	w = _mm_add_epi32(w, _mm_shuffle_epi32(w, _MM_SHUFFLE(1, 0, 3, 2)));
+	w = _mm_add_epi32(w, _mm_shuffle_epi32(w, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(w);
 }
 
-void formatWalPutFrameHeader(bool native,
-			     unsigned page_number,
+/* AVX2 implementation, processing 8 words at a time. */
+__attribute__((target("avx2"))) static void formatChecksumAvx2(
+    bool native,
+    const uint8_t *data,
+    unsigned n,
+    uint32_t s[2])
+{
+	unsigned n_words = n / 4;
+	const uint32_t *k1 =
+	    formatChecksumCoef[0] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	const uint32_t *k2 =
+	    formatChecksumCoef[1] + FORMAT__CHECKSUM_MAX_WORDS - n_words;
+	const __m256i bswap = _mm256_setr_epi8(
+	    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7,
+	    6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i acc1 = _mm256_setzero_si256();
+	__m256i acc2 = _mm256_setzero_si256();
+	uint32_t t1;
+	uint32_t t2;
+	unsigned i;
+
+	for (i = 0; i + 8 <= n_words; i += 8) {
+		__m256i x =
+		    _mm256_loadu_si256((const __m256i *)(data + 4 * i));
+		if (!native) {
+			x = _mm256_shuffle_epi8(x, bswap);
+		}
+		acc1 = _mm256_add_epi32(
+		    acc1,
+		    _mm256_mullo_epi32(
+			x, _mm256_loadu_si256((const __m256i *)(k1 + i))));
+		acc2 = _mm256_add_epi32(
+		    acc2,
+		    _mm256_mullo_epi32(
+			x, _mm256_loadu_si256((const __m256i *)(k2 + i))));
+	}
+
+	t1 = formatChecksumSumAvx2(acc1);
+	t2 = formatChecksumSumAvx2(acc2);
+	formatChecksumTail(native, data, i, n_words, &t1, &t2);
+	formatChecksumFinish(n_words, s, t1, t2);
+}
+#endif /* FORMAT__CHECKSUM_X86 */
+
+/* Implementation used for buffers of at least FORMAT__CHECKSUM_SIMD_MIN
+ * bytes. */
+static void (*formatChecksumImpl)(bool native,
+				  const uint8_t *data,
+				  unsigned n,
+				  uint32_t s[2]) = formatChecksumScalar;
+
+bool formatWalChecksumUse(enum formatChecksumImpl impl)
+{
+	switch (impl) {
+		case FORMAT__CHECKSUM_SCALAR:
+			formatChecksumImpl = formatChecksumScalar;
+			return true;
+#if defined(FORMAT__CHECKSUM_X86)
+		case FORMAT__CHECKSUM_SSE41:
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("sse4.1")) {
+				return false;
+			}
+			pthread_once(&formatChecksumOnce,
+				     formatChecksumCoefInit);
+			formatChecksumImpl = formatChecksumSse41;
+			return true;
+		case FORMAT__CHECKSUM_AVX2:
+			__builtin_cpu_init();
+			if (!__builtin_cpu_supports("avx2")) {
+				return false;
+			}
+			pthread_once(&formatChecksumOnce,
+				     formatChecksumCoefInit);
+			formatChecksumImpl = formatChecksumAvx2;
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+void formatWalChecksumInit(void)
+{
+	if (formatWalChecksumUse(FORMAT__CHECKSUM_AVX2)) {
+		return;
+	}
+	if (formatWalChecksumUse(FORMAT__CHECKSUM_SSE41)) {
+		return;
+	}
+	formatWalChecksumUse(FORMAT__CHECKSUM_SCALAR);
+}
+
+void formatWalChecksum(bool native,
+		       const uint8_t *data,
+		       unsigned n,
+		       uint32_t checksum[2])
+{
+	assert(n >= 8);
+	assert((n & 0x00000007) == 0);
+	assert(n <= FORMAT__PAGE_SIZE_MAX);
+
+	if (n < FORMAT__CHECKSUM_SIMD_MIN) {
+		formatChecksumScalar(native, data, n, checksum);
+	} else {
+		formatChecksumImpl(native, data, n, checksum);
+	}
+}
+
+void formatWalPutFrameHeader(unsigned page_number,
 			     unsigned database_size,
 			     unsigned salt1,
 			     unsigned salt2,
-			     unsigned *checksum1,
-			     unsigned *checksum2,
-			     uint8_t *header,
-			     uint8_t *page,
-			     unsigned page_size)
+			     uint8_t *header)
 {
-	uint32_t checksum[2] = {*checksum1, *checksum2};
 	uint32_t salt;
 	formatPut32(page_number, header);
 	formatPut32(database_size, header + 4);
 
-	formatWalChecksumBytes(native, header, 8, checksum, checksum);
-	formatWalChecksumBytes(native, page, page_size, checksum, checksum);
-
 	salt = salt1;
 	memcpy(header + 8, &salt, sizeof salt);
 	salt = salt2;
 	memcpy(header + 12, &salt, sizeof salt);
+}
+
+void formatWalPutFrameChecksums(bool native,
+				unsigned *checksum1,
+				unsigned *checksum2,
+				uint8_t *header,
+				const uint8_t *page,
+				unsigned page_size)
+{
+	uint32_t checksum[2] = {*checksum1, *checksum2};
+
+	formatWalChecksum(native, header, 8, checksum);
+	formatWalChecksum(native, page, page_size, checksum);
 
 	formatPut32(checksum[0], header + 16);
 	formatPut32(checksum[1], header + 20);
@@ -246,7 +518,7 @@ void formatWalIndexHeaderRevert(uint8_t *header,
 	*(uint32_t *)(header + 24) = frame_checksum1;
 	*(uint32_t *)(header + 28) = frame_checksum2;
 
-	formatWalChecksumBytes(native, header, 40, checksum, checksum);
+	formatWalChecksum(native, header, 40, checksum);
 
 	*(uint32_t *)(header + 40) = checksum[0];
 	*(uint32_t *)(header + 44) = checksum[1];
@@ -28,6 +28,10 @@
  * WAL_READ_LOCK definition in the wal.c file of the SQLite source code. */
 #define FORMAT__WAL_READ_LOCK(I) (3 + (I))
 
+/* Index of the lock held by checkpointers. See the equivalent WAL_CKPT_LOCK
+ * definition in the wal.c file of the SQLite source code. */
+#define FORMAT__WAL_CKPT_LOCK 1
+
 /* Size of the first part of the WAL index header. */
 #define FORMAT__WAL_IDX_HDR_SIZE 48
 
@@ -93,6 +97,10 @@ void formatWalIndexHeaderRevert(uint8_t *header,
 /* Extract the page number from a WAL frame header. */
 void formatWalGetFramePageNumber(const uint8_t *header, unsigned *page_number);
 
+/* Extract the size of the database in pages after the commit from a WAL frame
+ * header. It's zero if the frame is not a commit frame. */
+void formatWalGetFrameDatabaseSize(const uint8_t *header, unsigned *n_pages);
+
 /* Extract the checksums from a WAL frame header. */
 void formatWalGetFrameChecksums(const uint8_t *header,
 				unsigned *checksum1,
@@ -102,16 +110,45 @@ void formatWalGetFrameChecksums(const uint8_t *header,
  * checksums, or false if bit-endian byte order should be used instead. */
 void formatWalGetNativeChecksum(const uint8_t *header, bool *native);
 
-/* Encode a frame header and return the calculated checksums. */
-void formatWalPutFrameHeader(bool native,
-			     unsigned page_number,
+/* Implementations of the checksum algorithm used for WAL frames. */
+enum formatChecksumImpl {
+	FORMAT__CHECKSUM_SCALAR, /* Portable C, two words at a time */
+	FORMAT__CHECKSUM_SSE41,  /* x86-64 SSE4.1, four words at a time */
+	FORMAT__CHECKSUM_AVX2    /* x86-64 AVX2, eight words at a time */
+};
+
+/* Use the given implementation of the WAL checksum algorithm from now on.
+ *
+ * Return false if the implementation is not supported by the CPU or by the
+ * compiler. */
+bool formatWalChecksumUse(enum formatChecksumImpl impl);
+
+/* Select the fastest implementation of the WAL checksum algorithm supported by
+ * the CPU. */
+void formatWalChecksumInit(void);
+
+/* Extend the given WAL checksum with the @n bytes of @data. The size must be a
+ * positive multiple of 8, no greater than FORMAT__PAGE_SIZE_MAX. */
+void formatWalChecksum(bool native,
+		       const uint8_t *data,
+		       unsigned n,
+		       uint32_t checksum[2]);
+
+/* Encode the page number, database size and salt fields of a frame header,
+ * leaving its checksum fields untouched. */
+void formatWalPutFrameHeader(unsigned page_number,
 			     unsigned database_size,
 			     unsigned salt1,
 			     unsigned salt2,
-			     unsigned *checksum1,
-			     unsigned *checksum2,
-			     uint8_t *header,
-			     uint8_t *data,
-			     unsigned n_data);
+			     uint8_t *header);
+
+/* Extend the given checksums with the first 8 bytes of a frame header and with
+ * its page, store the result in the header and return it. */
+void formatWalPutFrameChecksums(bool native,
+				unsigned *checksum1,
+				unsigned *checksum2,
+				uint8_t *header,
+				const uint8_t *page,
+				unsigned page_size);
 
 #endif /* FORMAT_H */
@@ -1,16 +1,25 @@
 #include <raft.h>
 
+#ifdef DQLITE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "lib/assert.h"
+#include "lib/lz4.h"
 #include "lib/serialize.h"
 
 #include "command.h"
+#include "format.h"
 #include "fsm.h"
 #include "vfs.h"
 
 struct fsm
 {
 	struct logger *logger;
+	struct config *config;
 	struct registry *registry;
+	struct uv_loop_s *loop; /* Loop whose thread pool encodes snapshots. */
+	struct dqlite__metrics metrics; /* Counters of snapshots. */
 };
 
 static int apply_open(struct fsm *f, const struct command_open *c)
@@ -216,7 +225,16 @@ err:
 	return rc;
 }
 
-#define SNAPSHOT_FORMAT 1
+/* Snapshot formats. Format 1 holds whole database and WAL files, while format 2
+ * splits them in chunks, see encodeDatabase(). Format 3 is the same as format 2,
+ * with compressed chunks. All can be restored, and format 3 is only used if
+ * compression is enabled. */
+#define SNAPSHOT_FORMAT_V1 1
+#define SNAPSHOT_FORMAT_V2 2
+#define SNAPSHOT_FORMAT_V3 3
+
+/* Maximum size of the file content held by a single chunk. */
+#define SNAPSHOT_CHUNK_SIZE (1024 * 1024)
 
 #define SNAPSHOT_HEADER(X, ...)          \
 	X(uint64, format, ##__VA_ARGS__) \
@@ -231,12 +249,125 @@ SERIALIZE__IMPLEMENT(snapshotHeader, SNAPSHOT_HEADER);
 SERIALIZE__DEFINE(snapshotDatabase, SNAPSHOT_DATABASE);
 SERIALIZE__IMPLEMENT(snapshotDatabase, SNAPSHOT_DATABASE);
 
+/* Header of a chunk of @len bytes of the main or WAL file of a database,
+ * starting at @offset. */
+#define SNAPSHOT_CHUNK(X, ...)           \
+	X(uint64, wal, ##__VA_ARGS__)    \
+	X(uint64, offset, ##__VA_ARGS__) \
+	X(uint64, len, ##__VA_ARGS__)
+SERIALIZE__DEFINE(snapshotChunk, SNAPSHOT_CHUNK);
+SERIALIZE__IMPLEMENT(snapshotChunk, SNAPSHOT_CHUNK);
+
+/* Header of a chunk of format 3 snapshots, whose @len bytes of content are
+ * stored in @size bytes compressed by @codec, one of the
+ * DQLITE_SNAPSHOT_COMPRESSION_* values. Chunks that don't get smaller are
+ * stored as they are, with no codec. The content is padded to 8 bytes. */
+#define SNAPSHOT_PACKED_CHUNK(X, ...)    \
+	X(uint64, wal, ##__VA_ARGS__)    \
+	X(uint64, offset, ##__VA_ARGS__) \
+	X(uint64, len, ##__VA_ARGS__)    \
+	X(uint64, codec, ##__VA_ARGS__)  \
+	X(uint64, size, ##__VA_ARGS__)
+SERIALIZE__DEFINE(snapshotPackedChunk, SNAPSHOT_PACKED_CHUNK);
+SERIALIZE__IMPLEMENT(snapshotPackedChunk, SNAPSHOT_PACKED_CHUNK);
+
+/* A codec compressing the chunks of format 3 snapshots. The compress function
+ * returns zero if the result doesn't fit in @cap bytes. The decompress function
+ * fails unless the data expands to exactly @len bytes. */
+struct snapshotCodec
+{
+	unsigned id; /* One of the DQLITE_SNAPSHOT_COMPRESSION_* values. */
+	size_t (*compress)(const void *src, size_t n, void *dst, size_t cap);
+	int (*decompress)(const void *src, size_t n, void *dst, size_t len);
+};
+
+#ifdef DQLITE_ZSTD
+
+/* Compression level of zstd. Snapshots are taken while the loop is blocked, so
+ * speed matters more than ratio. */
+#define SNAPSHOT_ZSTD_LEVEL 1
+
+static size_t zstdCompress(const void *src, size_t n, void *dst, size_t cap)
+{
+	size_t size = ZSTD_compress(dst, cap, src, n, SNAPSHOT_ZSTD_LEVEL);
+	return ZSTD_isError(size) ? 0 : size;
+}
+
+static int zstdDecompress(const void *src, size_t n, void *dst, size_t len)
+{
+	size_t size = ZSTD_decompress(dst, len, src, n);
+	return ZSTD_isError(size) || size != len ? DQLITE_ERROR : 0;
+}
+
+#endif /* DQLITE_ZSTD */
+
+static const struct snapshotCodec snapshotCodecs[] = {
+    {DQLITE_SNAPSHOT_COMPRESSION_LZ4, lz4__compress, lz4__decompress},
+#ifdef DQLITE_ZSTD
+    {DQLITE_SNAPSHOT_COMPRESSION_ZSTD, zstdCompress, zstdDecompress},
+#endif
+};
+
+/* Return the codec with the given id, or NULL if there's none, which is the
+ * case of DQLITE_SNAPSHOT_COMPRESSION_NONE. */
+static const struct snapshotCodec *snapshotCodecLookup(uint64_t id)
+{
+	size_t i;
+	for (i = 0; i < sizeof snapshotCodecs / sizeof *snapshotCodecs; i++) {
+		if (snapshotCodecs[i].id == id) {
+			return &snapshotCodecs[i];
+		}
+	}
+	return NULL;
+}
+
+/* Maximum number of thread pool requests encoding databases in parallel with
+ * the loop thread, matching the default size of the libuv thread pool. */
+#define SNAPSHOT_WORKERS 4
+
+/* A database whose content is being encoded in a snapshot. */
+struct snapshotEntry
+{
+	struct db *db;           /* Database being encoded. */
+	struct vfsSnapshot *vfs; /* Pinned content of the database. */
+	unsigned first;          /* Index of the first buffer of the database. */
+	unsigned n_bufs;         /* Number of buffers of the database. */
+	bool encoded;            /* Whether the buffers were filled. */
+};
+
+/* Databases of a snapshot being encoded in parallel, by the loop thread and by
+ * up to SNAPSHOT_WORKERS thread pool requests, each picking the next database
+ * to encode until none is left.
+ *
+ * The content of all databases is pinned beforehand, and once none is left to
+ * pick, the loop thread waits for the databases picked by requests to be
+ * encoded before returning, so nothing changes meanwhile. It never waits for
+ * requests that didn't start: those find nothing to pick, or get cancelled.
+ * The job is released once the loop has run the after-work callbacks of all
+ * requests, see snapshotWorkAfterCb(). */
+struct snapshotJob
+{
+	uv_mutex_t mutex;               /* Serialize access to the fields below. */
+	uv_cond_t cond;                 /* Signaled when a database is done. */
+	struct snapshotEntry *entries;  /* Databases to encode. */
+	unsigned n;                     /* Number of databases. */
+	unsigned next;                  /* Next database to encode. */
+	struct raft_buffer *bufs;       /* Buffers of the whole snapshot. */
+	const struct snapshotCodec *codec; /* Codec of the chunks, if any. */
+	unsigned running;               /* Databases being encoded. */
+	unsigned refs;                  /* Requests not completed, plus one. */
+	int rv;                         /* First error that occurred, if any. */
+	uv_work_t works[SNAPSHOT_WORKERS]; /* Thread pool requests. */
+};
+
 /* Encode the global snapshot header. */
-static int encodeSnapshotHeader(unsigned n, struct raft_buffer *buf)
+static int encodeSnapshotHeader(unsigned format,
+				unsigned n,
+				struct raft_buffer *buf)
 {
 	struct snapshotHeader header;
 	void *cursor;
-	header.format = SNAPSHOT_FORMAT;
+	header.format = format;
 	header.n = n;
 	buf->len = snapshotHeader__sizeof(&header);
 	buf->base = raft_malloc(buf->len);
@@ -248,82 +379,239 @@ static int encodeSnapshotHeader(unsigned n, struct raft_buffer *buf)
 	return 0;
 }
 
-/* Generate the WAL filename associated with the given main database
- * filename. */
-static char *generateWalFilename(const char *filename)
+/* Return the size of the chunk of the main or WAL file of a snapshot that
+ * starts at @offset. Chunks hold whole pages, or whole frames after the WAL
+ * header, and at most SNAPSHOT_CHUNK_SIZE bytes, unless a single frame is
+ * bigger than that. */
+static size_t chunkSize(struct vfsSnapshot *snapshot,
+			bool wal,
+			size_t offset,
+			size_t size)
+{
+	size_t unit = VfsSnapshotPageSize(snapshot);
+	size_t head = 0;
+	size_t n;
+
+	if (wal) {
+		unit += FORMAT__WAL_FRAME_HDR_SIZE;
+		if (offset == 0) {
+			head = FORMAT__WAL_HDR_SIZE;
+		}
+	}
+	n = (SNAPSHOT_CHUNK_SIZE - head) / unit;
+	if (n == 0) {
+		n = 1;
+	}
+	if (head + n * unit > size - offset) {
+		return size - offset;
+	}
+	return head + n * unit;
+}
+
+/* Return the number of chunks needed to encode a snapshot of a database. */
+static unsigned countChunks(struct vfsSnapshot *snapshot)
 {
-	char *out;
-	out = sqlite3_malloc((int)(strlen(filename) + strlen("-wal") + 1));
-	if (out == NULL) {
-		return out;
+	size_t sizes[2];
+	size_t offset;
+	unsigned n = 0;
+	unsigned i;
+
+	VfsSnapshotSize(snapshot, &sizes[0], &sizes[1]);
+	for (i = 0; i < 2; i++) {
+		for (offset = 0; offset < sizes[i];
+		     offset += chunkSize(snapshot, i == 1, offset, sizes[i])) {
+			n++;
+		}
 	}
-	sprintf(out, "%s-wal", filename);
-	return out;
+
+	return n;
 }
 
-/* Encode the given database. */
-static int encodeDatabase(struct db *db, struct raft_buffer bufs[3])
+/* Copy a chunk of the main or WAL file of a VFS snapshot into a new buffer,
+ * after its header. */
+static int encodeChunk(struct vfsSnapshot *snapshot,
+		       bool wal,
+		       size_t offset,
+		       size_t len,
+		       struct raft_buffer *buf)
 {
-	struct snapshotDatabase header;
-	char *walFilename;
+	struct snapshotChunk chunk;
 	void *cursor;
 	int rv;
 
-	walFilename = generateWalFilename(db->filename);
-	if (walFilename == NULL) {
-		rv = RAFT_NOMEM;
-		goto err;
+	chunk.wal = wal;
+	chunk.offset = offset;
+	chunk.len = len;
+
+	buf->len = snapshotChunk__sizeof(&chunk) + len;
+	buf->base = raft_malloc(buf->len);
+	if (buf->base == NULL) {
+		return RAFT_NOMEM;
 	}
+	cursor = buf->base;
+	snapshotChunk__encode(&chunk, &cursor);
+	rv = VfsSnapshotRead(snapshot, wal, offset, cursor, len);
+	if (rv != 0) {
+		raft_free(buf->base);
+		return rv == SQLITE_NOMEM ? RAFT_NOMEM : RAFT_CORRUPT;
+	}
+	return 0;
+}
 
-	header.filename = db->filename;
+/* Like encodeChunk(), but compress the content of the chunk with the given
+ * codec, straight after its header. The buffer only has room for the content as
+ * it is, which is copied there if compressing doesn't make it smaller, and is
+ * shrunk to fit otherwise. The content is read in @scratch beforehand, which is
+ * grown to @scratch_len bytes as needed. */
+static int encodePackedChunk(struct vfsSnapshot *snapshot,
+			     const struct snapshotCodec *codec,
+			     bool wal,
+			     size_t offset,
+			     size_t len,
+			     void **scratch,
+			     size_t *scratch_len,
+			     struct raft_buffer *buf)
+{
+	struct snapshotPackedChunk chunk;
+	size_t header;
+	size_t size;
+	void *base;
+	void *cursor;
+	int rv;
 
-	/* Main database file. */
-	rv = VfsFileRead(db->config->name, db->filename, &bufs[1].base,
-			 &bufs[1].len);
+	if (len > *scratch_len) {
+		raft_free(*scratch);
+		*scratch_len = 0;
+		*scratch = raft_malloc(len);
+		if (*scratch == NULL) {
+			return RAFT_NOMEM;
+		}
+		*scratch_len = len;
+	}
+	rv = VfsSnapshotRead(snapshot, wal, offset, *scratch, len);
 	if (rv != 0) {
-		goto err_after_wal_filename_alloc;
+		return rv == SQLITE_NOMEM ? RAFT_NOMEM : RAFT_CORRUPT;
 	}
-	header.main_size = bufs[1].len;
 
-	/* WAL file. */
-	rv = VfsFileRead(db->config->name, walFilename, &bufs[2].base,
-			 &bufs[2].len);
-	if (rv != 0) {
-		goto err_after_main_file_read;
+	chunk.wal = wal;
+	chunk.offset = offset;
+	chunk.len = len;
+	chunk.codec = codec->id;
+	chunk.size = len;
+	header = snapshotPackedChunk__sizeof(&chunk);
+
+	buf->len = header + byte__pad64(len);
+	buf->base = raft_malloc(buf->len);
+	if (buf->base == NULL) {
+		return RAFT_NOMEM;
+	}
+	cursor = (uint8_t *)buf->base + header;
+
+	size = codec->compress(*scratch, len, cursor, len - 1);
+	if (size > 0) {
+		chunk.size = size;
+	} else {
+		chunk.codec = DQLITE_SNAPSHOT_COMPRESSION_NONE;
+		memcpy(cursor, *scratch, len);
 	}
-	header.wal_size = bufs[2].len;
+	memset((uint8_t *)cursor + chunk.size, 0,
+	       byte__pad64((size_t)chunk.size) - (size_t)chunk.size);
+	cursor = buf->base;
+	snapshotPackedChunk__encode(&chunk, &cursor);
+
+	if (chunk.size < len) {
+		buf->len = header + byte__pad64((size_t)chunk.size);
+		base = raft_realloc(buf->base, buf->len);
+		if (base != NULL) {
+			buf->base = base;
+		}
+	}
+
+	return 0;
+}
+
+/* Encode the given database, whose content was pinned by @entry, as a
+ * database header followed by the chunks of its main file and of its WAL, each
+ * in its own buffer. Set @n to the number of buffers used, which is one more
+ * than the number of chunks.
+ *
+ * No buffer holds more than one chunk, so no allocation is as big as a whole
+ * database file, and raft can write the buffers as they are. Since raft takes
+ * all the buffers of a snapshot at once, they are all held in memory until it
+ * writes them, though.
+ *
+ * If @codec is not NULL, chunks are compressed with it, as format 3 wants. */
+static int encodeDatabase(struct db *db,
+			  struct snapshotEntry *entry,
+			  const struct snapshotCodec *codec,
+			  struct raft_buffer *bufs,
+			  unsigned *n)
+{
+	struct snapshotDatabase header;
+	size_t sizes[2];
+	size_t offset;
+	size_t len;
+	void *scratch = NULL;
+	size_t scratch_len = 0;
+	void *cursor;
+	unsigned i;
+	int rv;
+
+	VfsSnapshotSize(entry->vfs, &sizes[0], &sizes[1]);
+
+	header.filename = db->filename;
+	header.main_size = sizes[0];
+	header.wal_size = sizes[1];
 
-	/* Database header. */
 	bufs[0].len = snapshotDatabase__sizeof(&header);
 	bufs[0].base = raft_malloc(bufs[0].len);
 	if (bufs[0].base == NULL) {
 		rv = RAFT_NOMEM;
-		goto err_after_wal_file_read;
+		goto err;
 	}
 	cursor = bufs[0].base;
 	snapshotDatabase__encode(&header, &cursor);
-
-	sqlite3_free(walFilename);
+	*n = 1;
+
+	for (i = 0; i < 2; i++) {
+		for (offset = 0; offset < sizes[i]; offset += len) {
+			len = chunkSize(entry->vfs, i == 1, offset, sizes[i]);
+			if (codec != NULL) {
+				rv = encodePackedChunk(entry->vfs, codec,
+						       i == 1, offset, len,
+						       &scratch, &scratch_len,
+						       &bufs[*n]);
+			} else {
+				rv = encodeChunk(entry->vfs, i == 1, offset,
+						 len, &bufs[*n]);
+			}
+			if (rv != 0) {
+				goto err_after_encode;
+			}
+			*n += 1;
+		}
+	}
+	assert(*n == entry->n_bufs);
+	raft_free(scratch);
 
 	return 0;
 
-err_after_wal_file_read:
-	sqlite3_free(bufs[2].base);
-err_after_main_file_read:
-	sqlite3_free(bufs[1].base);
-err_after_wal_filename_alloc:
-	sqlite3_free(walFilename);
+err_after_encode:
+	raft_free(scratch);
+	while (*n > 0) {
+		*n -= 1;
+		raft_free(bufs[*n].base);
+	}
 err:
 	assert(rv != 0);
 	return rv;
 }
 
-/* Decode the database contained in a snapshot. */
+/* Decode a database contained in a format 1 snapshot. */
 static int decodeDatabase(struct fsm *f, struct cursor *cursor)
 {
 	struct snapshotDatabase header;
 	struct db *db;
-	char *walFilename;
 	int rv;
 
 	rv = snapshotDatabase__decode(cursor, &header);
@@ -334,26 +622,170 @@ static int decodeDatabase(struct fsm *f, struct cursor *cursor)
 	if (rv != 0) {
 		return rv;
 	}
-	rv = VfsFileWrite(db->config->name, db->filename, cursor->p,
-			  header.main_size);
+	if (header.main_size + header.wal_size > cursor->cap) {
+		return RAFT_MALFORMED;
+	}
+	rv = VfsRestore(db->config->name, db->filename, cursor->p,
+			header.main_size, cursor->p + header.main_size,
+			header.wal_size);
 	if (rv != 0) {
 		return rv;
 	}
-	walFilename = generateWalFilename(db->filename);
-	if (walFilename == NULL) {
-		return RAFT_NOMEM;
+	cursor->p += header.main_size + header.wal_size;
+	cursor->cap -= header.main_size + header.wal_size;
+
+	rv = db__open_follower(db);
+	if (rv != 0) {
+		return rv;
 	}
-	cursor->p += header.main_size;
-	if (header.wal_size > 0) {
-		rv = VfsFileWrite(db->config->name, walFilename, cursor->p,
-				  header.wal_size);
+
+	return 0;
+}
+
+/* Decode the next chunk of a format 2 or 3 snapshot, and point @data to its
+ * content. Compressed content is expanded into @scratch, which is grown to
+ * @scratch_len bytes as needed. No chunk can be bigger than @max bytes. */
+static int decodeChunk(struct cursor *cursor,
+		       uint64_t format,
+		       uint64_t max,
+		       struct snapshotChunk *chunk,
+		       const void **data,
+		       void **scratch,
+		       size_t *scratch_len)
+{
+	struct snapshotPackedChunk packed;
+	const struct snapshotCodec *codec;
+	size_t size;
+	int rv;
+
+	if (format == SNAPSHOT_FORMAT_V2) {
+		rv = snapshotChunk__decode(cursor, chunk);
 		if (rv != 0) {
-			sqlite3_free(walFilename);
 			return rv;
 		}
+		if (chunk->len == 0 || chunk->len > max ||
+		    chunk->len > cursor->cap) {
+			return RAFT_MALFORMED;
+		}
+		*data = cursor->p;
+		cursor->p += chunk->len;
+		cursor->cap -= chunk->len;
+		return 0;
+	}
+
+	rv = snapshotPackedChunk__decode(cursor, &packed);
+	if (rv != 0) {
+		return rv;
+	}
+	if (packed.len == 0 || packed.len > max || packed.size > cursor->cap ||
+	    byte__pad64((size_t)packed.size) > cursor->cap) {
+		return RAFT_MALFORMED;
+	}
+	size = (size_t)packed.size;
+	chunk->wal = packed.wal;
+	chunk->offset = packed.offset;
+	chunk->len = packed.len;
+
+	if (packed.codec == DQLITE_SNAPSHOT_COMPRESSION_NONE) {
+		if (packed.size != packed.len) {
+			return RAFT_MALFORMED;
+		}
+		*data = cursor->p;
+	} else {
+		/* Also a codec that this node was built without. */
+		codec = snapshotCodecLookup(packed.codec);
+		if (codec == NULL) {
+			return RAFT_MALFORMED;
+		}
+		if (packed.len > *scratch_len) {
+			raft_free(*scratch);
+			*scratch_len = 0;
+			*scratch = raft_malloc((size_t)packed.len);
+			if (*scratch == NULL) {
+				return RAFT_NOMEM;
+			}
+			*scratch_len = (size_t)packed.len;
+		}
+		rv = codec->decompress(cursor->p, size, *scratch,
+				       (size_t)packed.len);
+		if (rv != 0) {
+			return RAFT_MALFORMED;
+		}
+		*data = *scratch;
+	}
+	cursor->p += byte__pad64(size);
+	cursor->cap -= byte__pad64(size);
+
+	return 0;
+}
+
+/* Decode a database contained in a format 2 or 3 snapshot, restoring its files
+ * one chunk at a time. Compressed chunks are expanded into a scratch buffer of
+ * at most a chunk, which is freed as soon as the database is restored.
+ *
+ * The snapshot itself comes in a single buffer, which is only freed once all
+ * databases are restored, so restoring needs memory for the snapshot and the
+ * restored databases, plus the scratch buffer. */
+static int decodeDatabaseChunks(struct fsm *f,
+				struct cursor *cursor,
+				uint64_t format)
+{
+	struct snapshotDatabase header;
+	struct snapshotChunk chunk;
+	struct vfsRestore *restore;
+	struct db *db;
+	const void *data;
+	void *scratch = NULL;
+	size_t scratch_len = 0;
+	uint64_t left;
+	int rv;
+
+	rv = snapshotDatabase__decode(cursor, &header);
+	if (rv != 0) {
+		return rv;
+	}
+	rv = registry__db_get(f->registry, header.filename, &db);
+	if (rv != 0) {
+		return rv;
+	}
+
+	/* Don't let the follower connection keep a stale cache of the content
+	 * being replaced, nor checkpoint it when closed. */
+	if (db->follower != NULL) {
+		sqlite3_db_config(db->follower, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE,
+				  1, NULL);
+		rv = sqlite3_close(db->follower);
+		assert(rv == SQLITE_OK);
+		db->follower = NULL;
+	}
+
+	rv = VfsRestoreStart(db->config->name, db->filename, header.main_size,
+			     header.wal_size, &restore);
+	if (rv != 0) {
+		return rv;
+	}
+
+	left = header.main_size + header.wal_size;
+	while (left > 0) {
+		rv = decodeChunk(cursor, format, left, &chunk, &data, &scratch,
+				 &scratch_len);
+		if (rv != 0) {
+			goto err_after_restore_start;
+		}
+		rv = VfsRestoreWrite(restore, chunk.wal != 0,
+				     (size_t)chunk.offset, data,
+				     (size_t)chunk.len);
+		if (rv != 0) {
+			goto err_after_restore_start;
+		}
+		left -= chunk.len;
+	}
+	raft_free(scratch);
+
+	rv = VfsRestoreFinish(restore);
+	if (rv != 0) {
+		return rv;
 	}
-	cursor->p += header.wal_size;
-	sqlite3_free(walFilename);
 
 	rv = db__open_follower(db);
 	if (rv != 0) {
@@ -361,6 +793,112 @@ static int decodeDatabase(struct fsm *f, struct cursor *cursor)
 	}
 
 	return 0;
+
+err_after_restore_start:
+	raft_free(scratch);
+	VfsRestoreAbort(restore);
+	return rv;
+}
+
+/* Encode the databases of a job until none is left, or until an error
+ * occurs. Each database is counted as running from when it's picked until it's
+ * encoded. */
+static void snapshotEncode(struct snapshotJob *job)
+{
+	struct snapshotEntry *entry;
+	unsigned m;
+	int rv;
+
+	for (;;) {
+		uv_mutex_lock(&job->mutex);
+		if (job->next == job->n || job->rv != 0) {
+			uv_mutex_unlock(&job->mutex);
+			break;
+		}
+		entry = &job->entries[job->next];
+		job->next++;
+		job->running++;
+		uv_mutex_unlock(&job->mutex);
+
+		rv = encodeDatabase(entry->db, entry, job->codec,
+				    &job->bufs[entry->first], &m);
+
+		uv_mutex_lock(&job->mutex);
+		if (rv != 0) {
+			if (job->rv == 0) {
+				job->rv = rv;
+			}
+		} else {
+			assert(m == entry->n_bufs);
+			entry->encoded = true;
+		}
+		job->running--;
+		uv_cond_signal(&job->cond);
+		uv_mutex_unlock(&job->mutex);
+	}
+}
+
+static void snapshotJobUnref(struct snapshotJob *job)
+{
+	job->refs--;
+	if (job->refs > 0) {
+		return;
+	}
+	uv_cond_destroy(&job->cond);
+	uv_mutex_destroy(&job->mutex);
+	raft_free(job);
+}
+
+static void snapshotWorkCb(uv_work_t *work)
+{
+	snapshotEncode(work->data);
+}
+
+/* Run on the loop thread, possibly well after fsm__snapshot() returned. */
+static void snapshotWorkAfterCb(uv_work_t *work, int status)
+{
+	(void)status;
+	snapshotJobUnref(work->data);
+}
+
+/* Encode all databases of a job, spreading them over the thread pool of the
+ * given loop, if any, and wait for all of them to be done. */
+static int snapshotJobRun(struct snapshotJob *job, struct uv_loop_s *loop)
+{
+	unsigned n_works;
+	unsigned i;
+	int rv;
+
+	for (n_works = 0; loop != NULL && n_works < SNAPSHOT_WORKERS &&
+			  n_works + 1 < job->n;
+	     n_works++) {
+		job->works[n_works].data = job;
+		rv = uv_queue_work(loop, &job->works[n_works], snapshotWorkCb,
+				   snapshotWorkAfterCb);
+		if (rv != 0) {
+			/* The loop thread encodes what's left on its own. */
+			break;
+		}
+		job->refs++;
+	}
+
+	snapshotEncode(job);
+
+	uv_mutex_lock(&job->mutex);
+	while (job->running > 0) {
+		uv_cond_wait(&job->cond, &job->mutex);
+	}
+	rv = job->rv;
+	uv_mutex_unlock(&job->mutex);
+
+	/* Requests still queued, for instance because the thread pool is busy
+	 * with disk I/O, have nothing left to do. This fails for the ones that
+	 * already started, which is fine. */
+	for (i = 0; i < n_works; i++) {
+		uv_cancel((uv_req_t *)&job->works[i]);
+	}
+
+	return rv;
 }
 
 static int fsm__snapshot(struct raft_fsm *fsm,
@@ -368,57 +906,145 @@ static int fsm__snapshot(struct raft_fsm *fsm,
 			 unsigned *n_bufs)
 {
 	struct fsm *f = fsm->data;
+	struct snapshotJob *job;
+	struct snapshotEntry *entry;
 	queue *head;
 	struct db *db;
+	bool pending = false;
 	unsigned n = 0;
 	unsigned i;
+	unsigned j;
 	int rv;
 
 	/* First count how many databases we have and check that no transaction
-	 * is in progress. */
+	 * is half applied.
+	 *
+	 * The VFS snapshots leave out the frames of transactions in progress,
+	 * which is fine as long as none of their frames commands were applied:
+	 * followers installing the snapshot will get those commands from the
+	 * log entries that come after it. Transactions that already applied
+	 * non-commit frames commands can't be resumed from the snapshot, so
+	 * they still defer it. */
 	QUEUE__FOREACH(head, &f->registry->dbs)
 	{
 		db = QUEUE__DATA(head, struct db, queue);
 		if (db->tx != NULL) {
-			return RAFT_BUSY;
+			if (db->tx->state != TX__PENDING) {
+				__atomic_add_fetch(&f->metrics.snapshots_deferred, 1,
+						   __ATOMIC_RELAXED);
+				return RAFT_BUSY;
+			}
+			pending = true;
 		}
 		n++;
 	}
 
-	*n_bufs = 1;      /* Snapshot header */
-	*n_bufs += n * 3; /* Database header, main and wal */
-	*bufs = raft_malloc(*n_bufs * sizeof **bufs);
-	if (*bufs == NULL) {
+	job = raft_malloc(sizeof *job);
+	if (job == NULL) {
 		rv = RAFT_NOMEM;
 		goto err;
 	}
-
-	rv = encodeSnapshotHeader(n, &(*bufs)[0]);
+	job->entries = raft_malloc((n > 0 ? n : 1) * sizeof *job->entries);
+	if (job->entries == NULL) {
+		rv = RAFT_NOMEM;
+		goto err_after_job_alloc;
+	}
+	rv = uv_mutex_init(&job->mutex);
 	if (rv != 0) {
-		goto err_after_bufs_alloc;
+		rv = RAFT_NOMEM;
+		goto err_after_entries_alloc;
 	}
-
-	/* Encode individual databases. */
-	i = 1;
+	rv = uv_cond_init(&job->cond);
+	if (rv != 0) {
+		uv_mutex_destroy(&job->mutex);
+		rv = RAFT_NOMEM;
+		goto err_after_entries_alloc;
+	}
+	job->n = 0;
+	job->next = 0;
+	job->codec = snapshotCodecLookup(f->config->snapshot_compression);
+	job->running = 0;
+	job->refs = 1;
+	job->rv = 0;
+
+	/* Pin the content of all databases, to know how many buffers they
+	 * need. This doesn't copy any page. */
+	*n_bufs = 1; /* Snapshot header */
 	QUEUE__FOREACH(head, &f->registry->dbs)
 	{
 		db = QUEUE__DATA(head, struct db, queue);
-		rv = encodeDatabase(db, &(*bufs)[i]);
+		entry = &job->entries[job->n];
+		entry->db = db;
+		rv = VfsSnapshotAcquire(db->config->name, db->filename,
+					&entry->vfs);
 		if (rv != 0) {
-			goto err_after_encode_header;
+			goto err_after_snapshots_acquire;
 		}
-		i += 3;
+		entry->first = *n_bufs;
+		entry->n_bufs = 1 + countChunks(entry->vfs);
+		entry->encoded = false;
+		*n_bufs += entry->n_bufs;
+		job->n++;
+	}
+
+	*bufs = raft_malloc(*n_bufs * sizeof **bufs);
+	if (*bufs == NULL) {
+		rv = RAFT_NOMEM;
+		goto err_after_snapshots_acquire;
+	}
+	job->bufs = *bufs;
+
+	rv = encodeSnapshotHeader(
+	    job->codec != NULL ? SNAPSHOT_FORMAT_V3 : SNAPSHOT_FORMAT_V2, n,
+	    &(*bufs)[0]);
+	if (rv != 0) {
+		goto err_after_bufs_alloc;
+	}
+
+	rv = snapshotJobRun(job, f->loop);
+	if (rv != 0) {
+		goto err_after_encode;
+	}
+
+	for (i = 0; i < job->n; i++) {
+		VfsSnapshotRelease(job->entries[i].vfs);
+	}
+	raft_free(job->entries);
+	snapshotJobUnref(job);
+
+	/* Other threads read them, see dqlite_node_snapshot_stats(). */
+	__atomic_add_fetch(&f->metrics.snapshots, 1, __ATOMIC_RELAXED);
+	if (pending) {
+		__atomic_add_fetch(&f->metrics.snapshots_pending, 1,
+				   __ATOMIC_RELAXED);
 	}
 
 	return 0;
 
-err_after_encode_header:
-	do {
-		raft_free((*bufs)[i].base);
-		i--;
-	} while (i > 0);
+err_after_encode:
+	for (i = 0; i < job->n; i++) {
+		entry = &job->entries[i];
+		if (!entry->encoded) {
+			continue;
+		}
+		for (j = 0; j < entry->n_bufs; j++) {
+			raft_free((*bufs)[entry->first + j].base);
+		}
+	}
+	raft_free((*bufs)[0].base);
 err_after_bufs_alloc:
 	raft_free(*bufs);
+err_after_snapshots_acquire:
+	for (i = 0; i < job->n; i++) {
+		VfsSnapshotRelease(job->entries[i].vfs);
+	}
+	raft_free(job->entries);
+	snapshotJobUnref(job);
+	goto err;
+err_after_entries_alloc:
+	raft_free(job->entries);
+err_after_job_alloc:
+	raft_free(job);
 err:
 	assert(rv != 0);
 	return rv;
@@ -436,12 +1062,18 @@ static int fsm__restore(struct raft_fsm *fsm, struct raft_buffer *buf)
 	if (rv != 0) {
 		return rv;
 	}
-	if (header.format != SNAPSHOT_FORMAT) {
+	if (header.format != SNAPSHOT_FORMAT_V1 &&
+	    header.format != SNAPSHOT_FORMAT_V2 &&
+	    header.format != SNAPSHOT_FORMAT_V3) {
 		return RAFT_MALFORMED;
 	}
 
 	for (i = 0; i < header.n; i++) {
-		rv = decodeDatabase(f, &cursor);
+		if (header.format == SNAPSHOT_FORMAT_V1) {
+			rv = decodeDatabase(f, &cursor);
+		} else {
+			rv = decodeDatabaseChunks(f, &cursor, header.format);
+		}
 		if (rv != 0) {
 			return rv;
 		}
@@ -454,16 +1086,20 @@ static int fsm__restore(struct raft_fsm *fsm, struct raft_buffer *buf)
 
 int fsm__init(struct raft_fsm *fsm,
 	      struct config *config,
-	      struct registry *registry)
+	      struct registry *registry,
+	      struct uv_loop_s *loop)
 {
-	struct fsm *f = raft_malloc(sizeof *fsm);
+	struct fsm *f = raft_malloc(sizeof *f);
 
 	if (f == NULL) {
 		return DQLITE_NOMEM;
 	}
 
 	f->logger = &config->logger;
+	f->config = config;
 	f->registry = registry;
+	f->loop = loop;
+	dqlite__metrics_init(&f->metrics);
 
 	fsm->version = 1;
 	fsm->data = f;
@@ -479,3 +1115,9 @@ void fsm__close(struct raft_fsm *fsm)
 	struct fsm *f = fsm->data;
 	raft_free(f);
 }
+
+const struct dqlite__metrics *fsm__metrics(const struct raft_fsm *fsm)
+{
+	const struct fsm *f = fsm->data;
+	return &f->metrics;
+}
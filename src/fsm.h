@@ -6,18 +6,31 @@
 #define DQLITE_FSM_H_
 
 #include <raft.h>
+#include <uv.h>
 
 #include "registry.h"
 #include "config.h"
+#include "metrics.h"
 
 /**
  * Initialize the given SQLite replication interface with dqlite's raft based
  * implementation.
+ *
+ * If @loop is not NULL, snapshots encode databases in parallel on its thread
+ * pool.
  */
 int fsm__init(struct raft_fsm *fsm,
 	      struct config *config,
-	      struct registry *registry);
+	      struct registry *registry,
+	      struct uv_loop_s *loop);
 
 void fsm__close(struct raft_fsm *fsm);
 
+/**
+ * Return the counters of snapshots taken and deferred. The snapshot counters
+ * are updated atomically, so other threads can read them with
+ * __atomic_load_n().
+ */
+const struct dqlite__metrics *fsm__metrics(const struct raft_fsm *fsm);
+
 #endif /* DQLITE_REPLICATION_METHODS_H_ */
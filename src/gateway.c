@@ -665,17 +665,19 @@ static int handle_remove(struct handle *req, struct cursor *cursor)
 	return 0;
 }
 
+/* Encode the given file into the response buffer, reading its content directly
+ * into the buffer instead of going through a temporary copy. */
 static int dumpFile(struct gateway *g,
 		    const char *filename,
 		    struct buffer *buffer)
 {
 	void *cur;
-	void *buf;
 	size_t file_size;
 	uint64_t len;
 	int rv;
 
-	rv = VfsFileRead(g->config->name, filename, &buf, &file_size);
+	rv = VfsFileReadChunk(g->config->name, filename, 0, NULL, 0,
+			      &file_size);
 	if (rv != 0) {
 		return rv;
 	}
@@ -683,12 +685,12 @@ static int dumpFile(struct gateway *g,
 
 	cur = buffer__advance(buffer, text__sizeof(&filename));
 	if (cur == NULL) {
-		goto oom;
+		return DQLITE_NOMEM;
 	}
 	text__encode(&filename, &cur);
 	cur = buffer__advance(buffer, uint64__sizeof(&len));
 	if (cur == NULL) {
-		goto oom;
+		return DQLITE_NOMEM;
 	}
 	uint64__encode(&len, &cur);
 
@@ -697,21 +699,14 @@ static int dumpFile(struct gateway *g,
 	}
 
 	assert(len % 8 == 0);
-	assert(buf != NULL);
 
 	cur = buffer__advance(buffer, len);
 	if (cur == NULL) {
-		goto oom;
+		return DQLITE_NOMEM;
 	}
-	memcpy(cur, buf, len);
-
-	raft_free(buf);
-
-	return 0;
 
-oom:
-	sqlite3_free(buf);
-	return DQLITE_NOMEM;
+	return VfsFileReadChunk(g->config->name, filename, 0, cur, file_size,
+				&file_size);
 }
 
 static int handle_dump(struct handle *req, struct cursor *cursor)
@@ -154,6 +154,12 @@ static int openConnection(const char *filename,
 		goto err_after_open;
 	}
 
+	/* Read database pages straight from the VFS. */
+	rc = db__enable_fetch(*conn, page_size, &msg);
+	if (rc != SQLITE_OK) {
+		goto err_after_open;
+	}
+
 	/* Set WAL replication. */
 	rc = sqlite3_wal_replication_leader(*conn, "main", replication,
 					    replication_arg);
@@ -0,0 +1,281 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#include "../../include/dqlite.h"
+
+/* Minimum length of a match, implied by the format. */
+#define MIN_MATCH 4
+
+/* The format requires the last match to start at least MF_LIMIT bytes before
+ * the end of the input, and the last LAST_LITERALS bytes to be literals. */
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+
+/* Maximum distance of a match, encoded in two bytes. */
+#define MAX_DISTANCE 65535
+
+/* Number of bits of the hash of a 4-byte sequence, indexing the table holding
+ * the last position where each hash was seen. */
+#define HASH_LOG 12
+
+/* The step of the search for a match grows by one every 2^SKIP_TRIGGER bytes
+ * since the last match, to skim quickly over incompressible data. */
+#define SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static unsigned hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+size_t lz4__bound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+/* Write the part of a length exceeding the 15 that fit in the token. */
+static uint8_t *putLength(uint8_t *op, const uint8_t *oend, size_t length)
+{
+	for (; length >= 255; length -= 255) {
+		if (op == oend) {
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op == oend) {
+		return NULL;
+	}
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+/* Write a sequence of @n literals, followed by a match of @length bytes at the
+ * given @distance, unless @length is zero, which is the case of the last
+ * sequence. Return NULL if it doesn't fit. */
+static uint8_t *putSequence(uint8_t *op,
+			    const uint8_t *oend,
+			    const uint8_t *literals,
+			    size_t n,
+			    size_t distance,
+			    size_t length)
+{
+	uint8_t *token;
+
+	if (op == oend) {
+		return NULL;
+	}
+	token = op++;
+	*token = (uint8_t)((n >= 15 ? 15 : n) << 4);
+	if (n >= 15) {
+		op = putLength(op, oend, n - 15);
+		if (op == NULL) {
+			return NULL;
+		}
+	}
+	if ((size_t)(oend - op) < n) {
+		return NULL;
+	}
+	memcpy(op, literals, n);
+	op += n;
+
+	if (length == 0) {
+		return op;
+	}
+
+	if (oend - op < 2) {
+		return NULL;
+	}
+	*op++ = (uint8_t)distance;
+	*op++ = (uint8_t)(distance >> 8);
+	length -= MIN_MATCH;
+	*token |= (uint8_t)(length >= 15 ? 15 : length);
+	if (length >= 15) {
+		op = putLength(op, oend, length - 15);
+	}
+
+	return op;
+}
+
+size_t lz4__compress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const uint8_t *in = src;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + cap;
+	uint32_t table[1 << HASH_LOG];
+	size_t anchor = 0;
+	size_t ip = 1;
+
+	if (n > MF_LIMIT) {
+		size_t limit = n - MF_LIMIT;
+		size_t match_limit = n - LAST_LITERALS;
+
+		memset(table, 0, sizeof table);
+
+		while (ip < limit) {
+			uint32_t sequence = read32(in + ip);
+			unsigned h = hash(sequence);
+			size_t ref = table[h];
+			size_t length;
+
+			table[h] = (uint32_t)ip;
+
+			if (ip - ref > MAX_DISTANCE ||
+			    read32(in + ref) != sequence) {
+				ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+				continue;
+			}
+
+			/* Extend the match backwards over pending literals,
+			 * then forward. */
+			while (ip > anchor && ref > 0 &&
+			       in[ip - 1] == in[ref - 1]) {
+				ip--;
+				ref--;
+			}
+			length = MIN_MATCH;
+			while (ip + length + 8 <= match_limit &&
+			       read64(in + ip + length) ==
+				   read64(in + ref + length)) {
+				length += 8;
+			}
+			while (ip + length < match_limit &&
+			       in[ip + length] == in[ref + length]) {
+				length++;
+			}
+
+			op = putSequence(op, oend, in + anchor, ip - anchor,
+					 ip - ref, length);
+			if (op == NULL) {
+				return 0;
+			}
+			ip += length;
+			anchor = ip;
+
+			/* Index a position inside the match, which helps with
+			 * runs of repeated sequences. */
+			table[hash(read32(in + ip - 2))] = (uint32_t)(ip - 2);
+		}
+	}
+
+	op = putSequence(op, oend, in + anchor, n - anchor, 0, 0);
+	if (op == NULL) {
+		return 0;
+	}
+
+	return (size_t)(op - (uint8_t *)dst);
+}
+
+/* Read the part of a length exceeding the 15 that fit in the token. */
+static int getLength(const uint8_t **ip, const uint8_t *iend, size_t *length)
+{
+	uint8_t byte;
+	do {
+		if (*ip == iend) {
+			return DQLITE_ERROR;
+		}
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+int lz4__decompress(const void *src, size_t n, void *dst, size_t len)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + n;
+	uint8_t *out = dst;
+	size_t op = 0;
+
+	for (;;) {
+		unsigned token;
+		size_t length;
+		size_t distance;
+		size_t copied;
+
+		if (ip == iend) {
+			return DQLITE_ERROR;
+		}
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15 && getLength(&ip, iend, &length) != 0) {
+			return DQLITE_ERROR;
+		}
+		if (length > (size_t)(iend - ip) || length > len - op) {
+			return DQLITE_ERROR;
+		}
+		/* Copying a fixed size is much faster for short runs, and
+		 * the bytes past the end are overwritten later. */
+		if (length <= 16 && iend - ip >= 16 && len - op >= 16) {
+			memcpy(out + op, ip, 16);
+		} else {
+			memcpy(out + op, ip, length);
+		}
+		ip += length;
+		op += length;
+
+		/* The last sequence has no match. */
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return DQLITE_ERROR;
+		}
+		distance = (size_t)ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (distance == 0 || distance > op) {
+			return DQLITE_ERROR;
+		}
+
+		length = token & 15;
+		if (length == 15 && getLength(&ip, iend, &length) != 0) {
+			return DQLITE_ERROR;
+		}
+		length += MIN_MATCH;
+		if (length > len - op) {
+			return DQLITE_ERROR;
+		}
+
+		if (distance >= 8 && len - op >= length + 8) {
+			/* Copy 8 bytes at a time, possibly past the end of the
+			 * match, reading bytes written by earlier steps if the
+			 * match is closer than its length. */
+			for (copied = 0; copied < length; copied += 8) {
+				memcpy(out + op + copied,
+				       out + op - distance + copied, 8);
+			}
+		} else {
+			/* A match closer than its length repeats the last
+			 * @distance bytes. Copy them in non-overlapping blocks,
+			 * each twice as long as the previous one. */
+			for (copied = 0; copied < length;) {
+				size_t k = distance + copied;
+				if (k > length - copied) {
+					k = length - copied;
+				}
+				memcpy(out + op + copied, out + op - distance,
+				       k);
+				copied += k;
+			}
+		}
+		op += length;
+	}
+
+	return op == len ? 0 : DQLITE_ERROR;
+}
@@ -0,0 +1,39 @@
+/**
+ * Compression and decompression of buffers in the LZ4 block format.
+ *
+ * See https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ *
+ * Only whole buffers are handled, with no frame around them: the caller is
+ * expected to keep track of the size of a buffer before compression. The
+ * compressor is the simple greedy one, which trades some ratio for speed.
+ */
+
+#ifndef LIB_LZ4_H_
+#define LIB_LZ4_H_
+
+#include <stddef.h>
+
+/**
+ * Return the maximum size of the compressed form of @n bytes.
+ */
+size_t lz4__bound(size_t n);
+
+/**
+ * Compress the @n bytes at @src into @dst, which has room for @cap bytes.
+ *
+ * Return the size of the compressed data, or zero if it doesn't fit in @cap
+ * bytes. Passing a @cap of at least lz4__bound(@n) never fails.
+ */
+size_t lz4__compress(const void *src, size_t n, void *dst, size_t cap);
+
+/**
+ * Decompress the @n bytes at @src into @dst, which must end up holding exactly
+ * @len bytes.
+ *
+ * Return DQLITE_ERROR if the compressed data is malformed or doesn't expand to
+ * exactly @len bytes. Nothing is ever read or written outside of the given
+ * buffers.
+ */
+int lz4__decompress(const void *src, size_t n, void *dst, size_t len);
+
+#endif /* LIB_LZ4_H_ */
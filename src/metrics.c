@@ -9,4 +9,7 @@ void dqlite__metrics_init(struct dqlite__metrics *m) {
 
 	m->requests = 0;
 	m->duration = 0;
+	m->snapshots = 0;
+	m->snapshots_pending = 0;
+	m->snapshots_deferred = 0;
 }
@@ -12,6 +12,13 @@
 struct dqlite__metrics {
 	uint64_t requests; /* Total number of requests served. */
 	uint64_t duration; /* Total time spent to server requests. */
+
+	/* Number of snapshots taken, of snapshots taken while a write
+	 * transaction was in progress, and of snapshots deferred because of
+	 * one. */
+	uint64_t snapshots;
+	uint64_t snapshots_pending;
+	uint64_t snapshots_deferred;
 };
 
 void dqlite__metrics_init(struct dqlite__metrics *m);
@@ -27,9 +27,14 @@ int dqlite__init(struct dqlite_node *d,
 	if (rv != 0) {
 		goto err;
 	}
+	d->dir = sqlite3_mprintf("%s", dir);
+	if (d->dir == NULL) {
+		rv = DQLITE_NOMEM;
+		goto err_after_config_init;
+	}
 	rv = VfsInitV1(&d->vfs, d->config.name);
 	if (rv != 0) {
-		goto err_after_config_init;
+		goto err_after_dir_init;
 	}
 	registry__init(&d->registry, &d->config);
 	rv = uv_loop_init(&d->loop);
@@ -48,7 +53,8 @@ int dqlite__init(struct dqlite_node *d,
 		rv = DQLITE_ERROR;
 		goto err_after_raft_transport_init;
 	}
-	rv = fsm__init(&d->raft_fsm, &d->config, &d->registry);
+	rv = fsm__init(&d->raft_fsm, &d->config, &d->registry,
+		       &d->loop);
 	if (rv != 0) {
 		goto err_after_raft_io_init;
 	}
@@ -90,6 +96,7 @@ int dqlite__init(struct dqlite_node *d,
 	assert(rv == 0); /* Docs say that pthread_mutex_init can't fail */
 	QUEUE__INIT(&d->queue);
 	QUEUE__INIT(&d->conns);
+	d->spill_idle = 0;
 	d->running = false;
 	d->listener = NULL;
 	d->bind_address = NULL;
@@ -109,6 +116,8 @@ err_after_loop_init:
 	uv_loop_close(&d->loop);
 err_after_vfs_init:
 	VfsClose(&d->vfs);
+err_after_dir_init:
+	sqlite3_free(d->dir);
 err_after_config_init:
 	config__close(&d->config);
 err:
@@ -131,6 +140,7 @@ void dqlite__close(struct dqlite_node *d)
 	raftProxyClose(&d->raft_transport);
 	registry__close(&d->registry);
 	VfsClose(&d->vfs);
+	sqlite3_free(d->dir);
 	config__close(&d->config);
 	if (d->bind_address != NULL) {
 		sqlite3_free(d->bind_address);
@@ -308,6 +318,71 @@ int dqlite_node_set_failure_domain(dqlite_node *n, unsigned long long code)
 	return 0;
 }
 
+int dqlite_node_set_spill(dqlite_node *n, unsigned idle, size_t budget)
+{
+	int rv;
+	if (n->running) {
+		return DQLITE_MISUSE;
+	}
+	rv = VfsEnableSpill(&n->vfs, n->dir, idle, budget);
+	if (rv != 0) {
+		return rv;
+	}
+	n->spill_idle = idle;
+	return 0;
+}
+
+int dqlite_node_set_page_compression(dqlite_node *n, unsigned checkpoints)
+{
+	if (n->running) {
+		return DQLITE_MISUSE;
+	}
+	return VfsEnableCompression(&n->vfs, checkpoints);
+}
+
+int dqlite_node_enable_huge_pages(dqlite_node *n)
+{
+	if (n->running) {
+		return DQLITE_MISUSE;
+	}
+	return VfsEnableHugePages(&n->vfs);
+}
+
+int dqlite_node_set_snapshot_compression(dqlite_node *n, int codec)
+{
+	if (n->running) {
+		return DQLITE_MISUSE;
+	}
+	switch (codec) {
+		case DQLITE_SNAPSHOT_COMPRESSION_NONE:
+		case DQLITE_SNAPSHOT_COMPRESSION_LZ4:
+			break;
+		case DQLITE_SNAPSHOT_COMPRESSION_ZSTD:
+#ifdef DQLITE_ZSTD
+			break;
+#else
+			return DQLITE_ERROR;
+#endif
+		default:
+			return DQLITE_MISUSE;
+	}
+	n->config.snapshot_compression = (unsigned)codec;
+	return 0;
+}
+
+int dqlite_node_snapshot_stats(dqlite_node *n,
+			       struct dqlite_node_snapshot_stats *stats)
+{
+	const struct dqlite__metrics *metrics = fsm__metrics(&n->raft_fsm);
+
+	stats->taken = __atomic_load_n(&metrics->snapshots, __ATOMIC_RELAXED);
+	stats->pending =
+	    __atomic_load_n(&metrics->snapshots_pending, __ATOMIC_RELAXED);
+	stats->deferred =
+	    __atomic_load_n(&metrics->snapshots_deferred, __ATOMIC_RELAXED);
+	return 0;
+}
+
 static int maybeBootstrap(dqlite_node *d,
 			  dqlite_node_id id,
 			  const char *address)
@@ -350,6 +425,7 @@ static void raftCloseCb(struct raft *raft)
 	raft_uv_close(&s->raft_io);
 	uv_close((struct uv_handle_s *)&s->stop, NULL);
 	uv_close((struct uv_handle_s *)&s->startup, NULL);
+	uv_close((struct uv_handle_s *)&s->spill, NULL);
 	uv_close((struct uv_handle_s *)s->listener, NULL);
 }
 
@@ -390,6 +466,13 @@ static void startup_cb(uv_timer_t *startup)
 	assert(rv == 0); /* No reason for which posting should fail */
 }
 
+/* Callback invoked periodically to spill the database pages that went idle. */
+static void spillCb(uv_timer_t *spill)
+{
+	struct dqlite_node *d = spill->data;
+	VfsSpill(&d->vfs);
+}
+
 static void listenCb(uv_stream_t *listener, int status)
 {
 	struct dqlite_node *t = listener->data;
@@ -492,6 +575,17 @@ static int taskRun(struct dqlite_node *d)
 	rv = uv_timer_start(&d->startup, startup_cb, 0, 0);
 	assert(rv == 0);
 
+	/* Check for idle database pages twice per idle period, so they get
+	 * spilled at most one and a half periods after their last use. */
+	d->spill.data = d;
+	rv = uv_timer_init(&d->loop, &d->spill);
+	assert(rv == 0);
+	if (d->spill_idle > 0) {
+		rv = uv_timer_start(&d->spill, spillCb, d->spill_idle / 2 + 1,
+				    d->spill_idle / 2 + 1);
+		assert(rv == 0);
+	}
+
 	d->raft.data = d;
 	rv = raft_start(&d->raft);
 	if (rv != 0) {
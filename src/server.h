@@ -31,6 +31,9 @@ struct dqlite_node
 	struct uv_stream_s *listener;               /* Listening socket */
 	struct uv_async_s stop;                     /* Trigger UV loop stop */
 	struct uv_timer_s startup;                  /* Unblock ready sem */
+	struct uv_timer_s spill;                    /* Spill idle pages */
+	unsigned spill_idle;                        /* Spill period, or zero */
+	char *dir;                                  /* Data directory */
 	char *bind_address;                         /* Listen address */
 	char errmsg[RAFT_ERRMSG_BUF_SIZE];          /* Last error occurred */
 };
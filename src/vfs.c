@@ -1,16 +1,27 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <raft.h>
 
 #include <sqlite3.h>
 
+#ifdef DQLITE_ZLIB
+#define ZLIB_CONST
+#include <zlib.h>
+#endif
+
 #include "../include/dqlite.h"
 
 #include "lib/assert.h"
+#include "lib/byte.h"
 
 #include "format.h"
 #include "vfs.h"
@@ -26,40 +37,258 @@ struct vfsShm
 {
 	void **regions;     /* Pointers to shared memory regions. */
 	unsigned n_regions; /* Number of shared memory regions. */
+	size_t size;        /* Memory used by the regions and their array. */
 
-	unsigned shared[SQLITE_SHM_NLOCK];    /* Count of shared locks */
-	unsigned exclusive[SQLITE_SHM_NLOCK]; /* Count of exclusive locks */
+	/* State of each lock slot: the number of shared locks held, or
+	 * VFS__SHM_EXCLUSIVE. Slots are updated atomically, see vfsShmLock(). */
+	int locks[SQLITE_SHM_NLOCK];
 };
 
+/* Value of a shared memory lock slot held in exclusive mode. */
+#define VFS__SHM_EXCLUSIVE -1
+
 struct vfsWal;
+struct vfsFrame;
+struct vfsFramePool;
+
+/* Number of pages tracked by each leaf of a database page index. */
+#define VFS__PAGE_LEAF_SIZE 1024
+
+/* Minimum and maximum number of pages held by a single slab. The first slab of
+ * a database holds VFS__SLAB_MIN_PAGES pages and each following one doubles in
+ * size, up to VFS__SLAB_MAX_PAGES, so small databases don't waste memory and
+ * large ones need few allocations. */
+#define VFS__SLAB_MIN_PAGES 4
+#define VFS__SLAB_MAX_PAGES 256
+
+/* Size of a huge page. With VfsEnableHugePages(), slabs grow up to this size
+ * if VFS__SLAB_MAX_PAGES pages are less, and slabs whose data is a multiple of
+ * it are backed by aligned regions of huge pages. */
+#define VFS__HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Number of buffers holding decompressed pages of each database, see
+ * VfsEnableCompression(). */
+#define VFS__PAGE_CACHE_SIZE 16
+
+/* Largest region of a spill file, able to hold the biggest possible slab. */
+#define VFS__SPILL_MAX_SHIFT 24
+
+/* File holding the pages of slabs that were spilled out of memory, see
+ * VfsEnableSpill().
+ *
+ * The file is unlinked as soon as it's created. Each spilled slab owns a region
+ * of the file whose size is a power of two, at least as big as a system page.
+ * Released regions are punched out of the file, so they don't use any disk
+ * space, and are recycled by later spills of the same size class. */
+struct vfsSpill
+{
+	int fd;                                    /* Unlinked spill file. */
+	off_t size;                                /* Size of the file. */
+	size_t page_size;                          /* System page size. */
+	off_t *free[VFS__SPILL_MAX_SHIFT + 1];     /* Released regions. */
+	unsigned n_free[VFS__SPILL_MAX_SHIFT + 1]; /* N. of released regions. */
+	unsigned idle;         /* Milliseconds before an unused slab spills. */
+	size_t budget;         /* Max. resident page bytes of a database. */
+	bool threadsafe;       /* Whether to serialize access. */
+	pthread_mutex_t mutex; /* Guard size and free lists, if threadsafe. */
+};
+
+/* Read-only private mapping of a database image file, shared by the slabs whose
+ * pages are still read from it, see VfsLoadImage(). */
+struct vfsImage
+{
+	unsigned refcount; /* N. of slabs using the mapping. */
+	uint8_t *map;      /* Mapping of the whole file. */
+	size_t size;       /* Size of the mapping. */
+};
+
+/* A single allocation holding the content of a range of consecutive database
+ * pages.
+ *
+ * Slabs are referenced by their database and by the snapshots that pinned
+ * them, see VfsSnapshotAcquire(). The pages of a slab referenced by a snapshot
+ * are never modified: writes are redirected to private frames instead.
+ *
+ * A slab that was spilled has no data of its own, and its pages are read from
+ * a read-only mapping of its spill file region instead. Spilled slabs are
+ * never modified either: the database faults them back into a new slab before
+ * using them, see vfsDatabaseSlabFault().
+ *
+ * Slabs loaded from a database image read their pages from a region of the
+ * image mapping in the same way, but they're only faulted when written.
+ *
+ * The same goes for compressed slabs, whose data holds the compressed content
+ * of their first @n_compressed pages, each compressed on its own: an array of
+ * @n_compressed + 1 offsets, followed by the compressed bytes. Reads decompress
+ * single pages, while writes fault the whole slab back.
+ *
+ * The data of a slab follows the slab object, unless it's in a region of huge
+ * pages of its own, see vfsHugeAlloc(). */
+struct vfsSlab
+{
+	unsigned first;           /* Number of the first page stored. */
+	unsigned n_pages;         /* Number of pages the slab can hold. */
+	unsigned refcount;        /* N. of database and snapshot references. */
+	bool hot;                 /* Used since the spill hand last passed. */
+	unsigned long long atime; /* Time of the last use, in milliseconds. */
+	unsigned epoch;           /* Checkpoint count at the time of last use. */
+	unsigned n_compressed;    /* N. of compressed pages, if compressed. */
+	struct vfsSpill *spill;   /* File holding the pages, if spilled. */
+	struct vfsImage *image;   /* Image holding the pages, if loaded. */
+	uint8_t *map;             /* Mapping of the spilled or loaded pages. */
+	off_t offset;             /* Offset of the spilled region. */
+	size_t size;              /* Size of the spilled or loaded region. */
+	size_t huge;              /* Size of the huge page region, if any. */
+	uint8_t *data;            /* Content of the pages, if resident. */
+};
+
+/* A leaf of the page index of a database.
+ *
+ * Each page has a slot in a slab, but when a checkpoint writes back a page
+ * that it has just read from the WAL, the WAL frame holding that page is lent
+ * to the database instead of copying its content, see vfsDatabasePageLend().
+ * In that case the content of the slab slot is stale and the frame is used in
+ * its place, until the page is written again. Private frames are used in the
+ * same way when a page gets written while its slab is pinned by a snapshot.
+ *
+ * Pages skipped by a write past the end of the file are holes instead: they
+ * have no slot and no frame, and read as zeros until they're written, see
+ * vfsDatabaseGrow(). Leaves holding only holes are not allocated at all. */
+struct vfsLeaf
+{
+	void *pages[VFS__PAGE_LEAF_SIZE];             /* Slots in slabs. */
+	struct vfsFrame *frames[VFS__PAGE_LEAF_SIZE]; /* Lent frames. */
+	unsigned n_frames;                            /* N. of lent frames. */
+};
+
+/* Memory used by a database and by its WAL, in bytes, as measured by
+ * sqlite3_msize(). See VfsStats(). */
+struct vfsUsage
+{
+	size_t pages;    /* Slabs. */
+	size_t frames;   /* Frames of the WAL and frames used by pages. */
+	size_t overhead; /* Page index, arrays and file objects. */
+	size_t spilled;  /* Spill file regions, not counted as memory. */
+	size_t mapped;   /* Pages read from an image, not counted as memory. */
+	size_t compressed;   /* Compressed slabs, also counted in @pages. */
+	size_t uncompressed; /* Size of the pages of compressed slabs. */
+};
+
+/* Buffer holding the decompressed content of a page of a compressed slab. */
+struct vfsCachedPage
+{
+	unsigned pgno;           /* Number of the page, or zero if unused. */
+	unsigned long long tick; /* Time of the last use, in cache lookups. */
+	uint8_t *buf;            /* Content of the page. */
+};
+
+/* Compressed pages of a database, see VfsEnableCompression().
+ *
+ * Reads of a compressed page go through a small cache of decompressed pages,
+ * evicting the least recently used one on a miss. */
+struct vfsCompression
+{
+	void *inflater; /* Decompression stream, created on first use. */
+	struct vfsCachedPage cache[VFS__PAGE_CACHE_SIZE]; /* Hot pages. */
+	unsigned long long tick;  /* N. of cache lookups. */
+	unsigned long long reads; /* N. of reads of compressed pages. */
+	unsigned long long pages; /* N. of pages decompressed. */
+};
 
 /* Database-specific content */
 struct vfsDatabase
 {
-	unsigned page_size; /* Page size of each page. */
-	void **pages;       /* All database. */
-	unsigned n_pages;   /* Number of pages. */
-	struct vfsShm shm;  /* Shared memory. */
-	struct vfsWal *wal; /* Associated WAL. */
+	struct vfsFramePool *pool; /* Pool to release lent frames to. */
+	unsigned page_size;        /* Page size of each page. */
+	struct vfsLeaf **leaves;   /* Two-level index of pages, see vfsLeaf. */
+	unsigned n_leaves;         /* Number of leaf pointers in the index. */
+	struct vfsSlab **slabs;    /* Slabs holding the content of all pages. */
+	unsigned n_slabs;          /* Number of slabs. */
+	unsigned n_pages;          /* Number of pages. */
+	struct vfsSpill *spill;    /* File to spill unused slabs to, if any. */
+	unsigned hand;             /* Next slab to consider for spilling. */
+	unsigned checkpoints;      /* N. of checkpoints so far. */
+	unsigned compress_age;     /* Checkpoints before compressing a slab. */
+	struct vfsCompression *compression; /* Compressed pages state. */
+	bool huge;                 /* Whether to use huge pages for slabs. */
+	struct vfsImage *image;    /* Image the pages were loaded from, if any. */
+	struct vfsShm shm;         /* Shared memory. */
+	struct vfsWal *wal;        /* Associated WAL. */
+	struct vfsUsage usage;     /* Memory used by the database and WAL. */
+	size_t quota;              /* Maximum memory usage, or zero. */
+	pthread_mutex_t mutex;     /* Guard pages, frames and WAL, if enabled. */
 	int version;
 };
 
-/* Hold the content of a single WAL frame. */
+struct vfsBuffer;
+
+/* Hold the content of a single WAL frame.
+ *
+ * The frame object and its page are allocated as a single block, with the page
+ * content at the beginning of the block and the frame object right after it,
+ * see vfsFrameCreate().
+ *
+ * Frames created by VfsCommitAdopt() are the exception: their page points
+ * into a buffer owned by the caller, and @owner is set. */
 struct vfsFrame
 {
 	uint8_t hdr[FORMAT__WAL_FRAME_HDR_SIZE];
-	void *buf; /* Content of the page. */
+	void *buf;               /* Content of the page. */
+	unsigned refcount;       /* N. of WAL and database references. */
+	unsigned holders;        /* Whether held by the WAL or database. */
+	struct vfsFrame *next;   /* Next free frame, when in a pool. */
+	struct vfsBuffer *owner; /* Adopted buffer holding the page, if any. */
+};
+
+/* A buffer of WAL pages adopted by VfsCommitAdopt(), shared by all frames of
+ * the commit and allocated along with their frame objects. The buffer is handed
+ * back to its owner once all frames are gone. */
+struct vfsBuffer
+{
+	unsigned refcount;          /* N. of frames pointing into the buffer. */
+	void (*release)(void *arg); /* Release callback of the owner. */
+	void *arg;                  /* Argument for the release callback. */
+	struct vfsFrame frames[];   /* Frame objects of the commit. */
+};
+
+/* Size of a CPU cache line. Frame blocks are aligned to cache lines and sized
+ * in whole cache lines. Since page sizes are multiples of it, neither the page
+ * nor the frame object of a block shares a cache line with another block. */
+#define VFS__CACHE_LINE 64
+
+/* Number of page size classes, one for each power of two between
+ * FORMAT__PAGE_SIZE_MIN and FORMAT__PAGE_SIZE_MAX. */
+#define VFS__FRAME_POOL_N_CLASSES 8
+
+/* Maximum number of bytes that a frame pool keeps around in free frames. */
+#define VFS__FRAME_POOL_MAX_SIZE (16 * 1024 * 1024)
+
+/* Pool of free WAL frames, recycled across checkpoints. Each WAL truncation
+ * releases frames that will be soon needed again by new transactions, so we
+ * save the allocation cost. */
+struct vfsFramePool
+{
+	struct vfsFrame *free[VFS__FRAME_POOL_N_CLASSES]; /* Free lists */
+	size_t size;               /* Total size of all free frames. */
+	unsigned long long hits;   /* N. of frames taken from the pool. */
+	unsigned long long misses; /* N. of frames allocated from heap. */
+	bool threadsafe;           /* Whether to serialize access. */
+	pthread_mutex_t mutex;     /* Guard all fields, if threadsafe is set. */
 };
 
 /* WAL-specific content */
 struct vfsWal
 {
+	struct vfsFramePool *pool;         /* Pool to allocate frames from */
 	struct vfsDatabase *database;      /* Associated database */
 	uint8_t hdr[FORMAT__WAL_HDR_SIZE]; /* Header. */
 	struct vfsFrame **frames;          /* All frames committed. */
 	unsigned n_frames;                 /* Number of committed frames. */
+	unsigned n_checksummed;            /* Committed frames with checksums. */
 	struct vfsFrame **tx;              /* Frames added by a transaction. */
 	unsigned n_tx;                     /* Number of added frames. */
+	const void *read_buf;              /* Buffer of the last page read. */
+	unsigned read_index;               /* Frame of the last page read. */
 	int version;
 };
 
@@ -73,6 +302,8 @@ enum vfsContentType {
 struct vfsContent
 {
 	char *filename;           /* Name of the file. */
+	unsigned hash;            /* Hash of the filename, see vfsHash(). */
+	unsigned i;               /* Position in the VFS contents array. */
 	enum vfsContentType type; /* Content type (either main db or WAL). */
 	unsigned refcount;        /* N. of files referencing this content. */
 	union {
@@ -81,42 +312,401 @@ struct vfsContent
 	};
 };
 
-/* Create a new frame of a WAL file. */
-static struct vfsFrame *vfsFrameCreate(unsigned size)
+/* Compute the FNV-1a hash of the first @len bytes of the given filename. */
+static unsigned vfsHash(const char *filename, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)filename[i];
+		hash *= 16777619u;
+	}
+
+	return (unsigned)hash;
+}
+
+/* Reference counts of slabs, frames and adopted buffers are shared between
+ * databases, WALs and snapshots. Since VfsSnapshotRelease() drops them without
+ * holding any database lock, they are always updated atomically, and so are the
+ * reference counts of file contents, which open files check locklessly. */
+static void vfsRef(unsigned *refcount)
+{
+	__atomic_add_fetch(refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference and return the number of references left. */
+static unsigned vfsUnref(unsigned *refcount)
+{
+	assert(__atomic_load_n(refcount, __ATOMIC_RELAXED) > 0);
+	return __atomic_sub_fetch(refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Return the current number of references. */
+static unsigned vfsRefcount(unsigned *refcount)
+{
+	return __atomic_load_n(refcount, __ATOMIC_ACQUIRE);
+}
+
+/* Initialize an empty frame pool. */
+static void vfsFramePoolInit(struct vfsFramePool *p)
 {
+	unsigned i;
+	int rv;
+	for (i = 0; i < VFS__FRAME_POOL_N_CLASSES; i++) {
+		p->free[i] = NULL;
+	}
+	p->size = 0;
+	p->hits = 0;
+	p->misses = 0;
+	p->threadsafe = false;
+	rv = pthread_mutex_init(&p->mutex, NULL);
+	assert(rv == 0); /* Docs say that pthread_mutex_init can't fail */
+	(void)rv;
+}
+
+static void vfsFramePoolLock(struct vfsFramePool *p)
+{
+	if (p->threadsafe) {
+		pthread_mutex_lock(&p->mutex);
+	}
+}
+
+static void vfsFramePoolUnlock(struct vfsFramePool *p)
+{
+	if (p->threadsafe) {
+		pthread_mutex_unlock(&p->mutex);
+	}
+}
+
+/* Release all free frames of the pool. */
+static void vfsFramePoolClose(struct vfsFramePool *p)
+{
+	unsigned i;
+	for (i = 0; i < VFS__FRAME_POOL_N_CLASSES; i++) {
+		while (p->free[i] != NULL) {
+			struct vfsFrame *f = p->free[i];
+			p->free[i] = f->next;
+			free(f->buf);
+		}
+	}
+	p->size = 0;
+	pthread_mutex_destroy(&p->mutex);
+}
+
+/* Return the pool class of frames with the given page size. */
+static unsigned vfsFramePoolClass(unsigned size)
+{
+	unsigned i = 0;
+
+	assert(size >= FORMAT__PAGE_SIZE_MIN && size <= FORMAT__PAGE_SIZE_MAX);
+	assert((size & (size - 1)) == 0);
+
+	while (((unsigned)FORMAT__PAGE_SIZE_MIN << i) < size) {
+		i++;
+	}
+
+	return i;
+}
+
+/* Return the size of the block holding a frame with the given page size. */
+static size_t vfsFrameBlockSize(unsigned size)
+{
+	size_t n = (size_t)size + sizeof(struct vfsFrame);
+	return (n + VFS__CACHE_LINE - 1) & ~(size_t)(VFS__CACHE_LINE - 1);
+}
+
+/* Create a new frame of a WAL file, possibly recycling a free frame from the
+ * pool.
+ *
+ * The content of the frame is not initialized, since the frame header and page
+ * are always fully written right after the frame gets created. */
+static struct vfsFrame *vfsFrameCreate(struct vfsFramePool *p, unsigned size)
+{
+	unsigned i = vfsFramePoolClass(size);
 	struct vfsFrame *f;
+	uint8_t *block;
 
 	assert(size > 0);
 
-	f = sqlite3_malloc(sizeof *f);
-	if (f == NULL) {
-		goto oom;
+	vfsFramePoolLock(p);
+	f = p->free[i];
+	if (f != NULL) {
+		p->free[i] = f->next;
+		p->size -= vfsFrameBlockSize(size);
+		p->hits++;
+		vfsFramePoolUnlock(p);
+		f->refcount = 1;
+		f->holders = 0;
+		f->next = NULL;
+		return f;
 	}
+	vfsFramePoolUnlock(p);
 
-	f->buf = sqlite3_malloc64(size);
-	if (f->buf == NULL) {
-		goto oom_after_page_alloc;
+	/* Blocks don't come from sqlite3_malloc64(), which doesn't align them
+	 * to cache lines, so they are released with free(). */
+	if (posix_memalign((void **)&block, VFS__CACHE_LINE,
+			   vfsFrameBlockSize(size)) != 0) {
+		return NULL;
 	}
+	vfsFramePoolLock(p);
+	p->misses++;
+	vfsFramePoolUnlock(p);
 
-	memset(f->buf, 0, (size_t)size);
-	memset(f->hdr, 0, FORMAT__WAL_FRAME_HDR_SIZE);
+	f = (struct vfsFrame *)(block + size);
+	f->buf = block;
+	f->refcount = 1;
+	f->holders = 0;
+	f->next = NULL;
+	f->owner = NULL;
 
 	return f;
+}
 
-oom_after_page_alloc:
-	sqlite3_free(f);
-oom:
-	return NULL;
+/* Drop a reference to an adopted buffer, releasing it if it was the last. */
+static void vfsBufferUnref(struct vfsBuffer *b)
+{
+	if (vfsUnref(&b->refcount) > 0) {
+		return;
+	}
+	b->release(b->arg);
+	sqlite3_free(b);
 }
 
-/* Destroy a WAL frame */
-static void vfsFrameDestroy(struct vfsFrame *f)
+/* Drop a reference to a WAL frame. When the last reference is gone, destroy the
+ * frame, returning it to the pool unless the pool is full. */
+static void vfsFrameDestroy(struct vfsFramePool *p, struct vfsFrame *f)
 {
+	unsigned size;
+	unsigned i;
+	size_t block_size;
+
 	assert(f != NULL);
 	assert(f->buf != NULL);
 
-	sqlite3_free(f->buf);
-	sqlite3_free(f);
+	if (vfsUnref(&f->refcount) > 0) {
+		return;
+	}
+
+	if (f->owner != NULL) {
+		vfsBufferUnref(f->owner);
+		return;
+	}
+
+	/* The frame object is stored right after its page. */
+	size = (unsigned)((uint8_t *)f - (uint8_t *)f->buf);
+	i = vfsFramePoolClass(size);
+	block_size = vfsFrameBlockSize(size);
+
+	vfsFramePoolLock(p);
+	if (p->size + block_size > VFS__FRAME_POOL_MAX_SIZE) {
+		vfsFramePoolUnlock(p);
+		free(f->buf);
+		return;
+	}
+
+	f->next = p->free[i];
+	p->free[i] = f;
+	p->size += block_size;
+	vfsFramePoolUnlock(p);
+}
+
+/* Bits of the holders mask of a frame. A frame counts towards the memory usage
+ * of a database as long as the database or its WAL hold it, even if it's also
+ * referenced by a snapshot. */
+#define VFS__FRAME_WAL 1      /* The frame is in the WAL. */
+#define VFS__FRAME_DATABASE 2 /* The frame is lent or private to a page. */
+
+/* Return the memory used by a frame of the given database. A frame backed by
+ * an adopted buffer counts its page and its frame object. */
+static size_t vfsFrameSize(const struct vfsDatabase *d,
+			   const struct vfsFrame *f)
+{
+	if (f->owner != NULL) {
+		return d->page_size + sizeof *f;
+	}
+	return vfsFrameBlockSize(d->page_size);
+}
+
+/* Record that the given frame is held by the WAL or by the pages of the
+ * database @d, as indicated by @holder. */
+static void vfsFrameHold(struct vfsDatabase *d,
+			 struct vfsFrame *f,
+			 unsigned holder)
+{
+	if (f->holders == 0) {
+		d->usage.frames += vfsFrameSize(d, f);
+	}
+	f->holders |= holder;
+}
+
+/* Record that the WAL or the pages of the database @d stopped holding the
+ * given frame. The reference to the frame must be dropped separately. */
+static void vfsFrameUnhold(struct vfsDatabase *d,
+			   struct vfsFrame *f,
+			   unsigned holder)
+{
+	assert(f->holders & holder);
+	f->holders &= ~holder;
+	if (f->holders == 0) {
+		d->usage.frames -= vfsFrameSize(d, f);
+	}
+}
+
+/* Return the current time in milliseconds, used to track slab usage. */
+static unsigned long long vfsSpillNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (unsigned long long)now.tv_sec * 1000 +
+	       (unsigned long long)now.tv_nsec / (1000 * 1000);
+}
+
+/* Create an unlinked spill file in the given directory. */
+static int vfsSpillInit(struct vfsSpill *s,
+			const char *dir,
+			unsigned idle,
+			size_t budget)
+{
+	char *path;
+	unsigned i;
+	int rv;
+
+	path = sqlite3_mprintf("%s/dqlite-spill-XXXXXX", dir);
+	if (path == NULL) {
+		return DQLITE_NOMEM;
+	}
+	s->fd = mkostemp(path, O_CLOEXEC);
+	if (s->fd == -1) {
+		sqlite3_free(path);
+		return DQLITE_ERROR;
+	}
+	unlink(path);
+	sqlite3_free(path);
+
+	s->size = 0;
+	s->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	for (i = 0; i <= VFS__SPILL_MAX_SHIFT; i++) {
+		s->free[i] = NULL;
+		s->n_free[i] = 0;
+	}
+	s->idle = idle;
+	s->budget = budget;
+	s->threadsafe = false;
+	rv = pthread_mutex_init(&s->mutex, NULL);
+	assert(rv == 0); /* Docs say that pthread_mutex_init can't fail */
+	(void)rv;
+
+	return 0;
+}
+
+/* Close the spill file, which must not be used by any slab anymore. */
+static void vfsSpillClose(struct vfsSpill *s)
+{
+	unsigned i;
+	for (i = 0; i <= VFS__SPILL_MAX_SHIFT; i++) {
+		sqlite3_free(s->free[i]);
+	}
+	close(s->fd);
+	pthread_mutex_destroy(&s->mutex);
+}
+
+static void vfsSpillLock(struct vfsSpill *s)
+{
+	if (s->threadsafe) {
+		pthread_mutex_lock(&s->mutex);
+	}
+}
+
+static void vfsSpillUnlock(struct vfsSpill *s)
+{
+	if (s->threadsafe) {
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+/* Return the size class of spill file regions of the given size. */
+static unsigned vfsSpillClass(struct vfsSpill *s, size_t size)
+{
+	unsigned shift = 0;
+
+	if (size < s->page_size) {
+		size = s->page_size;
+	}
+	while (((size_t)1 << shift) < size) {
+		shift++;
+	}
+	assert(shift <= VFS__SPILL_MAX_SHIFT);
+
+	return shift;
+}
+
+/* Reserve a region of the spill file able to hold @len bytes, recycling a
+ * released region of the same class if possible. */
+static void vfsSpillAlloc(struct vfsSpill *s,
+			  size_t len,
+			  off_t *offset,
+			  size_t *size)
+{
+	unsigned shift = vfsSpillClass(s, len);
+
+	*size = (size_t)1 << shift;
+
+	vfsSpillLock(s);
+	if (s->n_free[shift] > 0) {
+		s->n_free[shift]--;
+		*offset = s->free[shift][s->n_free[shift]];
+	} else {
+		/* All regions are multiples of the system page size, so they
+		 * can be mapped at their offset. */
+		*offset = s->size;
+		s->size += (off_t)*size;
+	}
+	vfsSpillUnlock(s);
+}
+
+/* Release a region of the spill file, so it can be reused. */
+static void vfsSpillRelease(struct vfsSpill *s, off_t offset, size_t size)
+{
+	unsigned shift = vfsSpillClass(s, size);
+	off_t *regions;
+
+	/* Give the disk space back. Not all file systems support this, in
+	 * which case the region is just overwritten when reused. */
+	fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+		  (off_t)size);
+
+	vfsSpillLock(s);
+	regions = sqlite3_realloc64(s->free[shift],
+				    sizeof *regions * (s->n_free[shift] + 1));
+	if (regions != NULL) {
+		regions[s->n_free[shift]] = offset;
+		s->free[shift] = regions;
+		s->n_free[shift]++;
+	}
+	/* Otherwise the region is simply never reused. */
+	vfsSpillUnlock(s);
+}
+
+/* Write @len bytes of @buf to the spill file at the given offset. */
+static int vfsSpillWrite(struct vfsSpill *s,
+			 off_t offset,
+			 const uint8_t *buf,
+			 size_t len)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(s->fd, buf, len, offset);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return SQLITE_IOERR_WRITE;
+		}
+		buf += n;
+		len -= (size_t)n;
+		offset += n;
+	}
+	return SQLITE_OK;
 }
 
 /* Initialize the shared memory mapping of a database file. */
@@ -126,10 +716,10 @@ static void vfsShmInit(struct vfsShm *s)
 
 	s->regions = NULL;
 	s->n_regions = 0;
+	s->size = 0;
 
 	for (i = 0; i < SQLITE_SHM_NLOCK; i++) {
-		s->shared[i] = 0;
-		s->exclusive[i] = 0;
+		s->locks[i] = 0;
 	}
 }
 
@@ -161,26 +751,74 @@ static void vfsShmReset(struct vfsShm *s)
 	vfsShmInit(s);
 }
 
+/* Return true if an exclusive lock is held on the given slot. */
+static bool vfsShmIsExclusive(struct vfsShm *s, int i)
+{
+	return __atomic_load_n(&s->locks[i], __ATOMIC_ACQUIRE) ==
+	       VFS__SHM_EXCLUSIVE;
+}
+
 /* Initialize a new database object. */
 static void vfsDatabaseInit(struct vfsDatabase *d, int version)
 {
+	int rv;
+	d->pool = NULL;
 	d->page_size = 0;
-	d->pages = NULL;
+	d->leaves = NULL;
+	d->n_leaves = 0;
+	d->slabs = NULL;
+	d->n_slabs = 0;
 	d->n_pages = 0;
+	d->spill = NULL;
+	d->hand = 0;
+	d->checkpoints = 0;
+	d->compress_age = 0;
+	d->huge = false;
+	d->compression = NULL;
+	d->image = NULL;
 	vfsShmInit(&d->shm);
 	d->version = version;
 	d->wal = NULL;
+	d->usage.pages = 0;
+	d->usage.frames = 0;
+	d->usage.overhead = 0;
+	d->usage.spilled = 0;
+	d->usage.mapped = 0;
+	d->usage.compressed = 0;
+	d->usage.uncompressed = 0;
+	d->quota = 0;
+	rv = pthread_mutex_init(&d->mutex, NULL);
+	assert(rv == 0); /* Docs say that pthread_mutex_init can't fail */
+	(void)rv;
+}
+
+/* Return the memory used by a database, including its WAL. */
+static size_t vfsDatabaseUsage(const struct vfsDatabase *d)
+{
+	return d->usage.pages + d->usage.frames + d->usage.overhead +
+	       d->shm.size;
+}
+
+/* Return true if using @size more bytes would exceed the quota of the given
+ * database. */
+static bool vfsDatabaseOverQuota(const struct vfsDatabase *d, size_t size)
+{
+	return d->quota != 0 && vfsDatabaseUsage(d) + size > d->quota;
 }
 
 /* Initialize a new WAL object. */
 static void vfsWalInit(struct vfsWal *w, int version)
 {
+	w->pool = NULL;
 	w->database = NULL;
 	memset(w->hdr, 0, FORMAT__WAL_HDR_SIZE);
 	w->frames = NULL;
 	w->n_frames = 0;
+	w->n_checksummed = 0;
 	w->tx = NULL;
 	w->n_tx = 0;
+	w->read_buf = NULL;
+	w->read_index = 0;
 	w->version = version;
 }
 
@@ -207,6 +845,7 @@ static struct vfsContent *vfsContentCreate(const char *name,
 	}
 	strcpy(c->filename, name);
 
+	c->hash = vfsHash(name, strlen(name));
 	c->refcount = 0;
 	c->type = type;
 
@@ -229,2127 +868,5932 @@ oom:
 	return NULL;
 }
 
-/* Release all memory used by a database object. */
-static void vfsDatabaseClose(struct vfsDatabase *d)
+/* Map an anonymous region of @size bytes aligned to VFS__HUGE_PAGE_SIZE, and
+ * ask the kernel to back it with transparent huge pages. If that's not
+ * supported the region just uses regular pages. */
+static void *vfsHugeAlloc(size_t size)
 {
-	unsigned i;
-	for (i = 0; i < d->n_pages; i++) {
-		sqlite3_free(d->pages[i]);
+	size_t len = size + VFS__HUGE_PAGE_SIZE;
+	uint8_t *map;
+	uint8_t *region;
+	size_t head;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
 	}
-	if (d->pages != NULL) {
-		sqlite3_free(d->pages);
+
+	/* Trim the mapping to an aligned region. */
+	head = (VFS__HUGE_PAGE_SIZE -
+		(uintptr_t)map % VFS__HUGE_PAGE_SIZE) % VFS__HUGE_PAGE_SIZE;
+	region = map + head;
+	if (head > 0) {
+		munmap(map, head);
 	}
-	vfsShmClose(&d->shm);
+	munmap(region + size, len - head - size);
+
+#ifdef MADV_HUGEPAGE
+	madvise(region, size, MADV_HUGEPAGE);
+#endif
+
+	return region;
 }
 
-/* Release all memory used by a WAL object. */
-static void vfsWalClose(struct vfsWal *w)
+/* Create a slab for @n_pages pages, starting from page number @first, with
+ * @size bytes of data. The data of a resident slab holds the content of all its
+ * pages, while spilled slabs have none.
+ *
+ * If @huge is set, the data is allocated in a region of huge pages, falling
+ * back to the heap if the region can't be mapped. */
+static struct vfsSlab *vfsSlabCreate(unsigned first,
+				     unsigned n_pages,
+				     size_t size,
+				     bool huge)
 {
-	unsigned i;
-	for (i = 0; i < w->n_frames; i++) {
-		vfsFrameDestroy(w->frames[i]);
+	struct vfsSlab *slab;
+	uint8_t *region = NULL;
+
+	if (huge) {
+		region = vfsHugeAlloc(size);
 	}
-	if (w->frames != NULL) {
-		sqlite3_free(w->frames);
+
+	slab = sqlite3_malloc64(sizeof *slab + (region != NULL ? 0 : size));
+	if (slab == NULL) {
+		if (region != NULL) {
+			munmap(region, size);
+		}
+		return NULL;
 	}
-	for (i = 0; i < w->n_tx; i++) {
-		vfsFrameDestroy(w->tx[i]);
+	slab->first = first;
+	slab->n_pages = n_pages;
+	slab->refcount = 1;
+	slab->hot = true;
+	slab->atime = vfsSpillNow();
+	slab->epoch = 0;
+	slab->n_compressed = 0;
+	slab->spill = NULL;
+	slab->image = NULL;
+	slab->map = NULL;
+	slab->offset = 0;
+	slab->size = 0;
+	slab->huge = region != NULL ? size : 0;
+	slab->data = region != NULL ? region : (uint8_t *)(slab + 1);
+
+	return slab;
+}
+
+/* Map a whole database image file of @size bytes. */
+static struct vfsImage *vfsImageMap(int fd, size_t size)
+{
+	struct vfsImage *image;
+
+	image = sqlite3_malloc(sizeof *image);
+	if (image == NULL) {
+		return NULL;
 	}
-	if (w->tx != NULL) {
-		sqlite3_free(w->tx);
+	image->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image->map == MAP_FAILED) {
+		sqlite3_free(image);
+		return NULL;
 	}
+	image->refcount = 1;
+	image->size = size;
+
+	return image;
 }
 
-/* Destroy the content of a volatile file. */
-static void vfsContentDestroy(struct vfsContent *c)
+/* Drop a reference to an image, unmapping it if it was the last. */
+static void vfsImageUnref(struct vfsImage *image)
 {
-	assert(c != NULL);
-	assert(c->filename != NULL);
-
-	/* Free the filename. */
-	sqlite3_free(c->filename);
+	if (vfsUnref(&image->refcount) == 0) {
+		munmap(image->map, image->size);
+		sqlite3_free(image);
+	}
+}
 
-	switch (c->type) {
-		case VFS__DATABASE:
-			vfsDatabaseClose(&c->database);
-			break;
-		case VFS__JOURNAL:
-			break;
-		case VFS__WAL:
-			vfsWalClose(&c->wal);
-			break;
+/* Drop a reference to a slab, releasing it if it was the last. */
+static void vfsSlabUnref(struct vfsSlab *slab)
+{
+	if (vfsUnref(&slab->refcount) == 0) {
+		if (slab->image != NULL) {
+			vfsImageUnref(slab->image);
+		} else if (slab->map != NULL) {
+			munmap(slab->map, slab->size);
+			vfsSpillRelease(slab->spill, slab->offset, slab->size);
+		}
+		if (slab->huge > 0) {
+			munmap(slab->data, slab->huge);
+		}
+		sqlite3_free(slab);
 	}
+}
 
-	sqlite3_free(c);
+/* Return the memory used by a slab, including its huge page region. */
+static size_t vfsSlabSize(const struct vfsSlab *slab)
+{
+	return (size_t)sqlite3_msize((void *)slab) + slab->huge;
 }
 
-/* Get a page from the given database, possibly creating a new one. */
-static int vfsDatabasePageGet(struct vfsDatabase *d, unsigned pgno, void **page)
+/* Return true if the content of the pages of a slab is in its data, as opposed
+ * to spilled, compressed or loaded from an image. */
+static bool vfsSlabIsResident(const struct vfsSlab *slab)
 {
-	int rc;
+	return slab->map == NULL && slab->n_compressed == 0;
+}
 
-	assert(d != NULL);
-	assert(pgno > 0);
+#ifdef DQLITE_ZLIB
+/* Allocation functions of compression streams, which count the memory they use
+ * in the counter passed as opaque pointer, if any. */
+static voidpf vfsZalloc(voidpf opaque, uInt items, uInt size)
+{
+	size_t *counter = opaque;
+	void *p = sqlite3_malloc64((sqlite3_uint64)items * size);
+	if (p != NULL && counter != NULL) {
+		*counter += (size_t)sqlite3_msize(p);
+	}
+	return p;
+}
 
-	/* SQLite should access pages progressively, without jumping more than
-	 * one page after the end. */
-	if (pgno > d->n_pages + 1) {
-		rc = SQLITE_IOERR_WRITE;
-		goto err;
+static void vfsZfree(voidpf opaque, voidpf p)
+{
+	size_t *counter = opaque;
+	if (counter != NULL) {
+		*counter -= (size_t)sqlite3_msize(p);
 	}
+	sqlite3_free(p);
+}
+#endif
 
-	if (pgno == d->n_pages + 1) {
-		/* Create a new page, grow the page array, and append the
-		 * new page to it. */
-		void **pages; /* New page array. */
-
-		/* We assume that the page size has been set, either by
-		 * intercepting the first main database file write, or by
-		 * handling a 'PRAGMA page_size=N' command in
-		 * vfs__file_control(). This assumption is enforced in
-		 * vfsFileWrite(). */
-		assert(d->page_size > 0);
-
-		*page = sqlite3_malloc((int)d->page_size);
-		if (*page == NULL) {
-			rc = SQLITE_NOMEM;
-			goto err;
-		}
-
-		pages =
-		    sqlite3_realloc(d->pages, (int)((sizeof *pages) * pgno));
-		if (pages == NULL) {
-			rc = SQLITE_NOMEM;
-			goto err_after_vfs_page_create;
-		}
-
-		/* Append the new page to the new page array. */
-		*(pages + pgno - 1) = *page;
-
-		/* Update the page array. */
-		d->pages = pages;
-		d->n_pages = pgno;
-	} else {
-		/* Return the existing page. */
-		assert(d->pages != NULL);
-		*page = d->pages[pgno - 1];
-	}
-
-	return SQLITE_OK;
-
-err_after_vfs_page_create:
-	sqlite3_free(*page);
-err:
-	*page = NULL;
-	return rc;
-}
-
-/* Get a frame from the WAL, possibly creating a new one. */
-static int vfsWalFrameGetV1(struct vfsWal *w, int pgno, struct vfsFrame **page)
+/* Compress the first @n pages of a resident slab into a new compressed slab.
+ *
+ * Pages are compressed one by one with raw deflate at its fastest level, so
+ * they can be decompressed on their own. Fails with SQLITE_FULL if the pages
+ * don't shrink to at most 3/4 of their size, since that's not worth the cost
+ * of decompressing them. */
+static int vfsSlabDeflate(const struct vfsSlab *slab,
+			  unsigned n,
+			  unsigned page_size,
+			  struct vfsSlab **compressed)
 {
-	int rc;
+#ifdef DQLITE_ZLIB
+	size_t header = sizeof(uint32_t) * (n + 1);
+	size_t cap = (size_t)n * page_size / 4 * 3;
+	uint8_t *buf;
+	uint32_t offset = 0;
+	z_stream stream;
+	int bits = 9;
+	unsigned k;
+	int rv;
 
-	assert(w != NULL);
-	assert(pgno > 0);
+	assert(vfsSlabIsResident(slab));
+	assert(n > 0);
 
-	/* SQLite should access pages progressively, without jumping more than
-	 * one page after the end. */
-	if (pgno > (int)(w->n_frames + 1)) {
-		rc = SQLITE_IOERR_WRITE;
-		goto err;
+	/* A window as big as a page is all we need. */
+	while (bits < 15 && (1U << bits) < page_size) {
+		bits++;
 	}
 
-	if (pgno == (int)(w->n_frames + 1)) {
-		/* Create a new page, grow the page array, and append the
-		 * new page to it. */
-		struct vfsFrame **frames; /* New frames array. */
-
-		/* We assume that the page size has been set, either by
-		 * intercepting the first main database file write, or by
-		 * handling a 'PRAGMA page_size=N' command in
-		 * vfs__file_control(). This assumption is enforced in
-		 * vfsFileWrite(). */
-		assert(w->database->page_size > 0);
+	buf = sqlite3_malloc64(header + cap);
+	if (buf == NULL) {
+		return SQLITE_NOMEM;
+	}
 
-		*page = vfsFrameCreate(w->database->page_size);
-		if (*page == NULL) {
-			rc = SQLITE_NOMEM;
-			goto err;
-		}
+	memset(&stream, 0, sizeof stream);
+	stream.zalloc = vfsZalloc;
+	stream.zfree = vfsZfree;
+	rv = deflateInit2(&stream, 1, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY);
+	if (rv != Z_OK) {
+		sqlite3_free(buf);
+		return SQLITE_NOMEM;
+	}
 
-		frames =
-		    sqlite3_realloc(w->frames, (int)(sizeof *frames) * pgno);
-		if (frames == NULL) {
-			rc = SQLITE_NOMEM;
-			goto err_after_vfs_page_create;
+	for (k = 0; k < n; k++) {
+		memcpy(buf + sizeof offset * k, &offset, sizeof offset);
+		deflateReset(&stream);
+		stream.next_in = slab->data + (size_t)k * page_size;
+		stream.avail_in = page_size;
+		stream.next_out = buf + header + offset;
+		stream.avail_out = (uInt)(cap - offset);
+		rv = deflate(&stream, Z_FINISH);
+		if (rv != Z_STREAM_END) {
+			break;
 		}
+		offset = (uint32_t)(cap - stream.avail_out);
+	}
+	deflateEnd(&stream);
 
-		/* Append the new page to the new page array. */
-		*(frames + pgno - 1) = *page;
+	if (k < n) {
+		sqlite3_free(buf);
+		return rv == Z_OK || rv == Z_BUF_ERROR ? SQLITE_FULL
+						       : SQLITE_NOMEM;
+	}
+	memcpy(buf + sizeof offset * n, &offset, sizeof offset);
 
-		/* Update the page array. */
-		w->frames = frames;
-		w->n_frames = (unsigned)pgno;
-	} else {
-		/* Return the existing page. */
-		assert(w->frames != NULL);
-		*page = w->frames[pgno - 1];
+	*compressed = vfsSlabCreate(slab->first, slab->n_pages, header + offset,
+				    false);
+	if (*compressed == NULL) {
+		sqlite3_free(buf);
+		return SQLITE_NOMEM;
 	}
+	memcpy((*compressed)->data, buf, header + offset);
+	(*compressed)->n_compressed = n;
+	sqlite3_free(buf);
 
 	return SQLITE_OK;
-
-err_after_vfs_page_create:
-	vfsFrameDestroy(*page);
-
-err:
-	*page = NULL;
-
-	return rc;
+#else
+	(void)slab;
+	(void)n;
+	(void)page_size;
+	(void)compressed;
+	return SQLITE_ERROR;
+#endif
 }
 
-/* Get a frame from the current transaction, possibly creating a new one. */
-static int vfsWalFrameGetV2(struct vfsWal *w,
-			    unsigned index,
-			    struct vfsFrame **frame)
+/* Decompress the page with index @k of a compressed slab into @buf.
+ *
+ * The decompression @stream is created if it's NULL, counting its memory in
+ * @counter, and can be reused by later calls. */
+static int vfsSlabInflate(const struct vfsSlab *slab,
+			  unsigned k,
+			  unsigned page_size,
+			  void **stream,
+			  size_t *counter,
+			  uint8_t *buf)
 {
+#ifdef DQLITE_ZLIB
+	z_stream *z = *stream;
+	uint32_t offsets[2];
 	int rv;
 
-	assert(w != NULL);
-	assert(index > 0);
-
-	/* SQLite should access pages progressively, without jumping more than
-	 * one page after the end. */
-	if (index > w->n_frames + w->n_tx + 1) {
-		rv = SQLITE_IOERR_WRITE;
-		goto err;
-	}
-
-	if (index == w->n_frames + w->n_tx + 1) {
-		/* Create a new frame, grow the transaction array, and append
-		 * the new frame to it. */
-		struct vfsFrame **tx;
-
-		/* We assume that the page size has been set, either by
-		 * intervepting the first main database file write, or by
-		 * handling a 'PRAGMA page_size=N' command in
-		 * vfs__file_control(). This assumption is enforved in
-		 * vfsFileWrite(). */
-		assert(w->database->page_size > 0);
+	assert(k < slab->n_compressed);
 
-		*frame = vfsFrameCreate(w->database->page_size);
-		if (*frame == NULL) {
-			rv = SQLITE_NOMEM;
-			goto err;
+	if (z == NULL) {
+		z = vfsZalloc(counter, 1, sizeof *z);
+		if (z == NULL) {
+			return SQLITE_NOMEM;
 		}
-
-		tx = sqlite3_realloc64(w->tx, sizeof *tx * w->n_tx + 1);
-		if (tx == NULL) {
-			rv = SQLITE_NOMEM;
-			goto err_after_vfs_frame_create;
+		memset(z, 0, sizeof *z);
+		z->zalloc = vfsZalloc;
+		z->zfree = vfsZfree;
+		z->opaque = counter;
+		if (inflateInit2(z, -15) != Z_OK) {
+			vfsZfree(counter, z);
+			return SQLITE_NOMEM;
 		}
-
-		/* Append the new page to the new page array. */
-		tx[index - w->n_frames - 1] = *frame;
-
-		/* Update the page array. */
-		w->tx = tx;
-		w->n_tx++;
+		*stream = z;
 	} else {
-		/* Return the existing page. */
-		assert(w->tx != NULL);
-		*frame = w->tx[index - w->n_frames - 1];
+		inflateReset(z);
 	}
 
-	return SQLITE_OK;
+	memcpy(offsets, slab->data + sizeof *offsets * k, sizeof offsets);
+	z->next_in = slab->data + sizeof *offsets * (slab->n_compressed + 1) +
+		     offsets[0];
+	z->avail_in = offsets[1] - offsets[0];
+	z->next_out = buf;
+	z->avail_out = page_size;
+	rv = inflate(z, Z_FINISH);
+	if (rv != Z_STREAM_END || z->avail_out != 0) {
+		return rv == Z_MEM_ERROR ? SQLITE_NOMEM : SQLITE_CORRUPT;
+	}
 
-err_after_vfs_frame_create:
-	vfsFrameDestroy(*frame);
-err:
-	*frame = NULL;
-	return rv;
+	return SQLITE_OK;
+#else
+	(void)slab;
+	(void)k;
+	(void)page_size;
+	(void)stream;
+	(void)counter;
+	(void)buf;
+	return SQLITE_ERROR;
+#endif
 }
 
-/* Lookup a page from the given database, returning NULL if it doesn't exist. */
-static void *vfsDatabasePageLookup(struct vfsDatabase *d, unsigned pgno)
+/* Release a decompression stream created by vfsSlabInflate(), if any. */
+static void vfsInflateEnd(void **stream, size_t *counter)
 {
-	void *page;
+#ifdef DQLITE_ZLIB
+	z_stream *z = *stream;
+	if (z != NULL) {
+		inflateEnd(z);
+		vfsZfree(counter, z);
+		*stream = NULL;
+	}
+#else
+	(void)counter;
+	assert(*stream == NULL);
+#endif
+}
 
-	assert(d != NULL);
-	assert(pgno > 0);
+/* Count the memory used by a slab of the given database, or the spill file
+ * space or image space used by its pages if it was spilled or loaded. */
+static void vfsDatabaseSlabCharge(struct vfsDatabase *d, struct vfsSlab *slab)
+{
+	if (slab->image != NULL) {
+		d->usage.overhead += vfsSlabSize(slab);
+		d->usage.mapped += slab->size;
+	} else if (slab->map != NULL) {
+		d->usage.overhead += vfsSlabSize(slab);
+		d->usage.spilled += slab->size;
+	} else {
+		d->usage.pages += vfsSlabSize(slab);
+	}
+	if (slab->n_compressed > 0) {
+		d->usage.compressed += vfsSlabSize(slab);
+		d->usage.uncompressed += (size_t)slab->n_compressed * d->page_size;
+	}
+}
 
-	if (pgno > d->n_pages) {
-		/* This page hasn't been written yet. */
-		return NULL;
+static void vfsDatabaseSlabDischarge(struct vfsDatabase *d,
+				     struct vfsSlab *slab)
+{
+	if (slab->image != NULL) {
+		d->usage.overhead -= vfsSlabSize(slab);
+		d->usage.mapped -= slab->size;
+	} else if (slab->map != NULL) {
+		d->usage.overhead -= vfsSlabSize(slab);
+		d->usage.spilled -= slab->size;
+	} else {
+		d->usage.pages -= vfsSlabSize(slab);
+	}
+	if (slab->n_compressed > 0) {
+		d->usage.compressed -= vfsSlabSize(slab);
+		d->usage.uncompressed -= (size_t)slab->n_compressed * d->page_size;
 	}
+}
 
-	page = d->pages[pgno - 1];
+/* Release the frame lent to the page with the given position in a leaf. */
+static void vfsDatabaseFrameDrop(struct vfsDatabase *d,
+				 struct vfsLeaf *leaf,
+				 unsigned j)
+{
+	struct vfsFrame *frame = leaf->frames[j];
 
-	assert(page != NULL);
+	assert(frame != NULL);
+	assert(leaf->n_frames > 0);
 
-	return page;
+	vfsFrameUnhold(d, frame, VFS__FRAME_DATABASE);
+	vfsFrameDestroy(d->pool, frame);
+	leaf->frames[j] = NULL;
+	leaf->n_frames--;
 }
 
-/* Lookup a frame from the WAL, returning NULL if it doesn't exist. */
-static struct vfsFrame *vfsWalFrameLookup(struct vfsWal *w, unsigned n)
+/* Release the slabs and index leaves that are not needed to hold the given
+ * number of pages, along with the frames lent to pages beyond that number.
+ *
+ * Whole leaves and slabs are dropped at once: only the leaves that have lent
+ * frames are looked into, so the cost doesn't depend on the number of pages
+ * released. */
+static void vfsDatabaseShrink(struct vfsDatabase *d, unsigned n_pages)
 {
-	struct vfsFrame *frame;
-
-	assert(w != NULL);
-	assert(n > 0);
+	unsigned n_leaves =
+	    (n_pages + VFS__PAGE_LEAF_SIZE - 1) / VFS__PAGE_LEAF_SIZE;
+	unsigned i;
 
-	if (w->version == VFS__V1) {
-		if (n > w->n_frames) {
-			/* This page hasn't been written yet. */
-			return NULL;
+	for (i = n_pages / VFS__PAGE_LEAF_SIZE; i < d->n_leaves; i++) {
+		struct vfsLeaf *leaf = d->leaves[i];
+		unsigned j = 0;
+		if (leaf == NULL) {
+			continue;
 		}
-		frame = w->frames[n - 1];
-	} else {
-		if (n > w->n_frames + w->n_tx) {
-			/* This page hasn't been written yet. */
-			return NULL;
+		if (i == n_pages / VFS__PAGE_LEAF_SIZE) {
+			/* Turn the slots past the end of a partially truncated
+			 * leaf into holes, since their slabs might go away. */
+			j = n_pages % VFS__PAGE_LEAF_SIZE;
+			memset(&leaf->pages[j], 0,
+			       sizeof *leaf->pages * (VFS__PAGE_LEAF_SIZE - j));
 		}
-		if (n <= w->n_frames) {
-			frame = w->frames[n - 1];
-		} else {
-			frame = w->tx[n - w->n_frames - 1];
+		for (; j < VFS__PAGE_LEAF_SIZE && leaf->n_frames > 0; j++) {
+			if (leaf->frames[j] != NULL) {
+				vfsDatabaseFrameDrop(d, leaf, j);
+			}
 		}
 	}
 
-	assert(frame != NULL);
+	/* Slabs hold consecutive pages, so all the slabs that start after the
+	 * last page can be released as a whole. */
+	while (d->n_slabs > 0 && d->slabs[d->n_slabs - 1]->first > n_pages) {
+		struct vfsSlab *slab = d->slabs[d->n_slabs - 1];
+		vfsDatabaseSlabDischarge(d, slab);
+		vfsSlabUnref(slab);
+		d->n_slabs--;
+	}
+	if (d->n_slabs == 0) {
+		d->usage.overhead -= (size_t)sqlite3_msize(d->slabs);
+		sqlite3_free(d->slabs);
+		d->slabs = NULL;
+		/* Pages fetched by SQLite might point into the image even
+		 * after their slab was faulted, so it's kept around until no
+		 * page is left. */
+		if (d->image != NULL) {
+			vfsImageUnref(d->image);
+			d->image = NULL;
+		}
+	}
 
-	return frame;
+	while (d->n_leaves > n_leaves) {
+		struct vfsLeaf *leaf = d->leaves[d->n_leaves - 1];
+		d->usage.overhead -= (size_t)sqlite3_msize(leaf);
+		sqlite3_free(leaf);
+		d->n_leaves--;
+	}
+	if (d->n_leaves == 0) {
+		d->usage.overhead -= (size_t)sqlite3_msize(d->leaves);
+		sqlite3_free(d->leaves);
+		d->leaves = NULL;
+	}
 }
 
-/* Truncate a database file to be exactly the given number of pages. */
-static int vfsDatabaseTruncate(struct vfsDatabase *d, sqlite_int64 size)
+/* Release all memory used by a database object. */
+static void vfsDatabaseClose(struct vfsDatabase *d)
 {
-	void **cursor;
-	unsigned n_pages;
+	struct vfsCompression *c = d->compression;
 	unsigned i;
 
-	if (d->n_pages == 0) {
-		if (size > 0) {
-			return SQLITE_IOERR_TRUNCATE;
+	vfsDatabaseShrink(d, 0);
+	if (c != NULL) {
+		vfsInflateEnd(&c->inflater, &d->usage.overhead);
+		for (i = 0; i < VFS__PAGE_CACHE_SIZE; i++) {
+			sqlite3_free(c->cache[i].buf);
 		}
-		return SQLITE_OK;
+		sqlite3_free(c);
 	}
+	vfsShmClose(&d->shm);
+	pthread_mutex_destroy(&d->mutex);
+}
 
-	/* Since the file size is not zero, some content must
-	 * have been written and the page size must be known. */
-	assert(d->page_size > 0);
-
-	if ((size % d->page_size) != 0) {
-		return SQLITE_IOERR_TRUNCATE;
+/* Release all memory used by a WAL object. */
+static void vfsWalClose(struct vfsWal *w)
+{
+	unsigned i;
+	for (i = 0; i < w->n_frames; i++) {
+		vfsFrameDestroy(w->pool, w->frames[i]);
 	}
+	if (w->frames != NULL) {
+		sqlite3_free(w->frames);
+	}
+	for (i = 0; i < w->n_tx; i++) {
+		vfsFrameDestroy(w->pool, w->tx[i]);
+	}
+	if (w->tx != NULL) {
+		sqlite3_free(w->tx);
+	}
+}
 
-	n_pages = (unsigned)(size / d->page_size);
-
-	/* We expect callers to only invoke us if some actual content has been
-	 * written already. */
-	assert(d->n_pages > 0);
+/* Destroy the content of a volatile file. */
+static void vfsContentDestroy(struct vfsContent *c)
+{
+	assert(c != NULL);
+	assert(c->filename != NULL);
 
-	/* Truncate should always shrink a file. */
-	assert(n_pages <= d->n_pages);
-	assert(d->pages != NULL);
+	/* Free the filename. */
+	sqlite3_free(c->filename);
 
-	/* Destroy pages beyond pages_len. */
-	cursor = d->pages + n_pages;
-	for (i = 0; i < (d->n_pages - n_pages); i++) {
-		sqlite3_free(*cursor);
-		cursor++;
+	switch (c->type) {
+		case VFS__DATABASE:
+			vfsDatabaseClose(&c->database);
+			break;
+		case VFS__JOURNAL:
+			break;
+		case VFS__WAL:
+			vfsWalClose(&c->wal);
+			break;
 	}
 
-	/* Shrink the page array, possibly to 0.
-	 *
-	 * TODO: in principle realloc could fail also when shrinking. */
-	d->pages = sqlite3_realloc64(d->pages, sizeof *d->pages * n_pages);
-
-	/* Update the page count. */
-	d->n_pages = n_pages;
+	sqlite3_free(c);
+}
 
-	return SQLITE_OK;
+/* Return the memory used by the object and the filename of a file content. */
+static size_t vfsContentSize(struct vfsContent *c)
+{
+	return (size_t)sqlite3_msize(c) + (size_t)sqlite3_msize(c->filename);
 }
 
-/* Truncate a WAL file to zero. */
-static int vfsWalTruncate(struct vfsWal *w, sqlite3_int64 size)
+/* Stop counting the memory used by a WAL towards its database, which is about
+ * to be unlinked from it. */
+static void vfsWalUnaccount(struct vfsWal *w)
 {
+	struct vfsDatabase *d = w->database;
 	unsigned i;
 
-	/* We expect SQLite to only truncate to zero, after a
-	 * full checkpoint.
-	 *
-	 * TODO: figure out other case where SQLite might
-	 * truncate to a different size.
-	 */
-	if (size != 0) {
-		return SQLITE_PROTOCOL;
+	for (i = 0; i < w->n_frames; i++) {
+		vfsFrameUnhold(d, w->frames[i], VFS__FRAME_WAL);
 	}
-
-	if (w->n_frames == 0) {
-		return SQLITE_OK;
+	for (i = 0; i < w->n_tx; i++) {
+		vfsFrameUnhold(d, w->tx[i], VFS__FRAME_WAL);
 	}
+	d->usage.overhead -= (size_t)sqlite3_msize(w->frames);
+	d->usage.overhead -= (size_t)sqlite3_msize(w->tx);
+}
 
-	assert(w->frames != NULL);
-
-	/* Reset the file header (for WAL files). */
-	memset(w->hdr, 0, FORMAT__WAL_HDR_SIZE);
+/* Return the leaf of the page index holding the given page, and the position
+ * of the page within the leaf. Return NULL if the leaf only has holes. */
+static struct vfsLeaf *vfsDatabaseLeaf(struct vfsDatabase *d,
+				       unsigned pgno,
+				       unsigned *j)
+{
+	unsigned i = (pgno - 1) / VFS__PAGE_LEAF_SIZE;
+	*j = (pgno - 1) % VFS__PAGE_LEAF_SIZE;
+	if (i >= d->n_leaves) {
+		return NULL;
+	}
+	return d->leaves[i];
+}
 
-	/* Destroy all frames. */
-	for (i = 0; i < w->n_frames; i++) {
-		vfsFrameDestroy(w->frames[i]);
+/* Look for the slab holding the slot of the given page, in an array of @n
+ * slabs sorted by page number. If there's one, return true and set @i to its
+ * index. Otherwise the page is a hole, and @i is set to the index where a slab
+ * for it should be inserted. */
+static bool vfsSlabFind(struct vfsSlab *const *slabs,
+			unsigned n,
+			unsigned pgno,
+			unsigned *i)
+{
+	unsigned lo = 0;
+	unsigned hi = n;
+
+	/* Find the first slab starting after the page. */
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (slabs[mid]->first <= pgno) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	sqlite3_free(w->frames);
 
-	w->frames = NULL;
-	w->n_frames = 0;
+	if (lo > 0 && pgno < slabs[lo - 1]->first + slabs[lo - 1]->n_pages) {
+		*i = lo - 1;
+		return true;
+	}
 
-	return SQLITE_OK;
+	*i = lo;
+	return false;
 }
 
-/* Implementation of the abstract sqlite3_file base class. */
-struct vfsFile
+/* Return the index of the database slab holding the slot of the given page,
+ * which must not be a hole. */
+static unsigned vfsDatabaseSlabIndex(struct vfsDatabase *d, unsigned pgno)
 {
-	sqlite3_file base;          /* Base class. Must be first. */
-	struct vfs *vfs;            /* Pointer to volatile VFS data. */
-	struct vfsContent *content; /* Handle to the file content. */
-	int flags;                  /* Flags passed to xOpen */
-	sqlite3_file *temp;         /* For temp-files, actual VFS. */
-};
+	unsigned i;
+	bool found;
 
-/* Custom dqlite VFS. Contains pointers to the content of all files that were
- * created. */
-struct vfs
-{
-	struct vfsContent **contents; /* Files content */
-	unsigned n_contents;          /* Number of files */
-	int error;                    /* Last error occurred. */
-	int version;
-};
+	found = vfsSlabFind(d->slabs, d->n_slabs, pgno, &i);
+	assert(found);
+	(void)found;
 
-/* Create a new vfs object. */
-static struct vfs *vfsCreate(int version)
+	return i;
+}
+
+/* Return the maximum number of pages of a slab of the given database. */
+static unsigned vfsDatabaseSlabMaxPages(const struct vfsDatabase *d)
 {
-	struct vfs *v;
+	unsigned n = VFS__SLAB_MAX_PAGES;
 
-	v = sqlite3_malloc(sizeof *v);
-	if (v == NULL) {
-		return NULL;
+	if (d->huge && (size_t)n * d->page_size < VFS__HUGE_PAGE_SIZE) {
+		n = VFS__HUGE_PAGE_SIZE / d->page_size;
 	}
 
-	v->contents = NULL;
-	v->n_contents = 0;
-	v->version = version;
-
-	return v;
+	return n;
 }
 
-/* Release the memory used internally by the VFS object.
- *
- * All file content will be de-allocated, so dangling open FDs against
- * those files will be broken.
- */
-static void vfsDestroy(struct vfs *r)
+/* Return true if a slab of the given database holding @n_pages pages should be
+ * backed by huge pages. */
+static bool vfsDatabaseSlabHuge(const struct vfsDatabase *d, unsigned n_pages)
 {
-	unsigned i;
+	return d->huge &&
+	       ((size_t)n_pages * d->page_size) % VFS__HUGE_PAGE_SIZE == 0;
+}
 
-	assert(r != NULL);
+/* Return the number of pages of the given slab that are in use. */
+static unsigned vfsDatabaseSlabUsed(const struct vfsDatabase *d,
+				    const struct vfsSlab *slab)
+{
+	unsigned n;
 
-	for (i = 0; i < r->n_contents; i++) {
-		struct vfsContent *content = r->contents[i];
-		vfsContentDestroy(content);
+	if (d->n_pages < slab->first) {
+		return 0;
 	}
+	n = d->n_pages - slab->first + 1;
 
-	if (r->contents != NULL) {
-		sqlite3_free(r->contents);
-	}
+	return n < slab->n_pages ? n : slab->n_pages;
 }
 
-/* Find a content object by filename. */
-static struct vfsContent *vfsContentLookup(struct vfs *r, const char *filename)
+/* Drop the decompressed pages of the given range from the page cache. */
+static void vfsDatabaseCacheDrop(struct vfsDatabase *d,
+				 unsigned first,
+				 unsigned n_pages)
 {
 	unsigned i;
 
-	assert(r != NULL);
-	assert(filename != NULL);
+	if (d->compression == NULL) {
+		return;
+	}
 
-	for (i = 0; i < r->n_contents; i++) {
-		struct vfsContent *content = r->contents[i];
-		if (strcmp(content->filename, filename) == 0) {
-			// Found matching file.
-			return content;
+	for (i = 0; i < VFS__PAGE_CACHE_SIZE; i++) {
+		struct vfsCachedPage *page = &d->compression->cache[i];
+		if (page->pgno >= first && page->pgno < first + n_pages) {
+			page->pgno = 0;
+			page->tick = 0;
 		}
 	}
-
-	return NULL;
 }
 
-/* Find the database object associated with the given WAL file name. */
-static struct vfsDatabase *vfsDatabaseLookup(struct vfs *v,
-					     const char *wal_filename)
+/* Replace the slab with the given index with one holding the same pages,
+ * pointing the index slots of the pages to the content of the new slab. The
+ * slots of compressed pages are set to NULL. */
+static void vfsDatabaseSlabReplace(struct vfsDatabase *d,
+				   unsigned i,
+				   struct vfsSlab *slab)
 {
-	size_t database_filename_len;
-	unsigned i;
+	uint8_t *data = slab->map != NULL ? slab->map : slab->data;
+	unsigned n = vfsDatabaseSlabUsed(d, slab);
+	unsigned k;
 
-	assert(v != NULL);
-	assert(wal_filename != NULL);
+	assert(slab->first == d->slabs[i]->first);
+	assert(slab->n_pages == d->slabs[i]->n_pages);
 
-	database_filename_len = strlen(wal_filename) - strlen("-wal");
+	if (slab->n_compressed > 0) {
+		data = NULL;
+	}
 
-	for (i = 0; i < v->n_contents; i++) {
-		struct vfsContent *content = v->contents[i];
-		if (strncmp(content->filename, wal_filename,
-			    database_filename_len) == 0) {
-			// Found matching file.
-			return &content->database;
-		}
+	for (k = 0; k < n; k++) {
+		unsigned j;
+		struct vfsLeaf *leaf = vfsDatabaseLeaf(d, slab->first + k, &j);
+		leaf->pages[j] =
+		    data != NULL ? data + (size_t)k * d->page_size : NULL;
 	}
 
-	return NULL;
+	vfsDatabaseCacheDrop(d, slab->first, slab->n_pages);
+
+	vfsDatabaseSlabDischarge(d, d->slabs[i]);
+	vfsSlabUnref(d->slabs[i]);
+	d->slabs[i] = slab;
+	vfsDatabaseSlabCharge(d, slab);
 }
 
-static int vfsDeleteContent(struct vfs *r, const char *filename)
+/* Copy the content of the frames lent to the first @n pages of a resident slab
+ * back into the slab, and release them. */
+static void vfsDatabaseSlabTakeBack(struct vfsDatabase *d,
+				    struct vfsSlab *slab,
+				    unsigned n)
 {
-	unsigned i;
+	unsigned k;
 
-	for (i = 0; i < r->n_contents; i++) {
-		struct vfsContent *content = r->contents[i];
-		unsigned j;
+	assert(vfsSlabIsResident(slab));
+	assert(vfsRefcount(&slab->refcount) == 1);
 
-		if (strcmp(content->filename, filename) != 0) {
+	for (k = 0; k < n; k++) {
+		unsigned j;
+		struct vfsLeaf *leaf = vfsDatabaseLeaf(d, slab->first + k, &j);
+		struct vfsFrame *frame = leaf->frames[j];
+		if (frame == NULL) {
 			continue;
 		}
-
-		/* Check that there are no consumers of this file. */
-		if (content->refcount > 0) {
-			r->error = EBUSY;
-			return SQLITE_IOERR_DELETE;
-		}
-
-		/* Free all memory allocated for this file. */
-		vfsContentDestroy(content);
-
-		/* Shift all other contents objects. */
-		for (j = i + 1; j < r->n_contents; j++) {
-			r->contents[j - 1] = r->contents[j];
-		}
-		r->n_contents--;
-
-		return SQLITE_OK;
+		memcpy(slab->data + (size_t)k * d->page_size, frame->buf,
+		       d->page_size);
+		vfsDatabaseFrameDrop(d, leaf, j);
 	}
-
-	r->error = ENOENT;
-	return SQLITE_IOERR_DELETE_NOENT;
 }
 
-static int vfsFileClose(sqlite3_file *file)
+/* Move the pages of the slab with the given index to the spill file, and
+ * release its memory along with the frames lent to its pages. */
+static int vfsDatabaseSlabSpill(struct vfsDatabase *d, unsigned i)
 {
-	int rc = SQLITE_OK;
-	struct vfsFile *f = (struct vfsFile *)file;
-	struct vfs *v = (struct vfs *)(f->vfs);
+	struct vfsSlab *slab = d->slabs[i];
+	struct vfsSlab *spilled;
+	unsigned n = vfsDatabaseSlabUsed(d, slab);
+	size_t len = (size_t)n * d->page_size;
+	void *map;
+	int rv;
 
-	if (f->temp != NULL) {
-		/* Close the actual temporary file. */
-		rc = f->temp->pMethods->xClose(f->temp);
-		sqlite3_free(f->temp);
+	assert(vfsSlabIsResident(slab));
+	assert(vfsRefcount(&slab->refcount) == 1);
 
-		return rc;
+	if (n == 0) {
+		return SQLITE_OK;
 	}
 
-	assert(f->content->refcount);
-	f->content->refcount--;
+	/* Take back the content of lent frames, so it gets spilled too. */
+	vfsDatabaseSlabTakeBack(d, slab, n);
 
-	/* If we got zero references, reset the shared memory mapping. */
-	if (f->content->refcount == 0 && f->content->type == VFS__DATABASE) {
-		vfsShmReset(&f->content->database.shm);
+	spilled = vfsSlabCreate(slab->first, slab->n_pages, 0, false);
+	if (spilled == NULL) {
+		rv = SQLITE_NOMEM;
+		goto err;
 	}
 
-	if (f->flags & SQLITE_OPEN_DELETEONCLOSE) {
-		rc = vfsDeleteContent(v, f->content->filename);
+	vfsSpillAlloc(d->spill, len, &spilled->offset, &spilled->size);
+	rv = vfsSpillWrite(d->spill, spilled->offset, slab->data, len);
+	if (rv != SQLITE_OK) {
+		goto err_after_alloc;
 	}
 
-	return rc;
+	map = mmap(NULL, spilled->size, PROT_READ, MAP_SHARED, d->spill->fd,
+		   spilled->offset);
+	if (map == MAP_FAILED) {
+		rv = SQLITE_IOERR_MMAP;
+		goto err_after_alloc;
+	}
+
+	spilled->hot = false;
+	spilled->spill = d->spill;
+	spilled->map = map;
+	vfsDatabaseSlabReplace(d, i, spilled);
+
+	return SQLITE_OK;
+
+err_after_alloc:
+	vfsSpillRelease(d->spill, spilled->offset, spilled->size);
+	sqlite3_free(spilled);
+err:
+	return rv;
 }
 
-/* Read data from the main database. */
-static int vfsDatabaseRead(struct vfsDatabase *d,
-			   void *buf,
-			   int amount,
-			   sqlite_int64 offset)
+/* Copy the pages of the spilled or compressed slab with the given index back
+ * into a resident slab. A resident slab pinned by a snapshot can be copied as
+ * well, to get free slots that can be modified.
+ *
+ * The old slab is left alone if a snapshot pinned it, since its pages are
+ * never modified. */
+static int vfsDatabaseSlabFault(struct vfsDatabase *d, unsigned i)
 {
-	unsigned page_size = d->page_size;
-	unsigned pgno;
-	void *page;
+	struct vfsSlab *old = d->slabs[i];
+	struct vfsSlab *slab;
+	unsigned n = vfsDatabaseSlabUsed(d, old);
+	unsigned k;
+	int rv;
 
-	if (d->n_pages == 0) {
-		return SQLITE_IOERR_SHORT_READ;
-	}
+	assert(!vfsSlabIsResident(old) || vfsRefcount(&old->refcount) > 1);
 
-	/* If the main database file is not empty, we expect the
-	 * page size to have been set by an initial write. */
-	assert(page_size > 0);
+	slab = vfsSlabCreate(old->first, old->n_pages,
+			     (size_t)old->n_pages * d->page_size,
+			     vfsDatabaseSlabHuge(d, old->n_pages));
+	if (slab == NULL) {
+		return SQLITE_NOMEM;
+	}
 
-	if (offset < page_size) {
-		/* Reading from page 1. We expect the read to be
-		 * at most page_size bytes. */
-		assert(amount <= (int)page_size);
-		pgno = 1;
+	if (vfsSlabIsResident(old)) {
+		memcpy(slab->data, old->data, (size_t)n * d->page_size);
+	} else if (old->map != NULL) {
+		memcpy(slab->data, old->map, (size_t)n * d->page_size);
 	} else {
-		/* For pages greater than 1, we expect a full
-		 * page read, with an offset that starts exectly
-		 * at the page boundary. */
-		assert(amount == (int)page_size);
-		assert(((unsigned)offset % page_size) == 0);
-		pgno = ((unsigned)offset / page_size) + 1;
+		assert(n <= old->n_compressed);
+		for (k = 0; k < n; k++) {
+			rv = vfsSlabInflate(
+			    old, k, d->page_size, &d->compression->inflater,
+			    &d->usage.overhead,
+			    slab->data + (size_t)k * d->page_size);
+			if (rv != SQLITE_OK) {
+				sqlite3_free(slab);
+				return rv;
+			}
+		}
+		d->compression->pages += n;
 	}
 
-	assert(pgno > 0);
+	slab->epoch = d->checkpoints;
+	vfsDatabaseSlabReplace(d, i, slab);
 
-	page = vfsDatabasePageLookup(d, pgno);
+	return SQLITE_OK;
+}
 
-	if (pgno == 1) {
-		/* Read the desired part of page 1. */
-		memcpy(buf, page + offset, (size_t)amount);
-	} else {
-		/* Read the full page. */
-		memcpy(buf, page, (size_t)amount);
+/* Compress the pages of the slab with the given index, releasing its memory
+ * along with the frames lent to its pages. */
+static int vfsDatabaseSlabCompress(struct vfsDatabase *d, unsigned i)
+{
+	struct vfsSlab *slab = d->slabs[i];
+	struct vfsSlab *compressed;
+	unsigned n = vfsDatabaseSlabUsed(d, slab);
+	int rv;
+
+	if (n == 0) {
+		return SQLITE_OK;
+	}
+
+	/* Take back the content of lent frames, so it gets compressed too. */
+	vfsDatabaseSlabTakeBack(d, slab, n);
+
+	rv = vfsSlabDeflate(slab, n, d->page_size, &compressed);
+	if (rv != SQLITE_OK) {
+		return rv;
 	}
+	compressed->hot = false;
+	vfsDatabaseSlabReplace(d, i, compressed);
 
 	return SQLITE_OK;
 }
 
-/* Read data from the WAL. */
-static int vfsWalRead(struct vfsWal *w,
-		      void *buf,
-		      int amount,
-		      sqlite_int64 offset)
+/* Compress all resident slabs of the database that were not used during the
+ * last @compress_age checkpoints.
+ *
+ * Compression is best effort, so failures just leave the slabs as they are.
+ * Slabs pinned by snapshots are skipped, and slabs whose pages don't compress
+ * well wait for another @compress_age checkpoints before being tried again. */
+static void vfsDatabaseCompressIdle(struct vfsDatabase *d)
 {
-	unsigned page_size = w->database->page_size;
-	unsigned index;
-	struct vfsFrame *frame;
+	unsigned i;
+	int rv;
 
-	if (w->n_frames == 0) {
-		return SQLITE_IOERR_SHORT_READ;
+	if (d->compression == NULL) {
+		d->compression = sqlite3_malloc(sizeof *d->compression);
+		if (d->compression == NULL) {
+			return;
+		}
+		memset(d->compression, 0, sizeof *d->compression);
+		d->usage.overhead += (size_t)sqlite3_msize(d->compression);
 	}
 
-	if (offset == 0) {
-		/* Read the header. */
-		assert(amount == FORMAT__WAL_HDR_SIZE);
-		memcpy(buf, w->hdr, FORMAT__WAL_HDR_SIZE);
-		return SQLITE_OK;
+	for (i = 0; i < d->n_slabs; i++) {
+		struct vfsSlab *slab = d->slabs[i];
+		if (!vfsSlabIsResident(slab) ||
+		    vfsRefcount(&slab->refcount) > 1 ||
+		    d->checkpoints - slab->epoch <= d->compress_age) {
+			continue;
+		}
+		rv = vfsDatabaseSlabCompress(d, i);
+		if (rv == SQLITE_FULL) {
+			slab->epoch = d->checkpoints;
+			continue;
+		}
+		if (rv != SQLITE_OK) {
+			return;
+		}
 	}
+}
 
-	/* For any other frame, we expect either a header read,
-	 * a checksum read, a page read or a full frame read. */
-	if (amount == FORMAT__WAL_FRAME_HDR_SIZE) {
-		assert(((offset - FORMAT__WAL_HDR_SIZE) %
-			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
-		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
-	} else if (amount == sizeof(uint32_t) * 2) {
-		if (offset == FORMAT__WAL_FRAME_HDR_SIZE) {
-			/* Read the checksum from the WAL
-			 * header. */
-			memcpy(buf, w->hdr + offset, (size_t)amount);
+/* Return a buffer holding the content of a page of a compressed slab, taken
+ * from the page cache or decompressed into its least recently used buffer. */
+static int vfsDatabasePageInflate(struct vfsDatabase *d,
+				  const struct vfsSlab *slab,
+				  unsigned pgno,
+				  void **page)
+{
+	struct vfsCompression *c = d->compression;
+	struct vfsCachedPage *lru = &c->cache[0];
+	unsigned i;
+	int rv;
+
+	c->tick++;
+	c->reads++;
+
+	for (i = 0; i < VFS__PAGE_CACHE_SIZE; i++) {
+		struct vfsCachedPage *cached = &c->cache[i];
+		if (cached->pgno == pgno) {
+			cached->tick = c->tick;
+			*page = cached->buf;
 			return SQLITE_OK;
 		}
-		assert(((offset - 16 - FORMAT__WAL_HDR_SIZE) %
-			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
-		index = ((unsigned)offset - 16 - FORMAT__WAL_HDR_SIZE) /
-			    (page_size + FORMAT__WAL_FRAME_HDR_SIZE) +
-			1;
-	} else if (amount == (int)page_size) {
-		assert(((offset - FORMAT__WAL_HDR_SIZE -
-			 FORMAT__WAL_FRAME_HDR_SIZE) %
-			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
-		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
-	} else {
-		assert(amount == (FORMAT__WAL_FRAME_HDR_SIZE + (int)page_size));
-		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+		if (cached->tick < lru->tick) {
+			lru = cached;
+		}
 	}
 
-	if (index == 0) {
-		// This is an attempt to read a page that was
-		// never written.
-		memset(buf, 0, (size_t)amount);
-		return SQLITE_IOERR_SHORT_READ;
+	if (lru->buf == NULL) {
+		lru->buf = sqlite3_malloc((int)d->page_size);
+		if (lru->buf == NULL) {
+			return SQLITE_NOMEM;
+		}
+		d->usage.overhead += (size_t)sqlite3_msize(lru->buf);
 	}
 
-	frame = vfsWalFrameLookup(w, index);
-
-	if (amount == FORMAT__WAL_FRAME_HDR_SIZE) {
-		memcpy(buf, frame->hdr, (size_t)amount);
-	} else if (amount == sizeof(uint32_t) * 2) {
-		memcpy(buf, frame->hdr + 16, (size_t)amount);
-	} else if (amount == (int)page_size) {
-		memcpy(buf, frame->buf, (size_t)amount);
-	} else {
-		memcpy(buf, frame->hdr, FORMAT__WAL_FRAME_HDR_SIZE);
-		memcpy(buf + FORMAT__WAL_FRAME_HDR_SIZE, frame->buf, page_size);
-	}
+	lru->pgno = 0;
+	lru->tick = 0;
+	rv = vfsSlabInflate(slab, pgno - slab->first, d->page_size,
+			    &c->inflater, &d->usage.overhead, lru->buf);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+	c->pages++;
+	lru->pgno = pgno;
+	lru->tick = c->tick;
+	*page = lru->buf;
 
 	return SQLITE_OK;
 }
 
-static int vfsFileRead(sqlite3_file *file,
-		       void *buf,
-		       int amount,
-		       sqlite_int64 offset)
+/* Spill slabs until the resident pages of the database fit in the budget.
+ *
+ * This works like the CLOCK page replacement algorithm: a hand sweeps the
+ * slabs, spilling the ones that were not used since its last pass and giving
+ * the others a second chance. Spilling is best effort, so failures just leave
+ * the slabs in memory. Slabs pinned by snapshots, and the @keep slab, are never
+ * spilled. */
+static void vfsDatabaseSpillOverBudget(struct vfsDatabase *d,
+				       const struct vfsSlab *keep)
 {
-	struct vfsFile *f = (struct vfsFile *)file;
-	int rv;
+	unsigned n;
 
-	assert(buf != NULL);
-	assert(amount > 0);
-	assert(f != NULL);
-
-	if (f->temp != NULL) {
-		/* Read from the actual temporary file. */
-		return f->temp->pMethods->xRead(f->temp, buf, amount, offset);
+	if (d->spill->budget == 0) {
+		return;
 	}
 
-	assert(f->content != NULL);
-	assert(f->content->filename != NULL);
-	assert(f->content->refcount > 0);
+	for (n = 2 * d->n_slabs; n > 0 && d->usage.pages > d->spill->budget;
+	     n--) {
+		unsigned i = d->hand % d->n_slabs;
+		struct vfsSlab *slab = d->slabs[i];
 
-	switch (f->content->type) {
-		case VFS__DATABASE:
-			rv = vfsDatabaseRead(&f->content->database, buf, amount,
-					     offset);
-			break;
-		case VFS__WAL:
-			rv = vfsWalRead(&f->content->wal, buf, amount, offset);
-			break;
-		default:
-			rv = SQLITE_IOERR_READ;
-			break;
-	}
+		d->hand = i + 1;
 
-	/* From SQLite docs:
-	 *
-	 *   If xRead() returns SQLITE_IOERR_SHORT_READ it must also fill
-	 *   in the unread portions of the buffer with zeros.  A VFS that
-	 *   fails to zero-fill short reads might seem to work.  However,
-	 *   failure to zero-fill short reads will eventually lead to
-	 *   database corruption.
-	 */
-	if (rv == SQLITE_IOERR_SHORT_READ) {
-		memset(buf, 0, (size_t)amount);
+		if (slab == keep || !vfsSlabIsResident(slab) ||
+		    vfsRefcount(&slab->refcount) > 1) {
+			continue;
+		}
+		if (slab->hot) {
+			slab->hot = false;
+			continue;
+		}
+		if (vfsDatabaseSlabSpill(d, i) != SQLITE_OK) {
+			return;
+		}
 	}
-
-	return rv;
 }
 
-static int vfsDatabaseWrite(struct vfsDatabase *d,
-			    const void *buf,
-			    int amount,
-			    sqlite_int64 offset)
+/* Spill all slabs of the database that were not used in the idle period of its
+ * spill file. */
+static void vfsDatabaseSpillIdle(struct vfsDatabase *d, unsigned long long now)
 {
-	unsigned pgno;
-	void *page;
-	int rc;
+	unsigned i;
 
-	if (offset == 0) {
-		unsigned page_size;
+	for (i = 0; i < d->n_slabs; i++) {
+		struct vfsSlab *slab = d->slabs[i];
+		if (!vfsSlabIsResident(slab) ||
+		    vfsRefcount(&slab->refcount) > 1 ||
+		    now - slab->atime < d->spill->idle) {
+			continue;
+		}
+		if (vfsDatabaseSlabSpill(d, i) != SQLITE_OK) {
+			return;
+		}
+	}
+}
 
-		/* This is the first database page. We expect
-		 * the data to contain at least the header. */
-		assert(amount >= FORMAT__DB_HDR_SIZE);
+/* Return the slab holding the slot of the given page, faulting it back into
+ * memory if it was spilled, or if it was compressed or loaded from an image
+ * and the page is going to be written, and mark it as used. */
+static int vfsDatabaseSlabUse(struct vfsDatabase *d,
+			      unsigned pgno,
+			      bool write,
+			      struct vfsSlab **slab)
+{
+	unsigned i = vfsDatabaseSlabIndex(d, pgno);
+	int rv;
 
-		/* Extract the page size from the header. */
-		formatDatabaseGetPageSize(buf, &page_size);
-		if (page_size == 0) {
-			return SQLITE_CORRUPT;
+	if (d->slabs[i]->spill != NULL ||
+	    (write && !vfsSlabIsResident(d->slabs[i]))) {
+		rv = vfsDatabaseSlabFault(d, i);
+		if (rv != SQLITE_OK) {
+			return rv;
 		}
+	}
 
-		if (d->page_size > 0) {
-			/* Check that the given page size actually matches what
-			 * we have recorded. Since we make 'PRAGMA page_size=N'
-			 * fail if the page is already set (see struct
-			 * vfs__fileControl), there should be no way for the
-			 * user to change it. */
-			assert(page_size == d->page_size);
-		} else {
-			/* This must be the very first write to the
-			 * database. Keep track of the page size. */
-			d->page_size = page_size;
-		}
+	*slab = d->slabs[i];
+	(*slab)->epoch = d->checkpoints;
 
-		pgno = 1;
-	} else {
-		/* The header must have been written and the page size set. */
-		if (d->page_size == 0) {
-			return SQLITE_IOERR_WRITE;
+	if (d->spill != NULL) {
+		(*slab)->hot = true;
+		if (d->spill->idle > 0) {
+			(*slab)->atime = vfsSpillNow();
 		}
+		vfsDatabaseSpillOverBudget(d, *slab);
+	}
 
-		/* For pages beyond the first we expect offset to be a multiple
-		 * of the page size. */
-		assert((offset % d->page_size) == 0);
+	return SQLITE_OK;
+}
 
-		/* We expect that SQLite writes a page at time. */
-		assert(amount == (int)d->page_size);
+/* Insert a new slab holding @n_pages pages starting at @first in the array of
+ * slabs of the database, at the given index. */
+static int vfsDatabaseSlabInsert(struct vfsDatabase *d,
+				 unsigned i,
+				 unsigned first,
+				 unsigned n_pages,
+				 struct vfsSlab **slab)
+{
+	struct vfsSlab **slabs;
+	size_t size;
 
-		pgno = ((unsigned)offset / d->page_size) + 1;
+	*slab = vfsSlabCreate(first, n_pages, (size_t)n_pages * d->page_size,
+			      vfsDatabaseSlabHuge(d, n_pages));
+	if (*slab == NULL) {
+		return SQLITE_NOMEM;
 	}
+	(*slab)->epoch = d->checkpoints;
 
-	rc = vfsDatabasePageGet(d, pgno, &page);
-	if (rc != SQLITE_OK) {
-		return rc;
+	size = (size_t)sqlite3_msize(d->slabs);
+	slabs = sqlite3_realloc64(d->slabs, sizeof *slabs * (d->n_slabs + 1));
+	if (slabs == NULL) {
+		sqlite3_free(*slab);
+		return SQLITE_NOMEM;
 	}
+	memmove(&slabs[i + 1], &slabs[i], sizeof *slabs * (d->n_slabs - i));
+	slabs[i] = *slab;
+	d->slabs = slabs;
+	d->n_slabs++;
 
-	assert(page != NULL);
-
-	memcpy(page, buf, (size_t)amount);
+	d->usage.pages += vfsSlabSize(*slab);
+	d->usage.overhead += (size_t)sqlite3_msize(slabs) - size;
 
 	return SQLITE_OK;
 }
 
-static int vfsWalWrite(struct vfsWal *w,
-		       const void *buf,
-		       int amount,
-		       sqlite_int64 offset)
+/* Append a new slab to the database, able to hold the page with the given
+ * number and the ones following it. */
+static int vfsDatabaseSlabAppend(struct vfsDatabase *d, unsigned pgno)
 {
-	unsigned page_size = w->database->page_size;
-	unsigned index;
-	struct vfsFrame *frame;
+	struct vfsSlab *slab;
+	unsigned n_pages = VFS__SLAB_MIN_PAGES;
+	unsigned max = vfsDatabaseSlabMaxPages(d);
+
+	if (d->n_slabs > 0) {
+		n_pages = d->slabs[d->n_slabs - 1]->n_pages * 2;
+		if (n_pages > max) {
+			n_pages = max;
+		}
+	}
 
-	if (offset == 0) {
-		/* This is the WAL header. */
-		unsigned int new_page_size;
+	return vfsDatabaseSlabInsert(d, d->n_slabs, pgno, n_pages, &slab);
+}
 
-		/* We expect the data to contain exactly 32
-		 * bytes. */
-		assert(amount == FORMAT__WAL_HDR_SIZE);
+/* Allocate an empty leaf of the page index. */
+static struct vfsLeaf *vfsLeafCreate(void)
+{
+	struct vfsLeaf *leaf;
 
-		/* The page size indicated in the header must be
-		 * valid
-		 * and match the one of the database file. */
-		formatWalGetPageSize(buf, &new_page_size);
-		if (new_page_size == 0) {
-			return SQLITE_CORRUPT;
-		}
+	leaf = sqlite3_malloc64(sizeof *leaf);
+	if (leaf == NULL) {
+		return NULL;
+	}
+	memset(leaf, 0, sizeof *leaf);
 
-		if (new_page_size != page_size) {
-			return SQLITE_CORRUPT;
+	return leaf;
+}
+
+/* Like vfsDatabaseLeaf(), but allocate the leaf if it doesn't exist yet. Only
+ * the small array of pointers to leaves is reallocated, pointers to existing
+ * pages never move. */
+static struct vfsLeaf *vfsDatabaseLeafEnsure(struct vfsDatabase *d,
+					     unsigned pgno,
+					     unsigned *j)
+{
+	unsigned i = (pgno - 1) / VFS__PAGE_LEAF_SIZE;
+	struct vfsLeaf **leaves;
+	struct vfsLeaf *leaf;
+	size_t size;
+
+	*j = (pgno - 1) % VFS__PAGE_LEAF_SIZE;
+
+	if (i >= d->n_leaves) {
+		size = (size_t)sqlite3_msize(d->leaves);
+		leaves = sqlite3_realloc64(d->leaves, sizeof *leaves * (i + 1));
+		if (leaves == NULL) {
+			return NULL;
 		}
+		memset(&leaves[d->n_leaves], 0,
+		       sizeof *leaves * (i + 1 - d->n_leaves));
+		d->leaves = leaves;
+		d->n_leaves = i + 1;
+		d->usage.overhead += (size_t)sqlite3_msize(leaves) - size;
+	}
 
-		memcpy(w->hdr, buf, (size_t)amount);
-		return SQLITE_OK;
+	if (d->leaves[i] == NULL) {
+		leaf = vfsLeafCreate();
+		if (leaf == NULL) {
+			return NULL;
+		}
+		d->leaves[i] = leaf;
+		d->usage.overhead += (size_t)sqlite3_msize(leaf);
 	}
 
-	assert(page_size > 0);
+	return d->leaves[i];
+}
 
-	/* This is a WAL frame write. We expect either a frame
-	 * header or page write. */
-	if (amount == FORMAT__WAL_FRAME_HDR_SIZE) {
-		/* Frame header write. */
-		assert(((offset - FORMAT__WAL_HDR_SIZE) %
-			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+/* Append a new page to the database, carving it out of the last slab and
+ * possibly appending a new slab and a new index leaf. */
+static int vfsDatabasePageAppend(struct vfsDatabase *d, void **page)
+{
+	struct vfsSlab *slab;
+	struct vfsLeaf *leaf;
+	unsigned pgno = d->n_pages + 1;
+	unsigned j;
+	int rv;
 
-		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+	/* We assume that the page size has been set, either by intercepting
+	 * the first main database file write, or by handling a 'PRAGMA
+	 * page_size=N' command in vfs__file_control(). This assumption is
+	 * enforced in vfsFileWrite(). */
+	assert(d->page_size > 0);
 
-		if (w->version == VFS__V1) {
-			vfsWalFrameGetV1(w, (int)index, &frame);
-		} else {
-			vfsWalFrameGetV2(w, index, &frame);
-		}
-		if (frame == NULL) {
-			return SQLITE_NOMEM;
+	if (d->n_slabs == 0 || pgno >= d->slabs[d->n_slabs - 1]->first +
+					   d->slabs[d->n_slabs - 1]->n_pages) {
+		rv = vfsDatabaseSlabAppend(d, pgno);
+		if (rv != SQLITE_OK) {
+			return rv;
 		}
-		memcpy(frame->hdr, buf, (size_t)amount);
-	} else {
-		/* Frame page write. */
-		assert(amount == (int)page_size);
-		assert(((offset - FORMAT__WAL_HDR_SIZE -
-			 FORMAT__WAL_FRAME_HDR_SIZE) %
-			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+	}
 
-		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+	leaf = vfsDatabaseLeafEnsure(d, pgno, &j);
+	if (leaf == NULL) {
+		/* Release the slab we might have just appended. */
+		vfsDatabaseShrink(d, d->n_pages);
+		return SQLITE_NOMEM;
+	}
 
-		/* The header for the this frame must already
-		 * have been written, so the page is there. */
-		frame = vfsWalFrameLookup(w, index);
+	/* The free slots of the last slab might have been spilled or
+	 * compressed along with its pages. */
+	slab = d->slabs[d->n_slabs - 1];
+	if (!vfsSlabIsResident(slab)) {
+		rv = vfsDatabaseSlabFault(d, d->n_slabs - 1);
+		if (rv != SQLITE_OK) {
+			vfsDatabaseShrink(d, d->n_pages);
+			return rv;
+		}
+		slab = d->slabs[d->n_slabs - 1];
+	}
 
-		assert(frame != NULL);
+	*page = slab->data + (size_t)(pgno - slab->first) * d->page_size;
+	leaf->pages[j] = *page;
+	assert(leaf->frames[j] == NULL);
 
-		memcpy(frame->buf, buf, (size_t)amount);
-	}
+	d->n_pages = pgno;
 
 	return SQLITE_OK;
 }
 
-static int vfsFileWrite(sqlite3_file *file,
-			const void *buf,
-			int amount,
-			sqlite_int64 offset)
+/* Extend the database to the given number of pages, more than it has.
+ *
+ * The new pages that fit in the free slots of the last slab are zeroed, the
+ * others are left as holes, using no memory until they get written. */
+static int vfsDatabaseGrow(struct vfsDatabase *d, unsigned n_pages)
 {
-	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfsSlab *slab;
+	unsigned n = d->n_pages;
+	unsigned end;
+	unsigned pgno;
 	int rv;
 
-	assert(buf != NULL);
-	assert(amount > 0);
-	assert(f != NULL);
+	assert(n_pages > d->n_pages);
+	assert(d->page_size > 0);
 
-	if (f->temp != NULL) {
-		/* Write to the actual temporary file. */
-		return f->temp->pMethods->xWrite(f->temp, buf, amount, offset);
+	if (d->n_slabs == 0) {
+		goto out;
 	}
 
-	assert(f->content != NULL);
-	assert(f->content->filename != NULL);
-	assert(f->content->refcount > 0);
+	slab = d->slabs[d->n_slabs - 1];
+	end = slab->first + slab->n_pages - 1;
+	if (end > n_pages) {
+		end = n_pages;
+	}
+	if (end <= n) {
+		goto out;
+	}
 
-	switch (f->content->type) {
-		case VFS__DATABASE:
-			rv = vfsDatabaseWrite(&f->content->database, buf,
-					      amount, offset);
-			break;
-		case VFS__WAL:
-			rv = vfsWalWrite(&f->content->wal, buf, amount, offset);
-			break;
-		case VFS__JOURNAL:
-			/* Silently swallow writes to the journal */
-			rv = SQLITE_OK;
-			break;
-		default:
-			rv = SQLITE_IOERR_WRITE;
-			break;
+	/* The free slots might have been spilled or compressed, or still be
+	 * seen by a snapshot taken before a truncation. */
+	if (!vfsSlabIsResident(slab) || vfsRefcount(&slab->refcount) > 1) {
+		rv = vfsDatabaseSlabFault(d, d->n_slabs - 1);
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+		slab = d->slabs[d->n_slabs - 1];
 	}
 
-	return rv;
+	memset(slab->data + (size_t)(n + 1 - slab->first) * d->page_size, 0,
+	       (size_t)(end - n) * d->page_size);
+	for (pgno = n + 1; pgno <= end; pgno++) {
+		unsigned j;
+		struct vfsLeaf *leaf = vfsDatabaseLeafEnsure(d, pgno, &j);
+		if (leaf == NULL) {
+			vfsDatabaseShrink(d, n);
+			return SQLITE_NOMEM;
+		}
+		leaf->pages[j] = slab->data +
+				 (size_t)(pgno - slab->first) * d->page_size;
+	}
+
+out:
+	d->n_pages = n_pages;
+	return SQLITE_OK;
 }
 
-static int vfsFileTruncate(sqlite3_file *file, sqlite_int64 size)
+/* Give a slot to the hole with the given page number, by inserting a zeroed
+ * slab that covers it, along with the neighbouring holes of a small aligned
+ * window. */
+static int vfsDatabaseHoleFill(struct vfsDatabase *d, unsigned pgno)
 {
-	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfsSlab *slab;
+	unsigned first = pgno - (pgno - 1) % VFS__SLAB_MIN_PAGES;
+	unsigned last = first + VFS__SLAB_MIN_PAGES - 1;
+	unsigned i;
+	unsigned k;
+	bool found;
 	int rv;
 
-	assert(f != NULL);
-	assert(f->content != NULL);
+	found = vfsSlabFind(d->slabs, d->n_slabs, pgno, &i);
+	assert(!found);
+	(void)found;
 
-	switch (f->content->type) {
-		case VFS__DATABASE:
-			rv = vfsDatabaseTruncate(&f->content->database, size);
-			break;
+	/* Don't overlap the slabs around the hole. */
+	if (i > 0 && first < d->slabs[i - 1]->first + d->slabs[i - 1]->n_pages) {
+		first = d->slabs[i - 1]->first + d->slabs[i - 1]->n_pages;
+	}
+	if (i < d->n_slabs && last >= d->slabs[i]->first) {
+		last = d->slabs[i]->first - 1;
+	}
+	if (last > d->n_pages) {
+		last = d->n_pages;
+	}
 
-		case VFS__WAL:
-			rv = vfsWalTruncate(&f->content->wal, size);
-			break;
+	/* Create the leaves first, so the slab is never left half indexed. */
+	for (k = first; k <= last; k++) {
+		unsigned j;
+		if (vfsDatabaseLeafEnsure(d, k, &j) == NULL) {
+			return SQLITE_NOMEM;
+		}
+	}
 
-		default:
-			rv = SQLITE_IOERR_TRUNCATE;
-			break;
+	rv = vfsDatabaseSlabInsert(d, i, first, last - first + 1, &slab);
+	if (rv != SQLITE_OK) {
+		return rv;
 	}
+	memset(slab->data, 0, (size_t)slab->n_pages * d->page_size);
 
-	return rv;
+	for (k = first; k <= last; k++) {
+		unsigned j;
+		struct vfsLeaf *leaf = vfsDatabaseLeaf(d, k, &j);
+		assert(leaf->pages[j] == NULL);
+		assert(leaf->frames[j] == NULL);
+		leaf->pages[j] =
+		    slab->data + (size_t)(k - first) * d->page_size;
+	}
+
+	return SQLITE_OK;
+}
+
+/* Make sure that the page with the given number has a slot, appending it or
+ * growing the database if it's past the end, or filling it if it's a hole.
+ *
+ * If @append is set, the page was past the end. */
+static int vfsDatabasePageSlot(struct vfsDatabase *d,
+			       unsigned pgno,
+			       bool *append)
+{
+	struct vfsLeaf *leaf;
+	unsigned n = d->n_pages;
+	unsigned j;
+	unsigned i;
+	void *page;
+	int rv;
+
+	*append = pgno > n;
+
+	if (*append) {
+		if (pgno > n + 1) {
+			rv = vfsDatabaseGrow(d, pgno - 1);
+			if (rv != SQLITE_OK) {
+				return rv;
+			}
+		}
+		rv = vfsDatabasePageAppend(d, &page);
+		if (rv != SQLITE_OK) {
+			vfsDatabaseShrink(d, n);
+			d->n_pages = n;
+		}
+		return rv;
+	}
+
+	leaf = vfsDatabaseLeaf(d, pgno, &j);
+	if (leaf != NULL && (leaf->pages[j] != NULL || leaf->frames[j] != NULL)) {
+		return SQLITE_OK;
+	}
+
+	/* Compressed pages have no slot pointer either. */
+	if (vfsSlabFind(d->slabs, d->n_slabs, pgno, &i)) {
+		return SQLITE_OK;
+	}
+
+	return vfsDatabaseHoleFill(d, pgno);
+}
+
+/* Get a writable buffer for a page of the given database, possibly creating a
+ * new page.
+ *
+ * Normally this is the slot of the page in its slab, which takes back the
+ * content of a frame that was lent to the page, if any. If the slab is pinned
+ * by a snapshot, the page gets a private frame instead. */
+static int vfsDatabasePageGet(struct vfsDatabase *d, unsigned pgno, void **page)
+{
+	struct vfsLeaf *leaf;
+	struct vfsSlab *slab;
+	struct vfsFrame *frame;
+	struct vfsFrame *copy;
+	unsigned n = d->n_pages;
+	bool append;
+	unsigned j;
+	int rc;
+
+	assert(d != NULL);
+	assert(pgno > 0);
+
+	rc = vfsDatabasePageSlot(d, pgno, &append);
+	if (rc != SQLITE_OK) {
+		goto err;
+	}
+
+	rc = vfsDatabaseSlabUse(d, pgno, true, &slab);
+	if (rc != SQLITE_OK) {
+		goto err_after_slot;
+	}
+
+	leaf = vfsDatabaseLeaf(d, pgno, &j);
+	frame = leaf->frames[j];
+
+	if (vfsRefcount(&slab->refcount) == 1) {
+		*page = leaf->pages[j];
+		if (frame != NULL) {
+			memcpy(*page, frame->buf, d->page_size);
+			vfsDatabaseFrameDrop(d, leaf, j);
+		}
+		return SQLITE_OK;
+	}
+
+	/* The slab is pinned. Reuse the frame of the page if nobody else is
+	 * using it. */
+	if (frame != NULL && vfsRefcount(&frame->refcount) == 1) {
+		*page = frame->buf;
+		return SQLITE_OK;
+	}
+
+	copy = vfsFrameCreate(d->pool, d->page_size);
+	if (copy == NULL) {
+		rc = SQLITE_NOMEM;
+		goto err_after_slot;
+	}
+	if (frame != NULL) {
+		memcpy(copy->buf, frame->buf, d->page_size);
+		vfsFrameUnhold(d, frame, VFS__FRAME_DATABASE);
+		vfsFrameDestroy(d->pool, frame);
+	} else {
+		if (!append) {
+			memcpy(copy->buf, leaf->pages[j], d->page_size);
+		}
+		leaf->n_frames++;
+	}
+	vfsFrameHold(d, copy, VFS__FRAME_DATABASE);
+	leaf->frames[j] = copy;
+	*page = copy->buf;
+
+	return SQLITE_OK;
+
+err_after_slot:
+	if (append) {
+		vfsDatabaseShrink(d, n);
+		d->n_pages = n;
+	}
+err:
+	*page = NULL;
+	return rc;
+}
+
+/* Get a frame from the WAL, possibly creating a new one. */
+static int vfsWalFrameGetV1(struct vfsWal *w, int pgno, struct vfsFrame **page)
+{
+	size_t size;
+	int rc;
+
+	assert(w != NULL);
+	assert(pgno > 0);
+
+	/* SQLite should access pages progressively, without jumping more than
+	 * one page after the end. */
+	if (pgno > (int)(w->n_frames + 1)) {
+		rc = SQLITE_IOERR_WRITE;
+		goto err;
+	}
+
+	if (pgno == (int)(w->n_frames + 1)) {
+		/* Create a new page, grow the page array, and append the
+		 * new page to it. */
+		struct vfsFrame **frames; /* New frames array. */
+
+		/* We assume that the page size has been set, either by
+		 * intercepting the first main database file write, or by
+		 * handling a 'PRAGMA page_size=N' command in
+		 * vfs__file_control(). This assumption is enforced in
+		 * vfsFileWrite(). */
+		assert(w->database->page_size > 0);
+
+		if (vfsDatabaseOverQuota(
+			w->database,
+			vfsFrameBlockSize(w->database->page_size))) {
+			rc = SQLITE_FULL;
+			goto err;
+		}
+
+		*page = vfsFrameCreate(w->pool, w->database->page_size);
+		if (*page == NULL) {
+			rc = SQLITE_NOMEM;
+			goto err;
+		}
+
+		size = (size_t)sqlite3_msize(w->frames);
+		frames =
+		    sqlite3_realloc(w->frames, (int)(sizeof *frames) * pgno);
+		if (frames == NULL) {
+			rc = SQLITE_NOMEM;
+			goto err_after_vfs_page_create;
+		}
+
+		/* Append the new page to the new page array. */
+		*(frames + pgno - 1) = *page;
+
+		/* Update the page array. */
+		w->frames = frames;
+		w->n_frames = (unsigned)pgno;
+
+		w->database->usage.overhead +=
+		    (size_t)sqlite3_msize(frames) - size;
+		vfsFrameHold(w->database, *page, VFS__FRAME_WAL);
+	} else {
+		/* Return the existing page. */
+		assert(w->frames != NULL);
+		*page = w->frames[pgno - 1];
+	}
+
+	return SQLITE_OK;
+
+err_after_vfs_page_create:
+	vfsFrameDestroy(w->pool, *page);
+
+err:
+	*page = NULL;
+
+	return rc;
+}
+
+/* Get a frame from the current transaction, possibly creating a new one. */
+static int vfsWalFrameGetV2(struct vfsWal *w,
+			    unsigned index,
+			    struct vfsFrame **frame)
+{
+	size_t size;
+	int rv;
+
+	assert(w != NULL);
+	assert(index > 0);
+
+	/* SQLite should access pages progressively, without jumping more than
+	 * one page after the end. */
+	if (index > w->n_frames + w->n_tx + 1) {
+		rv = SQLITE_IOERR_WRITE;
+		goto err;
+	}
+
+	if (index == w->n_frames + w->n_tx + 1) {
+		/* Create a new frame, grow the transaction array, and append
+		 * the new frame to it. */
+		struct vfsFrame **tx;
+
+		/* We assume that the page size has been set, either by
+		 * intervepting the first main database file write, or by
+		 * handling a 'PRAGMA page_size=N' command in
+		 * vfs__file_control(). This assumption is enforved in
+		 * vfsFileWrite(). */
+		assert(w->database->page_size > 0);
+
+		if (vfsDatabaseOverQuota(
+			w->database,
+			vfsFrameBlockSize(w->database->page_size))) {
+			rv = SQLITE_FULL;
+			goto err;
+		}
+
+		*frame = vfsFrameCreate(w->pool, w->database->page_size);
+		if (*frame == NULL) {
+			rv = SQLITE_NOMEM;
+			goto err;
+		}
+
+		size = (size_t)sqlite3_msize(w->tx);
+		tx = sqlite3_realloc64(w->tx, sizeof *tx * (w->n_tx + 1));
+		if (tx == NULL) {
+			rv = SQLITE_NOMEM;
+			goto err_after_vfs_frame_create;
+		}
+
+		/* Append the new page to the new page array. */
+		tx[index - w->n_frames - 1] = *frame;
+
+		/* Update the page array. */
+		w->tx = tx;
+		w->n_tx++;
+
+		w->database->usage.overhead += (size_t)sqlite3_msize(tx) - size;
+		vfsFrameHold(w->database, *frame, VFS__FRAME_WAL);
+	} else {
+		/* Return the existing page. */
+		assert(w->tx != NULL);
+		*frame = w->tx[index - w->n_frames - 1];
+	}
+
+	return SQLITE_OK;
+
+err_after_vfs_frame_create:
+	vfsFrameDestroy(w->pool, *frame);
+err:
+	*frame = NULL;
+	return rv;
+}
+
+/* Lookup a page from the given database, returning NULL if it doesn't exist,
+ * if it's a hole or if it's compressed. */
+static void *vfsDatabasePageLookup(struct vfsDatabase *d, unsigned pgno)
+{
+	struct vfsLeaf *leaf;
+	unsigned j;
+
+	assert(d != NULL);
+	assert(pgno > 0);
+
+	if (pgno > d->n_pages) {
+		/* This page hasn't been written yet. */
+		return NULL;
+	}
+
+	leaf = vfsDatabaseLeaf(d, pgno, &j);
+	if (leaf == NULL) {
+		return NULL;
+	}
+	if (leaf->frames[j] != NULL) {
+		return leaf->frames[j]->buf;
+	}
+
+	return leaf->pages[j];
+}
+
+/* Lookup a frame from the WAL, returning NULL if it doesn't exist. */
+static struct vfsFrame *vfsWalFrameLookup(struct vfsWal *w, unsigned n)
+{
+	struct vfsFrame *frame;
+
+	assert(w != NULL);
+	assert(n > 0);
+
+	if (w->version == VFS__V1) {
+		if (n > w->n_frames) {
+			/* This page hasn't been written yet. */
+			return NULL;
+		}
+		frame = w->frames[n - 1];
+	} else {
+		if (n > w->n_frames + w->n_tx) {
+			/* This page hasn't been written yet. */
+			return NULL;
+		}
+		if (n <= w->n_frames) {
+			frame = w->frames[n - 1];
+		} else {
+			frame = w->tx[n - w->n_frames - 1];
+		}
+	}
+
+	assert(frame != NULL);
+
+	return frame;
+}
+
+/* Truncate a database file to be exactly the given number of pages. */
+static int vfsDatabaseTruncate(struct vfsDatabase *d, sqlite_int64 size)
+{
+	unsigned n_pages;
+
+	if (d->n_pages == 0) {
+		if (size > 0) {
+			return SQLITE_IOERR_TRUNCATE;
+		}
+		return SQLITE_OK;
+	}
+
+	/* Since the file size is not zero, some content must
+	 * have been written and the page size must be known. */
+	assert(d->page_size > 0);
+
+	if ((size % d->page_size) != 0) {
+		return SQLITE_IOERR_TRUNCATE;
+	}
+
+	n_pages = (unsigned)(size / d->page_size);
+
+	/* We expect callers to only invoke us if some actual content has been
+	 * written already. */
+	assert(d->n_pages > 0);
+
+	/* Growing a file just adds holes past the end. */
+	if (n_pages > d->n_pages) {
+		return vfsDatabaseGrow(d, n_pages);
+	}
+
+	/* Release the slabs and index leaves beyond the new size. The slots of
+	 * a partially truncated slab will be reused if the file grows again. */
+	vfsDatabaseShrink(d, n_pages);
+
+	/* Update the page count. */
+	d->n_pages = n_pages;
+
+	return SQLITE_OK;
+}
+
+/* Truncate a WAL file to zero. */
+static int vfsWalTruncate(struct vfsWal *w, sqlite3_int64 size)
+{
+	unsigned i;
+
+	/* We expect SQLite to only truncate to zero, after a
+	 * full checkpoint.
+	 *
+	 * TODO: figure out other case where SQLite might
+	 * truncate to a different size.
+	 */
+	if (size != 0) {
+		return SQLITE_PROTOCOL;
+	}
+
+	if (w->n_frames == 0) {
+		return SQLITE_OK;
+	}
+
+	assert(w->frames != NULL);
+
+	/* Reset the file header (for WAL files). */
+	memset(w->hdr, 0, FORMAT__WAL_HDR_SIZE);
+
+	w->read_buf = NULL;
+	w->n_checksummed = 0;
+
+	/* Destroy all frames, recycling them for later transactions. Frames
+	 * that were lent to the database stay alive until it's done with
+	 * them. */
+	for (i = 0; i < w->n_frames; i++) {
+		vfsFrameUnhold(w->database, w->frames[i], VFS__FRAME_WAL);
+		vfsFrameDestroy(w->pool, w->frames[i]);
+	}
+	w->database->usage.overhead -= (size_t)sqlite3_msize(w->frames);
+	sqlite3_free(w->frames);
+
+	w->frames = NULL;
+	w->n_frames = 0;
+
+	/* Truncating the WAL completes a checkpoint, after which pages that
+	 * were not used for a while can be compressed. */
+	w->database->checkpoints++;
+	if (w->database->compress_age > 0) {
+		vfsDatabaseCompressIdle(w->database);
+	}
+
+	return SQLITE_OK;
+}
+
+/* Size of the chunks holding the content of temporary files in memory. */
+#define VFS__TEMP_CHUNK_SIZE (16 * 1024)
+
+/* Default limit of the memory used by the temporary files of a VFS. */
+#define VFS__TEMP_LIMIT (16 * 1024 * 1024)
+
+/* Content of a temporary file kept in memory, see VfsSetTempLimit().
+ *
+ * The content is split in fixed-size chunks, so growing the file never moves
+ * existing data. Chunks that were never written are NULL and read as zeros. */
+struct vfsTemp
+{
+	uint8_t **chunks;   /* Chunks of the file content. */
+	unsigned n_chunks;  /* Length of the chunks array. */
+	sqlite3_int64 size; /* Size of the file. */
+};
+
+/* Implementation of the abstract sqlite3_file base class. */
+struct vfsFile
+{
+	sqlite3_file base;          /* Base class. Must be first. */
+	struct vfs *vfs;            /* Pointer to volatile VFS data. */
+	struct vfsContent *content; /* Handle to the file content. */
+	int flags;                  /* Flags passed to xOpen */
+	sqlite3_file *temp;         /* For temp-files, actual VFS. */
+	struct vfsTemp mem;         /* For temp-files, content in memory. */
+	sqlite3_int64 mmap_size;    /* Limit for xFetch, see 'PRAGMA mmap_size'. */
+};
+
+/* Initial number of slots of the filename index. Must be a power of two. */
+#define VFS__INDEX_INITIAL_SLOTS 16
+
+/* Open-addressing hash table mapping filenames to content objects, using
+ * linear probing. The table is grown when more than half of its slots are in
+ * use, so probe sequences stay short. */
+struct vfsIndex
+{
+	struct vfsContent **slots; /* Table slots, NULL if empty. */
+	unsigned n_slots;          /* Number of slots, a power of two. */
+	unsigned n;                /* Number of used slots. */
+};
+
+/* Custom dqlite VFS. Contains pointers to the content of all files that were
+ * created. */
+struct vfs
+{
+	struct vfsContent **contents; /* Files content */
+	unsigned n_contents;          /* Number of files */
+	struct vfsIndex index;        /* Filename index of the contents array */
+	struct vfsFramePool pool;     /* Free WAL frames */
+	int error;                    /* Last error occurred. */
+	int version;
+	bool threadsafe;              /* Whether locking is enabled. */
+	size_t quota;                 /* Memory quota of new databases. */
+	struct vfsSpill *spill;       /* File to spill unused pages to. */
+	unsigned compress_age;        /* Checkpoints before compressing. */
+	bool huge;                    /* Whether to use huge pages for slabs. */
+	size_t temp_limit;            /* Max. memory used by temp files. */
+	size_t temp_used;             /* Memory used by temp files. */
+	pthread_rwlock_t lock;        /* Guard contents and index. */
+};
+
+/* Initialize an empty index with the given number of slots. */
+static int vfsIndexInit(struct vfsIndex *x, unsigned n_slots)
+{
+	assert(n_slots > 0);
+	assert((n_slots & (n_slots - 1)) == 0);
+
+	x->slots = sqlite3_malloc64(sizeof *x->slots * n_slots);
+	if (x->slots == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memset(x->slots, 0, sizeof *x->slots * n_slots);
+	x->n_slots = n_slots;
+	x->n = 0;
+
+	return SQLITE_OK;
+}
+
+/* Release all memory used by the index. */
+static void vfsIndexClose(struct vfsIndex *x)
+{
+	sqlite3_free(x->slots);
+}
+
+/* Find the content whose filename matches the first @len bytes of the given
+ * name, or return NULL. */
+static struct vfsContent *vfsIndexLookup(struct vfsIndex *x,
+					 const char *name,
+					 size_t len)
+{
+	unsigned mask = x->n_slots - 1;
+	unsigned hash = vfsHash(name, len);
+	unsigned i;
+
+	for (i = hash & mask; x->slots[i] != NULL; i = (i + 1) & mask) {
+		struct vfsContent *content = x->slots[i];
+		if (content->hash == hash &&
+		    strncmp(content->filename, name, len) == 0 &&
+		    content->filename[len] == '\0') {
+			return content;
+		}
+	}
+
+	return NULL;
+}
+
+/* Place the given content in the first free slot of its probe sequence. The
+ * content must not be in the index already, and a free slot must exist. */
+static void vfsIndexPlace(struct vfsIndex *x, struct vfsContent *content)
+{
+	unsigned mask = x->n_slots - 1;
+	unsigned i;
+
+	for (i = content->hash & mask; x->slots[i] != NULL;
+	     i = (i + 1) & mask) {
+	}
+
+	x->slots[i] = content;
+	x->n++;
+}
+
+/* Make sure that the index has room for one more content object, possibly
+ * doubling the number of its slots. */
+static int vfsIndexReserve(struct vfsIndex *x)
+{
+	struct vfsIndex grown;
+	unsigned i;
+	int rv;
+
+	if ((x->n + 1) * 2 <= x->n_slots) {
+		return SQLITE_OK;
+	}
+
+	rv = vfsIndexInit(&grown, x->n_slots * 2);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	for (i = 0; i < x->n_slots; i++) {
+		if (x->slots[i] != NULL) {
+			vfsIndexPlace(&grown, x->slots[i]);
+		}
+	}
+
+	vfsIndexClose(x);
+	*x = grown;
+
+	return SQLITE_OK;
+}
+
+/* Remove the given content from the index. Since we use linear probing, the
+ * entries that follow in the same cluster are shifted back so that no lookup
+ * sequence gets broken by the new hole. */
+static void vfsIndexRemove(struct vfsIndex *x, struct vfsContent *content)
+{
+	unsigned mask = x->n_slots - 1;
+	unsigned i;
+	unsigned j;
+
+	for (i = content->hash & mask; x->slots[i] != content;
+	     i = (i + 1) & mask) {
+		assert(x->slots[i] != NULL);
+	}
+
+	for (j = (i + 1) & mask; x->slots[j] != NULL; j = (j + 1) & mask) {
+		unsigned home = x->slots[j]->hash & mask;
+		/* The entry at j can fill the hole at i only if its home slot
+		 * is not cyclically within (i, j]. */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			x->slots[i] = x->slots[j];
+			i = j;
+		}
+	}
+
+	x->slots[i] = NULL;
+	x->n--;
+}
+
+/* In thread-safe mode, the contents array and the filename index are guarded
+ * by a reader/writer lock, while the pages, frames and shared memory regions of
+ * each database and of its WAL are guarded by the database mutex. Locks are
+ * always acquired in this order.
+ *
+ * When thread-safe mode is not enabled, these are no-ops. */
+static void vfsReadLock(struct vfs *v)
+{
+	if (v->threadsafe) {
+		pthread_rwlock_rdlock(&v->lock);
+	}
+}
+
+static void vfsWriteLock(struct vfs *v)
+{
+	if (v->threadsafe) {
+		pthread_rwlock_wrlock(&v->lock);
+	}
+}
+
+static void vfsUnlock(struct vfs *v)
+{
+	if (v->threadsafe) {
+		pthread_rwlock_unlock(&v->lock);
+	}
+}
+
+static void vfsDatabaseLock(struct vfs *v, struct vfsDatabase *d)
+{
+	if (v->threadsafe) {
+		pthread_mutex_lock(&d->mutex);
+	}
+}
+
+static void vfsDatabaseUnlock(struct vfs *v, struct vfsDatabase *d)
+{
+	if (v->threadsafe) {
+		pthread_mutex_unlock(&d->mutex);
+	}
+}
+
+/* Create a new vfs object. */
+static struct vfs *vfsCreate(int version)
+{
+	struct vfs *v;
+	int rv;
+
+	v = sqlite3_malloc(sizeof *v);
+	if (v == NULL) {
+		return NULL;
+	}
+
+	rv = vfsIndexInit(&v->index, VFS__INDEX_INITIAL_SLOTS);
+	if (rv != SQLITE_OK) {
+		sqlite3_free(v);
+		return NULL;
+	}
+
+	rv = pthread_rwlock_init(&v->lock, NULL);
+	if (rv != 0) {
+		vfsIndexClose(&v->index);
+		sqlite3_free(v);
+		return NULL;
+	}
+
+	vfsFramePoolInit(&v->pool);
+	v->contents = NULL;
+	v->n_contents = 0;
+	v->version = version;
+	v->threadsafe = false;
+	v->quota = 0;
+	v->spill = NULL;
+	v->compress_age = 0;
+	v->huge = false;
+	v->temp_limit = VFS__TEMP_LIMIT;
+	v->temp_used = 0;
+
+	return v;
+}
+
+/* Release the memory used internally by the VFS object.
+ *
+ * All file content will be de-allocated, so dangling open FDs against
+ * those files will be broken.
+ */
+static void vfsDestroy(struct vfs *r)
+{
+	unsigned i;
+
+	assert(r != NULL);
+
+	for (i = 0; i < r->n_contents; i++) {
+		struct vfsContent *content = r->contents[i];
+		vfsContentDestroy(content);
+	}
+
+	if (r->contents != NULL) {
+		sqlite3_free(r->contents);
+	}
+
+	if (r->spill != NULL) {
+		vfsSpillClose(r->spill);
+		sqlite3_free(r->spill);
+	}
+
+	vfsIndexClose(&r->index);
+	vfsFramePoolClose(&r->pool);
+	pthread_rwlock_destroy(&r->lock);
+}
+
+/* Find a content object by filename. */
+static struct vfsContent *vfsContentLookup(struct vfs *r, const char *filename)
+{
+	assert(r != NULL);
+	assert(filename != NULL);
+
+	return vfsIndexLookup(&r->index, filename, strlen(filename));
+}
+
+/* Find the database object associated with the given WAL file name. */
+static struct vfsDatabase *vfsDatabaseLookup(struct vfs *v,
+					     const char *wal_filename)
+{
+	struct vfsContent *content;
+	size_t database_filename_len;
+
+	assert(v != NULL);
+	assert(wal_filename != NULL);
+
+	if (strlen(wal_filename) < strlen("-wal")) {
+		return NULL;
+	}
+	database_filename_len = strlen(wal_filename) - strlen("-wal");
+
+	content =
+	    vfsIndexLookup(&v->index, wal_filename, database_filename_len);
+	if (content == NULL || content->type != VFS__DATABASE) {
+		return NULL;
+	}
+
+	return &content->database;
+}
+
+static int vfsDeleteContent(struct vfs *r, const char *filename)
+{
+	struct vfsContent *content;
+
+	content = vfsContentLookup(r, filename);
+	if (content == NULL) {
+		r->error = ENOENT;
+		return SQLITE_IOERR_DELETE_NOENT;
+	}
+
+	/* Check that there are no consumers of this file. */
+	if (vfsRefcount(&content->refcount) > 0) {
+		r->error = EBUSY;
+		return SQLITE_IOERR_DELETE;
+	}
+
+	/* Unlink a WAL from its database, so the database won't reference
+	 * freed memory. */
+	if (content->type == VFS__WAL && content->wal.database != NULL) {
+		struct vfsDatabase *database = content->wal.database;
+		vfsDatabaseLock(r, database);
+		vfsWalUnaccount(&content->wal);
+		database->usage.overhead -= vfsContentSize(content);
+		database->wal = NULL;
+		vfsDatabaseUnlock(r, database);
+	}
+
+	vfsIndexRemove(&r->index, content);
+
+	/* Move the last content object in place of the deleted one, since the
+	 * order of the contents array is not relevant. */
+	assert(r->contents[content->i] == content);
+	r->contents[content->i] = r->contents[r->n_contents - 1];
+	r->contents[content->i]->i = content->i;
+	r->n_contents--;
+
+	/* Free all memory allocated for this file. */
+	vfsContentDestroy(content);
+
+	return SQLITE_OK;
+}
+
+static int vfsFileClose(sqlite3_file *file)
+{
+	int rc = SQLITE_OK;
+	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfs *v = (struct vfs *)(f->vfs);
+
+	vfsWriteLock(v);
+
+	/* If we got zero references, reset the shared memory mapping. */
+	if (vfsUnref(&f->content->refcount) == 0 &&
+	    f->content->type == VFS__DATABASE) {
+		struct vfsDatabase *database = &f->content->database;
+		vfsDatabaseLock(v, database);
+		vfsShmReset(&database->shm);
+		vfsDatabaseUnlock(v, database);
+	}
+
+	if (f->flags & SQLITE_OPEN_DELETEONCLOSE) {
+		rc = vfsDeleteContent(v, f->content->filename);
+	}
+
+	vfsUnlock(v);
+
+	return rc;
+}
+
+/* Return the database whose mutex guards the content of the given file, or
+ * NULL if the file is a journal. */
+static struct vfsDatabase *vfsFileDatabase(struct vfsFile *f)
+{
+	switch (f->content->type) {
+		case VFS__DATABASE:
+			return &f->content->database;
+		case VFS__WAL:
+			return f->content->wal.database;
+		default:
+			return NULL;
+	}
+}
+
+/* Acquire the database mutex guarding the content of the given file. */
+static void vfsFileLockContent(struct vfsFile *f)
+{
+	struct vfsDatabase *database;
+	if (!f->vfs->threadsafe) {
+		return;
+	}
+	database = vfsFileDatabase(f);
+	if (database != NULL) {
+		pthread_mutex_lock(&database->mutex);
+	}
+}
+
+static void vfsFileUnlockContent(struct vfsFile *f)
+{
+	struct vfsDatabase *database;
+	if (!f->vfs->threadsafe) {
+		return;
+	}
+	database = vfsFileDatabase(f);
+	if (database != NULL) {
+		pthread_mutex_unlock(&database->mutex);
+	}
+}
+
+/* Read data from the main database. */
+static int vfsDatabaseRead(struct vfsDatabase *d,
+			   void *buf,
+			   int amount,
+			   sqlite_int64 offset)
+{
+	unsigned page_size = d->page_size;
+	unsigned pgno;
+	void *page;
+	int rv;
+
+	if (d->n_pages == 0) {
+		return SQLITE_IOERR_SHORT_READ;
+	}
+
+	/* If the main database file is not empty, we expect the
+	 * page size to have been set by an initial write. */
+	assert(page_size > 0);
+
+	if (offset < page_size) {
+		/* Reading from page 1. We expect the read to be
+		 * at most page_size bytes. */
+		assert(amount <= (int)page_size);
+		pgno = 1;
+	} else {
+		/* For pages greater than 1, we expect a full
+		 * page read, with an offset that starts exectly
+		 * at the page boundary. */
+		assert(amount == (int)page_size);
+		assert(((unsigned)offset % page_size) == 0);
+		pgno = ((unsigned)offset / page_size) + 1;
+	}
+
+	assert(pgno > 0);
+
+	/* Fault the page back into memory if it was spilled, or decompress it,
+	 * unless its content is in a lent frame. */
+	page = NULL;
+	if ((d->spill != NULL || d->compression != NULL) &&
+	    pgno <= d->n_pages) {
+		struct vfsLeaf *leaf;
+		struct vfsSlab *slab;
+		unsigned i;
+		unsigned j;
+		leaf = vfsDatabaseLeaf(d, pgno, &j);
+		if (leaf != NULL && leaf->frames[j] == NULL &&
+		    vfsSlabFind(d->slabs, d->n_slabs, pgno, &i)) {
+			rv = vfsDatabaseSlabUse(d, pgno, false, &slab);
+			if (rv != SQLITE_OK) {
+				return rv;
+			}
+			if (slab->n_compressed > 0) {
+				rv = vfsDatabasePageInflate(d, slab, pgno,
+							    &page);
+				if (rv != SQLITE_OK) {
+					return rv;
+				}
+			}
+		}
+	}
+
+	if (page == NULL) {
+		page = vfsDatabasePageLookup(d, pgno);
+	}
+
+	/* Holes read as zeros. */
+	if (page == NULL) {
+		memset(buf, 0, (size_t)amount);
+		return pgno > d->n_pages ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+	}
+
+	if (pgno == 1) {
+		/* Read the desired part of page 1. */
+		memcpy(buf, page + offset, (size_t)amount);
+	} else {
+		/* Read the full page. */
+		memcpy(buf, page, (size_t)amount);
+	}
+
+	return SQLITE_OK;
+}
+
+/* Make sure that the headers of the first @n committed frames hold valid
+ * checksums.
+ *
+ * Frames appended by vfsWalCommit() only get their page number, commit size
+ * and salts: the rolling checksum chain is computed here, the first time a
+ * frame header is actually needed, and cached in the headers themselves. */
+static void vfsWalChecksum(struct vfsWal *w, unsigned n)
+{
+	unsigned page_size = w->database->page_size;
+	unsigned i;
+	bool native;
+	unsigned checksum1;
+	unsigned checksum2;
+
+	assert(n <= w->n_frames);
+
+	if (n <= w->n_checksummed) {
+		return;
+	}
+
+	formatWalGetNativeChecksum(w->hdr, &native);
+	if (w->n_checksummed == 0) {
+		formatWalGetChecksums(w->hdr, &checksum1, &checksum2);
+	} else {
+		struct vfsFrame *frame = w->frames[w->n_checksummed - 1];
+		formatWalGetFrameChecksums(frame->hdr, &checksum1, &checksum2);
+	}
+
+	for (i = w->n_checksummed; i < n; i++) {
+		struct vfsFrame *frame = w->frames[i];
+		formatWalPutFrameChecksums(native, &checksum1, &checksum2,
+					   frame->hdr, frame->buf, page_size);
+	}
+
+	w->n_checksummed = n;
+}
+
+/* Read data from the WAL. */
+static int vfsWalRead(struct vfsWal *w,
+		      void *buf,
+		      int amount,
+		      sqlite_int64 offset)
+{
+	unsigned page_size = w->database->page_size;
+	unsigned index;
+	struct vfsFrame *frame;
+
+	if (w->n_frames == 0) {
+		return SQLITE_IOERR_SHORT_READ;
+	}
+
+	if (offset == 0) {
+		/* Read the header. */
+		assert(amount == FORMAT__WAL_HDR_SIZE);
+		memcpy(buf, w->hdr, FORMAT__WAL_HDR_SIZE);
+		return SQLITE_OK;
+	}
+
+	/* For any other frame, we expect either a header read,
+	 * a checksum read, a page read or a full frame read. */
+	if (amount == FORMAT__WAL_FRAME_HDR_SIZE) {
+		assert(((offset - FORMAT__WAL_HDR_SIZE) %
+			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+	} else if (amount == sizeof(uint32_t) * 2) {
+		if (offset == FORMAT__WAL_FRAME_HDR_SIZE) {
+			/* Read the checksum from the WAL
+			 * header. */
+			memcpy(buf, w->hdr + offset, (size_t)amount);
+			return SQLITE_OK;
+		}
+		assert(((offset - 16 - FORMAT__WAL_HDR_SIZE) %
+			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+		index = ((unsigned)offset - 16 - FORMAT__WAL_HDR_SIZE) /
+			    (page_size + FORMAT__WAL_FRAME_HDR_SIZE) +
+			1;
+	} else if (amount == (int)page_size) {
+		assert(((offset - FORMAT__WAL_HDR_SIZE -
+			 FORMAT__WAL_FRAME_HDR_SIZE) %
+			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+	} else {
+		assert(amount == (FORMAT__WAL_FRAME_HDR_SIZE + (int)page_size));
+		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+	}
+
+	if (index == 0) {
+		// This is an attempt to read a page that was
+		// never written.
+		memset(buf, 0, (size_t)amount);
+		return SQLITE_IOERR_SHORT_READ;
+	}
+
+	frame = vfsWalFrameLookup(w, index);
+
+	/* Page reads don't need the checksum chain. */
+	if (amount != (int)page_size && index <= w->n_frames) {
+		vfsWalChecksum(w, index);
+	}
+
+	if (amount == FORMAT__WAL_FRAME_HDR_SIZE) {
+		memcpy(buf, frame->hdr, (size_t)amount);
+	} else if (amount == sizeof(uint32_t) * 2) {
+		memcpy(buf, frame->hdr + 16, (size_t)amount);
+	} else if (amount == (int)page_size) {
+		memcpy(buf, frame->buf, (size_t)amount);
+		/* Remember this read, in case it's a checkpoint that is going
+		 * to write the page back to the database. */
+		w->read_buf = buf;
+		w->read_index = index;
+	} else {
+		memcpy(buf, frame->hdr, FORMAT__WAL_FRAME_HDR_SIZE);
+		memcpy(buf + FORMAT__WAL_FRAME_HDR_SIZE, frame->buf, page_size);
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsFileRead(sqlite3_file *file,
+		       void *buf,
+		       int amount,
+		       sqlite_int64 offset)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	int rv;
+
+	assert(buf != NULL);
+	assert(amount > 0);
+	assert(f != NULL);
+
+	assert(f->content != NULL);
+	assert(f->content->filename != NULL);
+	assert(vfsRefcount(&f->content->refcount) > 0);
+
+	vfsFileLockContent(f);
+	switch (f->content->type) {
+		case VFS__DATABASE:
+			rv = vfsDatabaseRead(&f->content->database, buf, amount,
+					     offset);
+			break;
+		case VFS__WAL:
+			rv = vfsWalRead(&f->content->wal, buf, amount, offset);
+			break;
+		default:
+			rv = SQLITE_IOERR_READ;
+			break;
+	}
+	vfsFileUnlockContent(f);
+
+	/* From SQLite docs:
+	 *
+	 *   If xRead() returns SQLITE_IOERR_SHORT_READ it must also fill
+	 *   in the unread portions of the buffer with zeros.  A VFS that
+	 *   fails to zero-fill short reads might seem to work.  However,
+	 *   failure to zero-fill short reads will eventually lead to
+	 *   database corruption.
+	 */
+	if (rv == SQLITE_IOERR_SHORT_READ) {
+		memset(buf, 0, (size_t)amount);
+	}
+
+	return rv;
+}
+
+/* If the given write is a checkpoint writing back a page that it has just read
+ * from the WAL, return the WAL frame holding that page, otherwise NULL.
+ *
+ * While holding the checkpoint lock, SQLite reads each page to backfill from
+ * the WAL into a buffer, and then writes that same buffer to the database
+ * without modifying it. We detect this pattern by remembering the buffer
+ * passed to the last page read, see vfsWalRead(). */
+static struct vfsFrame *vfsDatabaseCheckpointFrame(struct vfsDatabase *d,
+						   const void *buf,
+						   int amount,
+						   unsigned pgno)
+{
+	struct vfsWal *w = d->wal;
+	struct vfsFrame *frame;
+	unsigned frame_pgno;
+
+	if (w == NULL || w->read_buf != buf || amount != (int)d->page_size) {
+		return NULL;
+	}
+
+	if (!vfsShmIsExclusive(&d->shm, FORMAT__WAL_CKPT_LOCK)) {
+		return NULL;
+	}
+
+	/* Only committed frames get checkpointed. */
+	if (w->read_index == 0 || w->read_index > w->n_frames) {
+		return NULL;
+	}
+
+	/* Pages of adopted buffers are copied, to avoid pinning the whole
+	 * buffer for as long as the database uses one of its pages. */
+	frame = w->frames[w->read_index - 1];
+	if (frame->owner != NULL) {
+		return NULL;
+	}
+
+	formatWalGetFramePageNumber(frame->hdr, &frame_pgno);
+	if (frame_pgno != pgno) {
+		return NULL;
+	}
+
+	return frame;
+}
+
+/* Lend the given WAL frame to a database page, which will use the frame content
+ * instead of a copy of it, until the page is written again. */
+static int vfsDatabasePageLend(struct vfsDatabase *d,
+			       unsigned pgno,
+			       struct vfsFrame *frame)
+{
+	struct vfsLeaf *leaf;
+	struct vfsSlab *slab;
+	bool append;
+	unsigned j;
+	int rv;
+
+	/* Holes get a slot too, so lent frames always shadow one. */
+	rv = vfsDatabasePageSlot(d, pgno, &append);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	/* Lent frames get spilled or compressed along with the slab of their
+	 * page, so the slab must be in memory. */
+	if (d->spill != NULL || d->compression != NULL) {
+		rv = vfsDatabaseSlabUse(d, pgno, true, &slab);
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+	}
+
+	leaf = vfsDatabaseLeaf(d, pgno, &j);
+	vfsRef(&frame->refcount);
+	if (leaf->frames[j] != NULL) {
+		/* This might be the very same frame, lent again. */
+		vfsDatabaseFrameDrop(d, leaf, j);
+	}
+	leaf->n_frames++;
+	vfsFrameHold(d, frame, VFS__FRAME_DATABASE);
+	leaf->frames[j] = frame;
+
+	return SQLITE_OK;
+}
+
+static int vfsDatabaseWrite(struct vfsDatabase *d,
+			    const void *buf,
+			    int amount,
+			    sqlite_int64 offset)
+{
+	struct vfsFrame *frame;
+	unsigned pgno;
+	void *page;
+	int rc;
+
+	if (offset == 0) {
+		unsigned page_size;
+
+		/* This is the first database page. We expect
+		 * the data to contain at least the header. */
+		assert(amount >= FORMAT__DB_HDR_SIZE);
+
+		/* Extract the page size from the header. */
+		formatDatabaseGetPageSize(buf, &page_size);
+		if (page_size == 0) {
+			return SQLITE_CORRUPT;
+		}
+
+		if (d->page_size > 0) {
+			/* Check that the given page size actually matches what
+			 * we have recorded. Since we make 'PRAGMA page_size=N'
+			 * fail if the page is already set (see struct
+			 * vfs__fileControl), there should be no way for the
+			 * user to change it. */
+			assert(page_size == d->page_size);
+		} else {
+			/* This must be the very first write to the
+			 * database. Keep track of the page size. */
+			d->page_size = page_size;
+		}
+
+		pgno = 1;
+	} else {
+		/* The header must have been written and the page size set. */
+		if (d->page_size == 0) {
+			return SQLITE_IOERR_WRITE;
+		}
+
+		/* For pages beyond the first we expect offset to be a multiple
+		 * of the page size. */
+		assert((offset % d->page_size) == 0);
+
+		/* We expect that SQLite writes a page at time. */
+		assert(amount == (int)d->page_size);
+
+		pgno = ((unsigned)offset / d->page_size) + 1;
+	}
+
+	/* Avoid copying pages written back by a checkpoint, since their WAL
+	 * frames can be used directly. */
+	frame = vfsDatabaseCheckpointFrame(d, buf, amount, pgno);
+	if (frame != NULL) {
+		return vfsDatabasePageLend(d, pgno, frame);
+	}
+
+	rc = vfsDatabasePageGet(d, pgno, &page);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+
+	assert(page != NULL);
+
+	memcpy(page, buf, (size_t)amount);
+
+	return SQLITE_OK;
+}
+
+/* Replace the frame with the given index with a private copy of it, so it can
+ * be modified. This is needed when rewriting a frame whose content is also used
+ * by the database or is backed by an adopted buffer. */
+static int vfsWalFrameUnshare(struct vfsWal *w,
+			      unsigned index,
+			      struct vfsFrame **frame)
+{
+	struct vfsFrame **slot;
+	struct vfsFrame *copy;
+
+	if (index <= w->n_frames) {
+		slot = &w->frames[index - 1];
+	} else {
+		slot = &w->tx[index - w->n_frames - 1];
+	}
+	assert(*slot == *frame);
+
+	copy = vfsFrameCreate(w->pool, w->database->page_size);
+	if (copy == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memcpy(copy->hdr, (*frame)->hdr, FORMAT__WAL_FRAME_HDR_SIZE);
+	memcpy(copy->buf, (*frame)->buf, w->database->page_size);
+
+	vfsFrameHold(w->database, copy, VFS__FRAME_WAL);
+	vfsFrameUnhold(w->database, *frame, VFS__FRAME_WAL);
+	vfsFrameDestroy(w->pool, *frame);
+	*slot = copy;
+	*frame = copy;
+
+	return SQLITE_OK;
+}
+
+static int vfsWalWrite(struct vfsWal *w,
+		       const void *buf,
+		       int amount,
+		       sqlite_int64 offset)
+{
+	unsigned page_size = w->database->page_size;
+	unsigned index;
+	struct vfsFrame *frame;
+	int rv;
+
+	/* Frames might be about to change. */
+	w->read_buf = NULL;
+
+	if (offset == 0) {
+		/* This is the WAL header. */
+		unsigned int new_page_size;
+
+		/* We expect the data to contain exactly 32
+		 * bytes. */
+		assert(amount == FORMAT__WAL_HDR_SIZE);
+
+		/* The page size indicated in the header must be
+		 * valid
+		 * and match the one of the database file. */
+		formatWalGetPageSize(buf, &new_page_size);
+		if (new_page_size == 0) {
+			return SQLITE_CORRUPT;
+		}
+
+		if (new_page_size != page_size) {
+			return SQLITE_CORRUPT;
+		}
+
+		/* The checksum chain of existing frames starts from the
+		 * current header, so settle it before replacing it. */
+		vfsWalChecksum(w, w->n_frames);
+
+		memcpy(w->hdr, buf, (size_t)amount);
+		return SQLITE_OK;
+	}
+
+	assert(page_size > 0);
+
+	/* This is a WAL frame write. We expect either a frame
+	 * header or page write. */
+	if (amount == FORMAT__WAL_FRAME_HDR_SIZE) {
+		/* Frame header write. */
+		assert(((offset - FORMAT__WAL_HDR_SIZE) %
+			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+
+		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+
+		if (w->version == VFS__V1) {
+			rv = vfsWalFrameGetV1(w, (int)index, &frame);
+		} else {
+			rv = vfsWalFrameGetV2(w, index, &frame);
+		}
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+		if (vfsRefcount(&frame->refcount) > 1 || frame->owner != NULL) {
+			rv = vfsWalFrameUnshare(w, index, &frame);
+			if (rv != SQLITE_OK) {
+				return rv;
+			}
+		}
+		/* SQLite computes the checksum of the frame it writes, which
+		 * extends the checksum chain if it was complete up to here. */
+		if (index <= w->n_frames) {
+			vfsWalChecksum(w, index - 1);
+			if (w->n_checksummed == index - 1) {
+				w->n_checksummed = index;
+			}
+		}
+		memcpy(frame->hdr, buf, (size_t)amount);
+	} else {
+		/* Frame page write. */
+		assert(amount == (int)page_size);
+		assert(((offset - FORMAT__WAL_HDR_SIZE -
+			 FORMAT__WAL_FRAME_HDR_SIZE) %
+			(page_size + FORMAT__WAL_FRAME_HDR_SIZE)) == 0);
+
+		index = formatWalCalcFrameIndex(page_size, (unsigned)offset);
+
+		/* The header for the this frame must already
+		 * have been written, so the page is there. */
+		frame = vfsWalFrameLookup(w, index);
+
+		assert(frame != NULL);
+
+		if (vfsRefcount(&frame->refcount) > 1 || frame->owner != NULL) {
+			rv = vfsWalFrameUnshare(w, index, &frame);
+			if (rv != SQLITE_OK) {
+				return rv;
+			}
+		}
+		memcpy(frame->buf, buf, (size_t)amount);
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsFileWrite(sqlite3_file *file,
+			const void *buf,
+			int amount,
+			sqlite_int64 offset)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	int rv;
+
+	assert(buf != NULL);
+	assert(amount > 0);
+	assert(f != NULL);
+
+	assert(f->content != NULL);
+	assert(f->content->filename != NULL);
+	assert(vfsRefcount(&f->content->refcount) > 0);
+
+	vfsFileLockContent(f);
+	switch (f->content->type) {
+		case VFS__DATABASE:
+			rv = vfsDatabaseWrite(&f->content->database, buf,
+					      amount, offset);
+			break;
+		case VFS__WAL:
+			rv = vfsWalWrite(&f->content->wal, buf, amount, offset);
+			break;
+		case VFS__JOURNAL:
+			/* Silently swallow writes to the journal */
+			rv = SQLITE_OK;
+			break;
+		default:
+			rv = SQLITE_IOERR_WRITE;
+			break;
+	}
+	vfsFileUnlockContent(f);
+
+	return rv;
+}
+
+static int vfsFileTruncate(sqlite3_file *file, sqlite_int64 size)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	int rv;
+
+	assert(f != NULL);
+	assert(f->content != NULL);
+
+	vfsFileLockContent(f);
+	switch (f->content->type) {
+		case VFS__DATABASE:
+			rv = vfsDatabaseTruncate(&f->content->database, size);
+			break;
+
+		case VFS__WAL:
+			rv = vfsWalTruncate(&f->content->wal, size);
+			break;
+
+		default:
+			rv = SQLITE_IOERR_TRUNCATE;
+			break;
+	}
+	vfsFileUnlockContent(f);
+
+	return rv;
+}
+
+static int vfsFileSync(sqlite3_file *file, int flags)
+{
+	(void)file;
+	(void)flags;
+
+	return SQLITE_IOERR_FSYNC;
+}
+
+static int vfsFileSize(sqlite3_file *file, sqlite_int64 *size)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+
+	vfsFileLockContent(f);
+	switch (f->content->type) {
+		case VFS__DATABASE:
+			*size = f->content->database.n_pages *
+				f->content->database.page_size;
+			break;
+
+		case VFS__JOURNAL:
+			*size = 0;
+			break;
+
+		case VFS__WAL:
+			/* TODO? here we assume that FileSize() is never invoked
+			 * between a header write and a page write. */
+			*size = (f->content->wal.n_frames *
+				 (FORMAT__WAL_FRAME_HDR_SIZE +
+				  f->content->wal.database->page_size));
+			if (*size > 0) {
+				*size += FORMAT__WAL_HDR_SIZE;
+			}
+			break;
+	}
+	vfsFileUnlockContent(f);
+
+	return SQLITE_OK;
+}
+
+/* Locking a file is a no-op, since no other process has visibility on it. */
+static int vfsFileLock(sqlite3_file *file, int lock)
+{
+	(void)file;
+	(void)lock;
+
+	return SQLITE_OK;
+}
+
+/* Unlocking a file is a no-op, since no other process has visibility on it. */
+static int vfsFileUnlock(sqlite3_file *file, int lock)
+{
+	(void)file;
+	(void)lock;
+
+	return SQLITE_OK;
+}
+
+/* We always report that a lock is held. This routine should be used only in
+ * journal mode, so it doesn't matter. */
+static int vfsFileCheckReservedLock(sqlite3_file *file, int *result)
+{
+	(void)file;
+
+	*result = 1;
+	return SQLITE_OK;
+}
+
+/* Handle pragma a pragma file control. See the xFileControl
+ * docstring in sqlite.h.in for more details. */
+static int vfsFileControlPragma(struct vfsFile *f, char **fnctl)
+{
+	const char *left;
+	const char *right;
+
+	assert(f != NULL);
+	assert(f->content->type == VFS__DATABASE);
+	assert(fnctl != NULL);
+
+	left = fnctl[1];
+	right = fnctl[2];
+
+	assert(left != NULL);
+
+	if (strcmp(left, "page_size") == 0 && right) {
+		/* When the user executes 'PRAGMA page_size=N' we save the
+		 * size internally.
+		 *
+		 * The page size must be between 512 and 65536, and be a
+		 * power of two. The check below was copied from
+		 * sqlite3BtreeSetPageSize in btree.c.
+		 *
+		 * Invalid sizes are simply ignored, SQLite will do the same.
+		 *
+		 * It's not possible to change the size after it's set.
+		 */
+		int page_size = atoi(right);
+
+		if (page_size >= FORMAT__PAGE_SIZE_MIN &&
+		    page_size <= FORMAT__PAGE_SIZE_MAX &&
+		    ((page_size - 1) & page_size) == 0) {
+			if (f->content->database.page_size &&
+			    page_size != (int)f->content->database.page_size) {
+				fnctl[0] =
+				    "changing page size is not supported";
+				return SQLITE_IOERR;
+			}
+			f->content->database.page_size = (unsigned)page_size;
+		}
+	} else if (strcmp(left, "journal_mode") == 0 && right) {
+		/* When the user executes 'PRAGMA journal_mode=x' we ensure
+		 * that the desired mode is 'wal'. */
+		if (strcasecmp(right, "wal") != 0) {
+			fnctl[0] = "only WAL mode is supported";
+			return SQLITE_IOERR;
+		}
+	}
+
+	/* We're returning NOTFOUND here to tell SQLite that we wish it to go on
+	 * with its own handling as well. If we returned SQLITE_OK the page size
+	 * of the journal mode wouldn't be effectively set, as the processing of
+	 * the PRAGMA would stop here. */
+	return SQLITE_NOTFOUND;
+}
+
+/* Revert the WAL index header as it was before the transaction started and save
+ * the header as it is now after the transaction ended. */
+static void vfsWalReverIndexHeader(struct vfsWal *w)
+{
+	struct vfsShm *shm = &w->database->shm;
+	uint8_t *hdr = shm->regions[0];
+	unsigned i;
+	unsigned max_frame = 0;
+	unsigned frame_checksum1 = 0;
+	unsigned frame_checksum2 = 0;
+	unsigned n_pages = w->database->n_pages;
+
+	vfsWalChecksum(w, w->n_frames);
+
+	for (i = 0; i < w->n_frames; i++) {
+		struct vfsFrame *frame = w->frames[i];
+		unsigned page_number;
+		formatWalGetFramePageNumber(frame->hdr, &page_number);
+		if (page_number > n_pages) {
+			n_pages = page_number;
+		}
+		max_frame++;
+		if (i == w->n_frames - 1) {
+			formatWalGetFrameChecksums(frame->hdr, &frame_checksum1,
+						   &frame_checksum2);
+		}
+	}
+
+	formatWalIndexHeaderRevert(hdr, max_frame, n_pages, frame_checksum1,
+				   frame_checksum2);
+}
+
+/* The SQLITE_FCNTL_COMMIT_PHASETWO file control op code is trigged by the
+ * SQLite pager after completing a transaction. */
+static int vfsFileControlCommitPhaseTwo(struct vfsFile *f)
+{
+	struct vfsDatabase *database = &f->content->database;
+	struct vfsWal *wal = database->wal;
+	if (database->version == VFS__V2 && wal != NULL && wal->n_tx > 0) {
+		vfsWalReverIndexHeader(wal);
+	}
+	return 0;
+}
+
+static int vfsFileControl(sqlite3_file *file, int op, void *arg)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	int rv;
+
+	switch (op) {
+		case SQLITE_FCNTL_PRAGMA:
+			vfsFileLockContent(f);
+			rv = vfsFileControlPragma(f, arg);
+			vfsFileUnlockContent(f);
+			break;
+		case SQLITE_FCNTL_COMMIT_PHASETWO:
+			vfsFileLockContent(f);
+			rv = vfsFileControlCommitPhaseTwo(f);
+			vfsFileUnlockContent(f);
+			break;
+		case SQLITE_FCNTL_PERSIST_WAL:
+			/* This prevents SQLite from deleting the WAL after the
+			 * last connection is closed. */
+			*(int *)(arg) = 1;
+			rv = SQLITE_OK;
+			break;
+		case SQLITE_FCNTL_MMAP_SIZE:
+			/* A negative value means that the limit should only be
+			 * queried. */
+			if (*(sqlite3_int64 *)arg >= 0) {
+				f->mmap_size = *(sqlite3_int64 *)arg;
+			}
+			*(sqlite3_int64 *)arg = f->mmap_size;
+			rv = SQLITE_OK;
+			break;
+		default:
+			rv = SQLITE_OK;
+			break;
+	}
+
+	return rv;
+}
+
+/* Hand SQLite a direct pointer to the content of a database page, so it
+ * doesn't need to keep a copy of it in its page cache.
+ *
+ * SQLite never modifies the returned memory, and its locking protocol
+ * guarantees that a page is not written by a checkpoint or truncated while a
+ * connection has a read transaction that might be using it. Since all database
+ * page writes happen in the context of a checkpoint, the page content and the
+ * memory holding it, be it a slab slot or a lent WAL frame, remain valid until
+ * xUnfetch() is called, so there's no need to pin them.
+ *
+ * That's not true anymore if spilling or compression are enabled, since any
+ * read might spill the slab holding a fetched page, and any checkpoint might
+ * compress it, so SQLite falls back to xRead() in that case.
+ *
+ * WAL frames are never fetched by SQLite. */
+static int vfsFileFetch(sqlite3_file *file,
+			sqlite3_int64 offset,
+			int amount,
+			void **pp)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfsDatabase *d;
+
+	*pp = NULL;
+
+	if (f->content->type != VFS__DATABASE) {
+		return SQLITE_OK;
+	}
+
+	if (offset + amount > f->mmap_size) {
+		return SQLITE_OK;
+	}
+
+	d = &f->content->database;
+
+	vfsFileLockContent(f);
+
+	/* SQLite only fetches whole pages, but fall back to xRead if that
+	 * ever changes. */
+	if (d->spill == NULL && d->compress_age == 0 &&
+	    d->compression == NULL && d->page_size != 0 &&
+	    amount == (int)d->page_size && (offset % d->page_size) == 0) {
+		*pp = vfsDatabasePageLookup(
+		    d, (unsigned)(offset / d->page_size) + 1);
+	}
+
+	vfsFileUnlockContent(f);
+
+	return SQLITE_OK;
+}
+
+/* Nothing to release, see vfsFileFetch(). */
+static int vfsFileUnfetch(sqlite3_file *file, sqlite3_int64 offset, void *p)
+{
+	(void)file;
+	(void)offset;
+	(void)p;
+
+	return SQLITE_OK;
+}
+
+static int vfsFileSectorSize(sqlite3_file *file)
+{
+	(void)file;
+
+	return 0;
+}
+
+static int vfsFileDeviceCharacteristics(sqlite3_file *file)
+{
+	(void)file;
+
+	return 0;
+}
+
+static int vfsShmMap(struct vfsShm *s,
+		     unsigned region_index,
+		     unsigned region_size,
+		     bool extend,
+		     void volatile **out)
+{
+	void **regions;
+	void *region;
+	size_t size;
+	int rv;
+
+	if (s->regions != NULL && region_index < s->n_regions) {
+		/* The region was already allocated. */
+		region = s->regions[region_index];
+		assert(region != NULL);
+	} else {
+		if (extend) {
+			/* We should grow the map one region at a time. */
+			assert(region_size == FORMAT__WAL_IDX_PAGE_SIZE);
+			assert(region_index == s->n_regions);
+			region = sqlite3_malloc64(region_size);
+			if (region == NULL) {
+				rv = SQLITE_NOMEM;
+				goto err;
+			}
+
+			memset(region, 0, region_size);
+
+			size = (size_t)sqlite3_msize(s->regions);
+			regions = sqlite3_realloc64(
+			    s->regions,
+			    sizeof *s->regions * (region_index + 1));
+
+			if (regions == NULL) {
+				rv = SQLITE_NOMEM;
+				goto err_after_region_malloc;
+			}
+
+			regions[region_index] = region;
+			s->regions = regions;
+			s->n_regions++;
+			s->size += (size_t)sqlite3_msize(region) +
+				   (size_t)sqlite3_msize(regions) - size;
+
+		} else {
+			/* The region was not allocated and we don't have to
+			 * extend the map. */
+			region = NULL;
+		}
+	}
+
+	*out = region;
+
+	return SQLITE_OK;
+
+err_after_region_malloc:
+	sqlite3_free(region);
+err:
+	assert(rv != SQLITE_OK);
+	*out = NULL;
+	return rv;
+}
+
+/* Simulate shared memory by allocating on the C heap. */
+static int vfsFileShmMap(sqlite3_file *file, /* Handle open on database file */
+			 int region_index,   /* Region to retrieve */
+			 int region_size,    /* Size of regions */
+			 int extend, /* True to extend file if necessary */
+			 void volatile **out /* OUT: Mapped memory */
+)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	int rv;
+
+	assert(f->content->type == VFS__DATABASE);
+
+	vfsFileLockContent(f);
+	rv = vfsShmMap(&f->content->database.shm, (unsigned)region_index,
+		       (unsigned)region_size, extend, out);
+	vfsFileUnlockContent(f);
+
+	return rv;
+}
+
+/* Acquire a shared memory lock.
+ *
+ * Each lock slot is updated with compare-and-swap operations, so connections
+ * running on different threads can safely contend for the same slots. An
+ * exclusive lock spanning several slots is acquired slot by slot, and the slots
+ * that were already taken are released if one of them turns out to be busy. */
+static int vfsShmLock(struct vfsShm *s, int ofst, int n, int flags)
+{
+	int i;
+
+	if (flags & SQLITE_SHM_EXCLUSIVE) {
+		/* No shared or exclusive lock must be held in the region. */
+		for (i = ofst; i < ofst + n; i++) {
+			int expected = 0;
+			if (!__atomic_compare_exchange_n(
+				&s->locks[i], &expected, VFS__SHM_EXCLUSIVE,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				while (i > ofst) {
+					i--;
+					__atomic_store_n(&s->locks[i], 0,
+							 __ATOMIC_RELEASE);
+				}
+				return SQLITE_BUSY;
+			}
+		}
+	} else {
+		/* No exclusive lock must be held in the region. */
+		for (i = ofst; i < ofst + n; i++) {
+			int locks = __atomic_load_n(&s->locks[i],
+						    __ATOMIC_RELAXED);
+			do {
+				if (locks == VFS__SHM_EXCLUSIVE) {
+					return SQLITE_BUSY;
+				}
+			} while (!__atomic_compare_exchange_n(
+			    &s->locks[i], &locks, locks + 1, false,
+			    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+		}
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsShmUnlock(struct vfsShm *s, int ofst, int n, int flags)
+{
+	int i;
+
+	for (i = ofst; i < ofst + n; i++) {
+		int locks = __atomic_load_n(&s->locks[i], __ATOMIC_RELAXED);
+
+		/* Sanity check that no lock of the other type is held in this
+		 * region. */
+		if (flags & SQLITE_SHM_SHARED) {
+			assert(locks != VFS__SHM_EXCLUSIVE);
+		} else {
+			assert(locks == VFS__SHM_EXCLUSIVE || locks == 0);
+		}
+
+		/* Only decrease the lock count if it's positive. In other words
+		 * releasing a never acquired lock is legal and idemponent. */
+		if (flags & SQLITE_SHM_SHARED) {
+			while (locks > 0 &&
+			       !__atomic_compare_exchange_n(
+				   &s->locks[i], &locks, locks - 1, false,
+				   __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			}
+		} else if (locks == VFS__SHM_EXCLUSIVE) {
+			__atomic_store_n(&s->locks[i], 0, __ATOMIC_RELEASE);
+		}
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsFileShmLock(sqlite3_file *file, int ofst, int n, int flags)
+{
+	struct vfsFile *f;
+	struct vfsShm *shm;
+	int rv;
+
+	assert(file != NULL);
+	assert(ofst >= 0);
+	assert(n >= 0);
+
+	/* Legal values for the offset and the range */
+	assert(ofst >= 0 && ofst + n <= SQLITE_SHM_NLOCK);
+	assert(n >= 1);
+	assert(n == 1 || (flags & SQLITE_SHM_EXCLUSIVE) != 0);
+
+	/* Legal values for the flags.
+	 *
+	 * See https://sqlite.org/c3ref/c_shm_exclusive.html. */
+	assert(flags == (SQLITE_SHM_LOCK | SQLITE_SHM_SHARED) ||
+	       flags == (SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE) ||
+	       flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED) ||
+	       flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE));
+
+	/* This is a no-op since shared-memory locking is relevant only for
+	 * inter-process concurrency. See also the unix-excl branch from
+	 * upstream (git commit cda6b3249167a54a0cf892f949d52760ee557129). */
+
+	f = (struct vfsFile *)file;
+
+	assert(f->content != NULL);
+
+	shm = &f->content->database.shm;
+	if (flags & SQLITE_SHM_UNLOCK) {
+		rv = vfsShmUnlock(shm, ofst, n, flags);
+	} else {
+		rv = vfsShmLock(shm, ofst, n, flags);
+	}
+
+	return rv;
+}
+
+static void vfsFileShmBarrier(sqlite3_file *file)
+{
+	(void)file;
+	/* This is a no-op since we expect SQLite to be compiled with mutex
+	 * support (i.e. SQLITE_MUTEX_OMIT or SQLITE_MUTEX_NOOP are *not*
+	 * defined, see sqliteInt.h). */
+}
+
+static int vfsFileShmUnmap(sqlite3_file *file, int delete_flag)
+{
+	(void)file;
+	(void)delete_flag;
+	return SQLITE_OK;
+}
+
+static const sqlite3_io_methods vfsFileMethods = {
+    3,                             // iVersion
+    vfsFileClose,                  // xClose
+    vfsFileRead,                   // xRead
+    vfsFileWrite,                  // xWrite
+    vfsFileTruncate,               // xTruncate
+    vfsFileSync,                   // xSync
+    vfsFileSize,                   // xFileSize
+    vfsFileLock,                   // xLock
+    vfsFileUnlock,                 // xUnlock
+    vfsFileCheckReservedLock,      // xCheckReservedLock
+    vfsFileControl,                // xFileControl
+    vfsFileSectorSize,             // xSectorSize
+    vfsFileDeviceCharacteristics,  // xDeviceCharacteristics
+    vfsFileShmMap,                 // xShmMap
+    vfsFileShmLock,                // xShmLock
+    vfsFileShmBarrier,             // xShmBarrier
+    vfsFileShmUnmap,               // xShmUnmap
+    vfsFileFetch,                  // xFetch
+    vfsFileUnfetch,                // xUnfetch
+};
+
+/* Release the memory used by the content of a temporary file kept in memory,
+ * starting from the chunk with the given index. */
+static void vfsTempRelease(struct vfsFile *f, unsigned first)
+{
+	struct vfsTemp *t = &f->mem;
+	unsigned i;
+
+	for (i = first; i < t->n_chunks; i++) {
+		if (t->chunks[i] != NULL) {
+			__atomic_sub_fetch(&f->vfs->temp_used,
+					   (size_t)sqlite3_msize(t->chunks[i]),
+					   __ATOMIC_RELAXED);
+			sqlite3_free(t->chunks[i]);
+			t->chunks[i] = NULL;
+		}
+	}
+	if (first == 0) {
+		sqlite3_free(t->chunks);
+		t->chunks = NULL;
+		t->n_chunks = 0;
+	}
+}
+
+/* Move the content of a temporary file kept in memory to an actual temporary
+ * file of the unix VFS, which serves all further requests. */
+static int vfsTempOverflow(struct vfsFile *f)
+{
+	struct vfsTemp *t = &f->mem;
+	sqlite3_vfs *vfs;
+	sqlite3_file *temp;
+	sqlite3_int64 offset;
+	int flags = f->flags;
+	int rc;
+
+	vfs = sqlite3_vfs_find("unix");
+	assert(vfs != NULL);
+
+	temp = sqlite3_malloc(vfs->szOsFile);
+	if (temp == NULL) {
+		return SQLITE_NOMEM;
+	}
+	rc = vfs->xOpen(vfs, NULL, temp, flags, &flags);
+	if (rc != SQLITE_OK) {
+		sqlite3_free(temp);
+		return rc;
+	}
+
+	for (offset = 0; offset < t->size; offset += VFS__TEMP_CHUNK_SIZE) {
+		unsigned i = (unsigned)(offset / VFS__TEMP_CHUNK_SIZE);
+		sqlite3_int64 n = t->size - offset;
+		if (i >= t->n_chunks || t->chunks[i] == NULL) {
+			continue;
+		}
+		if (n > VFS__TEMP_CHUNK_SIZE) {
+			n = VFS__TEMP_CHUNK_SIZE;
+		}
+		rc = temp->pMethods->xWrite(temp, t->chunks[i], (int)n,
+					    offset);
+		if (rc != SQLITE_OK) {
+			goto err;
+		}
+	}
+	if (t->size > 0) {
+		rc = temp->pMethods->xTruncate(temp, t->size);
+		if (rc != SQLITE_OK) {
+			goto err;
+		}
+	}
+
+	vfsTempRelease(f, 0);
+	t->size = 0;
+	f->temp = temp;
+
+	return SQLITE_OK;
+
+err:
+	temp->pMethods->xClose(temp);
+	sqlite3_free(temp);
+	return rc;
+}
+
+static int vfsTempClose(sqlite3_file *file)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	int rc = SQLITE_OK;
+
+	if (f->temp != NULL) {
+		/* Close the actual temporary file. */
+		rc = f->temp->pMethods->xClose(f->temp);
+		sqlite3_free(f->temp);
+		return rc;
+	}
+
+	vfsTempRelease(f, 0);
+
+	return rc;
+}
+
+static int vfsTempRead(sqlite3_file *file,
+		       void *buf,
+		       int amount,
+		       sqlite_int64 offset)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfsTemp *t = &f->mem;
+	uint8_t *cursor = buf;
+	sqlite3_int64 end = offset + amount;
+	int rc = SQLITE_OK;
+
+	if (f->temp != NULL) {
+		/* Read from the actual temporary file. */
+		return f->temp->pMethods->xRead(f->temp, buf, amount, offset);
+	}
+
+	/* Short reads must fill the rest of the buffer with zeros. */
+	if (end > t->size) {
+		sqlite3_int64 tail = end - (offset > t->size ? offset : t->size);
+		memset(cursor + (amount - tail), 0, (size_t)tail);
+		end -= tail;
+		rc = SQLITE_IOERR_SHORT_READ;
+	}
+
+	while (offset < end) {
+		unsigned i = (unsigned)(offset / VFS__TEMP_CHUNK_SIZE);
+		size_t start = (size_t)(offset % VFS__TEMP_CHUNK_SIZE);
+		size_t n = VFS__TEMP_CHUNK_SIZE - start;
+		if ((sqlite3_int64)n > end - offset) {
+			n = (size_t)(end - offset);
+		}
+		if (i < t->n_chunks && t->chunks[i] != NULL) {
+			memcpy(cursor, t->chunks[i] + start, n);
+		} else {
+			memset(cursor, 0, n);
+		}
+		cursor += n;
+		offset += (sqlite3_int64)n;
+	}
+
+	return rc;
+}
+
+static int vfsTempWrite(sqlite3_file *file,
+			const void *buf,
+			int amount,
+			sqlite_int64 offset)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfsTemp *t = &f->mem;
+	const uint8_t *cursor = buf;
+	sqlite3_int64 end = offset + amount;
+	unsigned n_chunks =
+	    (unsigned)((end + VFS__TEMP_CHUNK_SIZE - 1) / VFS__TEMP_CHUNK_SIZE);
+	unsigned i;
+	size_t size = 0;
+	int rc;
+
+	if (f->temp != NULL) {
+		/* Write to the actual temporary file. */
+		return f->temp->pMethods->xWrite(f->temp, buf, amount, offset);
+	}
+
+	/* Count the memory needed by new chunks, and move the file to disk if
+	 * that's over the limit. */
+	for (i = (unsigned)(offset / VFS__TEMP_CHUNK_SIZE); i < n_chunks; i++) {
+		if (i >= t->n_chunks || t->chunks[i] == NULL) {
+			size += VFS__TEMP_CHUNK_SIZE;
+		}
+	}
+	if (size > 0 && __atomic_add_fetch(&f->vfs->temp_used, size,
+					   __ATOMIC_RELAXED) >
+			    __atomic_load_n(&f->vfs->temp_limit,
+					    __ATOMIC_RELAXED)) {
+		__atomic_sub_fetch(&f->vfs->temp_used, size, __ATOMIC_RELAXED);
+		rc = vfsTempOverflow(f);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+		return f->temp->pMethods->xWrite(f->temp, buf, amount, offset);
+	}
+	__atomic_sub_fetch(&f->vfs->temp_used, size, __ATOMIC_RELAXED);
+
+	if (n_chunks > t->n_chunks) {
+		uint8_t **chunks;
+		chunks = sqlite3_realloc64(t->chunks, sizeof *chunks * n_chunks);
+		if (chunks == NULL) {
+			return SQLITE_NOMEM;
+		}
+		memset(chunks + t->n_chunks, 0,
+		       sizeof *chunks * (n_chunks - t->n_chunks));
+		t->chunks = chunks;
+		t->n_chunks = n_chunks;
+	}
+
+	while (offset < end) {
+		uint8_t **chunk = &t->chunks[offset / VFS__TEMP_CHUNK_SIZE];
+		size_t start = (size_t)(offset % VFS__TEMP_CHUNK_SIZE);
+		size_t n = VFS__TEMP_CHUNK_SIZE - start;
+		if ((sqlite3_int64)n > end - offset) {
+			n = (size_t)(end - offset);
+		}
+		if (*chunk == NULL) {
+			*chunk = sqlite3_malloc(VFS__TEMP_CHUNK_SIZE);
+			if (*chunk == NULL) {
+				return SQLITE_NOMEM;
+			}
+			memset(*chunk, 0, VFS__TEMP_CHUNK_SIZE);
+			__atomic_add_fetch(&f->vfs->temp_used,
+					   (size_t)sqlite3_msize(*chunk),
+					   __ATOMIC_RELAXED);
+		}
+		memcpy(*chunk + start, cursor, n);
+		cursor += n;
+		offset += (sqlite3_int64)n;
+	}
+
+	if (end > t->size) {
+		t->size = end;
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsTempTruncate(sqlite3_file *file, sqlite_int64 size)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfsTemp *t = &f->mem;
+	unsigned i = (unsigned)(size / VFS__TEMP_CHUNK_SIZE);
+
+	if (f->temp != NULL) {
+		return f->temp->pMethods->xTruncate(f->temp, size);
+	}
+
+	if (size >= t->size) {
+		t->size = size;
+		return SQLITE_OK;
+	}
+
+	/* Zero the truncated part of the last chunk, so it reads as zeros if
+	 * the file grows again, and release the chunks after it. */
+	if (i < t->n_chunks && t->chunks[i] != NULL) {
+		size_t start = (size_t)(size % VFS__TEMP_CHUNK_SIZE);
+		memset(t->chunks[i] + start, 0, VFS__TEMP_CHUNK_SIZE - start);
+	}
+	vfsTempRelease(f, size % VFS__TEMP_CHUNK_SIZE == 0 ? i : i + 1);
+	t->size = size;
+
+	return SQLITE_OK;
+}
+
+static int vfsTempSync(sqlite3_file *file, int flags)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+
+	if (f->temp != NULL) {
+		return f->temp->pMethods->xSync(f->temp, flags);
+	}
+
+	return SQLITE_OK;
+}
+
+static int vfsTempFileSize(sqlite3_file *file, sqlite_int64 *size)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+
+	if (f->temp != NULL) {
+		return f->temp->pMethods->xFileSize(f->temp, size);
+	}
+
+	*size = f->mem.size;
+
+	return SQLITE_OK;
+}
+
+static int vfsTempFileControl(sqlite3_file *file, int op, void *arg)
+{
+	struct vfsFile *f = (struct vfsFile *)file;
+
+	if (f->temp != NULL) {
+		return f->temp->pMethods->xFileControl(f->temp, op, arg);
+	}
+
+	return SQLITE_NOTFOUND;
+}
+
+/* Temporary files, such as sorter files, temporary databases and statement
+ * journals, are kept in memory until the temporary files of the VFS use more
+ * than its limit, see VfsSetTempLimit(). */
+static const sqlite3_io_methods vfsTempMethods = {
+    1,                             // iVersion
+    vfsTempClose,                  // xClose
+    vfsTempRead,                   // xRead
+    vfsTempWrite,                  // xWrite
+    vfsTempTruncate,               // xTruncate
+    vfsTempSync,                   // xSync
+    vfsTempFileSize,               // xFileSize
+    vfsFileLock,                   // xLock
+    vfsFileUnlock,                 // xUnlock
+    vfsFileCheckReservedLock,      // xCheckReservedLock
+    vfsTempFileControl,            // xFileControl
+    vfsFileSectorSize,             // xSectorSize
+    vfsFileDeviceCharacteristics,  // xDeviceCharacteristics
+    NULL,                          // xShmMap
+    NULL,                          // xShmLock
+    NULL,                          // xShmBarrier
+    NULL,                          // xShmUnmap
+    NULL,                          // xFetch
+    NULL,                          // xUnfetch
+};
+
+static int vfsOpen(sqlite3_vfs *vfs,
+		   const char *filename,
+		   sqlite3_file *file,
+		   int flags,
+		   int *out_flags)
+{
+	struct vfs *v;
+	struct vfsFile *f;
+	struct vfsContent *content;
+	enum vfsContentType type;
+	bool exists;
+	int exclusive = flags & SQLITE_OPEN_EXCLUSIVE;
+	int create = flags & SQLITE_OPEN_CREATE;
+	int rc;
+
+	(void)out_flags;
+
+	assert(vfs != NULL);
+	assert(vfs->pAppData != NULL);
+	assert(file != NULL);
+
+	/* From sqlite3.h.in:
+	 *
+	 *   The SQLITE_OPEN_EXCLUSIVE flag is always used in conjunction with
+	 *   the SQLITE_OPEN_CREATE flag, which are both directly analogous to
+	 *   the O_EXCL and O_CREAT flags of the POSIX open() API.  The
+	 *   SQLITE_OPEN_EXCLUSIVE flag, when paired with the
+	 *   SQLITE_OPEN_CREATE, is used to indicate that file should always be
+	 *   created, and that it is an error if it already exists.  It is not
+	 *   used to indicate the file should be opened for exclusive access.
+	 */
+	assert(!exclusive || create);
+
+	v = (struct vfs *)(vfs->pAppData);
+	f = (struct vfsFile *)file;
+
+	/* This tells SQLite to not call Close() in case we return an error. */
+	f->base.pMethods = 0;
+	f->temp = NULL;
+	memset(&f->mem, 0, sizeof f->mem);
+	f->mmap_size = 0;
+
+	/* Save the flags */
+	f->flags = flags;
+
+	/* From SQLite documentation:
+	 *
+	 * If the zFilename parameter to xOpen is a NULL pointer then xOpen
+	 * must invent its own temporary name for the file. Whenever the
+	 * xFilename parameter is NULL it will also be the case that the
+	 * flags parameter will include SQLITE_OPEN_DELETEONCLOSE.
+	 */
+	if (filename == NULL) {
+		assert(flags & SQLITE_OPEN_DELETEONCLOSE);
+
+		f->vfs = v;
+		f->content = NULL;
+
+		/* Open an actual temporary file right away if temporary files
+		 * can't use any memory. */
+		if (__atomic_load_n(&v->temp_limit, __ATOMIC_RELAXED) == 0) {
+			rc = vfsTempOverflow(f);
+			if (rc != SQLITE_OK) {
+				v->error = ENOENT;
+				return SQLITE_CANTOPEN;
+			}
+		}
+
+		if (out_flags != NULL) {
+			*out_flags = flags;
+		}
+		f->base.pMethods = &vfsTempMethods;
+
+		return SQLITE_OK;
+	}
+
+	vfsWriteLock(v);
+
+	/* Search if the file exists already. */
+	content = vfsContentLookup(v, filename);
+	exists = content != NULL;
+
+	/* If file exists, and the exclusive flag is on, return an error. */
+	if (exists && exclusive && create) {
+		v->error = EEXIST;
+		rc = SQLITE_CANTOPEN;
+		goto err;
+	}
+
+	if (!exists) {
+		struct vfsContent **contents;
+		unsigned n = v->n_contents + 1;
+
+		/* Check the create flag. */
+		if (!create) {
+			v->error = ENOENT;
+			rc = SQLITE_CANTOPEN;
+			goto err;
+		}
+
+		if (flags & SQLITE_OPEN_MAIN_DB) {
+			type = VFS__DATABASE;
+		} else if (flags & SQLITE_OPEN_MAIN_JOURNAL) {
+			type = VFS__JOURNAL;
+		} else if (flags & SQLITE_OPEN_WAL) {
+			type = VFS__WAL;
+		} else {
+			v->error = ENOENT;
+			rc = SQLITE_CANTOPEN;
+			goto err;
+		}
+
+		/* Create a new entry. */
+		contents = sqlite3_realloc64(v->contents, sizeof *contents * n);
+		if (contents == NULL) {
+			v->error = ENOMEM;
+			rc = SQLITE_CANTOPEN;
+			goto err;
+		}
+		v->contents = contents;
+
+		rc = vfsIndexReserve(&v->index);
+		if (rc != SQLITE_OK) {
+			v->error = ENOMEM;
+			rc = SQLITE_CANTOPEN;
+			goto err;
+		}
+
+		content = vfsContentCreate(filename, type, v->version);
+		if (content == NULL) {
+			v->error = ENOMEM;
+			rc = SQLITE_NOMEM;
+			goto err;
+		}
+
+		if (type == VFS__WAL) {
+			struct vfsDatabase *database;
+			/* An associated database file must have been
+			 * opened. */
+			database = vfsDatabaseLookup(v, filename);
+			if (database == NULL) {
+				rc = SQLITE_CANTOPEN;
+				goto err_after_content_create;
+			}
+			content->wal.pool = &v->pool;
+			content->wal.database = database;
+			vfsDatabaseLock(v, database);
+			database->wal = &content->wal;
+			database->usage.overhead += vfsContentSize(content);
+			vfsDatabaseUnlock(v, database);
+		}
+
+		if (type == VFS__DATABASE) {
+			content->database.pool = &v->pool;
+			content->database.usage.overhead =
+			    vfsContentSize(content);
+			content->database.quota = v->quota;
+			content->database.spill = v->spill;
+			content->database.compress_age = v->compress_age;
+			content->database.huge = v->huge;
+		}
+
+		content->i = n - 1;
+		v->contents[n - 1] = content;
+		v->n_contents = n;
+		vfsIndexPlace(&v->index, content);
+	}
+
+	// Populate the new file handle.
+	f->base.pMethods = &vfsFileMethods;
+	f->vfs = v;
+	f->content = content;
+
+	vfsRef(&content->refcount);
+
+	vfsUnlock(v);
+
+	return SQLITE_OK;
+
+err_after_content_create:
+	vfsContentDestroy(content);
+err:
+	vfsUnlock(v);
+	assert(rc != SQLITE_OK);
+	return rc;
+}
+
+static int vfsDelete(sqlite3_vfs *vfs, const char *filename, int dir_sync)
+{
+	struct vfs *v;
+	int rv;
+
+	(void)dir_sync;
+
+	assert(vfs != NULL);
+	assert(vfs->pAppData != NULL);
+
+	v = (struct vfs *)(vfs->pAppData);
+
+	vfsWriteLock(v);
+	rv = vfsDeleteContent(v, filename);
+	vfsUnlock(v);
+
+	return rv;
+}
+
+static int vfsAccess(sqlite3_vfs *vfs,
+		     const char *filename,
+		     int flags,
+		     int *result)
+{
+	struct vfs *v;
+	struct vfsContent *content;
+
+	(void)flags;
+
+	assert(vfs != NULL);
+	assert(vfs->pAppData != NULL);
+
+	v = (struct vfs *)(vfs->pAppData);
+
+	/* If the file exists, access is always granted. */
+	vfsReadLock(v);
+	content = vfsContentLookup(v, filename);
+	if (content == NULL) {
+		*result = 0;
+	} else {
+		*result = 1;
+	}
+	vfsUnlock(v);
+
+	return SQLITE_OK;
+}
+
+static int vfsFullPathname(sqlite3_vfs *vfs,
+			   const char *filename,
+			   int pathname_len,
+			   char *pathname)
+{
+	(void)vfs;
+
+	// Just return the path unchanged.
+	sqlite3_snprintf(pathname_len, pathname, "%s", filename);
+	return SQLITE_OK;
+}
+
+static void *vfsDlOpen(sqlite3_vfs *vfs, const char *filename)
+{
+	(void)vfs;
+	(void)filename;
+
+	return 0;
+}
+
+static void vfsDlError(sqlite3_vfs *vfs, int nByte, char *zErrMsg)
+{
+	(void)vfs;
+
+	sqlite3_snprintf(nByte, zErrMsg,
+			 "Loadable extensions are not supported");
+	zErrMsg[nByte - 1] = '\0';
+}
+
+static void (*vfsDlSym(sqlite3_vfs *vfs, void *pH, const char *z))(void)
+{
+	(void)vfs;
+	(void)pH;
+	(void)z;
+
+	return 0;
+}
+
+static void vfsDlClose(sqlite3_vfs *vfs, void *pHandle)
+{
+	(void)vfs;
+	(void)pHandle;
+
+	return;
+}
+
+static int vfsRandomness(sqlite3_vfs *vfs, int nByte, char *zByte)
+{
+	(void)vfs;
+	(void)nByte;
+	(void)zByte;
+
+	/* TODO (is this needed?) */
+	return SQLITE_OK;
+}
+
+static int vfsSleep(sqlite3_vfs *vfs, int microseconds)
+{
+	struct vfs *v = vfs->pAppData;
+
+	/* Connections running on other threads might be holding the locks that
+	 * the busy handler is waiting for, so give them a chance to run. */
+	if (v->threadsafe) {
+		usleep((useconds_t)microseconds);
+	}
+
+	return microseconds;
+}
+
+static int vfsCurrentTimeInt64(sqlite3_vfs *vfs, sqlite3_int64 *piNow)
+{
+	static const sqlite3_int64 unixEpoch =
+	    24405875 * (sqlite3_int64)8640000;
+	struct timeval now;
+
+	(void)vfs;
+
+	gettimeofday(&now, 0);
+	*piNow =
+	    unixEpoch + 1000 * (sqlite3_int64)now.tv_sec + now.tv_usec / 1000;
+	return SQLITE_OK;
+}
+
+static int vfsCurrentTime(sqlite3_vfs *vfs, double *piNow)
+{
+	// TODO: check if it's always safe to cast a double* to a
+	// sqlite3_int64*.
+	return vfsCurrentTimeInt64(vfs, (sqlite3_int64 *)piNow);
+}
+
+static int vfsGetLastError(sqlite3_vfs *vfs, int x, char *y)
+{
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	int rc;
+
+	(void)vfs;
+	(void)x;
+	(void)y;
+
+	rc = v->error;
+
+	return rc;
+}
+
+static int vfsInit(struct sqlite3_vfs *vfs, const char *name, int version)
+{
+	vfs->iVersion = 2;
+	vfs->szOsFile = sizeof(struct vfsFile);
+	vfs->mxPathname = VFS__MAX_PATHNAME;
+	vfs->pNext = NULL;
+
+	vfs->pAppData = vfsCreate(version);
+	if (vfs->pAppData == NULL) {
+		return DQLITE_NOMEM;
+	}
+
+	formatWalChecksumInit();
+
+	vfs->xOpen = vfsOpen;
+	vfs->xDelete = vfsDelete;
+	vfs->xAccess = vfsAccess;
+	vfs->xFullPathname = vfsFullPathname;
+	vfs->xDlOpen = vfsDlOpen;
+	vfs->xDlError = vfsDlError;
+	vfs->xDlSym = vfsDlSym;
+	vfs->xDlClose = vfsDlClose;
+	vfs->xRandomness = vfsRandomness;
+	vfs->xSleep = vfsSleep;
+	vfs->xCurrentTime = vfsCurrentTime;
+	vfs->xGetLastError = vfsGetLastError;
+	vfs->xCurrentTimeInt64 = vfsCurrentTimeInt64;
+	vfs->zName = name;
+
+	return 0;
+}
+
+int VfsInitV1(struct sqlite3_vfs *vfs, const char *name)
+{
+	int rv;
+
+	rv = vfsInit(vfs, name, VFS__V1);
+	if (rv != 0) {
+		return rv;
+	}
+
+	sqlite3_vfs_register(vfs, 0);
+
+	return 0;
+}
+
+int VfsInitV2(struct sqlite3_vfs *vfs, const char *name)
+{
+	return vfsInit(vfs, name, VFS__V2);
+}
+
+void VfsEnableThreadSafety(struct sqlite3_vfs *vfs)
+{
+	struct vfs *v = vfs->pAppData;
+	v->threadsafe = true;
+	v->pool.threadsafe = true;
+	if (v->spill != NULL) {
+		v->spill->threadsafe = true;
+	}
+}
+
+void VfsClose(struct sqlite3_vfs *vfs)
+{
+	struct vfs *v = vfs->pAppData;
+	if (v->version == VFS__V1) {
+		sqlite3_vfs_unregister(vfs);
+	}
+	vfsDestroy(v);
+	sqlite3_free(v);
+}
+
+static int vfsWalPoll(struct vfsWal *w, dqlite_vfs_frame **frames, unsigned *n)
+{
+	unsigned i;
+
+	if (w->n_tx == 0) {
+		assert(w->tx == NULL);
+		*frames = NULL;
+		*n = 0;
+		return 0;
+	}
+
+	*frames = sqlite3_malloc64(sizeof **frames * w->n_tx);
+	if (*frames == NULL) {
+		return DQLITE_NOMEM;
+	}
+
+	/* Callers release the pages with sqlite3_free(), so they get copies,
+	 * while the frames go back to the pool. */
+	for (i = 0; i < w->n_tx; i++) {
+		dqlite_vfs_frame *frame = &(*frames)[i];
+		frame->data = sqlite3_malloc64(w->database->page_size);
+		if (frame->data == NULL) {
+			goto err_after_frames_alloc;
+		}
+		memcpy(frame->data, w->tx[i]->buf, w->database->page_size);
+		formatWalGetFramePageNumber(w->tx[i]->hdr, &frame->page_number);
+	}
+	*n = w->n_tx;
+
+	/* The frames are going away. */
+	w->read_buf = NULL;
+
+	for (i = 0; i < w->n_tx; i++) {
+		vfsFrameUnhold(w->database, w->tx[i], VFS__FRAME_WAL);
+		vfsFrameDestroy(w->pool, w->tx[i]);
+	}
+
+	w->n_tx = 0;
+
+	return 0;
+
+err_after_frames_alloc:
+	while (i > 0) {
+		i--;
+		sqlite3_free((*frames)[i].data);
+	}
+	sqlite3_free(*frames);
+	*frames = NULL;
+	return DQLITE_NOMEM;
 }
 
-static int vfsFileSync(sqlite3_file *file, int flags)
+/* Size of the header of a batch of frames, see VfsPollBatch(). */
+#define VFS__BATCH_HDR_SIZE 8
+
+/* Like vfsWalPoll(), but copy the frames into a single batch buffer, and
+ * release them. */
+static int vfsWalPollBatch(struct vfsWal *w, void **buf, size_t *len)
 {
-	(void)file;
-	(void)flags;
+	unsigned page_size = w->database->page_size;
+	uint8_t *cursor;
+	uint8_t *pages;
+	uint32_t n;
+	uint16_t size;
+	uint16_t unused = 0;
+	unsigned i;
+
+	if (w->n_tx == 0) {
+		assert(w->tx == NULL);
+		*buf = NULL;
+		*len = 0;
+		return 0;
+	}
+
+	*len = VFS__BATCH_HDR_SIZE +
+	       (size_t)w->n_tx * (sizeof(uint64_t) + page_size);
+	*buf = sqlite3_malloc64(*len);
+	if (*buf == NULL) {
+		return DQLITE_NOMEM;
+	}
+
+	/* The page size 65536 doesn't fit, so it's stored as 1 like in the
+	 * database header. */
+	n = byte__flip32(w->n_tx);
+	size = byte__flip16((uint16_t)(page_size == 65536 ? 1 : page_size));
+	cursor = *buf;
+	memcpy(cursor, &n, sizeof n);
+	memcpy(cursor + 4, &size, sizeof size);
+	memcpy(cursor + 6, &unused, sizeof unused);
+	cursor += VFS__BATCH_HDR_SIZE;
+	pages = cursor + sizeof(uint64_t) * w->n_tx;
+
+	/* The frames are going away. */
+	w->read_buf = NULL;
+
+	for (i = 0; i < w->n_tx; i++) {
+		struct vfsFrame *frame = w->tx[i];
+		unsigned page_number;
+		uint64_t pgno;
+		formatWalGetFramePageNumber(frame->hdr, &page_number);
+		pgno = byte__flip64(page_number);
+		memcpy(cursor + sizeof pgno * i, &pgno, sizeof pgno);
+		memcpy(pages + (size_t)i * page_size, frame->buf, page_size);
+		vfsFrameUnhold(w->database, frame, VFS__FRAME_WAL);
+		vfsFrameDestroy(w->pool, frame);
+	}
+
+	w->n_tx = 0;
+
+	return 0;
+}
+
+/* Poll the WAL of the given database, returning its frames either as an array
+ * in @frames, or as a single batch in @buf. */
+static int vfsPoll(sqlite3_vfs *vfs,
+		   const char *filename,
+		   dqlite_vfs_frame **frames,
+		   unsigned *n,
+		   void **buf,
+		   size_t *len)
+{
+	struct vfs *v;
+	struct vfsContent *content;
+	struct vfsShm *shm;
+	struct vfsWal *wal;
+	int rv;
+
+	v = (struct vfs *)(vfs->pAppData);
+	vfsReadLock(v);
+	content = vfsContentLookup(v, filename);
+
+	if (content == NULL || content->type != VFS__DATABASE) {
+		rv = DQLITE_ERROR;
+		goto out;
+	}
+
+	vfsDatabaseLock(v, &content->database);
+
+	shm = &content->database.shm;
+	wal = content->database.wal;
+
+	if (wal == NULL) {
+		if (frames != NULL) {
+			*frames = NULL;
+			*n = 0;
+		} else {
+			*buf = NULL;
+			*len = 0;
+		}
+		rv = 0;
+		goto out_after_database_lock;
+	}
+
+	rv = vfsShmLock(shm, 0, 1, SQLITE_SHM_EXCLUSIVE);
+	if (rv != 0) {
+		goto out_after_database_lock;
+	}
+
+	if (frames != NULL) {
+		rv = vfsWalPoll(wal, frames, n);
+	} else {
+		rv = vfsWalPollBatch(wal, buf, len);
+	}
+
+out_after_database_lock:
+	vfsDatabaseUnlock(v, &content->database);
+out:
+	vfsUnlock(v);
+	return rv;
+}
+
+int VfsPoll(sqlite3_vfs *vfs,
+	    const char *filename,
+	    dqlite_vfs_frame **frames,
+	    unsigned *n)
+{
+	return vfsPoll(vfs, filename, frames, n, NULL, NULL);
+}
+
+int VfsPollBatch(sqlite3_vfs *vfs,
+		 const char *filename,
+		 void **buf,
+		 size_t *len)
+{
+	return vfsPoll(vfs, filename, NULL, NULL, buf, len);
+}
+
+/* Append @n frames to the WAL, with the content of their pages stored
+ * contiguously in @data.
+ *
+ * If @owner is NULL the pages are copied into newly created frames, otherwise
+ * the frames point directly into @data, using the frame objects pre-allocated
+ * in @owner. */
+static int vfsWalCommit(struct vfsWal *w,
+			unsigned n,
+			unsigned *page_numbers,
+			void *data,
+			struct vfsBuffer *owner)
+{
+	struct vfsFrame **frames; /* New frames array. */
+	struct vfsShm *shm;
+	unsigned page_size = w->database->page_size;
+	unsigned i;
+	unsigned j;
+	size_t size;
+	unsigned salt1;
+	unsigned salt2;
+
+	formatWalGetSalt(w->hdr, &salt1, &salt2);
+
+	size = (size_t)sqlite3_msize(w->frames);
+	frames =
+	    sqlite3_realloc64(w->frames, sizeof *frames * (w->n_frames + n));
+	if (frames == NULL) {
+		goto oom;
+	}
+	w->frames = frames;
+	w->database->usage.overhead += (size_t)sqlite3_msize(frames) - size;
+
+	for (i = 0; i < n; i++) {
+		struct vfsFrame *frame;
+		unsigned database_size;
+		void *page = (uint8_t *)data + (size_t)i * page_size;
+
+		if (owner != NULL) {
+			frame = &owner->frames[i];
+			frame->buf = page;
+			frame->refcount = 1;
+			frame->holders = 0;
+			frame->next = NULL;
+			frame->owner = owner;
+		} else {
+			frame = vfsFrameCreate(w->pool, page_size);
+			if (frame == NULL) {
+				goto oom_after_frames_alloc;
+			}
+		}
+
+		/* For commit records, the size of the database file in pages
+		 * after the commit. For all other records, zero. */
+		database_size = i == n - 1 ? page_numbers[i] : 0;
+
+		/* The checksums are left out, see vfsWalChecksum(). */
+		formatWalPutFrameHeader(page_numbers[i], database_size, salt1,
+					salt2, frame->hdr);
+		if (owner == NULL) {
+			memcpy(frame->buf, page, page_size);
+		}
+
+		vfsFrameHold(w->database, frame, VFS__FRAME_WAL);
+		frames[w->n_frames + i] = frame;
+	}
+
+	w->n_frames += n;
+
+	/* A write lock is held it means that this is the VFS that orginated
+	 * this commit. Let's release the lock and update the WAL index. */
+	shm = &w->database->shm;
+	if (vfsShmIsExclusive(shm, 0)) {
+		vfsShmUnlock(shm, 0, 1, SQLITE_SHM_EXCLUSIVE);
+		vfsWalReverIndexHeader(w);
+	}
+
+	return 0;
+
+oom_after_frames_alloc:
+	for (j = 0; j < i; j++) {
+		vfsFrameUnhold(w->database, frames[w->n_frames + j],
+			       VFS__FRAME_WAL);
+		vfsFrameDestroy(w->pool, frames[w->n_frames + j]);
+	}
+oom:
+	return DQLITE_NOMEM;
+}
+
+/* Append the given frames to the WAL of a database, copying their pages or, if
+ * @release is set, adopting the buffer holding them. If @page_size is not
+ * zero, it must match the page size of the database. Fails with DQLITE_ERROR
+ * if there's no such database or if its WAL is not open. */
+static int vfsCommit(sqlite3_vfs *vfs,
+		     const char *filename,
+		     unsigned n,
+		     unsigned *page_numbers,
+		     void *frames,
+		     unsigned page_size,
+		     void (*release)(void *arg),
+		     void *arg)
+{
+	struct vfs *v;
+	struct vfsContent *content;
+	struct vfsWal *wal;
+	struct vfsBuffer *owner = NULL;
+	int rv;
+
+	assert(n > 0);
+
+	if (release != NULL) {
+		owner = sqlite3_malloc64(sizeof *owner +
+					 sizeof *owner->frames * n);
+		if (owner == NULL) {
+			return DQLITE_NOMEM;
+		}
+		owner->refcount = n;
+		owner->release = release;
+		owner->arg = arg;
+	}
+
+	v = (struct vfs *)(vfs->pAppData);
+	vfsReadLock(v);
+	content = vfsContentLookup(v, filename);
+
+	if (content == NULL || content->type != VFS__DATABASE) {
+		rv = DQLITE_ERROR;
+		goto out;
+	}
+
+	vfsDatabaseLock(v, &content->database);
+	wal = content->database.wal;
+	if (wal == NULL) {
+		rv = DQLITE_ERROR;
+	} else if (page_size != 0 &&
+		   page_size != content->database.page_size) {
+		rv = DQLITE_MISUSE;
+	} else {
+		rv = vfsWalCommit(wal, n, page_numbers, frames, owner);
+	}
+	vfsDatabaseUnlock(v, &content->database);
+
+out:
+	vfsUnlock(v);
+
+	if (rv != 0) {
+		/* No frame was added, so ownership stays with the caller. */
+		sqlite3_free(owner);
+		return rv;
+	}
+
+	return 0;
+}
+
+int VfsCommit(sqlite3_vfs *vfs,
+	      const char *filename,
+	      unsigned n,
+	      unsigned *page_numbers,
+	      void *frames)
+{
+	return vfsCommit(vfs, filename, n, page_numbers, frames, 0, NULL,
+			 NULL);
+}
+
+int VfsCommitAdopt(sqlite3_vfs *vfs,
+		   const char *filename,
+		   unsigned n,
+		   unsigned *page_numbers,
+		   void *frames,
+		   void (*release)(void *arg),
+		   void *arg)
+{
+	assert(release != NULL);
+	return vfsCommit(vfs, filename, n, page_numbers, frames, 0, release,
+			 arg);
+}
+
+int VfsCommitBatch(sqlite3_vfs *vfs,
+		   const char *filename,
+		   void *buf,
+		   size_t len,
+		   void (*release)(void *arg),
+		   void *arg)
+{
+	const uint8_t *cursor = buf;
+	unsigned *page_numbers;
+	unsigned page_size;
+	uint32_t n;
+	uint16_t size;
+	unsigned i;
+	int rv;
+
+	if (len < VFS__BATCH_HDR_SIZE) {
+		return DQLITE_MISUSE;
+	}
+	memcpy(&n, cursor, sizeof n);
+	memcpy(&size, cursor + 4, sizeof size);
+	n = byte__flip32(n);
+	size = byte__flip16(size);
+	page_size = size == 1 ? FORMAT__PAGE_SIZE_MAX : size;
+	cursor += VFS__BATCH_HDR_SIZE;
+
+	/* The page size is checked against the one of the database later, but
+	 * it must be valid for the size check below to mean anything. */
+	if (page_size < FORMAT__PAGE_SIZE_MIN ||
+	    (page_size & (page_size - 1)) != 0) {
+		return DQLITE_MISUSE;
+	}
+	if (n == 0 || (uint64_t)len != VFS__BATCH_HDR_SIZE +
+					   (uint64_t)n *
+					       (sizeof(uint64_t) + page_size)) {
+		return DQLITE_MISUSE;
+	}
+
+	page_numbers = sqlite3_malloc64(sizeof *page_numbers * n);
+	if (page_numbers == NULL) {
+		return DQLITE_NOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		uint64_t pgno;
+		memcpy(&pgno, cursor + sizeof pgno * i, sizeof pgno);
+		pgno = byte__flip64(pgno);
+		if (pgno == 0 || pgno > UINT32_MAX) {
+			rv = DQLITE_MISUSE;
+			goto out;
+		}
+		page_numbers[i] = (unsigned)pgno;
+	}
+
+	rv = vfsCommit(vfs, filename, n, page_numbers,
+		       (uint8_t *)buf + VFS__BATCH_HDR_SIZE +
+			   sizeof(uint64_t) * n,
+		       page_size, release, arg);
+
+out:
+	sqlite3_free(page_numbers);
+	return rv;
+}
+
+/* Check if the given filename is a WAL filename. */
+static bool vfsIsWalFilename(const char *filename)
+{
+	/* TODO: improve the check. */
+	if (strstr(filename, "-wal") != NULL) {
+		return true;
+	}
+
+	return false;
+}
+
+void VfsFramePoolStats(sqlite3_vfs *vfs,
+			unsigned long long *hits,
+			unsigned long long *misses)
+{
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	vfsFramePoolLock(&v->pool);
+	*hits = v->pool.hits;
+	*misses = v->pool.misses;
+	vfsFramePoolUnlock(&v->pool);
+}
+
+int VfsStats(sqlite3_vfs *vfs,
+	     const char *filename,
+	     struct dqlite_vfs_stats *stats)
+{
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	struct vfsContent *content;
+	struct vfsDatabase *d;
+	int rv = 0;
+
+	vfsReadLock(v);
+	content = vfsContentLookup(v, filename);
+	if (content == NULL || content->type != VFS__DATABASE) {
+		rv = DQLITE_ERROR;
+		goto out;
+	}
+
+	d = &content->database;
+	vfsDatabaseLock(v, d);
+	stats->pages = d->usage.pages;
+	stats->frames = d->usage.frames;
+	stats->shm = d->shm.size;
+	stats->overhead = d->usage.overhead;
+	stats->spilled = d->usage.spilled;
+	stats->mapped = d->usage.mapped;
+	stats->compressed = d->usage.compressed;
+	stats->uncompressed = d->usage.uncompressed;
+	stats->compressed_reads = 0;
+	stats->decompressed = 0;
+	if (d->compression != NULL) {
+		stats->compressed_reads = d->compression->reads;
+		stats->decompressed = d->compression->pages;
+	}
+	vfsDatabaseUnlock(v, d);
+
+out:
+	vfsUnlock(v);
+	return rv;
+}
+
+void VfsSetQuota(sqlite3_vfs *vfs, size_t quota)
+{
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	unsigned i;
+
+	vfsWriteLock(v);
+	v->quota = quota;
+	for (i = 0; i < v->n_contents; i++) {
+		struct vfsContent *content = v->contents[i];
+		if (content->type != VFS__DATABASE) {
+			continue;
+		}
+		vfsDatabaseLock(v, &content->database);
+		content->database.quota = quota;
+		vfsDatabaseUnlock(v, &content->database);
+	}
+	vfsUnlock(v);
+}
+
+int VfsEnableSpill(sqlite3_vfs *vfs,
+		   const char *dir,
+		   unsigned idle,
+		   size_t budget)
+{
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	struct vfsSpill *s;
+	unsigned i;
+	int rv;
+
+	if (v->spill != NULL) {
+		return DQLITE_MISUSE;
+	}
+
+	s = sqlite3_malloc(sizeof *s);
+	if (s == NULL) {
+		return DQLITE_NOMEM;
+	}
+	rv = vfsSpillInit(s, dir, idle, budget);
+	if (rv != 0) {
+		sqlite3_free(s);
+		return rv;
+	}
+	s->threadsafe = v->threadsafe;
+
+	vfsWriteLock(v);
+	v->spill = s;
+	for (i = 0; i < v->n_contents; i++) {
+		struct vfsContent *content = v->contents[i];
+		if (content->type != VFS__DATABASE) {
+			continue;
+		}
+		vfsDatabaseLock(v, &content->database);
+		content->database.spill = s;
+		vfsDatabaseSpillOverBudget(&content->database, NULL);
+		vfsDatabaseUnlock(v, &content->database);
+	}
+	vfsUnlock(v);
 
-	return SQLITE_IOERR_FSYNC;
+	return 0;
 }
 
-static int vfsFileSize(sqlite3_file *file, sqlite_int64 *size)
+void VfsSpill(sqlite3_vfs *vfs)
 {
-	struct vfsFile *f = (struct vfsFile *)file;
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	unsigned long long now;
+	unsigned i;
 
-	switch (f->content->type) {
-		case VFS__DATABASE:
-			*size = f->content->database.n_pages *
-				f->content->database.page_size;
-			break;
+	if (v->spill == NULL || v->spill->idle == 0) {
+		return;
+	}
 
-		case VFS__JOURNAL:
-			*size = 0;
-			break;
+	now = vfsSpillNow();
 
-		case VFS__WAL:
-			/* TODO? here we assume that FileSize() is never invoked
-			 * between a header write and a page write. */
-			*size = (f->content->wal.n_frames *
-				 (FORMAT__WAL_FRAME_HDR_SIZE +
-				  f->content->wal.database->page_size));
-			if (*size > 0) {
-				*size += FORMAT__WAL_HDR_SIZE;
-			}
-			break;
+	vfsReadLock(v);
+	for (i = 0; i < v->n_contents; i++) {
+		struct vfsContent *content = v->contents[i];
+		if (content->type != VFS__DATABASE) {
+			continue;
+		}
+		vfsDatabaseLock(v, &content->database);
+		vfsDatabaseSpillIdle(&content->database, now);
+		vfsDatabaseUnlock(v, &content->database);
 	}
-
-	return SQLITE_OK;
+	vfsUnlock(v);
 }
 
-/* Locking a file is a no-op, since no other process has visibility on it. */
-static int vfsFileLock(sqlite3_file *file, int lock)
+void VfsSetTempLimit(sqlite3_vfs *vfs, size_t limit)
 {
-	(void)file;
-	(void)lock;
-
-	return SQLITE_OK;
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	__atomic_store_n(&v->temp_limit, limit, __ATOMIC_RELAXED);
 }
 
-/* Unlocking a file is a no-op, since no other process has visibility on it. */
-static int vfsFileUnlock(sqlite3_file *file, int lock)
+int VfsEnableCompression(sqlite3_vfs *vfs, unsigned checkpoints)
 {
-	(void)file;
-	(void)lock;
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	unsigned i;
 
-	return SQLITE_OK;
+#ifndef DQLITE_ZLIB
+	if (checkpoints > 0) {
+		return DQLITE_ERROR;
+	}
+#endif
+
+	vfsWriteLock(v);
+	v->compress_age = checkpoints;
+	for (i = 0; i < v->n_contents; i++) {
+		struct vfsContent *content = v->contents[i];
+		if (content->type != VFS__DATABASE) {
+			continue;
+		}
+		vfsDatabaseLock(v, &content->database);
+		content->database.compress_age = checkpoints;
+		vfsDatabaseUnlock(v, &content->database);
+	}
+	vfsUnlock(v);
+
+	return 0;
 }
 
-/* We always report that a lock is held. This routine should be used only in
- * journal mode, so it doesn't matter. */
-static int vfsFileCheckReservedLock(sqlite3_file *file, int *result)
+int VfsEnableHugePages(sqlite3_vfs *vfs)
 {
-	(void)file;
+	struct vfs *v = (struct vfs *)(vfs->pAppData);
+	unsigned i;
 
-	*result = 1;
-	return SQLITE_OK;
+#ifndef MADV_HUGEPAGE
+	(void)v;
+	(void)i;
+	return DQLITE_ERROR;
+#else
+	vfsWriteLock(v);
+	v->huge = true;
+	for (i = 0; i < v->n_contents; i++) {
+		struct vfsContent *content = v->contents[i];
+		if (content->type != VFS__DATABASE) {
+			continue;
+		}
+		vfsDatabaseLock(v, &content->database);
+		content->database.huge = true;
+		vfsDatabaseUnlock(v, &content->database);
+	}
+	vfsUnlock(v);
+
+	return 0;
+#endif
 }
 
-/* Handle pragma a pragma file control. See the xFileControl
- * docstring in sqlite.h.in for more details. */
-static int vfsFileControlPragma(struct vfsFile *f, char **fnctl)
+/* Pinned content of a database and of its WAL. */
+struct vfsSnapshot
 {
-	const char *left;
-	const char *right;
+	struct vfsFramePool *pool;  /* Pool to release frames to. */
+	unsigned page_size;         /* Page size of the database. */
+	void **pages;               /* Content of all database pages. */
+	unsigned n_pages;           /* Number of database pages. */
+	struct vfsSlab **slabs;     /* Pinned slabs of the database. */
+	unsigned n_slabs;           /* Number of pinned slabs. */
+	struct vfsFrame **lent;     /* Pinned frames lent to database pages. */
+	unsigned n_lent;            /* Number of pinned lent frames. */
+	uint8_t wal_hdr[FORMAT__WAL_HDR_SIZE]; /* WAL header. */
+	struct vfsFrame **frames;   /* Pinned committed WAL frames. */
+	unsigned n_frames;          /* Number of pinned WAL frames. */
+};
 
-	assert(f != NULL);
-	assert(f->content->type == VFS__DATABASE);
-	assert(fnctl != NULL);
+/* Pin all pages of the given database. */
+static int vfsSnapshotPinDatabase(struct vfsSnapshot *s, struct vfsDatabase *d)
+{
+	unsigned pgno;
+	unsigned i;
 
-	left = fnctl[1];
-	right = fnctl[2];
+	s->page_size = d->page_size;
 
-	assert(left != NULL);
+	if (d->n_pages == 0) {
+		return SQLITE_OK;
+	}
 
-	if (strcmp(left, "page_size") == 0 && right) {
-		/* When the user executes 'PRAGMA page_size=N' we save the
-		 * size internally.
-		 *
-		 * The page size must be between 512 and 65536, and be a
-		 * power of two. The check below was copied from
-		 * sqlite3BtreeSetPageSize in btree.c.
-		 *
-		 * Invalid sizes are simply ignored, SQLite will do the same.
-		 *
-		 * It's not possible to change the size after it's set.
-		 */
-		int page_size = atoi(right);
+	s->pages = sqlite3_malloc64(sizeof *s->pages * d->n_pages);
+	if (s->pages == NULL) {
+		return SQLITE_NOMEM;
+	}
+	s->slabs = sqlite3_malloc64(sizeof *s->slabs * d->n_slabs);
+	if (s->slabs == NULL) {
+		return SQLITE_NOMEM;
+	}
+	s->lent = sqlite3_malloc64(sizeof *s->lent * d->n_pages);
+	if (s->lent == NULL) {
+		return SQLITE_NOMEM;
+	}
 
-		if (page_size >= FORMAT__PAGE_SIZE_MIN &&
-		    page_size <= FORMAT__PAGE_SIZE_MAX &&
-		    ((page_size - 1) & page_size) == 0) {
-			if (f->content->database.page_size &&
-			    page_size != (int)f->content->database.page_size) {
-				fnctl[0] =
-				    "changing page size is not supported";
-				return SQLITE_IOERR;
-			}
-			f->content->database.page_size = (unsigned)page_size;
+	for (i = 0; i < d->n_slabs; i++) {
+		s->slabs[i] = d->slabs[i];
+		vfsRef(&s->slabs[i]->refcount);
+	}
+	s->n_slabs = d->n_slabs;
+
+	for (pgno = 1; pgno <= d->n_pages; pgno++) {
+		unsigned j;
+		struct vfsLeaf *leaf = vfsDatabaseLeaf(d, pgno, &j);
+		struct vfsFrame *frame;
+		if (leaf == NULL) {
+			s->pages[pgno - 1] = NULL;
+			continue;
 		}
-	} else if (strcmp(left, "journal_mode") == 0 && right) {
-		/* When the user executes 'PRAGMA journal_mode=x' we ensure
-		 * that the desired mode is 'wal'. */
-		if (strcasecmp(right, "wal") != 0) {
-			fnctl[0] = "only WAL mode is supported";
-			return SQLITE_IOERR;
+		frame = leaf->frames[j];
+		if (frame != NULL) {
+			vfsRef(&frame->refcount);
+			s->lent[s->n_lent] = frame;
+			s->n_lent++;
+			s->pages[pgno - 1] = frame->buf;
+		} else {
+			s->pages[pgno - 1] = leaf->pages[j];
 		}
 	}
+	s->n_pages = d->n_pages;
 
-	/* We're returning NOTFOUND here to tell SQLite that we wish it to go on
-	 * with its own handling as well. If we returned SQLITE_OK the page size
-	 * of the journal mode wouldn't be effectively set, as the processing of
-	 * the PRAGMA would stop here. */
-	return SQLITE_NOTFOUND;
+	return SQLITE_OK;
 }
 
-/* Revert the WAL index header as it was before the transaction started and save
- * the header as it is now after the transaction ended. */
-static void vfsWalReverIndexHeader(struct vfsWal *w)
+/* Return the number of frames of the given WAL up to its last commit frame.
+ *
+ * With the v2 implementation all frames of the WAL are committed, since the
+ * frames of a transaction in progress are kept apart. With the v1 one, they
+ * are appended to the WAL as SQLite writes them, possibly after the leftovers
+ * of rolled back transactions. */
+static unsigned vfsWalCommitted(struct vfsWal *w)
 {
-	struct vfsShm *shm = &w->database->shm;
-	uint8_t *hdr = shm->regions[0];
-	unsigned i;
-	unsigned max_frame = 0;
-	unsigned frame_checksum1 = 0;
-	unsigned frame_checksum2 = 0;
-	unsigned n_pages = w->database->n_pages;
+	unsigned n;
 
-	for (i = 0; i < w->n_frames; i++) {
-		struct vfsFrame *frame = w->frames[i];
-		unsigned page_number;
-		formatWalGetFramePageNumber(frame->hdr, &page_number);
-		if (page_number > n_pages) {
-			n_pages = page_number;
-		}
-		max_frame++;
-		if (i == w->n_frames - 1) {
-			formatWalGetFrameChecksums(frame->hdr, &frame_checksum1,
-						   &frame_checksum2);
+	for (n = w->n_frames; n > 0; n--) {
+		unsigned n_pages;
+		formatWalGetFrameDatabaseSize(w->frames[n - 1]->hdr, &n_pages);
+		if (n_pages > 0) {
+			break;
 		}
 	}
 
-	formatWalIndexHeaderRevert(hdr, max_frame, n_pages, frame_checksum1,
-				   frame_checksum2);
-}
-
-/* The SQLITE_FCNTL_COMMIT_PHASETWO file control op code is trigged by the
- * SQLite pager after completing a transaction. */
-static int vfsFileControlCommitPhaseTwo(struct vfsFile *f)
-{
-	struct vfsDatabase *database = &f->content->database;
-	struct vfsWal *wal = database->wal;
-	if (database->version == VFS__V2 && wal != NULL && wal->n_tx > 0) {
-		vfsWalReverIndexHeader(wal);
-	}
-	return 0;
+	return n;
 }
 
-static int vfsFileControl(sqlite3_file *file, int op, void *arg)
+/* Pin all committed frames of the given WAL. */
+static int vfsSnapshotPinWal(struct vfsSnapshot *s, struct vfsWal *w)
 {
-	struct vfsFile *f = (struct vfsFile *)file;
-	int rv;
+	unsigned n = vfsWalCommitted(w);
+	unsigned i;
 
-	switch (op) {
-		case SQLITE_FCNTL_PRAGMA:
-			rv = vfsFileControlPragma(f, arg);
-			break;
-		case SQLITE_FCNTL_COMMIT_PHASETWO:
-			rv = vfsFileControlCommitPhaseTwo(f);
-			break;
-		case SQLITE_FCNTL_PERSIST_WAL:
-			/* This prevents SQLite from deleting the WAL after the
-			 * last connection is closed. */
-			*(int *)(arg) = 1;
-			rv = SQLITE_OK;
-			break;
-		default:
-			rv = SQLITE_OK;
-			break;
+	if (n == 0) {
+		return SQLITE_OK;
 	}
 
-	return rv;
-}
-
-static int vfsFileSectorSize(sqlite3_file *file)
-{
-	(void)file;
+	s->frames = sqlite3_malloc64(sizeof *s->frames * n);
+	if (s->frames == NULL) {
+		return SQLITE_NOMEM;
+	}
 
-	return 0;
-}
+	/* Pinned frames are shared, so their headers must not change. */
+	vfsWalChecksum(w, n);
 
-static int vfsFileDeviceCharacteristics(sqlite3_file *file)
-{
-	(void)file;
+	memcpy(s->wal_hdr, w->hdr, FORMAT__WAL_HDR_SIZE);
+	for (i = 0; i < n; i++) {
+		s->frames[i] = w->frames[i];
+		vfsRef(&s->frames[i]->refcount);
+	}
+	s->n_frames = n;
 
-	return 0;
+	return SQLITE_OK;
 }
 
-static int vfsShmMap(struct vfsShm *s,
-		     unsigned region_index,
-		     unsigned region_size,
-		     bool extend,
-		     void volatile **out)
+int VfsSnapshotAcquire(const char *vfs_name,
+		       const char *filename,
+		       struct vfsSnapshot **snapshot)
 {
-	void *region;
+	sqlite3_vfs *vfs;
+	struct vfs *v;
+	struct vfsContent *content;
+	struct vfsSnapshot *s;
 	int rv;
 
-	if (s->regions != NULL && region_index < s->n_regions) {
-		/* The region was already allocated. */
-		region = s->regions[region_index];
-		assert(region != NULL);
-	} else {
-		if (extend) {
-			/* We should grow the map one region at a time. */
-			assert(region_size == FORMAT__WAL_IDX_PAGE_SIZE);
-			assert(region_index == s->n_regions);
-			region = sqlite3_malloc64(region_size);
-			if (region == NULL) {
-				rv = SQLITE_NOMEM;
-				goto err;
-			}
-
-			memset(region, 0, region_size);
+	vfs = sqlite3_vfs_find(vfs_name);
+	if (vfs == NULL) {
+		rv = SQLITE_ERROR;
+		goto err;
+	}
+	v = (struct vfs *)(vfs->pAppData);
 
-			s->regions = sqlite3_realloc64(
-			    s->regions,
-			    sizeof *s->regions * (region_index + 1));
+	s = sqlite3_malloc(sizeof *s);
+	if (s == NULL) {
+		rv = SQLITE_NOMEM;
+		goto err;
+	}
+	memset(s, 0, sizeof *s);
+	s->pool = &v->pool;
 
-			if (s->regions == NULL) {
-				rv = SQLITE_NOMEM;
-				goto err_after_region_malloc;
-			}
+	vfsReadLock(v);
 
-			s->regions[region_index] = region;
-			s->n_regions++;
+	content = vfsContentLookup(v, filename);
+	if (content == NULL || content->type != VFS__DATABASE) {
+		rv = SQLITE_CANTOPEN;
+		goto err_after_read_lock;
+	}
 
-		} else {
-			/* The region was not allocated and we don't have to
-			 * extend the map. */
-			region = NULL;
-		}
+	vfsDatabaseLock(v, &content->database);
+	rv = vfsSnapshotPinDatabase(s, &content->database);
+	if (rv == SQLITE_OK && content->database.wal != NULL) {
+		rv = vfsSnapshotPinWal(s, content->database.wal);
+	}
+	vfsDatabaseUnlock(v, &content->database);
+	if (rv != SQLITE_OK) {
+		goto err_after_read_lock;
 	}
 
-	*out = region;
+	vfsUnlock(v);
+
+	*snapshot = s;
 
 	return SQLITE_OK;
 
-err_after_region_malloc:
-	sqlite3_free(region);
+err_after_read_lock:
+	vfsUnlock(v);
+	VfsSnapshotRelease(s);
 err:
-	assert(rv != SQLITE_OK);
-	*out = NULL;
+	*snapshot = NULL;
 	return rv;
 }
 
-/* Simulate shared memory by allocating on the C heap. */
-static int vfsFileShmMap(sqlite3_file *file, /* Handle open on database file */
-			 int region_index,   /* Region to retrieve */
-			 int region_size,    /* Size of regions */
-			 int extend, /* True to extend file if necessary */
-			 void volatile **out /* OUT: Mapped memory */
-)
+void VfsSnapshotSize(const struct vfsSnapshot *s,
+		     size_t *main_size,
+		     size_t *wal_size)
 {
-	struct vfsFile *f = (struct vfsFile *)file;
-
-	assert(f->content->type == VFS__DATABASE);
+	*main_size = (size_t)s->n_pages * s->page_size;
+	*wal_size = 0;
+	if (s->n_frames > 0) {
+		*wal_size = FORMAT__WAL_HDR_SIZE +
+			    (size_t)s->n_frames *
+				(FORMAT__WAL_FRAME_HDR_SIZE + s->page_size);
+	}
+}
 
-	return vfsShmMap(&f->content->database.shm, (unsigned)region_index,
-			 (unsigned)region_size, extend, out);
+unsigned VfsSnapshotPageSize(const struct vfsSnapshot *s)
+{
+	return s->page_size;
 }
 
-static int vfsShmLock(struct vfsShm *s, int ofst, int n, int flags)
+/* Decompress the given page of a snapshot into @page, allocating it if needed,
+ * and point @src to it. If the page is a hole, @src is set to NULL. */
+static int vfsSnapshotPageInflate(const struct vfsSnapshot *s,
+				  unsigned pgno,
+				  void **inflater,
+				  uint8_t **page,
+				  const uint8_t **src)
 {
-	int i;
+	const struct vfsSlab *slab;
+	unsigned i;
+	int rv;
 
-	if (flags & SQLITE_SHM_EXCLUSIVE) {
-		/* No shared or exclusive lock must be held in the region. */
-		for (i = ofst; i < ofst + n; i++) {
-			if (s->shared[i] > 0 || s->exclusive[i] > 0) {
-				return SQLITE_BUSY;
-			}
-		}
+	*src = NULL;
 
-		for (i = ofst; i < ofst + n; i++) {
-			assert(s->exclusive[i] == 0);
-			s->exclusive[i] = 1;
-		}
-	} else {
-		/* No exclusive lock must be held in the region. */
-		for (i = ofst; i < ofst + n; i++) {
-			if (s->exclusive[i] > 0) {
-				return SQLITE_BUSY;
-			}
-		}
+	if (!vfsSlabFind(s->slabs, s->n_slabs, pgno, &i)) {
+		return SQLITE_OK;
+	}
+	slab = s->slabs[i];
 
-		for (i = ofst; i < ofst + n; i++) {
-			s->shared[i]++;
+	if (*page == NULL) {
+		*page = sqlite3_malloc((int)s->page_size);
+		if (*page == NULL) {
+			return SQLITE_NOMEM;
 		}
 	}
+	rv = vfsSlabInflate(slab, pgno - slab->first, s->page_size, inflater,
+			    NULL, *page);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+	*src = *page;
 
 	return SQLITE_OK;
 }
 
-static int vfsShmUnlock(struct vfsShm *s, int ofst, int n, int flags)
+/* Copy a range of the main database file of a snapshot. Pages of compressed
+ * slabs have no content pointer, and are decompressed on the fly, while holes
+ * have none either and read as zeros. */
+static int vfsSnapshotReadDatabase(const struct vfsSnapshot *s,
+				   size_t offset,
+				   uint8_t *buf,
+				   size_t len)
 {
-	unsigned *these_locks;
-	unsigned *other_locks;
-	int i;
-
-	if (flags & SQLITE_SHM_SHARED) {
-		these_locks = s->shared;
-		other_locks = s->exclusive;
-	} else {
-		these_locks = s->exclusive;
-		other_locks = s->shared;
-	}
-
-	for (i = ofst; i < ofst + n; i++) {
-		/* Sanity check that no lock of the other type is held in this
-		 * region. */
-		assert(other_locks[i] == 0);
-
-		/* Only decrease the lock count if it's positive. In other words
-		 * releasing a never acquired lock is legal and idemponent. */
-		if (these_locks[i] > 0) {
-			these_locks[i]--;
+	void *inflater = NULL;
+	uint8_t *page = NULL;
+	int rv = SQLITE_OK;
+
+	while (len > 0) {
+		size_t i = offset / s->page_size;
+		size_t start = offset % s->page_size;
+		size_t n = s->page_size - start;
+		const uint8_t *src;
+		if (n > len) {
+			n = len;
 		}
+		assert(i < s->n_pages);
+		src = s->pages[i];
+		if (src == NULL) {
+			rv = vfsSnapshotPageInflate(s, (unsigned)i + 1,
+						    &inflater, &page, &src);
+			if (rv != SQLITE_OK) {
+				break;
+			}
+		}
+		if (src != NULL) {
+			memcpy(buf, src + start, n);
+		} else {
+			/* Holes read as zeros. */
+			memset(buf, 0, n);
+		}
+		offset += n;
+		buf += n;
+		len -= n;
 	}
 
-	return SQLITE_OK;
+	vfsInflateEnd(&inflater, NULL);
+	sqlite3_free(page);
+
+	return rv;
 }
 
-static int vfsFileShmLock(sqlite3_file *file, int ofst, int n, int flags)
+/* Copy a range of the WAL file of a snapshot. */
+static void vfsSnapshotReadWal(const struct vfsSnapshot *s,
+			       size_t offset,
+			       uint8_t *buf,
+			       size_t len)
 {
-	struct vfsFile *f;
-	struct vfsShm *shm;
-	int rv;
-
-	assert(file != NULL);
-	assert(ofst >= 0);
-	assert(n >= 0);
-
-	/* Legal values for the offset and the range */
-	assert(ofst >= 0 && ofst + n <= SQLITE_SHM_NLOCK);
-	assert(n >= 1);
-	assert(n == 1 || (flags & SQLITE_SHM_EXCLUSIVE) != 0);
-
-	/* Legal values for the flags.
-	 *
-	 * See https://sqlite.org/c3ref/c_shm_exclusive.html. */
-	assert(flags == (SQLITE_SHM_LOCK | SQLITE_SHM_SHARED) ||
-	       flags == (SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE) ||
-	       flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED) ||
-	       flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE));
-
-	/* This is a no-op since shared-memory locking is relevant only for
-	 * inter-process concurrency. See also the unix-excl branch from
-	 * upstream (git commit cda6b3249167a54a0cf892f949d52760ee557129). */
+	size_t frame_size = FORMAT__WAL_FRAME_HDR_SIZE + s->page_size;
 
-	f = (struct vfsFile *)file;
-
-	assert(f->content != NULL);
+	while (len > 0) {
+		const uint8_t *src;
+		size_t n;
 
-	shm = &f->content->database.shm;
-	if (flags & SQLITE_SHM_UNLOCK) {
-		rv = vfsShmUnlock(shm, ofst, n, flags);
-	} else {
-		rv = vfsShmLock(shm, ofst, n, flags);
+		if (offset < FORMAT__WAL_HDR_SIZE) {
+			src = s->wal_hdr + offset;
+			n = FORMAT__WAL_HDR_SIZE - offset;
+		} else {
+			size_t i = (offset - FORMAT__WAL_HDR_SIZE) / frame_size;
+			size_t start = (offset - FORMAT__WAL_HDR_SIZE) % frame_size;
+			assert(i < s->n_frames);
+			if (start < FORMAT__WAL_FRAME_HDR_SIZE) {
+				src = s->frames[i]->hdr + start;
+				n = FORMAT__WAL_FRAME_HDR_SIZE - start;
+			} else {
+				start -= FORMAT__WAL_FRAME_HDR_SIZE;
+				src = (uint8_t *)s->frames[i]->buf + start;
+				n = s->page_size - start;
+			}
+		}
+		if (n > len) {
+			n = len;
+		}
+		memcpy(buf, src, n);
+		offset += n;
+		buf += n;
+		len -= n;
 	}
-
-	return rv;
 }
 
-static void vfsFileShmBarrier(sqlite3_file *file)
+int VfsSnapshotRead(const struct vfsSnapshot *s,
+		    bool wal,
+		    size_t offset,
+		    void *buf,
+		    size_t len)
 {
-	(void)file;
-	/* This is a no-op since we expect SQLite to be compiled with mutex
-	 * support (i.e. SQLITE_MUTEX_OMIT or SQLITE_MUTEX_NOOP are *not*
-	 * defined, see sqliteInt.h). */
+	if (wal) {
+		vfsSnapshotReadWal(s, offset, buf, len);
+		return SQLITE_OK;
+	}
+	return vfsSnapshotReadDatabase(s, offset, buf, len);
 }
 
-static int vfsFileShmUnmap(sqlite3_file *file, int delete_flag)
+void VfsSnapshotRelease(struct vfsSnapshot *s)
 {
-	(void)file;
-	(void)delete_flag;
-	return SQLITE_OK;
-}
+	unsigned i;
 
-static const sqlite3_io_methods vfsFileMethods = {
-    2,                             // iVersion
-    vfsFileClose,                  // xClose
-    vfsFileRead,                   // xRead
-    vfsFileWrite,                  // xWrite
-    vfsFileTruncate,               // xTruncate
-    vfsFileSync,                   // xSync
-    vfsFileSize,                   // xFileSize
-    vfsFileLock,                   // xLock
-    vfsFileUnlock,                 // xUnlock
-    vfsFileCheckReservedLock,      // xCheckReservedLock
-    vfsFileControl,                // xFileControl
-    vfsFileSectorSize,             // xSectorSize
-    vfsFileDeviceCharacteristics,  // xDeviceCharacteristics
-    vfsFileShmMap,                 // xShmMap
-    vfsFileShmLock,                // xShmLock
-    vfsFileShmBarrier,             // xShmBarrier
-    vfsFileShmUnmap,               // xShmUnmap
-    0,
-    0,
-};
+	for (i = 0; i < s->n_slabs; i++) {
+		vfsSlabUnref(s->slabs[i]);
+	}
+	for (i = 0; i < s->n_lent; i++) {
+		vfsFrameDestroy(s->pool, s->lent[i]);
+	}
+	for (i = 0; i < s->n_frames; i++) {
+		vfsFrameDestroy(s->pool, s->frames[i]);
+	}
+	sqlite3_free(s->pages);
+	sqlite3_free(s->slabs);
+	sqlite3_free(s->lent);
+	sqlite3_free(s->frames);
+	sqlite3_free(s);
+}
 
-static int vfsOpen(sqlite3_vfs *vfs,
-		   const char *filename,
-		   sqlite3_file *file,
-		   int flags,
-		   int *out_flags)
+/* Open a database or WAL file of the VFS registered under the given name,
+ * returning its size and, unless the file is empty, its page size. */
+static int vfsFileOpenForRead(const char *vfs_name,
+			      const char *filename,
+			      sqlite3_file **file,
+			      size_t *size,
+			      unsigned *page_size)
 {
-	struct vfs *v;
-	struct vfsFile *f;
-	struct vfsContent *content;
-	enum vfsContentType type;
-	bool exists;
-	int exclusive = flags & SQLITE_OPEN_EXCLUSIVE;
-	int create = flags & SQLITE_OPEN_CREATE;
+	sqlite3_vfs *vfs;
+	uint8_t header[FORMAT__WAL_HDR_SIZE];
+	bool is_wal;
+	int flags;
+	sqlite3_int64 file_size;
 	int rc;
 
-	(void)out_flags;
-
-	assert(vfs != NULL);
-	assert(vfs->pAppData != NULL);
-	assert(file != NULL);
-
-	/* From sqlite3.h.in:
-	 *
-	 *   The SQLITE_OPEN_EXCLUSIVE flag is always used in conjunction with
-	 *   the SQLITE_OPEN_CREATE flag, which are both directly analogous to
-	 *   the O_EXCL and O_CREAT flags of the POSIX open() API.  The
-	 *   SQLITE_OPEN_EXCLUSIVE flag, when paired with the
-	 *   SQLITE_OPEN_CREATE, is used to indicate that file should always be
-	 *   created, and that it is an error if it already exists.  It is not
-	 *   used to indicate the file should be opened for exclusive access.
-	 */
-	assert(!exclusive || create);
+	assert(vfs_name != NULL);
+	assert(filename != NULL);
 
-	v = (struct vfs *)(vfs->pAppData);
-	f = (struct vfsFile *)file;
+	/* Lookup the VFS object to use. */
+	vfs = sqlite3_vfs_find(vfs_name);
+	if (vfs == NULL) {
+		rc = SQLITE_ERROR;
+		goto err;
+	}
 
-	/* This tells SQLite to not call Close() in case we return an error. */
-	f->base.pMethods = 0;
-	f->temp = NULL;
+	is_wal = vfsIsWalFilename(filename);
 
-	/* Save the flags */
-	f->flags = flags;
+	/* Common flags */
+	flags = SQLITE_OPEN_READWRITE;
 
-	/* From SQLite documentation:
-	 *
-	 * If the zFilename parameter to xOpen is a NULL pointer then xOpen
-	 * must invent its own temporary name for the file. Whenever the
-	 * xFilename parameter is NULL it will also be the case that the
-	 * flags parameter will include SQLITE_OPEN_DELETEONCLOSE.
-	 */
-	if (filename == NULL) {
-		assert(flags & SQLITE_OPEN_DELETEONCLOSE);
+	if (is_wal) {
+		flags |= SQLITE_OPEN_WAL;
+	} else {
+		flags |= SQLITE_OPEN_MAIN_DB;
+	}
 
-		/* Open an actual temporary file. */
-		vfs = sqlite3_vfs_find("unix");
-		assert(vfs != NULL);
+	/* Open the file */
+	*file = sqlite3_malloc(vfs->szOsFile);
+	if (*file == NULL) {
+		rc = SQLITE_NOMEM;
+		goto err;
+	}
 
-		f->temp = sqlite3_malloc(vfs->szOsFile);
-		if (f->temp == NULL) {
-			v->error = ENOENT;
-			return SQLITE_CANTOPEN;
-		}
-		rc = vfs->xOpen(vfs, NULL, f->temp, flags, out_flags);
-		if (rc != SQLITE_OK) {
-			sqlite3_free(f->temp);
-			return rc;
-		}
+	rc = vfs->xOpen(vfs, filename, *file, flags, &flags);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_malloc;
+	}
 
-		f->base.pMethods = &vfsFileMethods;
-		f->vfs = NULL;
-		f->content = NULL;
+	/* Get the file size */
+	rc = (*file)->pMethods->xFileSize(*file, &file_size);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_open;
+	}
+	*size = (size_t)file_size;
+	*page_size = 0;
 
+	/* Check if the file is empty. */
+	if (*size == 0) {
 		return SQLITE_OK;
 	}
 
-	/* Search if the file exists already. */
-	content = vfsContentLookup(v, filename);
-	exists = content != NULL;
+	/* Read the header. The buffer size is enough for both database and WAL
+	 * files. */
+	rc = (*file)->pMethods->xRead(*file, header, FORMAT__WAL_HDR_SIZE, 0);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_open;
+	}
 
-	/* If file exists, and the exclusive flag is on, return an error. */
-	if (exists && exclusive && create) {
-		v->error = EEXIST;
-		rc = SQLITE_CANTOPEN;
-		goto err;
+	/* Figure the page size. */
+	if (is_wal) {
+		formatWalGetPageSize(header, page_size);
+	} else {
+		formatDatabaseGetPageSize(header, page_size);
+	}
+	if (*page_size == 0) {
+		rc = SQLITE_CORRUPT;
+		goto err_after_file_open;
 	}
 
-	if (!exists) {
-		struct vfsContent **contents;
-		unsigned n = v->n_contents + 1;
+	return SQLITE_OK;
+
+err_after_file_open:
+	(*file)->pMethods->xClose(*file);
+
+err_after_file_malloc:
+	sqlite3_free(*file);
+
+err:
+	assert(rc != SQLITE_OK);
+	*file = NULL;
+	return rc;
+}
+
+/* Close a file opened with vfsFileOpenForRead(). */
+static void vfsFileCloseForRead(sqlite3_file *file)
+{
+	file->pMethods->xClose(file);
+	sqlite3_free(file);
+}
 
-		/* Check the create flag. */
-		if (!create) {
-			v->error = ENOENT;
-			rc = SQLITE_CANTOPEN;
-			goto err;
-		}
+/* Copy @len bytes of the given file, starting at @offset, into @buf.
+ *
+ * The file is read one database page, or one WAL header or frame, at a time,
+ * since that's what its xRead() method expects. Records that the range covers
+ * only in part are read into a scratch buffer first. */
+static int vfsFileReadRange(sqlite3_file *file,
+			    const char *filename,
+			    unsigned page_size,
+			    size_t offset,
+			    uint8_t *buf,
+			    size_t len)
+{
+	bool is_wal = vfsIsWalFilename(filename);
+	size_t frame_size = FORMAT__WAL_FRAME_HDR_SIZE + page_size;
+	uint8_t *scratch = NULL;
+	int rc = SQLITE_OK;
 
-		if (flags & SQLITE_OPEN_MAIN_DB) {
-			type = VFS__DATABASE;
-		} else if (flags & SQLITE_OPEN_MAIN_JOURNAL) {
-			type = VFS__JOURNAL;
-		} else if (flags & SQLITE_OPEN_WAL) {
-			type = VFS__WAL;
+	while (len > 0) {
+		size_t start;
+		size_t size;
+		size_t n;
+		uint8_t *dst = buf;
+
+		if (!is_wal) {
+			start = offset - offset % page_size;
+			size = page_size;
+		} else if (offset < FORMAT__WAL_HDR_SIZE) {
+			start = 0;
+			size = FORMAT__WAL_HDR_SIZE;
 		} else {
-			v->error = ENOENT;
-			return SQLITE_CANTOPEN;
+			start = offset -
+				(offset - FORMAT__WAL_HDR_SIZE) % frame_size;
+			size = frame_size;
 		}
 
-		/* Create a new entry. */
-		contents = sqlite3_realloc64(v->contents, sizeof *contents * n);
-		if (contents == NULL) {
-			v->error = ENOMEM;
-			rc = SQLITE_CANTOPEN;
-			goto err;
+		n = start + size - offset;
+		if (n > len) {
+			n = len;
 		}
-		v->contents = contents;
 
-		content = vfsContentCreate(filename, type, v->version);
-		if (content == NULL) {
-			v->error = ENOMEM;
-			rc = SQLITE_NOMEM;
-			goto err;
+		if (offset != start || n != size) {
+			if (scratch == NULL) {
+				scratch = sqlite3_malloc((int)frame_size);
+				if (scratch == NULL) {
+					rc = SQLITE_NOMEM;
+					break;
+				}
+			}
+			dst = scratch;
 		}
 
-		if (type == VFS__WAL) {
-			struct vfsDatabase *database;
-			/* An associated database file must have been
-			 * opened. */
-			database = vfsDatabaseLookup(v, filename);
-			if (database == NULL) {
-				rc = SQLITE_CANTOPEN;
-				goto err_after_content_create;
-			}
-			content->wal.database = database;
-			database->wal = &content->wal;
+		rc = file->pMethods->xRead(file, dst, (int)size,
+					   (sqlite3_int64)start);
+		if (rc != SQLITE_OK) {
+			break;
+		}
+		if (dst != buf) {
+			memcpy(buf, dst + (offset - start), n);
 		}
 
-		v->contents[n - 1] = content;
-		v->n_contents = n;
+		offset += n;
+		buf += n;
+		len -= n;
 	}
 
-	// Populate the new file handle.
-	f->base.pMethods = &vfsFileMethods;
-	f->vfs = v;
-	f->content = content;
-
-	content->refcount++;
-
-	return SQLITE_OK;
+	sqlite3_free(scratch);
 
-err_after_content_create:
-	vfsContentDestroy(content);
-err:
-	assert(rc != SQLITE_OK);
 	return rc;
 }
 
-static int vfsDelete(sqlite3_vfs *vfs, const char *filename, int dir_sync)
+int VfsFileRead(const char *vfs_name,
+		const char *filename,
+		void **buf,
+		size_t *len)
 {
-	struct vfs *v;
+	sqlite3_file *file;
+	unsigned page_size;
+	int rc;
 
-	(void)dir_sync;
+	assert(buf != NULL);
+	assert(len != NULL);
 
-	assert(vfs != NULL);
-	assert(vfs->pAppData != NULL);
+	rc = vfsFileOpenForRead(vfs_name, filename, &file, len, &page_size);
+	if (rc != SQLITE_OK) {
+		goto err;
+	}
 
-	v = (struct vfs *)(vfs->pAppData);
+	/* Check if the file is empty. */
+	if (*len == 0) {
+		*buf = NULL;
+		goto out;
+	}
+
+	/* Allocate the read buffer.
+	 *
+	 * TODO: we should fix the tests and use sqlite3_malloc instead. */
+	*buf = raft_malloc(*len);
+	if (*buf == NULL) {
+		rc = SQLITE_NOMEM;
+		goto err_after_file_open;
+	}
+
+	rc = vfsFileReadRange(file, filename, page_size, 0, *buf, *len);
+	if (rc != SQLITE_OK) {
+		goto err_after_buf_malloc;
+	}
+
+out:
+	vfsFileCloseForRead(file);
+
+	return SQLITE_OK;
+
+err_after_buf_malloc:
+	raft_free(*buf);
+
+err_after_file_open:
+	vfsFileCloseForRead(file);
+
+err:
+	assert(rc != SQLITE_OK);
 
-	return vfsDeleteContent(v, filename);
+	*buf = NULL;
+	*len = 0;
+
+	return rc;
 }
 
-static int vfsAccess(sqlite3_vfs *vfs,
+int VfsFileReadChunk(const char *vfs_name,
 		     const char *filename,
-		     int flags,
-		     int *result)
+		     size_t offset,
+		     void *buf,
+		     size_t len,
+		     size_t *size)
 {
-	struct vfs *v;
-	struct vfsContent *content;
-
-	(void)flags;
+	sqlite3_file *file;
+	unsigned page_size;
+	int rc;
 
-	assert(vfs != NULL);
-	assert(vfs->pAppData != NULL);
+	assert(size != NULL);
 
-	v = (struct vfs *)(vfs->pAppData);
+	rc = vfsFileOpenForRead(vfs_name, filename, &file, size, &page_size);
+	if (rc != SQLITE_OK) {
+		*size = 0;
+		return rc;
+	}
 
-	/* If the file exists, access is always granted. */
-	content = vfsContentLookup(v, filename);
-	if (content == NULL) {
-		*result = 0;
-	} else {
-		*result = 1;
+	if (offset + len > *size) {
+		rc = SQLITE_IOERR_SHORT_READ;
+		goto out;
 	}
 
-	return SQLITE_OK;
-}
+	if (len > 0) {
+		rc = vfsFileReadRange(file, filename, page_size, offset, buf,
+				      len);
+	}
 
-static int vfsFullPathname(sqlite3_vfs *vfs,
-			   const char *filename,
-			   int pathname_len,
-			   char *pathname)
-{
-	(void)vfs;
+out:
+	vfsFileCloseForRead(file);
 
-	// Just return the path unchanged.
-	sqlite3_snprintf(pathname_len, pathname, "%s", filename);
-	return SQLITE_OK;
+	return rc;
 }
 
-static void *vfsDlOpen(sqlite3_vfs *vfs, const char *filename)
+int VfsFileWrite(const char *vfs_name,
+		 const char *filename,
+		 const void *buf,
+		 size_t len)
 {
-	(void)vfs;
-	(void)filename;
+	sqlite3_vfs *vfs;
+	sqlite3_file *file;
+	bool is_wal;
+	int flags;
+	unsigned int page_size;
+	sqlite3_int64 offset;
+	const uint8_t *pos;
+	int rc;
 
-	return 0;
-}
+	assert(vfs_name != NULL);
+	assert(filename != NULL);
+	assert(buf != NULL);
+	assert(len > 0);
 
-static void vfsDlError(sqlite3_vfs *vfs, int nByte, char *zErrMsg)
-{
-	(void)vfs;
+	/* Lookup the VFS object to use. */
+	vfs = sqlite3_vfs_find(vfs_name);
+	if (vfs == NULL) {
+		rc = SQLITE_ERROR;
+		goto err;
+	}
 
-	sqlite3_snprintf(nByte, zErrMsg,
-			 "Loadable extensions are not supported");
-	zErrMsg[nByte - 1] = '\0';
-}
+	/* Determine if this is a database or a WAL file. */
+	is_wal = vfsIsWalFilename(filename);
 
-static void (*vfsDlSym(sqlite3_vfs *vfs, void *pH, const char *z))(void)
-{
-	(void)vfs;
-	(void)pH;
-	(void)z;
+	/* Common flags */
+	flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
-	return 0;
-}
+	if (is_wal) {
+		flags |= SQLITE_OPEN_WAL;
+	} else {
+		flags |= SQLITE_OPEN_MAIN_DB;
+	}
 
-static void vfsDlClose(sqlite3_vfs *vfs, void *pHandle)
-{
-	(void)vfs;
-	(void)pHandle;
+	/* Open the file */
+	file = (sqlite3_file *)sqlite3_malloc(vfs->szOsFile);
+	if (file == NULL) {
+		rc = SQLITE_NOMEM;
+		goto err;
+	}
+	rc = vfs->xOpen(vfs, filename, file, flags, &flags);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_malloc;
+	}
 
-	return;
-}
+	/* Truncate any existing content. */
+	rc = file->pMethods->xTruncate(file, 0);
+	if (rc != SQLITE_OK) {
+		goto err_after_file_malloc;
+	}
 
-static int vfsRandomness(sqlite3_vfs *vfs, int nByte, char *zByte)
-{
-	(void)vfs;
-	(void)nByte;
-	(void)zByte;
+	/* Figure out the page size */
+	if (is_wal) {
+		formatWalGetPageSize(buf, &page_size);
+	} else {
+		formatDatabaseGetPageSize(buf, &page_size);
+	}
+	if (page_size == 0) {
+		rc = SQLITE_CORRUPT;
+		goto err_after_file_open;
+	}
 
-	/* TODO (is this needed?) */
-	return SQLITE_OK;
-}
+	offset = 0;
+	pos = buf;
 
-static int vfsSleep(sqlite3_vfs *vfs, int microseconds)
-{
-	(void)vfs;
+	/* If this is a WAL file , write the header first. */
+	if (is_wal) {
+		rc = file->pMethods->xWrite(file, pos, FORMAT__WAL_HDR_SIZE,
+					    offset);
+		if (rc != SQLITE_OK) {
+			goto err_after_file_open;
+		}
+		offset += FORMAT__WAL_HDR_SIZE;
+		pos += FORMAT__WAL_HDR_SIZE;
+	}
 
-	/* TODO (is this needed?) */
-	return microseconds;
-}
+	while ((size_t)offset < len) {
+		if (is_wal) {
+			/* Write the frame header */
+			rc = file->pMethods->xWrite(
+			    file, pos, FORMAT__WAL_FRAME_HDR_SIZE, offset);
+			if (rc != SQLITE_OK) {
+				goto err_after_file_open;
+			}
+			offset += FORMAT__WAL_FRAME_HDR_SIZE;
+			pos += FORMAT__WAL_FRAME_HDR_SIZE;
+		}
 
-static int vfsCurrentTimeInt64(sqlite3_vfs *vfs, sqlite3_int64 *piNow)
-{
-	static const sqlite3_int64 unixEpoch =
-	    24405875 * (sqlite3_int64)8640000;
-	struct timeval now;
+		/* Write the page */
+		rc = file->pMethods->xWrite(file, pos, (int)page_size, offset);
+		if (rc != SQLITE_OK) {
+			goto err_after_file_open;
+		}
+		offset += page_size;
+		pos += page_size;
+	};
 
-	(void)vfs;
+	file->pMethods->xClose(file);
+	sqlite3_free(file);
 
-	gettimeofday(&now, 0);
-	*piNow =
-	    unixEpoch + 1000 * (sqlite3_int64)now.tv_sec + now.tv_usec / 1000;
 	return SQLITE_OK;
-}
-
-static int vfsCurrentTime(sqlite3_vfs *vfs, double *piNow)
-{
-	// TODO: check if it's always safe to cast a double* to a
-	// sqlite3_int64*.
-	return vfsCurrentTimeInt64(vfs, (sqlite3_int64 *)piNow);
-}
 
-static int vfsGetLastError(sqlite3_vfs *vfs, int x, char *y)
-{
-	struct vfs *v = (struct vfs *)(vfs->pAppData);
-	int rc;
+err_after_file_open:
+	file->pMethods->xClose(file);
 
-	(void)vfs;
-	(void)x;
-	(void)y;
+err_after_file_malloc:
+	sqlite3_free(file);
 
-	rc = v->error;
+err:
+	assert(rc != SQLITE_OK);
 
 	return rc;
 }
 
-static int vfsInit(struct sqlite3_vfs *vfs, const char *name, int version)
+/* Presize the page index of an empty database for @n_pages pages, before
+ * loading them with vfsDatabaseLoadRun(). */
+static int vfsDatabaseLoadIndex(struct vfsDatabase *d, unsigned n_pages)
 {
-	vfs->iVersion = 2;
-	vfs->szOsFile = sizeof(struct vfsFile);
-	vfs->mxPathname = VFS__MAX_PATHNAME;
-	vfs->pNext = NULL;
-
-	vfs->pAppData = vfsCreate(version);
-	if (vfs->pAppData == NULL) {
-		return DQLITE_NOMEM;
-	}
-
-	vfs->xOpen = vfsOpen;
-	vfs->xDelete = vfsDelete;
-	vfs->xAccess = vfsAccess;
-	vfs->xFullPathname = vfsFullPathname;
-	vfs->xDlOpen = vfsDlOpen;
-	vfs->xDlError = vfsDlError;
-	vfs->xDlSym = vfsDlSym;
-	vfs->xDlClose = vfsDlClose;
-	vfs->xRandomness = vfsRandomness;
-	vfs->xSleep = vfsSleep;
-	vfs->xCurrentTime = vfsCurrentTime;
-	vfs->xGetLastError = vfsGetLastError;
-	vfs->xCurrentTimeInt64 = vfsCurrentTimeInt64;
-	vfs->zName = name;
+	unsigned n_leaves =
+	    (n_pages + VFS__PAGE_LEAF_SIZE - 1) / VFS__PAGE_LEAF_SIZE;
+	unsigned i;
 
-	return 0;
-}
+	assert(d->n_pages == 0);
+	assert(d->n_leaves == 0);
+	assert(d->n_slabs == 0);
 
-int VfsInitV1(struct sqlite3_vfs *vfs, const char *name)
-{
-	int rv;
+	if (n_pages == 0) {
+		return SQLITE_OK;
+	}
 
-	rv = vfsInit(vfs, name, VFS__V1);
-	if (rv != 0) {
-		return rv;
+	d->leaves = sqlite3_malloc64(sizeof *d->leaves * n_leaves);
+	if (d->leaves == NULL) {
+		goto oom;
+	}
+	d->usage.overhead += (size_t)sqlite3_msize(d->leaves);
+	for (i = 0; i < n_leaves; i++) {
+		struct vfsLeaf *leaf = vfsLeafCreate();
+		if (leaf == NULL) {
+			goto oom;
+		}
+		d->leaves[i] = leaf;
+		d->n_leaves++;
+		d->usage.overhead += (size_t)sqlite3_msize(leaf);
 	}
 
-	sqlite3_vfs_register(vfs, 0);
+	return SQLITE_OK;
 
-	return 0;
+oom:
+	vfsDatabaseShrink(d, 0);
+	return SQLITE_NOMEM;
 }
 
-int VfsInitV2(struct sqlite3_vfs *vfs, const char *name)
+/* Append a run of @n_pages pages to a database whose index was presized by
+ * vfsDatabaseLoadIndex(), copying them in runs as big as the largest slab.
+ *
+ * If @image is given, @data points into its mapping and nothing is copied:
+ * each slab reads its pages from its own region of the image, until it's
+ * written. If an error is returned, the pages of the run are dropped. */
+static int vfsDatabaseLoadRun(struct vfsDatabase *d,
+			      const uint8_t *data,
+			      unsigned n_pages,
+			      struct vfsImage *image)
 {
-	return vfsInit(vfs, name, VFS__V2);
-}
+	unsigned max = vfsDatabaseSlabMaxPages(d);
+	unsigned n_slabs = (n_pages + max - 1) / max;
+	unsigned last = d->n_pages + n_pages;
+	struct vfsSlab **slabs;
+	size_t size;
+	unsigned i;
 
-void VfsClose(struct sqlite3_vfs *vfs)
-{
-	struct vfs *v = vfs->pAppData;
-	if (v->version == VFS__V1) {
-		sqlite3_vfs_unregister(vfs);
-	}
-	vfsDestroy(v);
-	sqlite3_free(v);
-}
+	assert(d->page_size > 0);
+	assert(last <= d->n_leaves * VFS__PAGE_LEAF_SIZE);
 
-static int vfsWalPoll(struct vfsWal *w, dqlite_vfs_frame **frames, unsigned *n)
-{
-	unsigned i;
+	if (n_pages == 0) {
+		return SQLITE_OK;
+	}
 
-	if (w->n_tx == 0) {
-		assert(w->tx == NULL);
-		*frames = NULL;
-		*n = 0;
-		return 0;
+	size = (size_t)sqlite3_msize(d->slabs);
+	slabs = sqlite3_realloc64(d->slabs,
+				  sizeof *slabs * (d->n_slabs + n_slabs));
+	if (slabs == NULL) {
+		return SQLITE_NOMEM;
 	}
+	d->slabs = slabs;
+	d->usage.overhead += (size_t)sqlite3_msize(slabs) - size;
+
+	while (d->n_pages < last) {
+		struct vfsSlab *slab;
+		uint8_t *pages;
+		unsigned n = last - d->n_pages;
+		if (n > max) {
+			n = max;
+		}
 
-	*frames = sqlite3_malloc64(sizeof **frames * w->n_tx);
-	if (*frames == NULL) {
-		return DQLITE_NOMEM;
+		if (image != NULL) {
+			slab = vfsSlabCreate(d->n_pages + 1, n, 0, false);
+		} else {
+			slab = vfsSlabCreate(d->n_pages + 1, n,
+					     (size_t)n * d->page_size,
+					     vfsDatabaseSlabHuge(d, n));
+		}
+		if (slab == NULL) {
+			goto oom;
+		}
+		slab->epoch = d->checkpoints;
+		if (image != NULL) {
+			vfsRef(&image->refcount);
+			slab->hot = false;
+			slab->image = image;
+			slab->map = (uint8_t *)data;
+			slab->size = (size_t)n * d->page_size;
+			pages = slab->map;
+		} else {
+			memcpy(slab->data, data, (size_t)n * d->page_size);
+			pages = slab->data;
+		}
+		d->slabs[d->n_slabs] = slab;
+		d->n_slabs++;
+		vfsDatabaseSlabCharge(d, slab);
+
+		for (i = 0; i < n; i++) {
+			unsigned j;
+			struct vfsLeaf *leaf =
+			    vfsDatabaseLeaf(d, slab->first + i, &j);
+			leaf->pages[j] = pages + (size_t)i * d->page_size;
+		}
+		d->n_pages += n;
+		data += (size_t)n * d->page_size;
 	}
-	*n = w->n_tx;
 
-	for (i = 0; i < w->n_tx; i++) {
-		dqlite_vfs_frame *frame = &(*frames)[i];
-		frame->data = w->tx[i]->buf;
-		formatWalGetFramePageNumber(w->tx[i]->hdr, &frame->page_number);
-		/* Release the vfsFrame object, but not its buf attribute, since
-		 * responsibility for that memory has been transferred to the
-		 * caller. */
-		sqlite3_free(w->tx[i]);
+	if (d->spill != NULL) {
+		vfsDatabaseSpillOverBudget(d, NULL);
 	}
 
-	w->n_tx = 0;
+	return SQLITE_OK;
 
-	return 0;
+oom:
+	/* Only release the slabs of this run, keeping the presized leaves. */
+	while (d->n_slabs > 0 &&
+	       d->slabs[d->n_slabs - 1]->first > last - n_pages) {
+		struct vfsSlab *slab = d->slabs[d->n_slabs - 1];
+		unsigned k;
+		for (k = 0; k < slab->n_pages && slab->first + k <= d->n_pages;
+		     k++) {
+			unsigned j;
+			vfsDatabaseLeaf(d, slab->first + k, &j)->pages[j] = NULL;
+		}
+		vfsDatabaseSlabDischarge(d, slab);
+		vfsSlabUnref(slab);
+		d->n_slabs--;
+	}
+	d->n_pages = last - n_pages;
+	return SQLITE_NOMEM;
 }
 
-int VfsPoll(sqlite3_vfs *vfs,
-	    const char *filename,
-	    dqlite_vfs_frame **frames,
-	    unsigned *n)
+/* Load the content of a whole database file into an empty database, see
+ * vfsDatabaseLoadRun(). */
+static int vfsDatabaseLoad(struct vfsDatabase *d,
+			   const uint8_t *data,
+			   unsigned n_pages,
+			   struct vfsImage *image)
 {
-	struct vfs *v;
-	struct vfsContent *content;
-	struct vfsShm *shm;
-	struct vfsWal *wal;
 	int rv;
 
-	v = (struct vfs *)(vfs->pAppData);
-	content = vfsContentLookup(v, filename);
-
-	if (content == NULL || content->type != VFS__DATABASE) {
-		return DQLITE_ERROR;
-	}
-
-	shm = &content->database.shm;
-	wal = content->database.wal;
-
-	if (wal == NULL) {
-		*frames = NULL;
-		*n = 0;
-		return 0;
-	}
-
-	rv = vfsShmLock(shm, 0, 1, SQLITE_SHM_EXCLUSIVE);
-	if (rv != 0) {
+	rv = vfsDatabaseLoadIndex(d, n_pages);
+	if (rv != SQLITE_OK) {
 		return rv;
 	}
-
-	rv = vfsWalPoll(wal, frames, n);
-	if (rv != 0) {
+	rv = vfsDatabaseLoadRun(d, data, n_pages, image);
+	if (rv != SQLITE_OK) {
+		vfsDatabaseShrink(d, 0);
 		return rv;
 	}
 
-	return 0;
+	return SQLITE_OK;
 }
 
-static int vfsWalCommit(struct vfsWal *w,
-			unsigned n,
-			unsigned *page_numbers,
-			void *data)
+/* Presize the frame array of an empty WAL for @n_frames frames and set its
+ * header, before loading the frames with vfsWalLoadRun(). */
+static int vfsWalLoadIndex(struct vfsWal *w,
+			   const uint8_t *hdr,
+			   unsigned n_frames)
 {
-	struct vfsFrame **frames; /* New frames array. */
-	struct vfsShm *shm;
-	unsigned page_size = w->database->page_size;
-	unsigned i;
-	unsigned j;
-	bool native;
-	unsigned salt1;
-	unsigned salt2;
-	unsigned checksum1;
-	unsigned checksum2;
+	assert(w->n_frames == 0);
+	assert(w->frames == NULL);
 
-	formatWalGetNativeChecksum(w->hdr, &native);
-	formatWalGetSalt(w->hdr, &salt1, &salt2);
-	if (w->n_frames == 0) {
-		formatWalGetChecksums(w->hdr, &checksum1, &checksum2);
-	} else {
-		struct vfsFrame *frame = w->frames[w->n_frames - 1];
-		formatWalGetFrameChecksums(frame->hdr, &checksum1, &checksum2);
+	if (n_frames > 0) {
+		w->frames = sqlite3_malloc64(sizeof *w->frames * n_frames);
+		if (w->frames == NULL) {
+			return SQLITE_NOMEM;
+		}
+		w->database->usage.overhead += (size_t)sqlite3_msize(w->frames);
 	}
 
-	frames =
-	    sqlite3_realloc64(w->frames, sizeof *frames * (w->n_frames + n));
-	if (frames == NULL) {
-		goto oom;
-	}
-	w->frames = frames;
+	memcpy(w->hdr, hdr, FORMAT__WAL_HDR_SIZE);
 
-	for (i = 0; i < n; i++) {
-		struct vfsFrame *frame = vfsFrameCreate(page_size);
-		unsigned database_size;
-		void *page = data + i * page_size;
+	return SQLITE_OK;
+}
+
+/* Append a run of @n_frames frames to a WAL whose frame array was presized by
+ * vfsWalLoadIndex(). Frame headers are copied verbatim, so their checksums are
+ * preserved. If an error is returned, the frames of the run are dropped. */
+static int vfsWalLoadRun(struct vfsWal *w, const uint8_t *data, unsigned n_frames)
+{
+	unsigned page_size = w->database->page_size;
+	unsigned n = w->n_frames;
+	unsigned i;
 
+	for (i = 0; i < n_frames; i++) {
+		struct vfsFrame *frame = vfsFrameCreate(w->pool, page_size);
 		if (frame == NULL) {
-			goto oom_after_frames_alloc;
+			goto oom;
 		}
-
-		/* For commit records, the size of the database file in pages
-		 * after the commit. For all other records, zero. */
-		database_size = i == n - 1 ? page_numbers[i] : 0;
-
-		formatWalPutFrameHeader(native, page_numbers[i], database_size,
-					salt1, salt2, &checksum1, &checksum2,
-					frame->hdr, page, page_size);
-		memcpy(frame->buf, page, page_size);
-
-		frames[w->n_frames + i] = frame;
+		memcpy(frame->hdr, data, FORMAT__WAL_FRAME_HDR_SIZE);
+		data += FORMAT__WAL_FRAME_HDR_SIZE;
+		memcpy(frame->buf, data, page_size);
+		data += page_size;
+		vfsFrameHold(w->database, frame, VFS__FRAME_WAL);
+		w->frames[w->n_frames] = frame;
+		w->n_frames++;
 	}
+	w->n_checksummed = w->n_frames;
 
-	w->n_frames += n;
-
-	/* A write lock is held it means that this is the VFS that orginated
-	 * this commit. Let's release the lock and update the WAL index. */
-	shm = &w->database->shm;
-	if (shm->exclusive[0] == 1) {
-		shm->exclusive[0] = 0;
-		vfsWalReverIndexHeader(w);
-	}
-
-	return 0;
+	return SQLITE_OK;
 
-oom_after_frames_alloc:
-	for (j = 0; j < i; j++) {
-		vfsFrameDestroy(frames[w->n_frames + j]);
-	}
 oom:
-	return DQLITE_NOMEM;
+	while (w->n_frames > n) {
+		w->n_frames--;
+		vfsFrameUnhold(w->database, w->frames[w->n_frames],
+			       VFS__FRAME_WAL);
+		vfsFrameDestroy(w->pool, w->frames[w->n_frames]);
+	}
+	w->n_checksummed = w->n_frames;
+	return SQLITE_NOMEM;
 }
 
-int VfsCommit(sqlite3_vfs *vfs,
-	      const char *filename,
-	      unsigned n,
-	      unsigned *page_numbers,
-	      void *frames)
+/* Open a file of the given type, creating it if it doesn't exist. */
+static int vfsRestoreOpen(sqlite3_vfs *vfs,
+			  const char *filename,
+			  int type,
+			  sqlite3_file **file)
 {
-	struct vfs *v;
-	struct vfsContent *content;
-	struct vfsWal *wal;
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | type;
 	int rv;
 
-	v = (struct vfs *)(vfs->pAppData);
-	content = vfsContentLookup(v, filename);
-
-	wal = content->database.wal;
-
-	rv = vfsWalCommit(wal, n, page_numbers, frames);
-	if (rv != 0) {
+	*file = sqlite3_malloc(vfs->szOsFile);
+	if (*file == NULL) {
+		return SQLITE_NOMEM;
+	}
+	rv = vfs->xOpen(vfs, filename, *file, flags, &flags);
+	if (rv != SQLITE_OK) {
+		sqlite3_free(*file);
 		return rv;
 	}
 
-	return 0;
+	return SQLITE_OK;
 }
 
-/* Check if the given filename is a WAL filename. */
-static bool vfsIsWalFilename(const char *filename)
+/* Close a file opened with vfsRestoreOpen(). */
+static void vfsRestoreClose(sqlite3_file *file)
 {
-	/* TODO: improve the check. */
-	if (strstr(filename, "-wal") != NULL) {
-		return true;
+	file->pMethods->xClose(file);
+	sqlite3_free(file);
+}
+
+/* Incremental restore of a database and of its WAL. */
+struct vfsRestore
+{
+	sqlite3_file *main_file; /* Main database file being restored. */
+	sqlite3_file *wal_file;  /* WAL file being restored, if any. */
+	size_t main_size;        /* Size of the main database image. */
+	size_t wal_size;         /* Size of the WAL image. */
+	size_t main_offset;      /* Bytes of the main image written so far. */
+	size_t wal_offset;       /* Bytes of the WAL image written so far. */
+};
+
+/* Drop the content of the database being restored and of its WAL. */
+static int vfsRestoreReset(struct vfsRestore *r)
+{
+	struct vfsFile *main_file = (struct vfsFile *)r->main_file;
+	struct vfsDatabase *database = &main_file->content->database;
+	int rv = SQLITE_OK;
+
+	vfsFileLockContent(main_file);
+	if (database->wal != NULL) {
+		rv = vfsWalTruncate(database->wal, 0);
 	}
+	if (rv == SQLITE_OK) {
+		rv = vfsDatabaseTruncate(database, 0);
+	}
+	vfsFileUnlockContent(main_file);
 
-	return false;
+	return rv;
 }
 
-int VfsFileRead(const char *vfs_name,
-		const char *filename,
-		void **buf,
-		size_t *len)
+int VfsRestoreStart(const char *vfs_name,
+		    const char *filename,
+		    size_t main_size,
+		    size_t wal_size,
+		    struct vfsRestore **restore)
 {
 	sqlite3_vfs *vfs;
-	bool is_wal;
-	int flags;
-	sqlite3_file *file;
-	sqlite3_int64 file_size;
-	unsigned page_size;
-	sqlite3_int64 offset;
-	int rc;
+	struct vfsRestore *r;
+	char *wal_filename;
+	int rv;
 
 	assert(vfs_name != NULL);
 	assert(filename != NULL);
-	assert(buf != NULL);
-	assert(len != NULL);
 
-	/* Lookup the VFS object to use. */
 	vfs = sqlite3_vfs_find(vfs_name);
 	if (vfs == NULL) {
-		rc = SQLITE_ERROR;
+		rv = SQLITE_ERROR;
 		goto err;
 	}
 
-	is_wal = vfsIsWalFilename(filename);
-
-	/* Common flags */
-	flags = SQLITE_OPEN_READWRITE;
-
-	if (is_wal) {
-		flags |= SQLITE_OPEN_WAL;
-	} else {
-		flags |= SQLITE_OPEN_MAIN_DB;
+	if (main_size < FORMAT__DB_HDR_SIZE ||
+	    (wal_size > 0 && wal_size < FORMAT__WAL_HDR_SIZE)) {
+		rv = SQLITE_CORRUPT;
+		goto err;
 	}
 
-	/* Open the file */
-	file = sqlite3_malloc(vfs->szOsFile);
-	if (file == NULL) {
-		rc = SQLITE_NOMEM;
+	r = sqlite3_malloc(sizeof *r);
+	if (r == NULL) {
+		rv = SQLITE_NOMEM;
 		goto err;
 	}
-
-	rc = vfs->xOpen(vfs, filename, file, flags, &flags);
-	if (rc != SQLITE_OK) {
-		goto err_after_file_malloc;
+	r->wal_file = NULL;
+	r->main_size = main_size;
+	r->wal_size = wal_size;
+	r->main_offset = 0;
+	r->wal_offset = 0;
+
+	rv = vfsRestoreOpen(vfs, filename, SQLITE_OPEN_MAIN_DB, &r->main_file);
+	if (rv != SQLITE_OK) {
+		goto err_after_alloc;
 	}
 
-	/* Get the file size */
-	rc = file->pMethods->xFileSize(file, &file_size);
-	if (rc != SQLITE_OK) {
-		goto err_after_file_open;
+	/* Drop any existing content, including the WAL frames. */
+	rv = vfsRestoreReset(r);
+	if (rv != SQLITE_OK) {
+		goto err_after_main_file_open;
 	}
-	*len = (size_t)file_size;
 
-	/* Check if the file is empty. */
-	if (*len == 0) {
-		*buf = NULL;
-		goto out;
+	if (wal_size > 0) {
+		wal_filename = sqlite3_mprintf("%s-wal", filename);
+		if (wal_filename == NULL) {
+			rv = SQLITE_NOMEM;
+			goto err_after_main_file_open;
+		}
+		rv = vfsRestoreOpen(vfs, wal_filename, SQLITE_OPEN_WAL,
+				    &r->wal_file);
+		sqlite3_free(wal_filename);
+		if (rv != SQLITE_OK) {
+			goto err_after_main_file_open;
+		}
 	}
 
-	/* Allocate the read buffer.
-	 *
-	 * TODO: we should fix the tests and use sqlite3_malloc instead. */
-	*buf = raft_malloc(*len);
-	if (*buf == NULL) {
-		rc = SQLITE_NOMEM;
-		goto err_after_file_open;
-	}
+	*restore = r;
 
-	/* Read the header. The buffer size is enough for both database and WAL
-	 * files. */
-	rc = file->pMethods->xRead(file, *buf, FORMAT__WAL_HDR_SIZE, 0);
-	if (rc != SQLITE_OK) {
-		goto err_after_buf_malloc;
+	return SQLITE_OK;
+
+err_after_main_file_open:
+	vfsRestoreClose(r->main_file);
+err_after_alloc:
+	sqlite3_free(r);
+err:
+	assert(rv != SQLITE_OK);
+	*restore = NULL;
+	return rv;
+}
+
+/* Append a piece of the main database image. The first piece sets the page
+ * size and presizes the page index. */
+static int vfsRestoreWriteDatabase(struct vfsRestore *r,
+				   struct vfsDatabase *d,
+				   const uint8_t *buf,
+				   size_t len)
+{
+	unsigned page_size;
+	int rv;
+
+	if (r->main_offset == 0) {
+		if (len < FORMAT__DB_HDR_SIZE) {
+			return SQLITE_CORRUPT;
+		}
+		formatDatabaseGetPageSize(buf, &page_size);
+		if (page_size == 0 || r->main_size % page_size != 0) {
+			return SQLITE_CORRUPT;
+		}
+		d->page_size = page_size;
+		rv = vfsDatabaseLoadIndex(d,
+					  (unsigned)(r->main_size / page_size));
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
 	}
 
-	/* Figure the page size. */
-	if (is_wal) {
-		formatWalGetPageSize(*buf, &page_size);
-	} else {
-		formatDatabaseGetPageSize(*buf, &page_size);
+	if (len % d->page_size != 0) {
+		return SQLITE_CORRUPT;
 	}
+
+	return vfsDatabaseLoadRun(d, buf, (unsigned)(len / d->page_size), NULL);
+}
+
+/* Append a piece of the WAL image. The first piece must hold the WAL header,
+ * whose page size must match the one of the main image. */
+static int vfsRestoreWriteWal(struct vfsRestore *r,
+			      struct vfsWal *w,
+			      const uint8_t *buf,
+			      size_t len)
+{
+	unsigned page_size = w->database->page_size;
+	size_t frame_size = FORMAT__WAL_FRAME_HDR_SIZE + page_size;
+	int rv;
+
 	if (page_size == 0) {
-		rc = SQLITE_CORRUPT;
-		goto err_after_buf_malloc;
+		return SQLITE_CORRUPT;
 	}
 
-	offset = 0;
+	if (r->wal_offset == 0) {
+		unsigned wal_page_size;
+		if (len < FORMAT__WAL_HDR_SIZE) {
+			return SQLITE_CORRUPT;
+		}
+		formatWalGetPageSize(buf, &wal_page_size);
+		if (wal_page_size != page_size ||
+		    (r->wal_size - FORMAT__WAL_HDR_SIZE) % frame_size != 0) {
+			return SQLITE_CORRUPT;
+		}
+		rv = vfsWalLoadIndex(
+		    w, buf,
+		    (unsigned)((r->wal_size - FORMAT__WAL_HDR_SIZE) /
+			       frame_size));
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+		buf += FORMAT__WAL_HDR_SIZE;
+		len -= FORMAT__WAL_HDR_SIZE;
+	}
 
-	/* If this is a WAL file , we have already read the header and we can
-	 * move on. */
-	if (is_wal) {
-		offset += FORMAT__WAL_HDR_SIZE;
+	if (len % frame_size != 0) {
+		return SQLITE_CORRUPT;
 	}
 
-	while ((size_t)offset < *len) {
-		uint8_t *pos = (*buf) + offset;
+	return vfsWalLoadRun(w, buf, (unsigned)(len / frame_size));
+}
 
-		if (is_wal) {
-			/* Read the frame header */
-			rc = file->pMethods->xRead(
-			    file, pos, FORMAT__WAL_FRAME_HDR_SIZE, offset);
-			if (rc != SQLITE_OK) {
-				goto err_after_buf_malloc;
-			}
-			offset += FORMAT__WAL_FRAME_HDR_SIZE;
-			pos += FORMAT__WAL_FRAME_HDR_SIZE;
-		}
+int VfsRestoreWrite(struct vfsRestore *r,
+		    bool wal,
+		    size_t offset,
+		    const void *buf,
+		    size_t len)
+{
+	struct vfsFile *file;
+	size_t *written = wal ? &r->wal_offset : &r->main_offset;
+	size_t size = wal ? r->wal_size : r->main_size;
+	int rv;
 
-		/* Read the page */
-		rc = file->pMethods->xRead(file, pos, (int)page_size, offset);
-		if (rc != SQLITE_OK) {
-			goto err_after_buf_malloc;
-		}
-		offset += page_size;
-	};
+	if (offset != *written || len > size - offset) {
+		return SQLITE_CORRUPT;
+	}
 
-out:
-	file->pMethods->xClose(file);
-	sqlite3_free(file);
+	/* The main image goes first, since it sets the page size. */
+	if (wal && (r->wal_file == NULL || r->main_offset == 0)) {
+		return SQLITE_CORRUPT;
+	}
 
-	return SQLITE_OK;
+	file = (struct vfsFile *)(wal ? r->wal_file : r->main_file);
+	vfsFileLockContent(file);
+	if (wal) {
+		rv = vfsRestoreWriteWal(r, &file->content->wal, buf, len);
+	} else {
+		rv = vfsRestoreWriteDatabase(r, &file->content->database, buf,
+					     len);
+	}
+	vfsFileUnlockContent(file);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
 
-err_after_buf_malloc:
-	sqlite3_free(*buf);
+	*written += len;
 
-err_after_file_open:
-	file->pMethods->xClose(file);
+	return SQLITE_OK;
+}
 
-err_after_file_malloc:
-	sqlite3_free(file);
+int VfsRestoreFinish(struct vfsRestore *r)
+{
+	if (r->main_offset != r->main_size || r->wal_offset != r->wal_size) {
+		VfsRestoreAbort(r);
+		return SQLITE_CORRUPT;
+	}
 
-err:
-	assert(rc != SQLITE_OK);
+	if (r->wal_file != NULL) {
+		vfsRestoreClose(r->wal_file);
+	}
+	vfsRestoreClose(r->main_file);
+	sqlite3_free(r);
 
-	*buf = NULL;
-	*len = 0;
+	return SQLITE_OK;
+}
 
-	return rc;
+void VfsRestoreAbort(struct vfsRestore *r)
+{
+	vfsRestoreReset(r);
+	if (r->wal_file != NULL) {
+		vfsRestoreClose(r->wal_file);
+	}
+	vfsRestoreClose(r->main_file);
+	sqlite3_free(r);
 }
 
-int VfsFileWrite(const char *vfs_name,
-		 const char *filename,
-		 const void *buf,
-		 size_t len)
+int VfsRestore(const char *vfs_name,
+	       const char *filename,
+	       const void *main,
+	       size_t main_size,
+	       const void *wal,
+	       size_t wal_size)
 {
-	sqlite3_vfs *vfs;
-	sqlite3_file *file;
-	bool is_wal;
-	int flags;
-	unsigned int page_size;
-	sqlite3_int64 offset;
-	const uint8_t *pos;
-	int rc;
+	struct vfsRestore *r;
+	unsigned page_size;
+	int rv;
 
-	assert(vfs_name != NULL);
-	assert(filename != NULL);
-	assert(buf != NULL);
-	assert(len > 0);
+	assert(main != NULL);
 
-	/* Lookup the VFS object to use. */
-	vfs = sqlite3_vfs_find(vfs_name);
-	if (vfs == NULL) {
-		rc = SQLITE_ERROR;
-		goto err;
+	/* Validate the layout of both files before touching anything. */
+	if (main_size < FORMAT__DB_HDR_SIZE) {
+		return SQLITE_CORRUPT;
+	}
+	formatDatabaseGetPageSize(main, &page_size);
+	if (page_size == 0 || main_size % page_size != 0) {
+		return SQLITE_CORRUPT;
+	}
+	if (wal_size > 0) {
+		size_t frame_size = FORMAT__WAL_FRAME_HDR_SIZE + page_size;
+		unsigned wal_page_size;
+		if (wal_size < FORMAT__WAL_HDR_SIZE) {
+			return SQLITE_CORRUPT;
+		}
+		formatWalGetPageSize(wal, &wal_page_size);
+		if (wal_page_size != page_size ||
+		    (wal_size - FORMAT__WAL_HDR_SIZE) % frame_size != 0) {
+			return SQLITE_CORRUPT;
+		}
 	}
 
-	/* Determine if this is a database or a WAL file. */
-	is_wal = vfsIsWalFilename(filename);
+	rv = VfsRestoreStart(vfs_name, filename, main_size, wal_size, &r);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+	rv = VfsRestoreWrite(r, false, 0, main, main_size);
+	if (rv == SQLITE_OK && wal_size > 0) {
+		rv = VfsRestoreWrite(r, true, 0, wal, wal_size);
+	}
+	if (rv != SQLITE_OK) {
+		VfsRestoreAbort(r);
+		return rv;
+	}
 
-	/* Common flags */
-	flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	return VfsRestoreFinish(r);
+}
 
-	if (is_wal) {
-		flags |= SQLITE_OPEN_WAL;
-	} else {
-		flags |= SQLITE_OPEN_MAIN_DB;
-	}
+int VfsLoadImage(sqlite3_vfs *vfs, const char *filename, int fd)
+{
+	sqlite3_file *main_file;
+	struct vfsDatabase *database;
+	struct vfsImage *image;
+	struct stat st;
+	unsigned page_size;
+	int rv;
 
-	/* Open the file */
-	file = (sqlite3_file *)sqlite3_malloc(vfs->szOsFile);
-	if (file == NULL) {
-		rc = SQLITE_NOMEM;
+	assert(filename != NULL);
+
+	if (fstat(fd, &st) != 0) {
+		rv = SQLITE_IOERR_FSTAT;
 		goto err;
 	}
-	rc = vfs->xOpen(vfs, filename, file, flags, &flags);
-	if (rc != SQLITE_OK) {
-		goto err_after_file_malloc;
+	if (st.st_size < FORMAT__DB_HDR_SIZE) {
+		rv = SQLITE_CORRUPT;
+		goto err;
 	}
 
-	/* Truncate any existing content. */
-	rc = file->pMethods->xTruncate(file, 0);
-	if (rc != SQLITE_OK) {
-		goto err_after_file_malloc;
+	image = vfsImageMap(fd, (size_t)st.st_size);
+	if (image == NULL) {
+		rv = SQLITE_IOERR_MMAP;
+		goto err;
 	}
 
-	/* Figure out the page size */
-	if (is_wal) {
-		formatWalGetPageSize(buf, &page_size);
-	} else {
-		formatDatabaseGetPageSize(buf, &page_size);
+	/* Validate the layout of the file before touching anything. */
+	formatDatabaseGetPageSize(image->map, &page_size);
+	if (page_size == 0 || image->size % page_size != 0) {
+		rv = SQLITE_CORRUPT;
+		goto err_after_image_map;
 	}
-	if (page_size == 0) {
-		rc = SQLITE_CORRUPT;
-		goto err_after_file_open;
+
+	rv = vfsRestoreOpen(vfs, filename, SQLITE_OPEN_MAIN_DB, &main_file);
+	if (rv != SQLITE_OK) {
+		goto err_after_image_map;
 	}
+	database = &((struct vfsFile *)main_file)->content->database;
 
-	offset = 0;
-	pos = buf;
+	vfsFileLockContent((struct vfsFile *)main_file);
 
-	/* If this is a WAL file , write the header first. */
-	if (is_wal) {
-		rc = file->pMethods->xWrite(file, pos, FORMAT__WAL_HDR_SIZE,
-					    offset);
-		if (rc != SQLITE_OK) {
-			goto err_after_file_open;
-		}
-		offset += FORMAT__WAL_HDR_SIZE;
-		pos += FORMAT__WAL_HDR_SIZE;
+	/* Drop any existing content, including the WAL frames. */
+	if (database->wal != NULL) {
+		rv = vfsWalTruncate(database->wal, 0);
+	}
+	if (rv == SQLITE_OK) {
+		rv = vfsDatabaseTruncate(database, 0);
+	}
+	if (rv == SQLITE_OK) {
+		database->page_size = page_size;
+		rv = vfsDatabaseLoad(database, image->map,
+				     (unsigned)(image->size / page_size),
+				     image);
+	}
+	if (rv == SQLITE_OK) {
+		/* Hand our reference over to the database. */
+		database->image = image;
 	}
 
-	while ((size_t)offset < len) {
-		if (is_wal) {
-			/* Write the frame header */
-			rc = file->pMethods->xWrite(
-			    file, pos, FORMAT__WAL_FRAME_HDR_SIZE, offset);
-			if (rc != SQLITE_OK) {
-				goto err_after_file_open;
-			}
-			offset += FORMAT__WAL_FRAME_HDR_SIZE;
-			pos += FORMAT__WAL_FRAME_HDR_SIZE;
-		}
-
-		/* Write the page */
-		rc = file->pMethods->xWrite(file, pos, (int)page_size, offset);
-		if (rc != SQLITE_OK) {
-			goto err_after_file_open;
-		}
-		offset += page_size;
-		pos += page_size;
-	};
+	vfsFileUnlockContent((struct vfsFile *)main_file);
+	vfsRestoreClose(main_file);
 
-	file->pMethods->xClose(file);
-	sqlite3_free(file);
+	if (rv != SQLITE_OK) {
+		goto err_after_image_map;
+	}
 
 	return SQLITE_OK;
 
-err_after_file_open:
-	file->pMethods->xClose(file);
-
-err_after_file_malloc:
-	sqlite3_free(file);
-
+err_after_image_map:
+	vfsImageUnref(image);
 err:
-	assert(rc != SQLITE_OK);
-
-	return rc;
+	assert(rv != SQLITE_OK);
+	return rv;
 }
@@ -1,6 +1,8 @@
 #ifndef VFS_H_
 #define VFS_H_
 
+#include <stdbool.h>
+
 #include <sqlite3.h>
 
 #include "config.h"
@@ -19,6 +21,15 @@ int VfsInitV1(struct sqlite3_vfs *vfs, const char *name);
  * implementation. */
 int VfsInitV2(struct sqlite3_vfs *vfs, const char *name);
 
+/* Make the given VFS safe to use from multiple threads at once, for example by
+ * connections running queries on worker threads.
+ *
+ * Access to the set of files is serialized by a reader/writer lock, and access
+ * to the content of each database and of its WAL by a per-database mutex. This
+ * must be called right after initialization, before the VFS is used. If it's
+ * not called, the VFS doesn't do any locking. */
+void VfsEnableThreadSafety(struct sqlite3_vfs *vfs);
+
 /* Release all memory associated with the given dqlite in-memory VFS
  * implementation.
  *
@@ -33,6 +44,14 @@ int VfsPoll(sqlite3_vfs *vfs,
 	    dqlite_vfs_frame **frames,
 	    unsigned *n);
 
+/* Like VfsPoll(), but return the frames as a single buffer of @len bytes,
+ * allocated with sqlite3_malloc(), laid out like the frames of a FRAMES
+ * command, see command.h. */
+int VfsPollBatch(sqlite3_vfs *vfs,
+		 const char *database,
+		 void **buf,
+		 size_t *len);
+
 /* Append the given frames to the WAL. */
 int VfsCommit(sqlite3_vfs *vfs,
 	      const char *filename,
@@ -40,6 +59,138 @@ int VfsCommit(sqlite3_vfs *vfs,
 	      unsigned *page_numbers,
 	      void *frames);
 
+/* Like VfsCommit(), but instead of copying the pages in @frames, take
+ * ownership of the buffer and make the new WAL frames point into it. Once all
+ * frames are removed from the WAL, for example by a checkpoint, the @release
+ * callback is invoked with @arg. The buffer must not be modified until then.
+ *
+ * If an error is returned, the ownership of the buffer is not transferred. */
+int VfsCommitAdopt(sqlite3_vfs *vfs,
+		   const char *filename,
+		   unsigned n,
+		   unsigned *page_numbers,
+		   void *frames,
+		   void (*release)(void *arg),
+		   void *arg);
+
+/* Append the frames of a batch returned by VfsPollBatch() to the WAL. If
+ * @release is NULL the pages are copied, otherwise the buffer is adopted like
+ * VfsCommitAdopt() does. Fails with DQLITE_MISUSE if the batch is malformed or
+ * its page size doesn't match the database, and with DQLITE_ERROR if there's no
+ * such database or it has no WAL. */
+int VfsCommitBatch(sqlite3_vfs *vfs,
+		   const char *filename,
+		   void *buf,
+		   size_t len,
+		   void (*release)(void *arg),
+		   void *arg);
+
+/* Return the number of WAL frames that were allocated by recycling a frame
+ * released by a previous WAL truncation (hits), and the number of frames that
+ * had to be allocated from the heap (misses). */
+void VfsFramePoolStats(sqlite3_vfs *vfs,
+		       unsigned long long *hits,
+		       unsigned long long *misses);
+
+/* Return the memory used by the given database file and by its WAL. Fails with
+ * DQLITE_ERROR if there's no such database. */
+int VfsStats(sqlite3_vfs *vfs,
+	     const char *filename,
+	     struct dqlite_vfs_stats *stats);
+
+/* Limit the memory that each database of the VFS, including its WAL, can use
+ * to @quota bytes, as counted by VfsStats(). A zero quota means no limit.
+ *
+ * Only SQLite writes of new WAL frames are refused with SQLITE_FULL once the
+ * quota is reached. Checkpoints, commits and restores of replicated content
+ * always go through, so the usage can temporarily exceed the quota. */
+void VfsSetQuota(sqlite3_vfs *vfs, size_t quota);
+
+/* Allow the pages of the databases of the VFS to be spilled out of memory, to
+ * an unlinked file created in the given directory.
+ *
+ * Pages are spilled a slab at a time, once they were not read or written for
+ * @idle milliseconds, see VfsSpill(), or as soon as the pages that a database
+ * keeps in memory exceed @budget bytes, least recently used first. Either can
+ * be zero to disable it. Spilled pages are faulted back into memory when read
+ * or written.
+ *
+ * Fails with DQLITE_MISUSE if spilling is already enabled, and with
+ * DQLITE_ERROR if the file can't be created. */
+int VfsEnableSpill(sqlite3_vfs *vfs,
+		   const char *dir,
+		   unsigned idle,
+		   size_t budget);
+
+/* Spill the pages of all databases that were not used in the idle period set
+ * with VfsEnableSpill(). Meant to be called periodically. */
+void VfsSpill(sqlite3_vfs *vfs);
+
+/* Keep the temporary files that SQLite opens for sorts, temporary tables and
+ * statement journals in memory, as long as all temporary files of the VFS use
+ * at most @limit bytes. Once the limit is reached, a temporary file that needs
+ * to grow is moved to an actual temporary file on disk. A zero limit puts all
+ * new temporary files on disk. The default limit is 16 MiB. */
+void VfsSetTempLimit(sqlite3_vfs *vfs, size_t limit);
+
+/* Compress the pages of the databases of the VFS that were not read or written
+ * during the last @checkpoints checkpoints, to fit more data in memory. Zero,
+ * the default, stops compressing pages, but leaves compressed pages alone.
+ *
+ * Reads of compressed pages decompress them into a small per-database cache of
+ * recently used pages, while writes decompress their whole slab. Fails with
+ * DQLITE_ERROR if dqlite was built without zlib. */
+int VfsEnableCompression(sqlite3_vfs *vfs, unsigned checkpoints);
+
+/* Back the large slabs of pages of the databases of the VFS with transparent
+ * huge pages, to reduce TLB misses when accessing large databases.
+ *
+ * Slabs grow up to the size of a huge page, and each full slab gets an aligned
+ * region mapped with MADV_HUGEPAGE. If the kernel doesn't support transparent
+ * huge pages, regions use regular pages. Fails with DQLITE_ERROR if the
+ * platform lacks MADV_HUGEPAGE. */
+int VfsEnableHugePages(sqlite3_vfs *vfs);
+
+/* Pinned, read-only view of a database and of its WAL. */
+struct vfsSnapshot;
+
+/* Pin the current content of the given database file and of its committed WAL
+ * frames, using the VFS implementation registered under the given name.
+ *
+ * Frames written by a transaction that is still in progress, or left behind by
+ * a rolled back one, are not part of the snapshot.
+ *
+ * No page is copied: the pinned pages are shared with the database and WAL, and
+ * are copied on write as long as the snapshot is alive. The snapshot must be
+ * released before closing the VFS. */
+int VfsSnapshotAcquire(const char *vfs_name,
+		       const char *filename,
+		       struct vfsSnapshot **snapshot);
+
+/* Return the sizes that the main database and WAL files had when the snapshot
+ * was acquired. */
+void VfsSnapshotSize(const struct vfsSnapshot *snapshot,
+		     size_t *main_size,
+		     size_t *wal_size);
+
+/* Return the page size of the snapshotted database, which is zero if it was
+ * never written. */
+unsigned VfsSnapshotPageSize(const struct vfsSnapshot *snapshot);
+
+/* Copy @len bytes of the snapshotted main database file, or of the WAL file if
+ * @wal is true, starting at @offset. The range must be within the file size
+ * returned by VfsSnapshotSize().
+ *
+ * Compressed pages are decompressed while copying, which can fail. */
+int VfsSnapshotRead(const struct vfsSnapshot *snapshot,
+		    bool wal,
+		    size_t offset,
+		    void *buf,
+		    size_t len);
+
+/* Unpin the content of a snapshot and release it. */
+void VfsSnapshotRelease(struct vfsSnapshot *snapshot);
+
 /* Read the content of a file, using the VFS implementation registered under the
  * given name. Used to take database snapshots using the dqlite in-memory
  * VFS. */
@@ -48,6 +199,20 @@ int VfsFileRead(const char *vfs_name,
 		void **buf,
 		size_t *len);
 
+/* Copy @len bytes of a file starting at @offset into @buf, using the VFS
+ * implementation registered under the given name, and return the size of the
+ * file in @size. Used to stream files in chunks of any size, without holding
+ * a copy of the whole file like VfsFileRead() does.
+ *
+ * Passing a zero @len just returns the file size. Fails with
+ * SQLITE_IOERR_SHORT_READ if the range goes past the end of the file. */
+int VfsFileReadChunk(const char *vfs_name,
+		     const char *filename,
+		     size_t offset,
+		     void *buf,
+		     size_t len,
+		     size_t *size);
+
 /* Write the content of a file, using the VFS implementation registered under
  * the given name. Used to restore database snapshots against the dqlite
  * in-memory VFS. If the file already exists, it's overwritten. */
@@ -56,4 +221,62 @@ int VfsFileWrite(const char *vfs_name,
 		 const void *buf,
 		 size_t len);
 
+/* Replace the content of a database file and of its WAL with the given file
+ * images, using the VFS implementation registered under the given name. Used
+ * to restore database snapshots.
+ *
+ * The page index and the WAL frame array are sized upfront and the images are
+ * copied in large runs, instead of page by page. If @wal_size is zero, the WAL
+ * is left empty. */
+int VfsRestore(const char *vfs_name,
+	       const char *filename,
+	       const void *main,
+	       size_t main_size,
+	       const void *wal,
+	       size_t wal_size);
+
+/* Incremental restore of a database file and of its WAL. */
+struct vfsRestore;
+
+/* Start replacing the content of a database file and of its WAL with images of
+ * @main_size and @wal_size bytes, using the VFS implementation registered under
+ * the given name. The images are then passed in pieces to VfsRestoreWrite(),
+ * so they never need to be held in memory as a whole.
+ *
+ * The existing content is dropped right away. */
+int VfsRestoreStart(const char *vfs_name,
+		    const char *filename,
+		    size_t main_size,
+		    size_t wal_size,
+		    struct vfsRestore **restore);
+
+/* Copy @len bytes of the main database image, or of the WAL image if @wal is
+ * true, starting at @offset.
+ *
+ * Each image must be written in order, the main one first, in pieces holding
+ * whole pages, or whole WAL frames after the WAL header. Fails with
+ * SQLITE_CORRUPT otherwise, or if the images don't match their sizes. */
+int VfsRestoreWrite(struct vfsRestore *restore,
+		    bool wal,
+		    size_t offset,
+		    const void *buf,
+		    size_t len);
+
+/* Complete a restore and release it. Fails with SQLITE_CORRUPT if the images
+ * were not written completely, in which case the restore is aborted. */
+int VfsRestoreFinish(struct vfsRestore *restore);
+
+/* Abort a restore, leaving the database and its WAL empty, and release it. */
+void VfsRestoreAbort(struct vfsRestore *restore);
+
+/* Replace the content of a database file with the SQLite database file open at
+ * @fd, and empty its WAL.
+ *
+ * The file is mapped privately and read-only, and its pages are read from the
+ * mapping, without copying them, until they're written. The mapping is kept
+ * alive by the slabs using it and by the database, so @fd can be closed right
+ * away, but the file must not be truncated while mapped. Fails with
+ * SQLITE_CORRUPT if the file is not a database image. */
+int VfsLoadImage(sqlite3_vfs *vfs, const char *filename, int fd);
+
 #endif /* VFS_H_ */
@@ -0,0 +1,77 @@
+/* Helpers shared by the benchmark programs.
+ *
+ * Each benchmark is a standalone program built with "make bench" and run by
+ * hand. Positional arguments override the default sizes, and results are
+ * printed one line per measurement. */
+
+#ifndef DQLITE_TEST_BENCH_H
+#define DQLITE_TEST_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+/* Exit with an error message if the given expression is not zero. */
+#define BENCH_CHECK(EXPR)                                                   \
+	{                                                                   \
+		int rv_ = (EXPR);                                           \
+		if (rv_ != 0) {                                             \
+			fprintf(stderr, "%s:%d: %s failed with %d\n",       \
+				__FILE__, __LINE__, #EXPR, rv_);            \
+			exit(EXIT_FAILURE);                                 \
+		}                                                           \
+	}
+
+/* Run the given SQL statements on a connection, exiting on failure. */
+#define BENCH_EXEC(CONN, SQL) \
+	BENCH_CHECK(sqlite3_exec(CONN, SQL, NULL, NULL, NULL))
+
+/* Return the time elapsed since an arbitrary point in the past, in
+ * nanoseconds. */
+static inline unsigned long long benchNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL +
+	       (unsigned long long)now.tv_nsec;
+}
+
+/* Return the @i'th positional argument as a number, or @value if it was not
+ * given. */
+static inline unsigned long benchArg(int argc,
+				     char *argv[],
+				     int i,
+				     unsigned long value)
+{
+	if (i < argc) {
+		value = strtoul(argv[i], NULL, 10);
+	}
+
+	return value;
+}
+
+/* Open a connection to the given database of the given VFS, using WAL mode and
+ * pages of @page_size bytes. */
+static inline sqlite3 *benchOpen(const char *vfs,
+				 const char *filename,
+				 unsigned page_size)
+{
+	sqlite3 *conn;
+	char sql[64];
+
+	BENCH_CHECK(sqlite3_open_v2(filename, &conn,
+				    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+				    vfs));
+	sprintf(sql, "PRAGMA page_size=%u", page_size);
+	BENCH_EXEC(conn, sql);
+	BENCH_EXEC(conn, "PRAGMA synchronous=OFF");
+	BENCH_EXEC(conn, "PRAGMA journal_mode=WAL");
+
+	return conn;
+}
+
+#endif /* DQLITE_TEST_BENCH_H */
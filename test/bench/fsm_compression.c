@@ -0,0 +1,196 @@
+/* Measure the compression ratio of snapshots and their encode and restore
+ * throughput, with each snapshot compression codec.
+ *
+ * The database holds a table of user records with two indexes, so its pages
+ * have the usual mix of text, numbers and free space.
+ *
+ * Usage: bench-fsm-compression [ROWS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <raft.h>
+
+#include "../../include/dqlite.h"
+#include "../../src/config.h"
+#include "../../src/fsm.h"
+#include "../../src/registry.h"
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Number of rows of the database, unless given on the command line. */
+#define ROWS 400000
+
+/* Number of snapshots and restores timed for each codec, keeping the
+ * fastest. */
+#define RUNS 5
+
+/* A node with its own VFS and FSM. */
+struct node
+{
+	struct config config;
+	sqlite3_vfs vfs;
+	struct registry registry;
+	struct raft_fsm fsm;
+};
+
+static void setUpNode(struct node *node, const char *name)
+{
+	BENCH_CHECK(config__init(&node->config, 1, name));
+	node->config.page_size = 4096;
+	BENCH_CHECK(VfsInitV1(&node->vfs, node->config.name));
+	registry__init(&node->registry, &node->config);
+	BENCH_CHECK(fsm__init(&node->fsm, &node->config, &node->registry,
+			      NULL));
+}
+
+static void tearDownNode(struct node *node)
+{
+	fsm__close(&node->fsm);
+	registry__close(&node->registry);
+	VfsClose(&node->vfs);
+	config__close(&node->config);
+}
+
+/* Create the database of users on the given node. */
+static sqlite3 *createDatabase(struct node *node, unsigned long rows)
+{
+	struct db *db;
+	sqlite3 *conn;
+	char sql[512];
+
+	BENCH_CHECK(registry__db_get(&node->registry, "bench.db", &db));
+	conn = benchOpen(node->config.name, "bench.db", 4096);
+	BENCH_EXEC(conn,
+		   "CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT, "
+		   "email TEXT, created INT, balance REAL, note TEXT);"
+		   "CREATE INDEX users_email ON users(email);"
+		   "CREATE INDEX users_created ON users(created)");
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %lu) "
+		"INSERT INTO users(name, email, created, balance, note) "
+		"SELECT 'user-' || x, 'user' || x || '@example.com', "
+		"1600000000 + x * 37, (x %% 1000) / 7.0, "
+		"CASE WHEN x %% 5 = 0 THEN hex(randomblob(16)) "
+		"ELSE 'active' END FROM c",
+		rows);
+	BENCH_EXEC(conn, sql);
+	BENCH_EXEC(conn, "DELETE FROM users WHERE id % 3 = 0");
+	BENCH_CHECK(sqlite3_wal_checkpoint_v2(
+	    conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL));
+
+	return conn;
+}
+
+/* Take a snapshot and join its buffers into one, as raft does before restoring
+ * it. Return the time it took to take the snapshot. */
+static unsigned long long takeSnapshot(struct node *node,
+				       struct raft_buffer *buf)
+{
+	struct raft_buffer *bufs;
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned n_bufs;
+	unsigned i;
+	char *cursor;
+
+	start = benchNow();
+	BENCH_CHECK(node->fsm.snapshot(&node->fsm, &bufs, &n_bufs));
+	elapsed = benchNow() - start;
+
+	buf->len = 0;
+	for (i = 0; i < n_bufs; i++) {
+		buf->len += bufs[i].len;
+	}
+	buf->base = raft_malloc(buf->len);
+	cursor = buf->base;
+	for (i = 0; i < n_bufs; i++) {
+		memcpy(cursor, bufs[i].base, bufs[i].len);
+		cursor += bufs[i].len;
+		raft_free(bufs[i].base);
+	}
+	raft_free(bufs);
+
+	return elapsed;
+}
+
+/* Restore the given snapshot on a fresh node, which takes ownership of it, and
+ * return the time it took. */
+static unsigned long long restoreSnapshot(struct raft_buffer *buf)
+{
+	struct node node;
+	unsigned long long start;
+	unsigned long long elapsed;
+
+	setUpNode(&node, "restore");
+	start = benchNow();
+	BENCH_CHECK(node.fsm.restore(&node.fsm, buf));
+	elapsed = benchNow() - start;
+	tearDownNode(&node);
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct
+	{
+		unsigned codec;
+		const char *name;
+	} codecs[] = {
+	    {DQLITE_SNAPSHOT_COMPRESSION_NONE, "none"},
+	    {DQLITE_SNAPSHOT_COMPRESSION_LZ4, "lz4"},
+#ifdef DQLITE_ZSTD
+	    {DQLITE_SNAPSHOT_COMPRESSION_ZSTD, "zstd"},
+#endif
+	};
+	unsigned long rows = benchArg(argc, argv, 1, ROWS);
+	struct raft_buffer buf;
+	unsigned long long encode;
+	unsigned long long restore;
+	unsigned long long elapsed;
+	struct node node;
+	sqlite3 *conn;
+	size_t size;
+	size_t len = 0;
+	double mib;
+	unsigned i;
+	unsigned j;
+
+	setUpNode(&node, "bench");
+	conn = createDatabase(&node, rows);
+	BENCH_CHECK(VfsFileReadChunk(node.config.name, "bench.db", 0, NULL, 0,
+				     &size));
+	mib = (double)size / 1048576;
+	printf("database %.1f MiB\n", mib);
+
+	for (i = 0; i < sizeof codecs / sizeof *codecs; i++) {
+		node.config.snapshot_compression = codecs[i].codec;
+		encode = 0;
+		restore = 0;
+		for (j = 0; j < RUNS; j++) {
+			elapsed = takeSnapshot(&node, &buf);
+			if (encode == 0 || elapsed < encode) {
+				encode = elapsed;
+			}
+			len = buf.len;
+			elapsed = restoreSnapshot(&buf);
+			if (restore == 0 || elapsed < restore) {
+				restore = elapsed;
+			}
+		}
+		printf("%-5s snapshot %6.1f MiB  ratio %5.2f  "
+		       "encode %6.0f MiB/s  restore %6.0f MiB/s\n",
+		       codecs[i].name, (double)len / 1048576,
+		       (double)size / (double)len, mib / ((double)encode / 1e9),
+		       mib / ((double)restore / 1e9));
+	}
+
+	BENCH_CHECK(sqlite3_close(conn));
+	tearDownNode(&node);
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+/* Measure the time it takes to take a snapshot of 1, 16 and 256 databases,
+ * encoding them one after the other on the loop thread, and in parallel on the
+ * libuv thread pool.
+ *
+ * Raft blocks the loop until the snapshot is taken, so the loop stalls for the
+ * whole wall time either way. The CPU time of the loop thread tells how much of
+ * that time it spent encoding databases itself, rather than waiting for the
+ * thread pool.
+ *
+ * Usage: bench-fsm-snapshot [KIB] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <raft.h>
+#include <uv.h>
+
+#include "../../src/config.h"
+#include "../../src/fsm.h"
+#include "../../src/registry.h"
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Size of each database in KiB, unless given on the command line. */
+#define SIZE 1024
+
+/* Number of snapshots taken for each measurement, keeping the fastest. */
+#define RUNS 5
+
+/* A node holding some databases. */
+struct node
+{
+	struct config config;
+	sqlite3_vfs vfs;
+	struct registry registry;
+	struct raft_fsm fsm;
+	struct uv_loop_s loop;
+	sqlite3 **conns;
+	unsigned n;
+};
+
+/* Create a node with @n databases of about @size bytes each. */
+static void setUpNode(struct node *node, unsigned n, size_t size)
+{
+	char filename[16];
+	char sql[256];
+	struct db *db;
+	sqlite3 *conn;
+	unsigned i;
+
+	BENCH_CHECK(config__init(&node->config, 1, "1"));
+	node->config.page_size = 4096;
+	BENCH_CHECK(VfsInitV1(&node->vfs, node->config.name));
+	registry__init(&node->registry, &node->config);
+	BENCH_CHECK(uv_loop_init(&node->loop));
+	BENCH_CHECK(fsm__init(&node->fsm, &node->config, &node->registry,
+			      NULL));
+
+	node->conns = malloc(sizeof *node->conns * n);
+	node->n = n;
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %zu) "
+		"INSERT INTO test(n, blob) SELECT x, randomblob(1000) FROM c",
+		size / 1000);
+	for (i = 0; i < n; i++) {
+		sprintf(filename, "%u.db", i);
+		BENCH_CHECK(registry__db_get(&node->registry, filename, &db));
+		conn = benchOpen(node->config.name, filename, 4096);
+		BENCH_EXEC(conn, "CREATE TABLE test (n INT, blob BLOB)");
+		BENCH_EXEC(conn, sql);
+		node->conns[i] = conn;
+	}
+}
+
+static void tearDownNode(struct node *node)
+{
+	unsigned i;
+
+	for (i = 0; i < node->n; i++) {
+		BENCH_CHECK(sqlite3_close(node->conns[i]));
+	}
+	free(node->conns);
+	fsm__close(&node->fsm);
+	registry__close(&node->registry);
+	VfsClose(&node->vfs);
+	config__close(&node->config);
+	BENCH_CHECK(uv_loop_close(&node->loop));
+}
+
+/* Return the CPU time of the calling thread, in nanoseconds. */
+static unsigned long long threadTime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL +
+	       (unsigned long long)now.tv_nsec;
+}
+
+/* Take RUNS snapshots, encoding them on the thread pool of @loop if it's not
+ * NULL, and print the fastest wall time and its CPU time on this thread. */
+static void takeSnapshots(struct node *node,
+			  struct uv_loop_s *loop,
+			  const char *name)
+{
+	struct raft_buffer *bufs;
+	unsigned n_bufs;
+	unsigned long long start;
+	unsigned long long cpu_start;
+	unsigned long long wall;
+	unsigned long long cpu;
+	unsigned long long best = 0;
+	unsigned long long best_cpu = 0;
+	size_t len = 0;
+	unsigned i;
+	unsigned j;
+
+	fsm__close(&node->fsm);
+	BENCH_CHECK(fsm__init(&node->fsm, &node->config, &node->registry,
+			      loop));
+
+	for (i = 0; i < RUNS; i++) {
+		start = benchNow();
+		cpu_start = threadTime();
+		BENCH_CHECK(node->fsm.snapshot(&node->fsm, &bufs, &n_bufs));
+		wall = benchNow() - start;
+		cpu = threadTime() - cpu_start;
+		if (best == 0 || wall < best) {
+			best = wall;
+			best_cpu = cpu;
+		}
+		len = 0;
+		for (j = 0; j < n_bufs; j++) {
+			len += bufs[j].len;
+			raft_free(bufs[j].base);
+		}
+		raft_free(bufs);
+		/* Let the requests of the thread pool complete. */
+		uv_run(&node->loop, UV_RUN_DEFAULT);
+	}
+
+	printf("databases %3u  %6.1f MiB  %-6s  wall %8.2f ms  "
+	       "loop thread cpu %8.2f ms\n",
+	       node->n, (double)len / 1048576, name, (double)best / 1e6,
+	       (double)best_cpu / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned counts[] = {1, 16, 256};
+	size_t size = benchArg(argc, argv, 1, SIZE) * 1024;
+	struct node node;
+	unsigned i;
+
+	for (i = 0; i < sizeof counts / sizeof *counts; i++) {
+		setUpNode(&node, counts[i], size);
+		takeSnapshots(&node, NULL, "serial");
+		takeSnapshots(&node, &node.loop, "pool");
+		tearDownNode(&node);
+	}
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+/* Measure the read throughput and the page cache memory of connections to a
+ * database of the in-memory VFS, when SQLite copies pages into its page cache
+ * and when it fetches them from the VFS, as set up by db__enable_fetch().
+ *
+ * Usage: bench-vfs-fetch [ROWS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/db.h"
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Number of rows of the database, unless given on the command line. */
+#define ROWS 100000
+
+/* Size of the blob of each row. */
+#define BLOB_SIZE 500
+
+/* Number of full scans and point reads timed for each mode. */
+#define SCANS 5
+#define POINT_READS 200000
+
+/* Ways for a connection to read pages, set up with the given pragmas, or by
+ * db__enable_fetch() if there are none. */
+struct mode
+{
+	const char *name;
+	const char *pragmas;
+};
+
+/* Fill the database with @rows rows and move them to the main file, since
+ * SQLite only fetches pages from there. */
+static void createDatabase(unsigned long rows)
+{
+	sqlite3 *conn = benchOpen("bench", "bench.db", 4096);
+	char sql[256];
+
+	BENCH_EXEC(conn,
+		   "CREATE TABLE test (id INTEGER PRIMARY KEY, blob BLOB)");
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %lu) "
+		"INSERT INTO test(id, blob) SELECT x, randomblob(%d) FROM c",
+		rows, BLOB_SIZE);
+	BENCH_EXEC(conn, sql);
+	BENCH_CHECK(sqlite3_wal_checkpoint_v2(
+	    conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL));
+	BENCH_CHECK(sqlite3_close(conn));
+}
+
+/* Time full scans of the table and random point reads on a connection set up
+ * with the given mode. */
+static void readDatabase(const struct mode *mode, unsigned long rows)
+{
+	sqlite3 *conn = benchOpen("bench", "bench.db", 4096);
+	sqlite3_stmt *stmt;
+	unsigned long long start;
+	double scan;
+	double point;
+	int cache;
+	int highwater;
+	unsigned long id;
+	unsigned i;
+
+	if (mode->pragmas != NULL) {
+		BENCH_EXEC(conn, mode->pragmas);
+	} else {
+		BENCH_CHECK(db__enable_fetch(conn, 4096, NULL));
+	}
+
+	BENCH_CHECK(sqlite3_prepare_v2(
+	    conn, "SELECT sum(length(blob)) FROM test", -1, &stmt, NULL));
+	start = benchNow();
+	for (i = 0; i < SCANS; i++) {
+		if (sqlite3_step(stmt) != SQLITE_ROW ||
+		    (unsigned long)sqlite3_column_int64(stmt, 0) !=
+			rows * BLOB_SIZE) {
+			fprintf(stderr, "wrong scan result\n");
+			exit(EXIT_FAILURE);
+		}
+		BENCH_CHECK(sqlite3_reset(stmt));
+	}
+	scan = (double)(benchNow() - start) / SCANS;
+	BENCH_CHECK(sqlite3_finalize(stmt));
+
+	BENCH_CHECK(sqlite3_prepare_v2(
+	    conn, "SELECT length(blob) FROM test WHERE id = ?", -1, &stmt,
+	    NULL));
+	start = benchNow();
+	for (i = 0; i < POINT_READS; i++) {
+		id = 1 + (unsigned long)rand() % rows;
+		sqlite3_bind_int64(stmt, 1, (sqlite3_int64)id);
+		if (sqlite3_step(stmt) != SQLITE_ROW) {
+			fprintf(stderr, "missing row\n");
+			exit(EXIT_FAILURE);
+		}
+		BENCH_CHECK(sqlite3_reset(stmt));
+	}
+	point = (double)(benchNow() - start) / POINT_READS;
+	BENCH_CHECK(sqlite3_finalize(stmt));
+
+	BENCH_CHECK(sqlite3_db_status(conn, SQLITE_DBSTATUS_CACHE_USED, &cache,
+				      &highwater, 0));
+	printf("%-24s scan %7.1f MiB/s  point read %6.0f ns  cache %7.1f MiB\n",
+	       mode->name, (double)rows * BLOB_SIZE / 1048576 / (scan / 1e9),
+	       point, (double)cache / 1048576);
+
+	BENCH_CHECK(sqlite3_close(conn));
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct mode modes[] = {
+	    {"copy, default cache", "PRAGMA mmap_size=0"},
+	    {"copy, whole db cached", "PRAGMA mmap_size=0;"
+				      "PRAGMA cache_size=-1048576"},
+	    {"fetch, default cache", "PRAGMA mmap_size=1073741824"},
+	    {"fetch, small cache", NULL},
+	};
+	unsigned long rows = benchArg(argc, argv, 1, ROWS);
+	sqlite3_vfs vfs;
+	unsigned i;
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+	createDatabase(rows);
+
+	for (i = 0; i < sizeof modes / sizeof *modes; i++) {
+		readDatabase(&modes[i], rows);
+	}
+
+	VfsClose(&vfs);
+
+	return 0;
+}
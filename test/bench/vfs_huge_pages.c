@@ -0,0 +1,178 @@
+/* Measure random reads of the pages of a large database of the in-memory VFS,
+ * with pages on the heap and with pages on transparent huge pages.
+ *
+ * The database is restored from an image, like followers do with snapshots, so
+ * that all its pages live in slabs. Pages checkpointed from the WAL would keep
+ * using the heap memory of their frames instead.
+ *
+ * Data TLB read misses are counted with perf events when the kernel exposes
+ * them, and the memory backed by huge pages is read from /proc/self/smaps.
+ *
+ * Usage: bench-vfs-huge-pages [MIB] [READS] */
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <raft.h>
+
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Size of the database in MiB, unless given on the command line. */
+#define SIZE 1024
+
+/* Number of reads timed, unless given on the command line. */
+#define READS 5000000
+
+/* Create a database of about @size bytes, one row per 4 KiB page, and copy out
+ * its image. */
+static void createImage(size_t size, void **image, size_t *len)
+{
+	sqlite3_vfs vfs;
+	sqlite3 *conn;
+	char sql[256];
+
+	BENCH_CHECK(VfsInitV1(&vfs, "source"));
+	conn = benchOpen("source", "bench.db", 4096);
+	BENCH_EXEC(conn,
+		   "CREATE TABLE test (id INTEGER PRIMARY KEY, blob BLOB)");
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %zu) "
+		"INSERT INTO test(id, blob) SELECT x, randomblob(3000) FROM c",
+		size / 4096);
+	BENCH_EXEC(conn, sql);
+	BENCH_CHECK(sqlite3_wal_checkpoint_v2(
+	    conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL));
+	BENCH_CHECK(sqlite3_close(conn));
+
+	BENCH_CHECK(VfsFileRead("source", "bench.db", image, len));
+	VfsClose(&vfs);
+}
+
+/* Open a counter of data TLB read misses of this thread, or return -1 if the
+ * kernel or the CPU doesn't provide one. */
+static int openTlbCounter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Return the memory of the process backed by transparent huge pages. */
+static unsigned long anonHugePages(void)
+{
+	FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+	char line[256];
+	unsigned long kib = 0;
+
+	if (smaps == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof line, smaps) != NULL) {
+		if (sscanf(line, "AnonHugePages: %lu kB", &kib) == 1) {
+			break;
+		}
+	}
+	fclose(smaps);
+
+	return kib * 1024;
+}
+
+/* Read @n random pages of the database, and print the average latency and the
+ * TLB misses per read. */
+static void readDatabase(sqlite3_vfs *vfs, const char *name, unsigned long n)
+{
+	sqlite3_file *file = malloc((size_t)vfs->szOsFile);
+	int flags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE;
+	unsigned long long start;
+	unsigned long long elapsed;
+	sqlite3_int64 size;
+	long long misses = 0;
+	unsigned long n_pages;
+	unsigned long i;
+	char page[4096];
+	int counter;
+
+	BENCH_CHECK(vfs->xOpen(vfs, "bench.db", file, flags, NULL));
+	BENCH_CHECK(file->pMethods->xFileSize(file, &size));
+	n_pages = (unsigned long)size / 4096;
+
+	counter = openTlbCounter();
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start = benchNow();
+	for (i = 0; i < n; i++) {
+		sqlite3_int64 pgno = (sqlite3_int64)((unsigned long)rand() %
+						     n_pages);
+		BENCH_CHECK(file->pMethods->xRead(file, page, sizeof page,
+						  pgno * 4096));
+	}
+	elapsed = benchNow() - start;
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter, &misses, sizeof misses) != sizeof misses) {
+			misses = -1;
+		}
+		close(counter);
+	}
+
+	printf("%-11s %6.0f ns/read  ", name, (double)elapsed / (double)n);
+	if (counter >= 0 && misses >= 0) {
+		printf("dTLB misses %5.2f/read  ", (double)misses / (double)n);
+	} else {
+		printf("dTLB misses n/a  ");
+	}
+	printf("AnonHugePages %.0f MiB\n", (double)anonHugePages() / 1048576);
+
+	BENCH_CHECK(file->pMethods->xClose(file));
+	free(file);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = benchArg(argc, argv, 1, SIZE) * 1024 * 1024;
+	unsigned long reads = benchArg(argc, argv, 2, READS);
+	sqlite3_vfs vfs;
+	void *image;
+	size_t len;
+
+	createImage(size, &image, &len);
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+	BENCH_CHECK(VfsRestore("bench", "bench.db", image, len, NULL, 0));
+	readDatabase(&vfs, "heap slabs", reads);
+	VfsClose(&vfs);
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+	if (VfsEnableHugePages(&vfs) != 0) {
+		printf("huge pages not supported\n");
+	} else {
+		BENCH_CHECK(
+		    VfsRestore("bench", "bench.db", image, len, NULL, 0));
+		readDatabase(&vfs, "huge slabs", reads);
+	}
+	VfsClose(&vfs);
+
+	raft_free(image);
+
+	return 0;
+}
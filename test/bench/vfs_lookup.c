@@ -0,0 +1,96 @@
+/* Measure the time it takes the in-memory VFS to look up a file by name, as
+ * the number of files grows from 1 to 100000.
+ *
+ * Looking up the same file over and over should take about the same time
+ * whatever the number of files. Looking up files at random gets slower as the
+ * files outgrow the CPU caches, since each lookup then misses them.
+ *
+ * Usage: bench-vfs-lookup [LOOKUPS] */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Number of lookups timed at each size, unless given on the command line. */
+#define LOOKUPS 1000000
+
+/* Create @n database files named from their index, starting from @first. */
+static void createFiles(sqlite3_vfs *vfs, unsigned first, unsigned n)
+{
+	sqlite3_file *file = malloc((size_t)vfs->szOsFile);
+	int flags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_CREATE |
+		    SQLITE_OPEN_READWRITE;
+	char filename[32];
+	unsigned i;
+
+	for (i = first; i < first + n; i++) {
+		sprintf(filename, "%u.db", i);
+		BENCH_CHECK(vfs->xOpen(vfs, filename, file, flags, NULL));
+		BENCH_CHECK(file->pMethods->xClose(file));
+	}
+
+	free(file);
+}
+
+/* Look up @n files picked among the first @n_files ones, either at random or
+ * always the last one, and return the average time of a lookup in
+ * nanoseconds. */
+static double lookupFiles(sqlite3_vfs *vfs,
+			  unsigned n_files,
+			  unsigned n,
+			  bool random)
+{
+	char(*filenames)[16] = malloc(sizeof *filenames * n);
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned i;
+	int exists;
+
+	/* Format the names upfront, so only the lookups are timed. */
+	for (i = 0; i < n; i++) {
+		sprintf(filenames[i], "%u.db",
+			random ? (unsigned)rand() % n_files : n_files - 1);
+	}
+
+	start = benchNow();
+	for (i = 0; i < n; i++) {
+		BENCH_CHECK(vfs->xAccess(vfs, filenames[i],
+					 SQLITE_ACCESS_EXISTS, &exists));
+		if (!exists) {
+			fprintf(stderr, "file %s not found\n", filenames[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = benchNow() - start;
+
+	free(filenames);
+
+	return (double)elapsed / n;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned sizes[] = {1, 10, 100, 1000, 10000, 100000};
+	unsigned lookups = (unsigned)benchArg(argc, argv, 1, LOOKUPS);
+	sqlite3_vfs vfs;
+	unsigned n_files = 0;
+	unsigned i;
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+
+	for (i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+		createFiles(&vfs, n_files, sizes[i] - n_files);
+		n_files = sizes[i];
+		printf("files %6u  same %6.1f ns  random %6.1f ns\n", n_files,
+		       lookupFiles(&vfs, n_files, lookups, false),
+		       lookupFiles(&vfs, n_files, lookups, true));
+	}
+
+	VfsClose(&vfs);
+
+	return 0;
+}
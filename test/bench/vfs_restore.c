@@ -0,0 +1,166 @@
+/* Measure the time it takes to restore a database image and its WAL into the
+ * in-memory VFS, writing them file by file with VfsFileWrite(), all at once
+ * with VfsRestore(), and in pieces with VfsRestoreWrite() as snapshots do.
+ *
+ * Usage: bench-vfs-restore [MIB] */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <raft.h>
+
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Size of the database image in MiB, unless given on the command line. */
+#define SIZE 100
+
+/* Size of the blob of each row. */
+#define BLOB_SIZE 1000
+
+/* Size of the pieces passed to VfsRestoreWrite(). */
+#define PIECE_SIZE (1024 * 1024)
+
+/* Number of restores timed for each method, keeping the fastest. */
+#define RUNS 3
+
+/* Images of a database and of its WAL. */
+struct image
+{
+	void *main;
+	size_t main_size;
+	void *wal;
+	size_t wal_size;
+};
+
+/* Create a database of about @size bytes, with a few MiB of frames left in its
+ * WAL, and copy out the images of both files. */
+static void createImage(size_t size, struct image *image)
+{
+	sqlite3_vfs vfs;
+	sqlite3 *conn;
+	char sql[256];
+
+	BENCH_CHECK(VfsInitV1(&vfs, "source"));
+	conn = benchOpen("source", "bench.db", 4096);
+	BENCH_EXEC(conn,
+		   "CREATE TABLE test (id INTEGER PRIMARY KEY, blob BLOB)");
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %zu) "
+		"INSERT INTO test(id, blob) SELECT x, randomblob(%d) FROM c",
+		size / BLOB_SIZE, BLOB_SIZE);
+	BENCH_EXEC(conn, sql);
+	BENCH_CHECK(sqlite3_wal_checkpoint_v2(
+	    conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL));
+	BENCH_EXEC(conn, "UPDATE test SET blob = randomblob(1000) "
+			 "WHERE id % 100 = 0 AND id < 300000");
+	BENCH_CHECK(sqlite3_close(conn));
+
+	BENCH_CHECK(VfsFileRead("source", "bench.db", &image->main,
+				&image->main_size));
+	BENCH_CHECK(VfsFileRead("source", "bench.db-wal", &image->wal,
+				&image->wal_size));
+	VfsClose(&vfs);
+}
+
+static void restoreWithFileWrite(const struct image *image)
+{
+	BENCH_CHECK(VfsFileWrite("bench", "bench.db", image->main,
+				 image->main_size));
+	BENCH_CHECK(VfsFileWrite("bench", "bench.db-wal", image->wal,
+				 image->wal_size));
+}
+
+static void restoreWithRestore(const struct image *image)
+{
+	BENCH_CHECK(VfsRestore("bench", "bench.db", image->main,
+			       image->main_size, image->wal, image->wal_size));
+}
+
+/* Write the first @size bytes of @buf in pieces of about PIECE_SIZE bytes. WAL
+ * pieces hold whole frames after the header. */
+static void writePieces(struct vfsRestore *restore,
+			bool wal,
+			const void *buf,
+			size_t size)
+{
+	size_t offset = 0;
+	size_t len = PIECE_SIZE;
+
+	if (wal) {
+		/* WAL header, then frames of a 24-byte header and a page. */
+		BENCH_CHECK(VfsRestoreWrite(restore, true, 0, buf, 32));
+		offset = 32;
+		len = PIECE_SIZE / (24 + 4096) * (24 + 4096);
+	}
+
+	for (; offset < size; offset += len) {
+		if (len > size - offset) {
+			len = size - offset;
+		}
+		BENCH_CHECK(VfsRestoreWrite(restore, wal, offset,
+					    (const char *)buf + offset, len));
+	}
+}
+
+static void restoreInPieces(const struct image *image)
+{
+	struct vfsRestore *restore;
+
+	BENCH_CHECK(VfsRestoreStart("bench", "bench.db", image->main_size,
+				    image->wal_size, &restore));
+	writePieces(restore, false, image->main, image->main_size);
+	writePieces(restore, true, image->wal, image->wal_size);
+	BENCH_CHECK(VfsRestoreFinish(restore));
+}
+
+/* Restore the image RUNS times into a fresh VFS with the given method, and
+ * print the fastest time. */
+static void timeRestore(const char *name,
+			void (*restore)(const struct image *image),
+			const struct image *image)
+{
+	sqlite3_vfs vfs;
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned long long best = 0;
+	unsigned i;
+
+	for (i = 0; i < RUNS; i++) {
+		BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+		start = benchNow();
+		restore(image);
+		elapsed = benchNow() - start;
+		VfsClose(&vfs);
+		if (best == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+
+	printf("%-16s %8.3f s  %7.0f MiB/s\n", name, (double)best / 1e9,
+	       (double)(image->main_size + image->wal_size) / 1048576 /
+		   ((double)best / 1e9));
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = benchArg(argc, argv, 1, SIZE) * 1024 * 1024;
+	struct image image;
+
+	createImage(size, &image);
+	printf("main %.1f MiB, wal %.1f MiB\n",
+	       (double)image.main_size / 1048576,
+	       (double)image.wal_size / 1048576);
+
+	timeRestore("VfsFileWrite", restoreWithFileWrite, &image);
+	timeRestore("VfsRestore", restoreWithRestore, &image);
+	timeRestore("VfsRestoreWrite", restoreInPieces, &image);
+
+	raft_free(image.main);
+	raft_free(image.wal);
+
+	return 0;
+}
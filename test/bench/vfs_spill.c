@@ -0,0 +1,164 @@
+/* Measure the latency of reads of database pages when the in-memory VFS spills
+ * cold pages to disk: reads of a page that stays in memory, reads of a page
+ * that was just spilled, and random reads with a memory budget of a quarter of
+ * the database. Reads of a VFS that doesn't spill are timed for reference.
+ *
+ * Usage: bench-vfs-spill [PAGES] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Number of 4 KiB pages of the database, unless given on the command line. */
+#define PAGES 32768
+
+/* Milliseconds after which an untouched slab is spilled. */
+#define IDLE 1
+
+/* Number of reads timed for each measurement. */
+#define HOT_READS 1000000
+#define COLD_READS 200
+#define RANDOM_READS 10000
+
+/* Create a database with at least @n_pages pages. */
+static void createDatabase(const char *vfs, unsigned long n_pages)
+{
+	sqlite3 *conn = benchOpen(vfs, "bench.db", 4096);
+	char sql[256];
+
+	BENCH_EXEC(conn,
+		   "CREATE TABLE test (id INTEGER PRIMARY KEY, blob BLOB)");
+	/* Each row fills most of a page, so no two rows share one. */
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %lu) "
+		"INSERT INTO test(id, blob) SELECT x, randomblob(3000) FROM c",
+		n_pages);
+	BENCH_EXEC(conn, sql);
+	BENCH_CHECK(sqlite3_wal_checkpoint_v2(
+	    conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL));
+	BENCH_CHECK(sqlite3_close(conn));
+}
+
+/* Time a read of the given page, in nanoseconds. */
+static unsigned long long readPage(sqlite3_file *file, unsigned long pgno)
+{
+	char page[4096];
+	unsigned long long start = benchNow();
+
+	BENCH_CHECK(file->pMethods->xRead(file, page, sizeof page,
+					  (sqlite3_int64)(pgno - 1) * 4096));
+
+	return benchNow() - start;
+}
+
+/* Read the same page over and over, and return the average latency. */
+static double readHot(sqlite3_file *file)
+{
+	unsigned long long elapsed = 0;
+	unsigned i;
+
+	for (i = 0; i < HOT_READS; i++) {
+		elapsed += readPage(file, 1);
+	}
+
+	return (double)elapsed / HOT_READS;
+}
+
+/* Read random pages after spilling every slab, and return the average
+ * latency. */
+static double readCold(sqlite3_vfs *vfs,
+		       sqlite3_file *file,
+		       unsigned long n_pages)
+{
+	struct timespec idle = {0, (IDLE + 1) * 1000000};
+	unsigned long long elapsed = 0;
+	unsigned i;
+
+	for (i = 0; i < COLD_READS; i++) {
+		nanosleep(&idle, NULL);
+		VfsSpill(vfs);
+		elapsed += readPage(file, 1 + (unsigned long)rand() % n_pages);
+	}
+
+	return (double)elapsed / COLD_READS;
+}
+
+/* Read random pages, and return the average latency. */
+static double readRandom(sqlite3_file *file, unsigned long n_pages)
+{
+	unsigned long long elapsed = 0;
+	unsigned i;
+
+	for (i = 0; i < RANDOM_READS; i++) {
+		elapsed += readPage(file, 1 + (unsigned long)rand() % n_pages);
+	}
+
+	return (double)elapsed / RANDOM_READS;
+}
+
+/* Open the database file directly, to read its pages without going through
+ * the SQLite pager. */
+static sqlite3_file *openDatabase(sqlite3_vfs *vfs)
+{
+	sqlite3_file *file = malloc((size_t)vfs->szOsFile);
+	int flags = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE;
+
+	BENCH_CHECK(vfs->xOpen(vfs, "bench.db", file, flags, NULL));
+
+	return file;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long n_pages = benchArg(argc, argv, 1, PAGES);
+	size_t budget = n_pages * 4096 / 4;
+	struct dqlite_vfs_stats stats;
+	double hot;
+	double random;
+	double cold;
+	sqlite3_file *file;
+	sqlite3_vfs vfs;
+	char dir[] = "/tmp/dqlite-bench-XXXXXX";
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+	createDatabase("bench", n_pages);
+	file = openDatabase(&vfs);
+	hot = readHot(file);
+	random = readRandom(file, n_pages);
+	printf("no spill  hot %6.0f ns  random %6.0f ns\n", hot, random);
+	BENCH_CHECK(file->pMethods->xClose(file));
+	free(file);
+	VfsClose(&vfs);
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+	BENCH_CHECK(VfsEnableSpill(&vfs, dir, IDLE, budget));
+	createDatabase("bench", n_pages);
+	file = openDatabase(&vfs);
+	hot = readHot(file);
+	random = readRandom(file, n_pages);
+	cold = readCold(&vfs, file, n_pages);
+	printf("spill     hot %6.0f ns  random %6.0f ns  cold %6.0f ns\n", hot,
+	       random, cold);
+	BENCH_CHECK(VfsStats(&vfs, "bench.db", &stats));
+	printf("budget %.1f MiB  in memory %.1f MiB  spilled %.1f MiB\n",
+	       (double)budget / 1048576, (double)stats.pages / 1048576,
+	       (double)stats.spilled / 1048576);
+	BENCH_CHECK(file->pMethods->xClose(file));
+	free(file);
+	VfsClose(&vfs);
+
+	rmdir(dir);
+
+	return 0;
+}
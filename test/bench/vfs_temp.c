@@ -0,0 +1,106 @@
+/* Measure the time of sort-heavy queries against a database of the in-memory
+ * VFS, with temporary files kept on disk, or in memory up to a limit.
+ *
+ * Usage: bench-vfs-temp [ROWS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../src/vfs.h"
+
+#include "bench.h"
+
+/* Number of rows of the database, unless given on the command line. */
+#define ROWS 1000000
+
+/* Number of runs of each query, keeping the fastest. */
+#define RUNS 3
+
+/* Fill the database with @rows rows. */
+static void createDatabase(sqlite3 *conn, unsigned long rows)
+{
+	char sql[256];
+
+	BENCH_EXEC(conn, "CREATE TABLE test (n INT, k INT, text TEXT)");
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+		"SELECT x + 1 FROM c WHERE x < %lu) "
+		"INSERT INTO test(n, k, text) "
+		"SELECT x, abs(random()) %% %lu, hex(randomblob(16)) FROM c",
+		rows, rows / 4);
+	BENCH_EXEC(conn, sql);
+	BENCH_CHECK(sqlite3_wal_checkpoint_v2(
+	    conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL));
+}
+
+/* Run the query RUNS times, stepping through all its rows, and return the
+ * fastest time in seconds. */
+static double runQuery(sqlite3 *conn, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned long long best = 0;
+	unsigned i;
+	int rv;
+
+	BENCH_CHECK(sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL));
+	for (i = 0; i < RUNS; i++) {
+		start = benchNow();
+		do {
+			rv = sqlite3_step(stmt);
+		} while (rv == SQLITE_ROW);
+		elapsed = benchNow() - start;
+		BENCH_CHECK(rv == SQLITE_DONE ? 0 : rv);
+		BENCH_CHECK(sqlite3_reset(stmt));
+		if (best == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	BENCH_CHECK(sqlite3_finalize(stmt));
+
+	return (double)best / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct
+	{
+		size_t limit;
+		const char *name;
+	} limits[] = {
+	    {0, "0 (disk)"},
+	    {16 * 1024 * 1024, "16 MiB"},
+	    {256 * 1024 * 1024, "256 MiB"},
+	};
+	unsigned long rows = benchArg(argc, argv, 1, ROWS);
+	double order_by;
+	double group_by;
+	sqlite3_vfs vfs;
+	sqlite3 *conn;
+	unsigned i;
+
+	BENCH_CHECK(VfsInitV1(&vfs, "bench"));
+	conn = benchOpen("bench", "bench.db", 4096);
+	createDatabase(conn, rows);
+
+	/* A small page cache makes sorts spill to temporary files. */
+	BENCH_EXEC(conn, "PRAGMA cache_size=-2000");
+	BENCH_EXEC(conn, "PRAGMA temp_store=FILE");
+
+	for (i = 0; i < sizeof limits / sizeof *limits; i++) {
+		VfsSetTempLimit(&vfs, limits[i].limit);
+		order_by =
+		    runQuery(conn, "SELECT n, text FROM test ORDER BY text");
+		group_by = runQuery(conn,
+				    "SELECT k, count(*), max(text) FROM test "
+				    "GROUP BY k");
+		printf("limit %-8s  order by %6.3f s  group by %6.3f s\n",
+		       limits[i].name, order_by, group_by);
+	}
+
+	BENCH_CHECK(sqlite3_close(conn));
+	VfsClose(&vfs);
+
+	return 0;
+}
@@ -54,3 +54,26 @@ TEST(dqlite_node_start, success, setUp, tearDown, 0, NULL)
 	(void)f;
 	return MUNIT_OK;
 }
+
+/******************************************************************************
+ *
+ * dqlite_node_snapshot_stats
+ *
+ ******************************************************************************/
+
+SUITE(dqlite_node_snapshot_stats);
+
+/* A node that just started took no snapshot yet. */
+TEST(dqlite_node_snapshot_stats, none, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_node_snapshot_stats stats;
+	int rv;
+	(void)params;
+	rv = dqlite_node_snapshot_stats(f->server.dqlite, &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.taken, ==, 0);
+	munit_assert_int(stats.pending, ==, 0);
+	munit_assert_int(stats.deferred, ==, 0);
+	return MUNIT_OK;
+}
@@ -394,3 +394,233 @@ TEST(vfs, commitThenCloseThenReadOnNewConn, setUp, tearDown, 0, NULL)
 
 	return MUNIT_OK;
 }
+
+/* Release callback for dqlite_vfs_commit_adopt(), freeing the adopted buffer
+ * and flagging that it was invoked. */
+static bool releasedAdopted;
+static void releaseAdopted(void *arg)
+{
+	free(arg);
+	releasedAdopted = true;
+}
+
+/* Use dqlite_vfs_commit_adopt() to modify the WAL without copying the frames.
+ * The changes are visible to readers and the buffer is released only once the
+ * frames get checkpointed. */
+TEST(vfs, commitAdoptThenCheckpoint, setUp, tearDown, 0, NULL)
+{
+	sqlite3_vfs *vfs = sqlite3_vfs_find("1");
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct tx tx;
+	int rv;
+
+	OPEN("1", db);
+
+	EXEC(db, "CREATE TABLE test(n INT)");
+
+	POLL("1", tx);
+	releasedAdopted = false;
+	rv = dqlite_vfs_commit_adopt(vfs, "test.db", tx.n, tx.page_numbers,
+				     tx.frames, releaseAdopted, tx.frames);
+	munit_assert_int(rv, ==, 0);
+	free(tx.page_numbers);
+
+	PREPARE(db, stmt, "SELECT * FROM test");
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+
+	munit_assert_false(releasedAdopted);
+
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	munit_assert_true(releasedAdopted);
+
+	PREPARE(db, stmt, "SELECT * FROM test");
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
+/* Release callback for dqlite_vfs_commit_batch(), freeing a buffer returned by
+ * dqlite_vfs_poll_batch() and flagging that it was invoked. */
+static void releaseBatch(void *arg)
+{
+	sqlite3_free(arg);
+	releasedAdopted = true;
+}
+
+/* Use dqlite_vfs_poll_batch() to get the frames of a transaction as a single
+ * encoded buffer, and dqlite_vfs_commit_batch() to adopt it as is. */
+TEST(vfs, pollBatchThenCommitBatch, setUp, tearDown, 0, NULL)
+{
+	sqlite3_vfs *vfs = sqlite3_vfs_find("1");
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	uint8_t *buf;
+	size_t len;
+	unsigned n;
+	int rv;
+
+	OPEN("1", db);
+
+	EXEC(db, "CREATE TABLE test(n INT)");
+
+	rv = dqlite_vfs_poll_batch(vfs, "test.db", (void **)&buf, &len);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ptr_not_null(buf);
+
+	/* Number of frames and page size, then page numbers and pages. */
+	n = (unsigned)buf[0] | (unsigned)buf[1] << 8;
+	munit_assert_int(n, ==, 2);
+	munit_assert_int(buf[2], ==, 0);
+	munit_assert_int(buf[3], ==, 0);
+	munit_assert_int(buf[4] | buf[5] << 8, ==, PAGE_SIZE);
+	munit_assert_int(len, ==, 8 + n * (8 + PAGE_SIZE));
+	munit_assert_int(buf[8], ==, 1);
+	munit_assert_int(buf[16], ==, 2);
+
+	/* A truncated buffer is refused and stays with the caller. */
+	releasedAdopted = false;
+	rv = dqlite_vfs_commit_batch(vfs, "test.db", buf, len - 1, releaseBatch,
+				     buf);
+	munit_assert_int(rv, ==, DQLITE_MISUSE);
+	munit_assert_false(releasedAdopted);
+
+	rv = dqlite_vfs_commit_batch(vfs, "test.db", buf, len, releaseBatch,
+				     buf);
+	munit_assert_int(rv, ==, 0);
+
+	PREPARE(db, stmt, "SELECT * FROM test");
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+
+	munit_assert_false(releasedAdopted);
+
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	munit_assert_true(releasedAdopted);
+
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
+/* Commit a batch without a release callback, which copies the pages and
+ * leaves the buffer to the caller. */
+TEST(vfs, commitBatchCopy, setUp, tearDown, 0, NULL)
+{
+	sqlite3_vfs *vfs = sqlite3_vfs_find("1");
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	void *buf;
+	size_t len;
+	int rv;
+
+	OPEN("1", db);
+
+	EXEC(db, "CREATE TABLE test(n INT)");
+
+	rv = dqlite_vfs_poll_batch(vfs, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, 0);
+	rv = dqlite_vfs_commit_batch(vfs, "test.db", buf, len, NULL, NULL);
+	munit_assert_int(rv, ==, 0);
+	memset(buf, 0, len);
+	sqlite3_free(buf);
+
+	PREPARE(db, stmt, "SELECT * FROM test");
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
+/* A batch whose page size is not valid is refused before its length is trusted
+ * to hold any page, and stays with the caller. */
+TEST(vfs, commitBatchBadPageSize, setUp, tearDown, 0, NULL)
+{
+	sqlite3_vfs *vfs = sqlite3_vfs_find("1");
+	sqlite3 *db;
+	uint8_t *buf;
+	size_t len;
+	unsigned n;
+	int rv;
+
+	OPEN("1", db);
+
+	EXEC(db, "CREATE TABLE test(n INT)");
+
+	rv = dqlite_vfs_poll_batch(vfs, "test.db", (void **)&buf, &len);
+	munit_assert_int(rv, ==, 0);
+	n = (unsigned)buf[0] | (unsigned)buf[1] << 8;
+
+	/* A zero page size, with only room for the page numbers. */
+	buf[4] = 0;
+	buf[5] = 0;
+	releasedAdopted = false;
+	rv = dqlite_vfs_commit_batch(vfs, "test.db", buf, 8 + n * 8,
+				     releaseBatch, buf);
+	munit_assert_int(rv, ==, DQLITE_MISUSE);
+	munit_assert_false(releasedAdopted);
+
+	/* A page size that is not a power of two. */
+	buf[4] = 1000 & 0xff;
+	buf[5] = 1000 >> 8;
+	rv = dqlite_vfs_commit_batch(vfs, "test.db", buf, 8 + n * (8 + 1000),
+				     NULL, NULL);
+	munit_assert_int(rv, ==, DQLITE_MISUSE);
+
+	/* A page size smaller than the minimum. */
+	buf[4] = 256 & 0xff;
+	buf[5] = 256 >> 8;
+	rv = dqlite_vfs_commit_batch(vfs, "test.db", buf, 8 + n * (8 + 256),
+				     NULL, NULL);
+	munit_assert_int(rv, ==, DQLITE_MISUSE);
+
+	sqlite3_free(buf);
+
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
+/* A batch committed to a file that is not an open database is refused. */
+TEST(vfs, commitBatchNoDatabase, setUp, tearDown, 0, NULL)
+{
+	sqlite3_vfs *vfs = sqlite3_vfs_find("1");
+	sqlite3 *db;
+	void *buf;
+	size_t len;
+	int rv;
+
+	OPEN("1", db);
+
+	EXEC(db, "CREATE TABLE test(n INT)");
+
+	rv = dqlite_vfs_poll_batch(vfs, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, 0);
+
+	releasedAdopted = false;
+	rv = dqlite_vfs_commit_batch(vfs, "missing.db", buf, len, releaseBatch,
+				     buf);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	munit_assert_false(releasedAdopted);
+
+	rv = dqlite_vfs_commit_batch(vfs, "test.db-wal", buf, len, NULL, NULL);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+
+	sqlite3_free(buf);
+
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
@@ -86,7 +86,7 @@ struct server
                                                                                \
 		registry__init(&_s->registry, &_s->config);                    \
                                                                                \
-		_rc = fsm__init(_fsm, &_s->config, &_s->registry);             \
+		_rc = fsm__init(_fsm, &_s->config, &_s->registry, NULL);       \
 		munit_assert_int(_rc, ==, 0);                                  \
                                                                                \
 		_rc = replication__init(&_s->replication, &_s->config, _raft); \
@@ -215,3 +215,13 @@ void test_heap_fault_config(int delay, int repeat)
 void test_heap_fault_enable() {
 	test_fault_enable(&memFault.fault);
 }
+
+int test_heap_memory_used(void)
+{
+	int malloc_count;
+	int memory_used;
+
+	mem_stats(&malloc_count, &memory_used);
+
+	return memory_used;
+}
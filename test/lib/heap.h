@@ -26,6 +26,10 @@ void test_heap_fault_config(int delay, int repeat);
  * parameters passed to test_mem_fault_config(). */
 void test_heap_fault_enable(void);
 
+/* Return the number of bytes currently allocated through SQLite's memory
+ * management functions. */
+int test_heap_memory_used(void);
+
 #define SETUP_HEAP test_heap_setup(params, user_data);
 #define TEAR_DOWN_HEAP test_heap_tear_down(data);
 
@@ -34,7 +34,8 @@
 		rv2 = raft_uv_init(&f->raft_io, &f->loop, f->dir,        \
 				   &f->raft_transport);                  \
 		munit_assert_int(rv2, ==, 0);                            \
-		rv2 = fsm__init(&f->fsm, &f->config, &f->registry);      \
+		rv2 = fsm__init(&f->fsm, &f->config, &f->registry,       \
+			       &f->loop);                                \
 		munit_assert_int(rv2, ==, 0);                            \
 		rv2 = raft_init(&f->raft, &f->raft_io, &f->fsm, 1, "1"); \
 		munit_assert_int(rv2, ==, 0);                            \
@@ -0,0 +1,181 @@
+#include "../../../include/dqlite.h"
+#include "../../../src/lib/lz4.h"
+
+#include "../../lib/runner.h"
+
+TEST_MODULE(lib_lz4);
+
+/******************************************************************************
+ *
+ * Helpers.
+ *
+ ******************************************************************************/
+
+/* Compress the given data, decompress it back and check that it matches. Return
+ * the compressed size. */
+static size_t roundTrip(const void *data, size_t n)
+{
+	size_t cap = lz4__bound(n);
+	void *packed = munit_malloc(cap);
+	void *unpacked = munit_malloc(n + 1);
+	size_t size;
+	int rv;
+
+	size = lz4__compress(data, n, packed, cap);
+	munit_assert_int(size, >, 0);
+	munit_assert_int(size, <=, cap);
+
+	rv = lz4__decompress(packed, size, unpacked, n);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(memcmp(data, unpacked, n), ==, 0);
+
+	free(unpacked);
+	free(packed);
+
+	return size;
+}
+
+/******************************************************************************
+ *
+ * lz4__compress
+ *
+ ******************************************************************************/
+
+TEST_SUITE(compress);
+
+/* An empty buffer takes a single byte. */
+TEST_CASE(compress, empty, NULL)
+{
+	uint8_t buf[1] = {0};
+	(void)params;
+	(void)data;
+	munit_assert_int(roundTrip(buf, 0), ==, 1);
+	return MUNIT_OK;
+}
+
+/* Buffers too small to hold a match are stored as literals. */
+TEST_CASE(compress, small, NULL)
+{
+	uint8_t buf[12];
+	(void)params;
+	(void)data;
+	memset(buf, 0, sizeof buf);
+	munit_assert_int(roundTrip(buf, sizeof buf), ==, 1 + sizeof buf);
+	return MUNIT_OK;
+}
+
+/* A page of zeros shrinks to a few bytes. */
+TEST_CASE(compress, zeros, NULL)
+{
+	uint8_t buf[4096];
+	(void)params;
+	(void)data;
+	memset(buf, 0, sizeof buf);
+	munit_assert_int(roundTrip(buf, sizeof buf), <, 32);
+	return MUNIT_OK;
+}
+
+/* Repeated sequences shrink, including ones longer than their distance. */
+TEST_CASE(compress, repeated, NULL)
+{
+	uint8_t buf[8192];
+	size_t i;
+	(void)params;
+	(void)data;
+	for (i = 0; i < sizeof buf; i++) {
+		buf[i] = (uint8_t)("abcdefghij"[i % 10] + (i / 1000));
+	}
+	munit_assert_int(roundTrip(buf, sizeof buf), <, sizeof buf / 10);
+	return MUNIT_OK;
+}
+
+/* Random buf can grow, but never past the bound. */
+TEST_CASE(compress, random, NULL)
+{
+	uint8_t buf[70000];
+	(void)params;
+	(void)data;
+	munit_rand_memory(sizeof buf, buf);
+	munit_assert_int(roundTrip(buf, sizeof buf), >=, sizeof buf);
+	return MUNIT_OK;
+}
+
+/* Compression fails if the output doesn't fit. */
+TEST_CASE(compress, no_space, NULL)
+{
+	uint8_t buf[4096];
+	uint8_t packed[4096];
+	size_t size;
+	(void)params;
+	(void)data;
+	munit_rand_memory(sizeof buf, buf);
+	size = lz4__compress(buf, sizeof buf, packed, sizeof packed);
+	munit_assert_int(size, ==, 0);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * lz4__decompress
+ *
+ ******************************************************************************/
+
+TEST_SUITE(decompress);
+
+/* Data that doesn't expand to exactly the expected size is rejected. */
+TEST_CASE(decompress, wrong_size, NULL)
+{
+	uint8_t buf[4096];
+	uint8_t packed[64];
+	uint8_t unpacked[8192];
+	size_t size;
+	int rv;
+	(void)params;
+	(void)data;
+	memset(buf, 0, sizeof buf);
+	size = lz4__compress(buf, sizeof buf, packed, sizeof packed);
+	munit_assert_int(size, >, 0);
+	rv = lz4__decompress(packed, size, unpacked, sizeof buf - 1);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	rv = lz4__decompress(packed, size, unpacked, sizeof buf + 1);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	return MUNIT_OK;
+}
+
+/* Truncated buf is rejected. */
+TEST_CASE(decompress, truncated, NULL)
+{
+	uint8_t buf[4096];
+	uint8_t packed[64];
+	uint8_t unpacked[4096];
+	size_t size;
+	int rv;
+	(void)params;
+	(void)data;
+	memset(buf, 0, sizeof buf);
+	size = lz4__compress(buf, sizeof buf, packed, sizeof packed);
+	munit_assert_int(size, >, 0);
+	rv = lz4__decompress(packed, size - 1, unpacked, sizeof buf);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	rv = lz4__decompress(packed, 0, unpacked, sizeof buf);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	return MUNIT_OK;
+}
+
+/* A match pointing before the start of the output is rejected. */
+TEST_CASE(decompress, bad_distance, NULL)
+{
+	/* One literal, then a match of 4 bytes at distance 2. */
+	uint8_t packed[] = {0x10, 'a', 0x02, 0x00, 0x00};
+	uint8_t unpacked[5];
+	int rv;
+	(void)params;
+	(void)data;
+	rv = lz4__decompress(packed, sizeof packed, unpacked, sizeof unpacked);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+	packed[2] = 0x01;
+	rv = lz4__decompress(packed, sizeof packed, unpacked, sizeof unpacked);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(memcmp(unpacked, "aaaaa", 5), ==, 0);
+	return MUNIT_OK;
+}
@@ -180,3 +180,80 @@ TEST(formatDatabaseGetPageSize, notPowerOf2, NULL, NULL, 0, NULL)
 
 	return MUNIT_OK;
 }
+
+/******************************************************************************
+ *
+ * formatWalChecksum
+ *
+ ******************************************************************************/
+
+SUITE(formatWalChecksum);
+
+/* Check that the given implementation of the WAL checksum yields the same
+ * results as the scalar one, for buffers of all sizes up to the maximum page
+ * size and for both byte orders. */
+static void __checksum_compare(enum formatChecksumImpl impl)
+{
+	uint8_t *buf = munit_malloc(FORMAT__PAGE_SIZE_MAX);
+	unsigned n;
+	int native;
+
+	munit_rand_memory(FORMAT__PAGE_SIZE_MAX, buf);
+
+	for (n = 8; n <= FORMAT__PAGE_SIZE_MAX; n += n < 1024 ? 8 : 1016) {
+		for (native = 0; native < 2; native++) {
+			uint32_t in[2] = {munit_rand_uint32(),
+					  munit_rand_uint32()};
+			uint32_t expected[2] = {in[0], in[1]};
+			uint32_t actual[2] = {in[0], in[1]};
+
+			formatWalChecksumUse(FORMAT__CHECKSUM_SCALAR);
+			formatWalChecksum(native, buf, n, expected);
+
+			formatWalChecksumUse(impl);
+			formatWalChecksum(native, buf, n, actual);
+
+			munit_assert_uint32(actual[0], ==, expected[0]);
+			munit_assert_uint32(actual[1], ==, expected[1]);
+		}
+	}
+
+	formatWalChecksumUse(FORMAT__CHECKSUM_SCALAR);
+	free(buf);
+}
+
+/* The scalar implementation matches a known checksum. */
+TEST(formatWalChecksum, scalar, NULL, NULL, 0, NULL)
+{
+	uint8_t buf[16] = {0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4};
+	uint32_t checksum[2] = {0, 0};
+
+	formatWalChecksumUse(FORMAT__CHECKSUM_SCALAR);
+	formatWalChecksum(false, buf, sizeof buf, checksum);
+
+	/* s1 = 1, s2 = 3, s1 = 1 + 3 + 3 = 7, s2 = 3 + 4 + 7 = 14. */
+	munit_assert_uint32(checksum[0], ==, 7);
+	munit_assert_uint32(checksum[1], ==, 14);
+
+	return MUNIT_OK;
+}
+
+/* The SSE4.1 implementation is bit-exact with the scalar one. */
+TEST(formatWalChecksum, sse41, NULL, NULL, 0, NULL)
+{
+	if (!formatWalChecksumUse(FORMAT__CHECKSUM_SSE41)) {
+		return MUNIT_SKIP;
+	}
+	__checksum_compare(FORMAT__CHECKSUM_SSE41);
+	return MUNIT_OK;
+}
+
+/* The AVX2 implementation is bit-exact with the scalar one. */
+TEST(formatWalChecksum, avx2, NULL, NULL, 0, NULL)
+{
+	if (!formatWalChecksumUse(FORMAT__CHECKSUM_AVX2)) {
+		return MUNIT_SKIP;
+	}
+	__checksum_compare(FORMAT__CHECKSUM_AVX2);
+	return MUNIT_OK;
+}
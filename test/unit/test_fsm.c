@@ -0,0 +1,565 @@
+#include <string.h>
+
+#include "../../src/fsm.h"
+#include "../../src/registry.h"
+#include "../../src/vfs.h"
+
+#include "../lib/heap.h"
+#include "../lib/logger.h"
+#include "../lib/runner.h"
+#include "../lib/sqlite.h"
+#include "../lib/uv.h"
+
+TEST_MODULE(fsm);
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ ******************************************************************************/
+
+/* Number of nodes in the fixture. */
+#define N_NODES 2
+
+/* A node, with its own VFS, registry and FSM, but no raft instance: snapshots
+ * are taken and restored by calling the FSM directly. */
+struct node
+{
+	struct config config;
+	struct sqlite3_vfs vfs;
+	struct registry registry;
+	struct raft_fsm fsm;
+};
+
+struct fixture
+{
+	struct node nodes[N_NODES];
+	struct uv_loop_s loop; /* Loop whose thread pool nodes can use. */
+	sqlite3 *conn; /* Connection writing to test.db on the first node. */
+};
+
+static void setUpNode(const MunitParameter params[],
+		      struct node *n,
+		      unsigned id)
+{
+	char address[16];
+	int rv;
+
+	sprintf(address, "%u", id);
+	rv = config__init(&n->config, id, address);
+	munit_assert_int(rv, ==, 0);
+	test_logger_setup(params, &n->config.logger);
+	n->config.page_size = 512;
+	rv = VfsInitV1(&n->vfs, n->config.name);
+	munit_assert_int(rv, ==, 0);
+	registry__init(&n->registry, &n->config);
+	rv = fsm__init(&n->fsm, &n->config, &n->registry, NULL);
+	munit_assert_int(rv, ==, 0);
+}
+
+static void tearDownNode(struct node *n)
+{
+	fsm__close(&n->fsm);
+	registry__close(&n->registry);
+	VfsClose(&n->vfs);
+	test_logger_tear_down(&n->config.logger);
+	config__close(&n->config);
+}
+
+/* Register a database with the given filename on the given node, and open a
+ * connection to it, creating a test table. */
+static sqlite3 *openDatabase(struct node *n, const char *filename)
+{
+	struct db *db;
+	sqlite3 *conn;
+	int rv;
+
+	rv = registry__db_get(&n->registry, filename, &db);
+	munit_assert_int(rv, ==, 0);
+	rv = sqlite3_open_v2(filename, &conn,
+			     SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			     n->config.name);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_exec(conn,
+			  "PRAGMA page_size=512;"
+			  "PRAGMA synchronous=OFF;"
+			  "PRAGMA journal_mode=WAL;"
+			  "CREATE TABLE test (n INT, blob BLOB)",
+			  NULL, NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	return conn;
+}
+
+static void *setUp(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	unsigned i;
+
+	SETUP_HEAP;
+	SETUP_SQLITE;
+	test_uv_setup(params, &f->loop);
+	for (i = 0; i < N_NODES; i++) {
+		setUpNode(params, &f->nodes[i], i + 1);
+	}
+	f->conn = openDatabase(&f->nodes[0], "test.db");
+
+	return f;
+}
+
+static void tearDown(void *data)
+{
+	struct fixture *f = data;
+	unsigned i;
+
+	sqlite3_close(f->conn);
+	test_uv_stop(&f->loop);
+	test_uv_tear_down(&f->loop);
+	for (i = 0; i < N_NODES; i++) {
+		tearDownNode(&f->nodes[i]);
+	}
+	TEAR_DOWN_SQLITE;
+	TEAR_DOWN_HEAP;
+	free(f);
+}
+
+/******************************************************************************
+ *
+ * Helper macros.
+ *
+ ******************************************************************************/
+
+/* Return the I'th node. */
+#define NODE(I) (&f->nodes[I])
+
+/* Encode the snapshots of the I'th node using the thread pool of the fixture's
+ * loop. */
+#define USE_THREAD_POOL(I)                                               \
+	{                                                                \
+		int rv_;                                                 \
+		fsm__close(&NODE(I)->fsm);                               \
+		rv_ = fsm__init(&NODE(I)->fsm, &NODE(I)->config,         \
+				&NODE(I)->registry, &f->loop);           \
+		munit_assert_int(rv_, ==, 0);                            \
+	}
+
+/* Execute the given SQL using the given connection. */
+#define EXEC_CONN(CONN, SQL)                                      \
+	{                                                         \
+		int rv_;                                          \
+		rv_ = sqlite3_exec(CONN, SQL, NULL, NULL, NULL); \
+		munit_assert_int(rv_, ==, SQLITE_OK);             \
+	}
+
+/* Execute the given SQL on test.db of the first node. */
+#define EXEC(SQL) EXEC_CONN(f->conn, SQL)
+
+/* Insert N rows with a random blob of the given size using the given
+ * connection. */
+#define INSERT_CONN(CONN, N, SIZE)                                           \
+	{                                                                    \
+		char sql_[256];                                              \
+		sprintf(sql_,                                                \
+			"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "        \
+			"SELECT x + 1 FROM c WHERE x < %d) "                 \
+			"INSERT INTO test(n, blob) SELECT x, randomblob(%d) " \
+			"FROM c",                                            \
+			N, SIZE);                                            \
+		EXEC_CONN(CONN, sql_);                                       \
+	}
+
+/* Insert N rows with a random blob of the given size in test.db of the first
+ * node. */
+#define INSERT(N, SIZE) INSERT_CONN(f->conn, N, SIZE)
+
+/* Move the content of the WAL of test.db on the first node to the main
+ * file. */
+#define CHECKPOINT                                                          \
+	{                                                                   \
+		int rv_;                                                    \
+		rv_ = sqlite3_wal_checkpoint_v2(                            \
+		    f->conn, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL); \
+		munit_assert_int(rv_, ==, SQLITE_OK);                       \
+	}
+
+/* Take a snapshot on the I'th node, and join its buffers into BUF, as raft does
+ * before restoring it. */
+#define SNAPSHOT(I, BUF)                                                    \
+	{                                                                   \
+		struct raft_buffer *bufs_;                                  \
+		unsigned n_bufs_;                                           \
+		unsigned i_;                                                \
+		uint8_t *cursor_;                                           \
+		int rv_;                                                    \
+		rv_ = NODE(I)->fsm.snapshot(&NODE(I)->fsm, &bufs_, &n_bufs_); \
+		munit_assert_int(rv_, ==, 0);                               \
+		(BUF).len = 0;                                              \
+		for (i_ = 0; i_ < n_bufs_; i_++) {                          \
+			(BUF).len += bufs_[i_].len;                         \
+		}                                                           \
+		(BUF).base = raft_malloc((BUF).len);                        \
+		munit_assert_ptr_not_null((BUF).base);                      \
+		cursor_ = (BUF).base;                                       \
+		for (i_ = 0; i_ < n_bufs_; i_++) {                          \
+			memcpy(cursor_, bufs_[i_].base, bufs_[i_].len);     \
+			cursor_ += bufs_[i_].len;                           \
+			raft_free(bufs_[i_].base);                          \
+		}                                                           \
+		raft_free(bufs_);                                           \
+	}
+
+/* Restore the snapshot in BUF on the I'th node, which takes ownership of it. */
+#define RESTORE(I, BUF)                                            \
+	{                                                          \
+		int rv_;                                           \
+		rv_ = NODE(I)->fsm.restore(&NODE(I)->fsm, &(BUF)); \
+		munit_assert_int(rv_, ==, 0);                      \
+	}
+
+/* Assert that the file with the given name has the same content on the first
+ * and on the I'th node. */
+#define ASSERT_SAME_FILE(I, FILENAME)                                      \
+	{                                                                  \
+		void *buf1_;                                               \
+		void *buf2_;                                               \
+		size_t len1_;                                              \
+		size_t len2_;                                              \
+		int rv_;                                                   \
+		rv_ = VfsFileRead(NODE(0)->config.name, FILENAME, &buf1_,  \
+				  &len1_);                                 \
+		munit_assert_int(rv_, ==, 0);                              \
+		rv_ = VfsFileRead(NODE(I)->config.name, FILENAME, &buf2_,  \
+				  &len2_);                                 \
+		munit_assert_int(rv_, ==, 0);                              \
+		munit_assert_size(len1_, ==, len2_);                       \
+		munit_assert_memory_equal(len1_, buf1_, buf2_);            \
+		raft_free(buf1_);                                          \
+		raft_free(buf2_);                                          \
+	}
+
+/* Assert that test.db and its WAL have the same content on the first and on
+ * the I'th node. */
+#define ASSERT_SAME_DATABASE(I)                \
+	ASSERT_SAME_FILE(I, "test.db");        \
+	ASSERT_SAME_FILE(I, "test.db-wal")
+
+/******************************************************************************
+ *
+ * Snapshot and restore
+ *
+ ******************************************************************************/
+
+TEST_SUITE(snapshot);
+TEST_SETUP(snapshot, setUp);
+TEST_TEAR_DOWN(snapshot, tearDown);
+
+/* A database spanning several chunks, in both its main file and its WAL, is
+ * restored as it is. */
+TEST_CASE(snapshot, chunks, NULL)
+{
+	struct fixture *f = data;
+	struct raft_buffer buf;
+	(void)params;
+
+	INSERT(3000, 1000);
+	CHECKPOINT;
+	INSERT(3000, 1000);
+
+	SNAPSHOT(0, buf);
+	munit_assert_size(buf.len, >, 6000 * 1000);
+	RESTORE(1, buf);
+	ASSERT_SAME_DATABASE(1);
+
+	return MUNIT_OK;
+}
+
+/* Number of databases encoded in parallel by the thread pool tests. */
+#define N_DATABASES 8
+
+/* Create N_DATABASES databases on the first node, besides test.db, each with
+ * content in both its main file and its WAL. */
+static void createDatabases(struct fixture *f, sqlite3 *conns[])
+{
+	char filename[16];
+	unsigned i;
+
+	for (i = 0; i < N_DATABASES; i++) {
+		sprintf(filename, "%u.db", i);
+		conns[i] = openDatabase(NODE(0), filename);
+		INSERT_CONN(conns[i], 500 * (int)(i + 1), 1000);
+		EXEC_CONN(conns[i], "PRAGMA wal_checkpoint(TRUNCATE)");
+		INSERT_CONN(conns[i], 100, 1000);
+	}
+}
+
+/* Assert that the I'th node holds the same databases created by
+ * createDatabases() as the first node, and close their connections. */
+static void assertSameDatabases(struct fixture *f,
+				unsigned i,
+				sqlite3 *conns[])
+{
+	char filename[32];
+	unsigned j;
+
+	for (j = 0; j < N_DATABASES; j++) {
+		sprintf(filename, "%u.db", j);
+		ASSERT_SAME_FILE(i, filename);
+		sprintf(filename, "%u.db-wal", j);
+		ASSERT_SAME_FILE(i, filename);
+		sqlite3_close(conns[j]);
+	}
+}
+
+/* Databases are encoded in parallel by the thread pool. */
+TEST_CASE(snapshot, thread_pool, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *conns[N_DATABASES];
+	struct raft_buffer buf;
+	(void)params;
+
+	USE_THREAD_POOL(0);
+	createDatabases(f, conns);
+	INSERT(1000, 1000);
+
+	SNAPSHOT(0, buf);
+	RESTORE(1, buf);
+	ASSERT_SAME_DATABASE(1);
+	assertSameDatabases(f, 1, conns);
+
+	return MUNIT_OK;
+}
+
+/* Default number of threads in the libuv thread pool. */
+#define THREAD_POOL_SIZE 4
+
+/* Thread pool request occupying a thread until it's released. */
+struct blocker
+{
+	uv_work_t work;
+	uv_sem_t *started; /* Posted once the request runs. */
+	uv_sem_t *release; /* Waited for before returning. */
+};
+
+static void blockerWorkCb(uv_work_t *work)
+{
+	struct blocker *b = work->data;
+	uv_sem_post(b->started);
+	uv_sem_wait(b->release);
+}
+
+static void blockerAfterWorkCb(uv_work_t *work, int status)
+{
+	(void)work;
+	munit_assert_int(status, ==, 0);
+}
+
+/* If all threads of the pool are busy, the loop thread encodes all databases on
+ * its own, rather than waiting for a free thread. */
+TEST_CASE(snapshot, thread_pool_busy, NULL)
+{
+	struct fixture *f = data;
+	struct blocker blockers[THREAD_POOL_SIZE];
+	sqlite3 *conns[N_DATABASES];
+	struct raft_buffer buf;
+	uv_sem_t started;
+	uv_sem_t release;
+	unsigned i;
+	int rv;
+	(void)params;
+
+	USE_THREAD_POOL(0);
+	createDatabases(f, conns);
+
+	rv = uv_sem_init(&started, 0);
+	munit_assert_int(rv, ==, 0);
+	rv = uv_sem_init(&release, 0);
+	munit_assert_int(rv, ==, 0);
+	for (i = 0; i < THREAD_POOL_SIZE; i++) {
+		blockers[i].work.data = &blockers[i];
+		blockers[i].started = &started;
+		blockers[i].release = &release;
+		rv = uv_queue_work(&f->loop, &blockers[i].work, blockerWorkCb,
+				   blockerAfterWorkCb);
+		munit_assert_int(rv, ==, 0);
+	}
+	for (i = 0; i < THREAD_POOL_SIZE; i++) {
+		uv_sem_wait(&started);
+	}
+
+	SNAPSHOT(0, buf);
+
+	for (i = 0; i < THREAD_POOL_SIZE; i++) {
+		uv_sem_post(&release);
+	}
+	test_uv_run(&f->loop, TEST_UV_MAX_LOOP_RUN);
+	uv_sem_destroy(&release);
+	uv_sem_destroy(&started);
+
+	RESTORE(1, buf);
+	assertSameDatabases(f, 1, conns);
+
+	return MUNIT_OK;
+}
+
+/* A snapshot is taken while a write transaction is pending, leaving it out, and
+ * deferred once the transaction applied some of its frames. */
+TEST_CASE(snapshot, pending_tx, NULL)
+{
+	struct fixture *f = data;
+	const struct dqlite__metrics *metrics = fsm__metrics(&NODE(0)->fsm);
+	struct raft_buffer *bufs;
+	struct raft_buffer buf;
+	struct db *db;
+	unsigned n_bufs;
+	int rv;
+	(void)params;
+
+	INSERT(100, 1000);
+	rv = registry__db_get(&NODE(0)->registry, "test.db", &db);
+	munit_assert_int(rv, ==, 0);
+	rv = db__open_follower(db);
+	munit_assert_int(rv, ==, 0);
+	rv = db__create_tx(db, 1, db->follower);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(db->tx->state, ==, TX__PENDING);
+
+	SNAPSHOT(0, buf);
+	munit_assert_int(metrics->snapshots, ==, 1);
+	munit_assert_int(metrics->snapshots_pending, ==, 1);
+	munit_assert_int(metrics->snapshots_deferred, ==, 0);
+	RESTORE(1, buf);
+	ASSERT_SAME_DATABASE(1);
+
+	db->tx->state = TX__WRITING;
+	rv = NODE(0)->fsm.snapshot(&NODE(0)->fsm, &bufs, &n_bufs);
+	munit_assert_int(rv, ==, RAFT_BUSY);
+	munit_assert_int(metrics->snapshots, ==, 1);
+	munit_assert_int(metrics->snapshots_pending, ==, 1);
+	munit_assert_int(metrics->snapshots_deferred, ==, 1);
+
+	db__delete_tx(db);
+	SNAPSHOT(0, buf);
+	munit_assert_int(metrics->snapshots, ==, 2);
+	munit_assert_int(metrics->snapshots_pending, ==, 1);
+	raft_free(buf.base);
+
+	return MUNIT_OK;
+}
+
+/* Return the little-endian 64-bit integer at the given offset of a snapshot. */
+static uint64_t snapshotField(const struct raft_buffer *buf, size_t offset)
+{
+	const uint8_t *p = (const uint8_t *)buf->base + offset;
+	uint64_t value = 0;
+	unsigned i;
+
+	munit_assert_size(offset + 8, <=, buf->len);
+	for (i = 0; i < 8; i++) {
+		value |= (uint64_t)p[i] << (8 * i);
+	}
+
+	return value;
+}
+
+/* Offset of the header of the first chunk in a format 3 snapshot holding only
+ * test.db: the snapshot header, the filename and the file sizes come before
+ * it. */
+#define FIRST_PACKED_CHUNK (16 + 8 + 16)
+
+/* Fields of the header of a chunk in a format 3 snapshot. */
+enum { PACKED_WAL, PACKED_OFFSET, PACKED_LEN, PACKED_CODEC, PACKED_SIZE,
+       PACKED_N };
+
+/* Count the chunks of a format 3 snapshot holding only test.db that are stored
+ * with the given codec. */
+static unsigned countPackedChunks(const struct raft_buffer *buf, uint64_t codec)
+{
+	size_t offset = FIRST_PACKED_CHUNK;
+	uint64_t size;
+	unsigned n = 0;
+
+	munit_assert_int(snapshotField(buf, 0), ==, 3);
+	munit_assert_int(snapshotField(buf, 8), ==, 1);
+	while (offset < buf->len) {
+		if (snapshotField(buf, offset + 8 * PACKED_CODEC) == codec) {
+			n++;
+		}
+		size = snapshotField(buf, offset + 8 * PACKED_SIZE);
+		offset += 8 * PACKED_N + ((size + 7) & ~(uint64_t)7);
+	}
+	munit_assert_size(offset, ==, buf->len);
+
+	return n;
+}
+
+/* Chunks that compress well are stored compressed in format 3 snapshots. */
+TEST_CASE(snapshot, lz4, NULL)
+{
+	struct fixture *f = data;
+	struct raft_buffer buf;
+	(void)params;
+
+	NODE(0)->config.snapshot_compression = DQLITE_SNAPSHOT_COMPRESSION_LZ4;
+	EXEC("INSERT INTO test(n, blob) SELECT n, zeroblob(1000) FROM "
+	     "(WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c "
+	     "WHERE n < 3000) SELECT n FROM c)");
+	CHECKPOINT;
+	INSERT(10, 1000);
+
+	SNAPSHOT(0, buf);
+	munit_assert_uint(
+	    countPackedChunks(&buf, DQLITE_SNAPSHOT_COMPRESSION_LZ4), >, 0);
+	munit_assert_size(buf.len, <, 3000 * 1000 / 4);
+	RESTORE(1, buf);
+	ASSERT_SAME_DATABASE(1);
+
+	return MUNIT_OK;
+}
+
+/* Chunks that don't get smaller when compressed are stored as they are. */
+TEST_CASE(snapshot, lz4_incompressible, NULL)
+{
+	struct fixture *f = data;
+	struct raft_buffer buf;
+	(void)params;
+
+	/* Random blobs spanning whole overflow pages leave nothing to match. */
+	NODE(0)->config.snapshot_compression = DQLITE_SNAPSHOT_COMPRESSION_LZ4;
+	INSERT(30, 100000);
+	CHECKPOINT;
+	INSERT(10, 1000);
+
+	SNAPSHOT(0, buf);
+	munit_assert_uint(
+	    countPackedChunks(&buf, DQLITE_SNAPSHOT_COMPRESSION_NONE), >, 0);
+	RESTORE(1, buf);
+	ASSERT_SAME_DATABASE(1);
+
+	return MUNIT_OK;
+}
+
+/* A chunk compressed with an unknown codec can't be restored. */
+TEST_CASE(snapshot, unknown_codec, NULL)
+{
+	struct fixture *f = data;
+	struct raft_buffer buf;
+	uint8_t *codec;
+	int rv;
+	(void)params;
+
+	NODE(0)->config.snapshot_compression = DQLITE_SNAPSHOT_COMPRESSION_LZ4;
+	EXEC("INSERT INTO test(n, blob) VALUES(1, zeroblob(1000))");
+	CHECKPOINT;
+
+	SNAPSHOT(0, buf);
+	munit_assert_uint(
+	    countPackedChunks(&buf, DQLITE_SNAPSHOT_COMPRESSION_LZ4), ==, 1);
+	codec = (uint8_t *)buf.base + FIRST_PACKED_CHUNK + 8 * PACKED_CODEC;
+	*codec = 99;
+	rv = NODE(1)->fsm.restore(&NODE(1)->fsm, &buf);
+	munit_assert_int(rv, ==, RAFT_MALFORMED);
+	raft_free(buf.base);
+
+	return MUNIT_OK;
+}
@@ -216,6 +216,7 @@ TEST_CASE(exec, success, NULL)
 TEST_CASE(exec, snapshot, NULL)
 {
 	struct exec_fixture *f = data;
+	const struct dqlite__metrics *metrics = fsm__metrics(&f->fsms[0]);
 	(void)params;
 	CLUSTER_SNAPSHOT_THRESHOLD(0, 4);
 	CLUSTER_ELECT(0);
@@ -229,13 +230,17 @@ TEST_CASE(exec, snapshot, NULL)
 	munit_assert_true(f->invoked);
 	munit_assert_int(f->status, ==, SQLITE_DONE);
 	FINALIZE;
+	munit_assert_int(metrics->snapshots, ==, 1);
+	munit_assert_int(metrics->snapshots_deferred, ==, 0);
 	return MUNIT_OK;
 }
 
-/* If a transaction is in progress, no snapshot is taken. */
+/* If a transaction in progress already replicated some of its frames, no
+ * snapshot is taken. */
 TEST_CASE(exec, snapshot_busy, NULL)
 {
 	struct exec_fixture *f = data;
+	const struct dqlite__metrics *metrics = fsm__metrics(&f->fsms[0]);
 	(void)params;
 	unsigned i;
 	CLUSTER_SNAPSHOT_THRESHOLD(0, 4);
@@ -247,6 +252,8 @@ TEST_CASE(exec, snapshot_busy, NULL)
 	for (i = 0; i < 163; i++) {
 		EXEC_SQL(0, "INSERT INTO test(n) VALUES(1)");
 	}
+	munit_assert_int(metrics->snapshots, ==, 0);
+	munit_assert_int(metrics->snapshots_deferred, >, 0);
 	return MUNIT_OK;
 }
 
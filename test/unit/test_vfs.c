@@ -1,4 +1,7 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <raft.h>
 #include <sqlite3.h>
@@ -517,6 +520,83 @@ TEST(VfsOpen, tmp, setUp, tearDown, 0, NULL)
 	return MUNIT_OK;
 }
 
+/* Opening a WAL file whose main database file name is a prefix of an existing
+ * database's name results in an error. */
+TEST(VfsOpen, walPrefix, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file1 = __file_create(&f->vfs, "test.db2",
+					    SQLITE_OPEN_MAIN_DB);
+	sqlite3_file *file2 = munit_malloc(f->vfs.szOsFile);
+	int flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_WAL;
+	int rc;
+
+	(void)params;
+
+	rc = f->vfs.xOpen(&f->vfs, "test.db-wal", file2, flags, &flags);
+	munit_assert_int(rc, ==, SQLITE_CANTOPEN);
+
+	rc = file1->pMethods->xClose(file1);
+	munit_assert_int(rc, ==, 0);
+
+	free(file1);
+	free(file2);
+
+	return MUNIT_OK;
+}
+
+/* Open a large number of files, then delete half of them and check that the
+ * remaining ones can still be found. */
+TEST(VfsOpen, many, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = munit_malloc(f->vfs.szOsFile);
+	char name[32];
+	int exists;
+	unsigned i;
+	int rc;
+
+	(void)params;
+
+	for (i = 0; i < 1000; i++) {
+		int flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_DB;
+		sprintf(name, "test%u.db", i);
+		rc = f->vfs.xOpen(&f->vfs, name, file, flags, &flags);
+		munit_assert_int(rc, ==, 0);
+		rc = file->pMethods->xClose(file);
+		munit_assert_int(rc, ==, 0);
+
+		flags = SQLITE_OPEN_CREATE | SQLITE_OPEN_WAL;
+		sprintf(name, "test%u.db-wal", i);
+		rc = f->vfs.xOpen(&f->vfs, name, file, flags, &flags);
+		munit_assert_int(rc, ==, 0);
+		rc = file->pMethods->xClose(file);
+		munit_assert_int(rc, ==, 0);
+	}
+
+	for (i = 0; i < 1000; i += 2) {
+		sprintf(name, "test%u.db-wal", i);
+		rc = f->vfs.xDelete(&f->vfs, name, 0);
+		munit_assert_int(rc, ==, 0);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		sprintf(name, "test%u.db", i);
+		rc = f->vfs.xAccess(&f->vfs, name, 0, &exists);
+		munit_assert_int(rc, ==, 0);
+		munit_assert_true(exists);
+
+		sprintf(name, "test%u.db-wal", i);
+		rc = f->vfs.xAccess(&f->vfs, name, 0, &exists);
+		munit_assert_int(rc, ==, 0);
+		munit_assert_int(exists, ==, i % 2);
+	}
+
+	free(file);
+
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * xDelete
@@ -1008,7 +1088,7 @@ TEST(VfsWrite, beyondFirst, setUp, tearDown, 0, NULL)
 	return MUNIT_OK;
 }
 
-/* Trying to write two pages beyond the last one results in an error. */
+/* Writing two pages beyond the last one leaves a hole, which reads as zeros. */
 TEST(VfsWrite, beyondLast, setUp, tearDown, 0, NULL)
 {
 	struct fixture *f = data;
@@ -1016,19 +1096,33 @@ TEST(VfsWrite, beyondLast, setUp, tearDown, 0, NULL)
 	void *buf_page_1 = __buf_page_1();
 	void *buf_page_2 = __buf_page_2();
 	char buf[512];
+	sqlite_int64 size;
 	int rc;
 
 	(void)params;
 
-	memset(buf, 0, 512);
-
 	/* Write the first page. */
 	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
 	munit_assert_int(rc, ==, 0);
 
 	/* Write the third page, without writing the second. */
 	rc = file->pMethods->xWrite(file, buf_page_2, 512, 1024);
-	munit_assert_int(rc, ==, SQLITE_IOERR_WRITE);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xFileSize(file, &size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(size, ==, 1536);
+
+	/* The second page is zeroed. */
+	memset(buf, 1, sizeof buf);
+	rc = file->pMethods->xRead(file, buf, 512, 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(buf[0], ==, 0);
+	munit_assert_int(buf[511], ==, 0);
+
+	rc = file->pMethods->xRead(file, buf, 512, 1024);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(memcmp(buf, buf_page_2, 512), ==, 0);
 
 	free(buf_page_1);
 	free(buf_page_2);
@@ -1037,6 +1131,75 @@ TEST(VfsWrite, beyondLast, setUp, tearDown, 0, NULL)
 	return MUNIT_OK;
 }
 
+/* Writing far past the end of the file doesn't allocate memory for the skipped
+ * pages, which can be filled in later in any order. */
+TEST(VfsWrite, sparse, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __file_create_main_db(&f->vfs);
+	void *buf_page_1 = __buf_page_1();
+	struct dqlite_vfs_stats stats;
+	struct vfsSnapshot *snapshot;
+	char buf[512];
+	uint8_t *image;
+	size_t main_size;
+	size_t wal_size;
+	unsigned pgnos[] = {60000, 2, 30001, 30000, 45000};
+	unsigned i;
+	int rc;
+
+	(void)params;
+
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+
+	for (i = 0; i < sizeof pgnos / sizeof *pgnos; i++) {
+		memset(buf, (int)(i + 1), sizeof buf);
+		rc = file->pMethods->xWrite(file, buf, 512,
+					    (sqlite3_int64)(pgnos[i] - 1) * 512);
+		munit_assert_int(rc, ==, 0);
+	}
+
+	/* Holes use no memory: the 30 MiB file takes much less. */
+	rc = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_ullong(stats.pages, <, 64 * 1024);
+	munit_assert_ullong(stats.overhead, <, 256 * 1024);
+
+	for (i = 0; i < sizeof pgnos / sizeof *pgnos; i++) {
+		rc = file->pMethods->xRead(file, buf, 512,
+					   (sqlite3_int64)(pgnos[i] - 1) * 512);
+		munit_assert_int(rc, ==, 0);
+		munit_assert_int(buf[0], ==, (char)(i + 1));
+		munit_assert_int(buf[511], ==, (char)(i + 1));
+	}
+
+	/* Holes read as zeros, both from the file and from a snapshot. */
+	memset(buf, 1, sizeof buf);
+	rc = file->pMethods->xRead(file, buf, 512, 20000 * 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(buf[0], ==, 0);
+	munit_assert_int(buf[511], ==, 0);
+
+	rc = VfsSnapshotAcquire("dqlite", "test.db", &snapshot);
+	munit_assert_int(rc, ==, 0);
+	VfsSnapshotSize(snapshot, &main_size, &wal_size);
+	munit_assert_ullong(main_size, ==, 60000 * 512);
+	image = munit_malloc(main_size);
+	rc = VfsSnapshotRead(snapshot, false, 0, image, main_size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(image[20000 * 512], ==, 0);
+	munit_assert_int(image[(30000 - 1) * 512], ==, 4);
+	munit_assert_int(image[(60000 - 1) * 512], ==, 1);
+	VfsSnapshotRelease(snapshot);
+	free(image);
+
+	free(buf_page_1);
+	free(file);
+
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * xTruncate
@@ -1045,6 +1208,132 @@ TEST(VfsWrite, beyondLast, setUp, tearDown, 0, NULL)
 
 SUITE(VfsTruncate);
 
+/* Truncate a database file spanning several slabs and page index leaves, then
+ * grow it again. */
+TEST(VfsTruncate, databaseManyPages, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __file_create_main_db(&f->vfs);
+	void *buf_page_1 = __buf_page_1();
+	char buf[512];
+	sqlite_int64 size;
+	unsigned i;
+	int rc;
+
+	(void)params;
+
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+
+	/* Write 3000 pages, each one filled with its page number. */
+	for (i = 2; i <= 3000; i++) {
+		memset(buf, (int)(i % 256), sizeof buf);
+		rc = file->pMethods->xWrite(file, buf, 512, (i - 1) * 512);
+		munit_assert_int(rc, ==, 0);
+	}
+
+	/* Truncate in the middle of a slab and of a leaf. */
+	rc = file->pMethods->xTruncate(file, 1500 * 512);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xFileSize(file, &size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(size, ==, 1500 * 512);
+
+	/* Grow the file again, overwriting the truncated pages. */
+	for (i = 1501; i <= 2000; i++) {
+		memset(buf, (int)((i + 1) % 256), sizeof buf);
+		rc = file->pMethods->xWrite(file, buf, 512, (i - 1) * 512);
+		munit_assert_int(rc, ==, 0);
+	}
+
+	for (i = 2; i <= 2000; i++) {
+		rc = file->pMethods->xRead(file, buf, 512, (i - 1) * 512);
+		munit_assert_int(rc, ==, 0);
+		if (i <= 1500) {
+			munit_assert_int(buf[0], ==, (char)(i % 256));
+		} else {
+			munit_assert_int(buf[0], ==, (char)((i + 1) % 256));
+		}
+		munit_assert_int(buf[511], ==, buf[0]);
+	}
+
+	rc = file->pMethods->xTruncate(file, 0);
+	munit_assert_int(rc, ==, 0);
+
+	free(buf_page_1);
+	free(file);
+
+	return MUNIT_OK;
+}
+
+/* Truncating a sparse file drops its holes, and truncating it to a larger size
+ * adds holes. */
+TEST(VfsTruncate, databaseSparse, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __file_create_main_db(&f->vfs);
+	void *buf_page_1 = __buf_page_1();
+	char buf[512];
+	sqlite_int64 size;
+	int rc;
+
+	(void)params;
+
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+
+	memset(buf, 7, sizeof buf);
+	rc = file->pMethods->xWrite(file, buf, 512, 2 * 512);
+	munit_assert_int(rc, ==, 0);
+	rc = file->pMethods->xWrite(file, buf, 512, 9999 * 512);
+	munit_assert_int(rc, ==, 0);
+	rc = file->pMethods->xWrite(file, buf, 512, 4999 * 512);
+	munit_assert_int(rc, ==, 0);
+
+	/* Truncate in the middle of the hole past the 5000th page. */
+	rc = file->pMethods->xTruncate(file, 7000 * 512);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xRead(file, buf, 512, 4999 * 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(buf[0], ==, 7);
+
+	/* Grow the file again, the truncated page is now a hole. */
+	rc = file->pMethods->xTruncate(file, 12000 * 512);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xFileSize(file, &size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(size, ==, 12000 * 512);
+
+	rc = file->pMethods->xRead(file, buf, 512, 9999 * 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(buf[0], ==, 0);
+
+	/* Truncate right after the first page, in the middle of a slab whose
+	 * free slots get zeroed when the file grows again. */
+	rc = file->pMethods->xTruncate(file, 512);
+	munit_assert_int(rc, ==, 0);
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+	rc = file->pMethods->xTruncate(file, 3 * 512);
+	munit_assert_int(rc, ==, 0);
+
+	memset(buf, 1, sizeof buf);
+	rc = file->pMethods->xRead(file, buf, 512, 2 * 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(buf[0], ==, 0);
+
+	rc = file->pMethods->xTruncate(file, 0);
+	munit_assert_int(rc, ==, 0);
+
+	free(buf_page_1);
+	free(file);
+
+	return MUNIT_OK;
+}
+
 /* Truncate the main database file. */
 TEST(VfsTruncate, database, setUp, tearDown, 0, NULL)
 {
@@ -1293,6 +1582,104 @@ TEST(VfsTruncate, misaligned, setUp, tearDown, 0, NULL)
 	return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * xFetch
+ *
+ ******************************************************************************/
+
+SUITE(VfsFetch);
+
+/* Fetching a page returns a pointer to its content. */
+TEST(VfsFetch, page, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __file_create_main_db(&f->vfs);
+	void *buf_page_1 = __buf_page_1();
+	void *buf_page_2 = __buf_page_2();
+	sqlite3_int64 mmap_size = 1024;
+	void *p;
+	int rc;
+
+	(void)params;
+
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xWrite(file, buf_page_2, 512, 512);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xFileControl(file, SQLITE_FCNTL_MMAP_SIZE,
+					  &mmap_size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(mmap_size, ==, 1024);
+
+	rc = file->pMethods->xFetch(file, 512, 512, &p);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_ptr_not_null(p);
+	munit_assert_int(memcmp(p, buf_page_2, 512), ==, 0);
+
+	rc = file->pMethods->xUnfetch(file, 512, p);
+	munit_assert_int(rc, ==, 0);
+
+	/* Pages past the end of the file can't be fetched. */
+	rc = file->pMethods->xFetch(file, 1024, 512, &p);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_ptr_null(p);
+
+	rc = file->pMethods->xClose(file);
+	munit_assert_int(rc, ==, 0);
+
+	free(buf_page_1);
+	free(buf_page_2);
+	free(file);
+
+	return MUNIT_OK;
+}
+
+/* Pages beyond the limit set with SQLITE_FCNTL_MMAP_SIZE can't be fetched,
+ * and SQLite has to read them. */
+TEST(VfsFetch, beyondLimit, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __file_create_main_db(&f->vfs);
+	void *buf_page_1 = __buf_page_1();
+	void *buf_page_2 = __buf_page_2();
+	sqlite3_int64 mmap_size = 512;
+	void *p;
+	int rc;
+
+	(void)params;
+
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xWrite(file, buf_page_2, 512, 512);
+	munit_assert_int(rc, ==, 0);
+
+	/* By default the limit is zero. */
+	rc = file->pMethods->xFetch(file, 512, 512, &p);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_ptr_null(p);
+
+	rc = file->pMethods->xFileControl(file, SQLITE_FCNTL_MMAP_SIZE,
+					  &mmap_size);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xFetch(file, 512, 512, &p);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_ptr_null(p);
+
+	rc = file->pMethods->xClose(file);
+	munit_assert_int(rc, ==, 0);
+
+	free(buf_page_1);
+	free(buf_page_2);
+	free(file);
+
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * xShmMap
@@ -1900,35 +2287,187 @@ TEST(VfsIntegration, checkpoint, setUp, tearDown, 0, NULL)
 	return SQLITE_OK;
 }
 
-/******************************************************************************
- *
- * vfs file read/write
- *
- ******************************************************************************/
-
-SUITE(VfsFileRead);
-
-/* If the file being read does not exists, an error is returned. */
-TEST(VfsFileRead, cantOpen, setUp, tearDown, 0, NULL)
-{
-	struct fixture *f = data;
-	void *buf;
-	size_t len;
-	int rv;
-	(void)params;
-	rv = VfsFileRead(f->vfs.zName, "test.db", &buf, &len);
-	munit_assert_int(rv, ==, SQLITE_CANTOPEN);
-	return MUNIT_OK;
-}
-
-/* Read the content of an empty file. */
-TEST(VfsFileRead, empty, setUp, tearDown, 0, NULL)
+/* Frames released by a WAL truncation are recycled by later transactions. */
+TEST(VfsIntegration, framePool, setUp, tearDown, 0, NULL)
 {
 	struct fixture *f = data;
 	sqlite3 *db;
-	void *buf;
-	size_t len;
-	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	unsigned long long hits;
+	unsigned long long misses;
+	int log, ckpt;
+	int rv;
+
+	(void)params;
+
+	db = __db_open();
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+
+	/* Initially all frames are allocated from the heap. */
+	VfsFramePoolStats(&f->vfs, &hits, &misses);
+	munit_assert_int(hits, ==, 0);
+	munit_assert_int(misses, ==, 2);
+
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       &log, &ckpt);
+	munit_assert_int(rv, ==, 0);
+
+	/* The checkpointed frames were lent to the database, so the pool is
+	 * still empty. */
+	__db_exec(db, "INSERT INTO test(n) VALUES(1)");
+
+	VfsFramePoolStats(&f->vfs, &hits, &misses);
+	munit_assert_int(hits, ==, 0);
+	munit_assert_int(misses, ==, 3);
+
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       &log, &ckpt);
+	munit_assert_int(rv, ==, 0);
+
+	/* The frame previously lent to page 2 was replaced by the new one and
+	 * got recycled. */
+	__db_exec(db, "INSERT INTO test(n) VALUES(2)");
+
+	VfsFramePoolStats(&f->vfs, &hits, &misses);
+	munit_assert_int(hits, ==, 1);
+	munit_assert_int(misses, ==, 3);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* With memory-mapping enabled, SQLite reads database pages directly from the
+ * VFS, including pages whose WAL frames were lent to the database. */
+TEST(VfsIntegration, mmap, setUp, tearDown, 0, NULL)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	char sql[128];
+	int log, ckpt;
+	int i;
+	int rv;
+
+	(void)data;
+	(void)params;
+
+	db = __db_open();
+	__db_exec(db, "PRAGMA mmap_size=1048576");
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_exec(db, "BEGIN");
+	for (i = 0; i < 200; i++) {
+		sprintf(sql, "INSERT INTO test(n) VALUES(%d)", i);
+		__db_exec(db, sql);
+	}
+	__db_exec(db, "COMMIT");
+
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       &log, &ckpt);
+	munit_assert_int(rv, ==, 0);
+
+	__db_exec(db, "UPDATE test SET n = n + 1 WHERE n < 100");
+
+	rv = sqlite3_prepare_v2(db, "SELECT count(*), sum(n) FROM test", -1,
+				&stmt, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_step(stmt);
+	munit_assert_int(rv, ==, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 200);
+	munit_assert_int(sqlite3_column_int(stmt, 1), ==, 199 * 200 / 2 + 100);
+	rv = sqlite3_finalize(stmt);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Checkpointed pages are shared between the WAL and the database. Frames that
+ * get rewritten after a WAL restart don't affect the database content. */
+TEST(VfsIntegration, checkpointThenRestart, setUp, tearDown, 0, NULL)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	char sql[128];
+	int log, ckpt;
+	int i;
+	int rv;
+
+	(void)data;
+	(void)params;
+
+	db = __db_open();
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_exec(db, "BEGIN");
+	for (i = 0; i < 200; i++) {
+		sprintf(sql, "INSERT INTO test(n) VALUES(%d)", i);
+		__db_exec(db, sql);
+	}
+	__db_exec(db, "COMMIT");
+
+	/* A passive checkpoint backfills all frames without truncating the
+	 * WAL, which will then be restarted by the next write. */
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_PASSIVE,
+				       &log, &ckpt);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(log, ==, ckpt);
+
+	__db_exec(db, "UPDATE test SET n = n + 1");
+
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       &log, &ckpt);
+	munit_assert_int(rv, ==, 0);
+
+	__db_close(db);
+
+	db = __db_open();
+
+	rv = sqlite3_prepare_v2(db, "SELECT count(*), sum(n) FROM test", -1,
+				&stmt, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_step(stmt);
+	munit_assert_int(rv, ==, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 200);
+	munit_assert_int(sqlite3_column_int(stmt, 1), ==, 200 * 201 / 2);
+	rv = sqlite3_finalize(stmt);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * vfs file read/write
+ *
+ ******************************************************************************/
+
+SUITE(VfsFileRead);
+
+/* If the file being read does not exists, an error is returned. */
+TEST(VfsFileRead, cantOpen, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	void *buf;
+	size_t len;
+	int rv;
+	(void)params;
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_CANTOPEN);
+	return MUNIT_OK;
+}
+
+/* Read the content of an empty file. */
+TEST(VfsFileRead, empty, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db;
+	void *buf;
+	size_t len;
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 	int rv;
 
 	(void)params;
@@ -2037,3 +2576,1879 @@ TEST(VfsFileRead, oom, setUp, tearDown, 0, file_read_oom_params)
 
 	return MUNIT_OK;
 }
+
+/******************************************************************************
+ *
+ * Snapshots
+ *
+ ******************************************************************************/
+
+SUITE(VfsSnapshot);
+
+/* Helper to insert a batch of rows in a single transaction. */
+static void __db_insert(sqlite3 *db, int n)
+{
+	char sql[128];
+	int i;
+
+	__db_exec(db, "BEGIN");
+	for (i = 0; i < n; i++) {
+		sprintf(sql, "INSERT INTO test(n) VALUES(%d)", i);
+		__db_exec(db, sql);
+	}
+	__db_exec(db, "COMMIT");
+}
+
+/* Helper to read the whole main database or WAL file of a snapshot. */
+static void *__snapshot_read(struct vfsSnapshot *snapshot, bool wal, size_t *len)
+{
+	size_t main_size;
+	size_t wal_size;
+	void *buf;
+	int rv;
+
+	VfsSnapshotSize(snapshot, &main_size, &wal_size);
+	*len = wal ? wal_size : main_size;
+	buf = munit_malloc(*len);
+	rv = VfsSnapshotRead(snapshot, wal, 0, buf, *len);
+	munit_assert_int(rv, ==, 0);
+
+	return buf;
+}
+
+/* The content of a snapshot matches the one of the database and WAL files. */
+TEST(VfsSnapshot, matchesFileRead, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	struct vfsSnapshot *snapshot;
+	void *buf1;
+	void *buf2;
+	size_t len1;
+	size_t len2;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_insert(db, 100);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_insert(db, 100);
+
+	rv = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rv, ==, 0);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf1, &len1);
+	munit_assert_int(rv, ==, 0);
+	buf2 = __snapshot_read(snapshot, false, &len2);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(buf1, buf2, len1), ==, 0);
+	raft_free(buf1);
+	free(buf2);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &buf1, &len1);
+	munit_assert_int(rv, ==, 0);
+	buf2 = __snapshot_read(snapshot, true, &len2);
+	munit_assert_int(len2, >, 0);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(buf1, buf2, len1), ==, 0);
+	raft_free(buf1);
+	free(buf2);
+
+	VfsSnapshotRelease(snapshot);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Changing, checkpointing and shrinking the database doesn't affect the
+ * content of a snapshot. */
+TEST(VfsSnapshot, copyOnWrite, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	struct vfsSnapshot *snapshot;
+	void *main1;
+	void *main2;
+	void *wal1;
+	void *wal2;
+	size_t main_len;
+	size_t wal_len;
+	size_t len;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_insert(db, 500);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_exec(db, "UPDATE test SET n = n + 1 WHERE n < 10");
+
+	rv = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rv, ==, 0);
+	main1 = __snapshot_read(snapshot, false, &main_len);
+	wal1 = __snapshot_read(snapshot, true, &wal_len);
+
+	/* Rewrite all pages, then checkpoint. */
+	__db_exec(db, "UPDATE test SET n = n + 1");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	main2 = __snapshot_read(snapshot, false, &len);
+	munit_assert_int(len, ==, main_len);
+	munit_assert_int(memcmp(main1, main2, len), ==, 0);
+	free(main2);
+
+	wal2 = __snapshot_read(snapshot, true, &len);
+	munit_assert_int(len, ==, wal_len);
+	munit_assert_int(memcmp(wal1, wal2, len), ==, 0);
+	free(wal2);
+
+	/* Shrink the database. */
+	__db_exec(db, "DELETE FROM test");
+	__db_exec(db, "VACUUM");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_insert(db, 100);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	main2 = __snapshot_read(snapshot, false, &len);
+	munit_assert_int(len, ==, main_len);
+	munit_assert_int(memcmp(main1, main2, len), ==, 0);
+	free(main2);
+
+	VfsSnapshotRelease(snapshot);
+
+	free(main1);
+	free(wal1);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Direct writes to pinned pages, including pages past the end of a truncated
+ * file, don't affect the content of a snapshot. */
+TEST(VfsSnapshot, writePinnedPages, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __file_create_main_db(&f->vfs);
+	struct vfsSnapshot *snapshot;
+	void *buf_page_1 = __buf_page_1();
+	void *buf_page_2 = __buf_page_2();
+	uint8_t page[512];
+	uint8_t *buf;
+	size_t len;
+	int rc;
+
+	(void)params;
+
+	rc = file->pMethods->xWrite(file, buf_page_1, 512, 0);
+	munit_assert_int(rc, ==, 0);
+	rc = file->pMethods->xWrite(file, buf_page_2, 512, 512);
+	munit_assert_int(rc, ==, 0);
+
+	rc = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rc, ==, 0);
+
+	/* Overwrite the second page twice. */
+	memset(page, 7, sizeof page);
+	rc = file->pMethods->xWrite(file, page, 512, 512);
+	munit_assert_int(rc, ==, 0);
+	memset(page, 8, sizeof page);
+	rc = file->pMethods->xWrite(file, page, 512, 512);
+	munit_assert_int(rc, ==, 0);
+
+	/* Truncate the file and grow it again. */
+	rc = file->pMethods->xTruncate(file, 512);
+	munit_assert_int(rc, ==, 0);
+	memset(page, 9, sizeof page);
+	rc = file->pMethods->xWrite(file, page, 512, 512);
+	munit_assert_int(rc, ==, 0);
+
+	rc = file->pMethods->xRead(file, page, 512, 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(page[0], ==, 9);
+	munit_assert_int(page[511], ==, 9);
+
+	buf = __snapshot_read(snapshot, false, &len);
+	munit_assert_int(len, ==, 1024);
+	munit_assert_int(memcmp(buf, buf_page_1, 512), ==, 0);
+	munit_assert_int(memcmp(buf + 512, buf_page_2, 512), ==, 0);
+	free(buf);
+
+	VfsSnapshotRelease(snapshot);
+
+	/* Once the snapshot is released, the file content is unchanged. */
+	rc = file->pMethods->xRead(file, page, 512, 512);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(page[0], ==, 9);
+
+	rc = file->pMethods->xClose(file);
+	munit_assert_int(rc, ==, 0);
+
+	free(buf_page_1);
+	free(buf_page_2);
+	free(file);
+
+	return MUNIT_OK;
+}
+
+/* Frames written by a transaction in progress are left out of a snapshot. */
+TEST(VfsSnapshot, uncommittedFrames, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	struct vfsSnapshot *snapshot;
+	void *buf1;
+	void *buf2;
+	size_t len1;
+	size_t len2;
+	char sql[128];
+	int i;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_insert(db, 100);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &buf1, &len1);
+	munit_assert_int(rv, ==, 0);
+
+	/* Make SQLite spill dirty pages to the WAL before committing. */
+	__db_exec(db, "PRAGMA cache_size=1");
+	__db_exec(db, "BEGIN");
+	for (i = 0; i < 500; i++) {
+		sprintf(sql, "INSERT INTO test(n) VALUES(%d)", i);
+		__db_exec(db, sql);
+	}
+
+	rv = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rv, ==, 0);
+	buf2 = __snapshot_read(snapshot, true, &len2);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(buf1, buf2, len1), ==, 0);
+	free(buf2);
+	VfsSnapshotRelease(snapshot);
+
+	/* The frames left behind by the rolled back transaction are left out
+	 * too. */
+	__db_exec(db, "ROLLBACK");
+
+	rv = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rv, ==, 0);
+	buf2 = __snapshot_read(snapshot, true, &len2);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(buf1, buf2, len1), ==, 0);
+	free(buf2);
+	VfsSnapshotRelease(snapshot);
+
+	raft_free(buf1);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsFileReadChunk
+ *
+ ******************************************************************************/
+
+SUITE(VfsFileReadChunk);
+
+/* Helper to read a whole file in chunks of the given size, checking that they
+ * match the given content. */
+static void __file_read_chunks(const char *vfs,
+			       const char *filename,
+			       const void *content,
+			       size_t len,
+			       size_t chunk)
+{
+	uint8_t *buf = munit_malloc(chunk);
+	size_t offset;
+	size_t size;
+	int rv;
+
+	for (offset = 0; offset < len; offset += chunk) {
+		size_t n = len - offset < chunk ? len - offset : chunk;
+		rv = VfsFileReadChunk(vfs, filename, offset, buf, n, &size);
+		munit_assert_int(rv, ==, 0);
+		munit_assert_int(size, ==, len);
+		munit_assert_int(
+		    memcmp(buf, (const uint8_t *)content + offset, n), ==, 0);
+	}
+
+	free(buf);
+}
+
+/* If the file being read does not exists, an error is returned. */
+TEST(VfsFileReadChunk, cantOpen, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	size_t size;
+	int rv;
+	(void)params;
+	rv = VfsFileReadChunk(f->vfs.zName, "test.db", 0, NULL, 0, &size);
+	munit_assert_int(rv, ==, SQLITE_CANTOPEN);
+	munit_assert_int(size, ==, 0);
+	return MUNIT_OK;
+}
+
+/* Reading zero bytes returns the size of the file, while reading past its end
+ * fails. */
+TEST(VfsFileReadChunk, size, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	uint8_t buf[16];
+	size_t size;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+
+	rv = VfsFileReadChunk(f->vfs.zName, "test.db", 0, NULL, 0, &size);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(size, ==, 512);
+
+	rv = VfsFileReadChunk(f->vfs.zName, "test.db-wal", 0, NULL, 0, &size);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(size, ==, 1104);
+
+	rv = VfsFileReadChunk(f->vfs.zName, "test.db", 500, buf, sizeof buf,
+			      &size);
+	munit_assert_int(rv, ==, SQLITE_IOERR_SHORT_READ);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Reading a file in chunks of any size yields the same bytes as VfsFileRead(),
+ * whether or not the chunks line up with pages and frames. */
+TEST(VfsFileReadChunk, matchesFileRead, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	size_t chunks[] = {1, 7, 24, 100, 512, 536, 1000, 4096, 1 << 20};
+	void *main;
+	void *wal;
+	size_t main_len;
+	size_t wal_len;
+	unsigned i;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_insert(db, 200);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_insert(db, 1000);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(main_len, >, 512);
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal, &wal_len);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(wal_len, >, 1104);
+
+	for (i = 0; i < sizeof chunks / sizeof *chunks; i++) {
+		__file_read_chunks(f->vfs.zName, "test.db", main, main_len,
+				   chunks[i]);
+		__file_read_chunks(f->vfs.zName, "test.db-wal", wal, wal_len,
+				   chunks[i]);
+	}
+
+	raft_free(main);
+	raft_free(wal);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsRestore
+ *
+ ******************************************************************************/
+
+SUITE(VfsRestore);
+
+/* Helper to count the rows of the test table. */
+static int __db_count(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int n;
+	int rv;
+
+	rv = sqlite3_prepare_v2(db, "SELECT count(*) FROM test", -1, &stmt,
+				NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_step(stmt);
+	munit_assert_int(rv, ==, SQLITE_ROW);
+	n = sqlite3_column_int(stmt, 0);
+	rv = sqlite3_finalize(stmt);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	return n;
+}
+
+/* Restoring the content of a database and of its WAL, spanning more than one
+ * slab, yields the same files. */
+TEST(VfsRestore, roundTrip, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	void *main1;
+	void *wal1;
+	void *buf;
+	size_t main_len;
+	size_t wal_len;
+	size_t len;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_exec(db,
+		  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		  "FROM c WHERE x < 600) "
+		  "INSERT INTO test(n) SELECT randomblob(400) FROM c");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_exec(db, "INSERT INTO test(n) VALUES(randomblob(400))");
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main1, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(main_len / 512, >, 256);
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal1, &wal_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(wal_len, >, 0);
+
+	__db_close(db);
+
+	rv = VfsRestore(f->vfs.zName, "test.db", main1, main_len, wal1,
+			wal_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, main_len);
+	munit_assert_int(memcmp(buf, main1, len), ==, 0);
+	raft_free(buf);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, wal_len);
+	munit_assert_int(memcmp(buf, wal1, len), ==, 0);
+	raft_free(buf);
+
+	raft_free(main1);
+	raft_free(wal1);
+
+	db = __db_open();
+	munit_assert_int(__db_count(db), ==, 601);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Restoring a database without a WAL drops the existing WAL frames. */
+TEST(VfsRestore, replace, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	void *main;
+	void *main2;
+	void *wal2;
+	void *buf;
+	size_t main_len;
+	size_t main2_len;
+	size_t wal2_len;
+	size_t len;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_insert(db, 10);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	__db_insert(db, 10);
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main2, &main2_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal2, &wal2_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(wal2_len, >, 0);
+	__db_close(db);
+
+	rv = VfsRestore(f->vfs.zName, "test.db", main2, main2_len, wal2,
+			wal2_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	raft_free(main2);
+	raft_free(wal2);
+
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len, NULL, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	raft_free(main);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, 0);
+
+	db = __db_open();
+	munit_assert_int(__db_count(db), ==, 10);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Images whose size doesn't match their page size are rejected. */
+TEST(VfsRestore, corrupt, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	void *main;
+	void *wal;
+	size_t main_len;
+	size_t wal_len;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal, &wal_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	__db_close(db);
+
+	rv = VfsRestore(f->vfs.zName, "test.db", main, 50, NULL, 0);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len - 1, NULL, 0);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len, wal,
+			wal_len - 1);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+
+	raft_free(main);
+	raft_free(wal);
+
+	return MUNIT_OK;
+}
+
+/* Restoring the images in pieces of a few pages or frames yields the same
+ * files as restoring them at once. */
+TEST(VfsRestore, pieces, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct vfsRestore *restore;
+	sqlite3 *db = __db_open();
+	void *main;
+	void *wal;
+	void *buf;
+	size_t main_len;
+	size_t wal_len;
+	size_t frame_size = FORMAT__WAL_FRAME_HDR_SIZE + 512;
+	size_t offset;
+	size_t len;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_exec(db,
+		  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		  "FROM c WHERE x < 600) "
+		  "INSERT INTO test(n) SELECT randomblob(400) FROM c");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_exec(db, "INSERT INTO test(n) VALUES(randomblob(400))");
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal, &wal_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+
+	rv = VfsRestoreStart(f->vfs.zName, "test.db", main_len, wal_len,
+			     &restore);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	/* Pieces must come in order. */
+	rv = VfsRestoreWrite(restore, false, 512, (uint8_t *)main + 512, 512);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+	rv = VfsRestoreWrite(restore, true, 0, wal, wal_len);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+
+	for (offset = 0; offset < main_len; offset += len) {
+		len = main_len - offset < 7 * 512 ? main_len - offset : 7 * 512;
+		rv = VfsRestoreWrite(restore, false, offset,
+				     (uint8_t *)main + offset, len);
+		munit_assert_int(rv, ==, SQLITE_OK);
+	}
+	rv = VfsRestoreWrite(restore, true, 0, wal,
+			     FORMAT__WAL_HDR_SIZE + frame_size);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	offset = FORMAT__WAL_HDR_SIZE + frame_size;
+	rv = VfsRestoreWrite(restore, true, offset, (uint8_t *)wal + offset,
+			     wal_len - offset);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsRestoreFinish(restore);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, main_len);
+	munit_assert_int(memcmp(buf, main, len), ==, 0);
+	raft_free(buf);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, wal_len);
+	munit_assert_int(memcmp(buf, wal, len), ==, 0);
+	raft_free(buf);
+
+	/* An incomplete restore leaves the database empty. */
+	rv = VfsRestoreStart(f->vfs.zName, "test.db", main_len, 0, &restore);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsRestoreWrite(restore, false, 0, main, 512);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsRestoreFinish(restore);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, 0);
+
+	raft_free(main);
+	raft_free(wal);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsLoadImage
+ *
+ ******************************************************************************/
+
+SUITE(VfsLoadImage);
+
+/* Helper to write the first @len bytes of @buf to a new file in @dir, and
+ * return a read-only file descriptor for it. */
+static int __image_create(const char *dir, const void *buf, size_t len)
+{
+	char path[256];
+	int fd;
+
+	sprintf(path, "%s/image.db", dir);
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	munit_assert_int(fd, >=, 0);
+	munit_assert_int(write(fd, buf, len), ==, len);
+	close(fd);
+
+	fd = open(path, O_RDONLY);
+	munit_assert_int(fd, >=, 0);
+
+	return fd;
+}
+
+/* Loading a database image maps its pages without copying them, until they
+ * get written. */
+TEST(VfsLoadImage, copyOnWrite, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	char *dir = test_dir_setup();
+	sqlite3 *db = __db_open();
+	sqlite3_file *file;
+	void *main;
+	void *page;
+	void *buf;
+	size_t main_len;
+	size_t len;
+	int flags;
+	int fd;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_exec(db,
+		  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		  "FROM c WHERE x < 600) "
+		  "INSERT INTO test(n) SELECT randomblob(400) FROM c");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(main_len / 512, >, 256);
+
+	/* Leave some frames in the WAL, which the image replaces. */
+	__db_exec(db, "DELETE FROM test");
+	__db_close(db);
+
+	fd = __image_create(dir, main, main_len);
+	rv = VfsLoadImage(&f->vfs, "test.db", fd);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	close(fd);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.mapped, ==, main_len);
+	munit_assert_int(stats.pages, ==, 0);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, main_len);
+	munit_assert_int(memcmp(buf, main, len), ==, 0);
+	raft_free(buf);
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &buf, &len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(len, ==, 0);
+
+	db = __db_open();
+	munit_assert_int(__db_count(db), ==, 600);
+
+	/* Checkpoints lend their frames to the mapped pages. */
+	__db_exec(db, "UPDATE test SET n = randomblob(300) WHERE rowid <= 5");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.pages, ==, 0);
+	munit_assert_int(stats.frames, >, 0);
+	munit_assert_int(stats.mapped, ==, main_len);
+
+	/* Other writes only fault the slab holding the page. */
+	file = munit_malloc(f->vfs.szOsFile);
+	flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_MAIN_DB;
+	rv = f->vfs.xOpen(&f->vfs, "test.db", file, flags, &flags);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	page = munit_malloc(512);
+	rv = file->pMethods->xRead(file, page, 512, 512 * 511);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = file->pMethods->xWrite(file, page, 512, 512 * 511);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	free(page);
+	file->pMethods->xClose(file);
+	free(file);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.pages, >, 0);
+	munit_assert_int(stats.mapped, >, 0);
+	munit_assert_int(stats.mapped, <, main_len);
+
+	db = __db_open();
+	munit_assert_int(__db_count(db), ==, 600);
+	__db_close(db);
+
+	raft_free(main);
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}
+
+/* Files whose size doesn't match their page size are rejected. */
+TEST(VfsLoadImage, corrupt, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	char *dir = test_dir_setup();
+	sqlite3 *db = __db_open();
+	void *main;
+	size_t main_len;
+	int fd;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+
+	fd = __image_create(dir, main, 50);
+	rv = VfsLoadImage(&f->vfs, "test.db", fd);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+	close(fd);
+
+	fd = __image_create(dir, main, main_len - 1);
+	rv = VfsLoadImage(&f->vfs, "test.db", fd);
+	munit_assert_int(rv, ==, SQLITE_CORRUPT);
+	close(fd);
+
+	raft_free(main);
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsCommit
+ *
+ ******************************************************************************/
+
+SUITE(VfsCommit);
+
+/* Helper to decode a big-endian 32-bit field of a WAL frame header. */
+static unsigned __frame_hdr_get32(const uint8_t *hdr, unsigned offset)
+{
+	const uint8_t *p = hdr + offset;
+	return (unsigned)p[0] << 24 | (unsigned)p[1] << 16 |
+	       (unsigned)p[2] << 8 | (unsigned)p[3];
+}
+
+/* Frames committed with VfsCommit() get their checksums only when the WAL is
+ * read, and those match the ones that SQLite computed for the same frames. */
+TEST(VfsCommit, lazyChecksums, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+	unsigned page_numbers[16];
+	uint8_t pages[16 * 512];
+	unsigned frame_size = FORMAT__WAL_FRAME_HDR_SIZE + 512;
+	unsigned n_frames;
+	unsigned n = 0;
+	unsigned i;
+	void *main;
+	void *wal1;
+	void *wal2;
+	size_t main_len;
+	size_t wal1_len;
+	size_t wal2_len;
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	for (i = 0; i < 20; i++) {
+		__db_exec(db, "INSERT INTO test(n) VALUES(randomblob(400))");
+	}
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal1, &wal1_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	__db_close(db);
+
+	/* Start over from an empty WAL with the same header, then replay the
+	 * frames written by SQLite one transaction at a time. */
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len, wal1,
+			FORMAT__WAL_HDR_SIZE);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	n_frames = (unsigned)(wal1_len - FORMAT__WAL_HDR_SIZE) / frame_size;
+	for (i = 0; i < n_frames; i++) {
+		const uint8_t *frame =
+		    (uint8_t *)wal1 + FORMAT__WAL_HDR_SIZE + i * frame_size;
+		unsigned database_size = __frame_hdr_get32(frame, 4);
+
+		munit_assert_int(n, <, 16);
+		page_numbers[n] = __frame_hdr_get32(frame, 0);
+		memcpy(pages + n * 512, frame + FORMAT__WAL_FRAME_HDR_SIZE,
+		       512);
+		n++;
+		if (database_size == 0) {
+			continue;
+		}
+		/* VfsCommit() uses the last page number as commit size. */
+		munit_assert_int(page_numbers[n - 1], ==, database_size);
+		rv = VfsCommit(&f->vfs, "test.db", n, page_numbers, pages);
+		munit_assert_int(rv, ==, 0);
+		n = 0;
+	}
+	munit_assert_int(n, ==, 0);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db-wal", &wal2, &wal2_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(wal2_len, ==, wal1_len);
+	munit_assert_int(memcmp(wal2, wal1, wal1_len), ==, 0);
+
+	raft_free(main);
+	raft_free(wal1);
+	raft_free(wal2);
+
+	/* SQLite accepts the frames when rebuilding the WAL index. */
+	db = __db_open();
+	munit_assert_int(__db_count(db), ==, 20);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsStats
+ *
+ ******************************************************************************/
+
+SUITE(VfsStats);
+
+/* Helper returning the total of the given memory counters. */
+static size_t __stats_total(const struct dqlite_vfs_stats *stats)
+{
+	return stats->pages + stats->frames + stats->shm + stats->overhead;
+}
+
+/* Helper returning the memory counters that are allocated with SQLite. WAL
+ * frames are not, since they are aligned to cache lines. */
+static size_t __stats_heap(const struct dqlite_vfs_stats *stats)
+{
+	return stats->pages + stats->shm + stats->overhead;
+}
+
+/* The memory counters of a database match the bytes allocated for it, as
+ * tracked by the test heap, except for WAL frames, which take whole cache
+ * lines. */
+TEST(VfsStats, matchesHeap, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct sqlite3_vfs src;
+	struct dqlite_vfs_stats stats;
+	sqlite3_file *file;
+	sqlite3 *db;
+	unsigned page_numbers[2] = {1, 2};
+	uint8_t pages[2 * 512];
+	void volatile *region;
+	void *main;
+	void *wal;
+	size_t main_len;
+	size_t wal_len;
+	int flags;
+	int used;
+	int rv;
+
+	(void)params;
+
+	/* Create the images of a database and of its WAL using a separate VFS,
+	 * which is then closed along with its frame pool. */
+	rv = VfsInitV1(&src, "src");
+	munit_assert_int(rv, ==, 0);
+	rv = sqlite3_open_v2("test.db", &db,
+			     SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "src");
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_exec(db, "PRAGMA page_size=512");
+	__db_exec(db, "PRAGMA synchronous=OFF");
+	__db_exec(db, "PRAGMA journal_mode=WAL");
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_exec(db,
+		  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		  "FROM c WHERE x < 600) "
+		  "INSERT INTO test(n) SELECT randomblob(400) FROM c");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_exec(db, "INSERT INTO test(n) VALUES(randomblob(400))");
+	rv = VfsFileRead("src", "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = VfsFileRead("src", "test.db-wal", &wal, &wal_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+	VfsClose(&src);
+
+	/* Create and delete an empty database and WAL first, so the array of
+	 * file contents of the VFS is already allocated. */
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len, wal,
+			FORMAT__WAL_HDR_SIZE);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = f->vfs.xDelete(&f->vfs, "test.db-wal", 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = f->vfs.xDelete(&f->vfs, "test.db", 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	used = test_heap_memory_used();
+
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len, wal, wal_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	raft_free(main);
+	raft_free(wal);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.pages, >=, main_len);
+	munit_assert_int(stats.frames, >, 0);
+	munit_assert_int(stats.shm, ==, 0);
+	munit_assert_int(stats.overhead, >, 0);
+	munit_assert_int(stats.frames % 64, ==, 0);
+	munit_assert_int(__stats_heap(&stats), ==,
+			 test_heap_memory_used() - used);
+
+	memset(pages, 0, sizeof pages);
+	rv = VfsCommit(&f->vfs, "test.db", 2, page_numbers, pages);
+	munit_assert_int(rv, ==, 0);
+
+	file = munit_malloc(f->vfs.szOsFile);
+	flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_MAIN_DB;
+	rv = f->vfs.xOpen(&f->vfs, "test.db", file, flags, &flags);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = file->pMethods->xShmMap(file, 0, FORMAT__WAL_IDX_PAGE_SIZE, 1,
+				     &region);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.shm, >=, FORMAT__WAL_IDX_PAGE_SIZE);
+	munit_assert_int(__stats_heap(&stats), ==,
+			 test_heap_memory_used() - used);
+
+	rv = file->pMethods->xClose(file);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	free(file);
+
+	rv = VfsStats(&f->vfs, "test.db-wal", &stats);
+	munit_assert_int(rv, ==, DQLITE_ERROR);
+
+	return MUNIT_OK;
+}
+
+/* Once the quota of a database is reached, SQLite writes fail with
+ * SQLITE_FULL, and succeed again after the quota is lifted. */
+TEST(VfsStats, quota, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	sqlite3 *db = __db_open();
+	int rv;
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+
+	VfsSetQuota(&f->vfs, __stats_total(&stats) + 16 * 1024);
+
+	rv = sqlite3_exec(db, "INSERT INTO test(n) VALUES(randomblob(400))",
+			  NULL, NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_exec(db,
+			  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT "
+			  "x+1 FROM c WHERE x < 100) "
+			  "INSERT INTO test(n) SELECT randomblob(400) FROM c",
+			  NULL, NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_FULL);
+	munit_assert_int(__db_count(db), ==, 1);
+
+	VfsSetQuota(&f->vfs, 0);
+	__db_exec(db,
+		  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		  "FROM c WHERE x < 100) "
+		  "INSERT INTO test(n) SELECT randomblob(400) FROM c");
+	munit_assert_int(__db_count(db), ==, 101);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsEnableSpill
+ *
+ ******************************************************************************/
+
+SUITE(VfsEnableSpill);
+
+/* Helper to insert @n rows of 400 random bytes and checkpoint them into the
+ * database. */
+static void __db_fill(sqlite3 *db, int n)
+{
+	char sql[256];
+	int rv;
+
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		"FROM c WHERE x < %d) "
+		"INSERT INTO test(n) SELECT randomblob(400) FROM c",
+		n);
+	__db_exec(db, sql);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+}
+
+/* Helper to check that the database is not corrupted. */
+static void __db_check(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	int rv;
+
+	rv = sqlite3_prepare_v2(db, "PRAGMA integrity_check", -1, &stmt, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_step(stmt);
+	munit_assert_int(rv, ==, SQLITE_ROW);
+	munit_assert_string_equal((const char *)sqlite3_column_text(stmt, 0),
+				  "ok");
+	rv = sqlite3_finalize(stmt);
+	munit_assert_int(rv, ==, SQLITE_OK);
+}
+
+/* Once the resident pages of a database exceed the budget, the least recently
+ * used ones get spilled, and are read back when needed. */
+TEST(VfsEnableSpill, budget, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	char *dir = test_dir_setup();
+	sqlite3 *db;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableSpill(&f->vfs, dir, 0, 16 * 1024);
+	munit_assert_int(rv, ==, 0);
+	rv = VfsEnableSpill(&f->vfs, dir, 0, 16 * 1024);
+	munit_assert_int(rv, ==, DQLITE_MISUSE);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_fill(db, 600);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.spilled, >, 0);
+	munit_assert_int(stats.pages, <, stats.spilled);
+
+	/* Reading all pages back with a fresh page cache, and writing them,
+	 * keeps spilling other pages. */
+	__db_close(db);
+	db = __db_open();
+	__db_check(db);
+	munit_assert_int(__db_count(db), ==, 600);
+	__db_exec(db, "UPDATE test SET n = randomblob(300)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+	db = __db_open();
+	__db_check(db);
+	__db_close(db);
+
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}
+
+/* Pages that were not used for the idle period get spilled by VfsSpill(). */
+TEST(VfsEnableSpill, idle, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	char *dir = test_dir_setup();
+	sqlite3 *db;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableSpill(&f->vfs, dir, 1, 0);
+	munit_assert_int(rv, ==, 0);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_fill(db, 600);
+	__db_close(db);
+
+	usleep(20 * 1000);
+	VfsSpill(&f->vfs);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.pages, ==, 0);
+	munit_assert_int(stats.spilled, >=, 600 * 400);
+
+	db = __db_open();
+	__db_check(db);
+	munit_assert_int(__db_count(db), ==, 600);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.pages, >=, 600 * 400);
+	munit_assert_int(stats.spilled, ==, 0);
+
+	__db_close(db);
+
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}
+
+/* A snapshot can pin spilled pages, which are left alone when the database
+ * writes them again. */
+TEST(VfsEnableSpill, snapshot, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	char *dir = test_dir_setup();
+	struct vfsSnapshot *snapshot;
+	sqlite3 *db;
+	void *main1;
+	void *main2;
+	size_t len1;
+	size_t len2;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableSpill(&f->vfs, dir, 1, 0);
+	munit_assert_int(rv, ==, 0);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_fill(db, 600);
+	usleep(20 * 1000);
+	VfsSpill(&f->vfs);
+
+	rv = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rv, ==, 0);
+	main1 = __snapshot_read(snapshot, false, &len1);
+
+	/* Rewrite all pages, then spill them again. */
+	__db_exec(db, "UPDATE test SET n = randomblob(400)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	usleep(20 * 1000);
+	VfsSpill(&f->vfs);
+
+	main2 = __snapshot_read(snapshot, false, &len2);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(main1, main2, len1), ==, 0);
+	free(main2);
+
+	VfsSnapshotRelease(snapshot);
+	free(main1);
+
+	__db_close(db);
+	db = __db_open();
+	__db_check(db);
+	__db_close(db);
+
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsEnableCompression
+ *
+ ******************************************************************************/
+
+SUITE(VfsEnableCompression);
+
+/* Helper to insert @n rows of compressible text and checkpoint them into the
+ * database. */
+static void __db_fill_text(sqlite3 *db, int n)
+{
+	char sql[256];
+	int rv;
+
+	sprintf(sql,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		"FROM c WHERE x < %d) "
+		"INSERT INTO test(n) SELECT printf('row %%d of %%s', x, "
+		"replace(hex(zeroblob(50)), '00', 'text ')) FROM c",
+		n);
+	__db_exec(db, sql);
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+}
+
+/* Pages that were not used during the last checkpoint get compressed, and are
+ * decompressed when read or written. */
+TEST(VfsEnableCompression, ratio, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	sqlite3 *db;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableCompression(&f->vfs, 1);
+	if (rv == DQLITE_ERROR) {
+		return MUNIT_SKIP;
+	}
+	munit_assert_int(rv, ==, 0);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n TEXT)");
+	__db_exec(db, "CREATE TABLE other (n INT)");
+	__db_fill_text(db, 1000);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.compressed, ==, 0);
+
+	/* Another checkpoint that doesn't touch the text. */
+	__db_exec(db, "INSERT INTO other(n) VALUES(1)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.compressed, >, 0);
+	munit_assert_int(stats.compressed, <=, stats.pages);
+	munit_assert_int(stats.uncompressed, >=, 3 * stats.compressed);
+
+	/* Reading all pages with a fresh page cache decompresses them. */
+	__db_close(db);
+	db = __db_open();
+	__db_check(db);
+	munit_assert_int(__db_count(db), ==, 1000);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.compressed_reads, >, 0);
+	munit_assert_int(stats.decompressed, >, 0);
+	munit_assert_int(stats.decompressed, <=, stats.compressed_reads);
+
+	/* Writing pages decompresses their slabs. */
+	__db_exec(db, "UPDATE test SET n = upper(n)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+	db = __db_open();
+	__db_check(db);
+	munit_assert_int(__db_count(db), ==, 1000);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Pages that don't shrink enough are left uncompressed. */
+TEST(VfsEnableCompression, incompressible, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	sqlite3 *db;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableCompression(&f->vfs, 1);
+	if (rv == DQLITE_ERROR) {
+		return MUNIT_SKIP;
+	}
+	munit_assert_int(rv, ==, 0);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_fill(db, 600);
+	__db_exec(db, "UPDATE test SET n = randomblob(400) WHERE rowid = 1");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.pages, >=, 600 * 400);
+	munit_assert_int(stats.compressed, <, stats.pages / 10);
+
+	__db_check(db);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/* Compressed pages are decompressed when reading a snapshot, and a snapshot can
+ * pin compressed slabs. */
+TEST(VfsEnableCompression, snapshot, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	struct vfsSnapshot *snapshot;
+	sqlite3 *db;
+	void *buf1;
+	void *buf2;
+	size_t len1;
+	size_t len2;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableCompression(&f->vfs, 1);
+	if (rv == DQLITE_ERROR) {
+		return MUNIT_SKIP;
+	}
+	munit_assert_int(rv, ==, 0);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n TEXT)");
+	__db_exec(db, "CREATE TABLE other (n INT)");
+	__db_fill_text(db, 1000);
+	__db_exec(db, "INSERT INTO other(n) VALUES(1)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(stats.compressed, >, 0);
+
+	rv = VfsSnapshotAcquire(f->vfs.zName, "test.db", &snapshot);
+	munit_assert_int(rv, ==, 0);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &buf1, &len1);
+	munit_assert_int(rv, ==, 0);
+	buf2 = __snapshot_read(snapshot, false, &len2);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(buf1, buf2, len1), ==, 0);
+	free(buf2);
+
+	/* Rewrite all pages while the snapshot pins them. */
+	__db_exec(db, "UPDATE test SET n = upper(n)");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	buf2 = __snapshot_read(snapshot, false, &len2);
+	munit_assert_int(len1, ==, len2);
+	munit_assert_int(memcmp(buf1, buf2, len1), ==, 0);
+	free(buf2);
+	raft_free(buf1);
+
+	VfsSnapshotRelease(snapshot);
+
+	__db_check(db);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsSetTempLimit
+ *
+ ******************************************************************************/
+
+SUITE(VfsSetTempLimit);
+
+/* Helper to open a new temporary file, like SQLite does for sorters. */
+static sqlite3_file *__temp_open(sqlite3_vfs *vfs)
+{
+	sqlite3_file *file = munit_malloc(vfs->szOsFile);
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+		    SQLITE_OPEN_EXCLUSIVE | SQLITE_OPEN_DELETEONCLOSE |
+		    SQLITE_OPEN_TEMP_JOURNAL;
+	int rc;
+
+	rc = vfs->xOpen(vfs, NULL, file, flags, &flags);
+	munit_assert_int(rc, ==, 0);
+
+	return file;
+}
+
+/* Helper to write @n bytes of a pattern depending on the offset. */
+static void __temp_write(sqlite3_file *file, sqlite3_int64 offset, int n)
+{
+	uint8_t *buf = munit_malloc((size_t)n);
+	int i;
+	int rc;
+
+	for (i = 0; i < n; i++) {
+		buf[i] = (uint8_t)((offset + i) % 251);
+	}
+	rc = file->pMethods->xWrite(file, buf, n, offset);
+	munit_assert_int(rc, ==, 0);
+	free(buf);
+}
+
+/* Helper to check that @n bytes match the pattern of __temp_write(). */
+static void __temp_check(sqlite3_file *file, sqlite3_int64 offset, int n)
+{
+	uint8_t *buf = munit_malloc((size_t)n);
+	int i;
+	int rc;
+
+	rc = file->pMethods->xRead(file, buf, n, offset);
+	munit_assert_int(rc, ==, 0);
+	for (i = 0; i < n; i++) {
+		munit_assert_int(buf[i], ==, (offset + i) % 251);
+	}
+	free(buf);
+}
+
+/* Temporary files kept in memory behave like regular files. */
+TEST(VfsSetTempLimit, memory, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file = __temp_open(&f->vfs);
+	sqlite3_int64 size;
+	uint8_t buf[64];
+	int rc;
+
+	(void)params;
+
+	/* Writes across chunk boundaries. */
+	__temp_write(file, 0, 1000);
+	__temp_write(file, 1000, 40000);
+	__temp_check(file, 0, 41000);
+	__temp_check(file, 16000, 1000);
+	rc = file->pMethods->xFileSize(file, &size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(size, ==, 41000);
+
+	/* Reads past the end are zero-filled. */
+	memset(buf, 0xff, sizeof buf);
+	rc = file->pMethods->xRead(file, buf, sizeof buf, 40990);
+	munit_assert_int(rc, ==, SQLITE_IOERR_SHORT_READ);
+	munit_assert_int(buf[9], ==, (40990 + 9) % 251);
+	munit_assert_int(buf[10], ==, 0);
+	munit_assert_int(buf[63], ==, 0);
+
+	/* Truncated content reads as zeros when the file grows again. */
+	rc = file->pMethods->xTruncate(file, 20000);
+	munit_assert_int(rc, ==, 0);
+	__temp_write(file, 36000, 100);
+	rc = file->pMethods->xRead(file, buf, sizeof buf, 19990);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(buf[9], ==, (19990 + 9) % 251);
+	munit_assert_int(buf[10], ==, 0);
+	__temp_check(file, 36000, 100);
+
+	rc = file->pMethods->xClose(file);
+	munit_assert_int(rc, ==, 0);
+	free(file);
+
+	return MUNIT_OK;
+}
+
+/* Once the limit is reached, the content of a temporary file moves to disk. */
+TEST(VfsSetTempLimit, overflow, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3_file *file1;
+	sqlite3_file *file2;
+	sqlite3_int64 size;
+	int i;
+	int rc;
+
+	(void)params;
+
+	VfsSetTempLimit(&f->vfs, 64 * 1024);
+
+	file1 = __temp_open(&f->vfs);
+	file2 = __temp_open(&f->vfs);
+
+	__temp_write(file2, 0, 1000);
+	for (i = 0; i < 50; i++) {
+		__temp_write(file1, i * 4096, 4096);
+	}
+	rc = file1->pMethods->xTruncate(file1, 150000);
+	munit_assert_int(rc, ==, 0);
+	__temp_write(file2, 1000, 1000);
+
+	__temp_check(file1, 0, 150000);
+	__temp_check(file2, 0, 2000);
+	rc = file1->pMethods->xFileSize(file1, &size);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(size, ==, 150000);
+
+	rc = file1->pMethods->xClose(file1);
+	munit_assert_int(rc, ==, 0);
+	rc = file2->pMethods->xClose(file2);
+	munit_assert_int(rc, ==, 0);
+	free(file1);
+	free(file2);
+
+	/* With no memory allowed, temporary files go to disk right away. */
+	VfsSetTempLimit(&f->vfs, 0);
+	file1 = __temp_open(&f->vfs);
+	__temp_write(file1, 0, 1000);
+	__temp_check(file1, 0, 1000);
+	rc = file1->pMethods->xClose(file1);
+	munit_assert_int(rc, ==, 0);
+	free(file1);
+
+	return MUNIT_OK;
+}
+
+/* Helper to check that a sort larger than the page cache returns ordered
+ * rows. */
+static void __db_sort(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 last = INT64_MIN;
+	int n = 0;
+	int rv;
+
+	rv = sqlite3_prepare_v2(db, "SELECT n FROM test ORDER BY n", -1, &stmt,
+				NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64 value = sqlite3_column_int64(stmt, 0);
+		munit_assert_int64(value, >=, last);
+		last = value;
+		n++;
+	}
+	munit_assert_int(rv, ==, SQLITE_DONE);
+	munit_assert_int(n, ==, 20000);
+	rv = sqlite3_finalize(stmt);
+	munit_assert_int(rv, ==, SQLITE_OK);
+}
+
+/* Sorts that spill out of the page cache give the same results whether their
+ * temporary files are in memory or on disk. */
+TEST(VfsSetTempLimit, sort, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	sqlite3 *db = __db_open();
+
+	(void)params;
+
+	__db_exec(db, "CREATE TABLE test (n INT, s TEXT)");
+	__db_exec(db,
+		  "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 "
+		  "FROM c WHERE x < 20000) "
+		  "INSERT INTO test(n, s) SELECT random(), hex(randomblob(20)) "
+		  "FROM c");
+	__db_exec(db, "PRAGMA cache_size=10");
+
+	__db_sort(db);
+	VfsSetTempLimit(&f->vfs, 16 * 1024);
+	__db_sort(db);
+	VfsSetTempLimit(&f->vfs, 0);
+	__db_sort(db);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsEnableHugePages
+ *
+ ******************************************************************************/
+
+SUITE(VfsEnableHugePages);
+
+/* Databases larger than a huge page use slabs of huge pages, both when growing
+ * and when restored from an image. */
+TEST(VfsEnableHugePages, slabs, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_vfs_stats stats;
+	sqlite3 *db;
+	void *main;
+	size_t main_len;
+	int rv;
+
+	(void)params;
+
+	rv = VfsEnableHugePages(&f->vfs);
+	if (rv == DQLITE_ERROR) {
+		return MUNIT_SKIP;
+	}
+	munit_assert_int(rv, ==, 0);
+
+	db = __db_open();
+	__db_exec(db, "CREATE TABLE test (n BLOB)");
+	__db_fill(db, 10000);
+	__db_check(db);
+
+	/* The huge page regions are counted as pages. */
+	rv = VfsStats(&f->vfs, "test.db", &stats);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ullong(stats.pages, >=, 2 * 1024 * 1024);
+
+	__db_exec(db, "DELETE FROM test WHERE rowid % 2 = 0");
+	__db_exec(db, "VACUUM");
+	rv = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_TRUNCATE,
+				       NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_check(db);
+
+	rv = VfsFileRead(f->vfs.zName, "test.db", &main, &main_len);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	__db_close(db);
+
+	rv = VfsRestore(f->vfs.zName, "test.db", main, main_len, NULL, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	raft_free(main);
+
+	db = __db_open();
+	__db_check(db);
+	munit_assert_int(__db_count(db), ==, 5000);
+	__db_close(db);
+
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * VfsEnableThreadSafety
+ *
+ ******************************************************************************/
+
+SUITE(VfsEnableThreadSafety);
+
+/* Number of transactions committed by the writer thread. */
+#define N_WRITES 500
+
+/* Number of reader threads. */
+#define N_READERS 4
+
+/* Shared state of the threads of the stress test. */
+struct stress
+{
+	bool done; /* Set by the writer after its last commit. */
+	int n;     /* Number of read transactions run by readers. */
+};
+
+/* Open a connection that waits for busy locks instead of failing. */
+static sqlite3 *__db_open_threaded(void)
+{
+	sqlite3 *db;
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+		    SQLITE_OPEN_NOMUTEX;
+	int rc;
+
+	rc = sqlite3_open_v2("test.db", &db, flags, "dqlite");
+	munit_assert_int(rc, ==, SQLITE_OK);
+	rc = sqlite3_busy_timeout(db, 10000);
+	munit_assert_int(rc, ==, SQLITE_OK);
+
+	__db_exec(db, "PRAGMA page_size=512");
+	__db_exec(db, "PRAGMA synchronous=OFF");
+	__db_exec(db, "PRAGMA journal_mode=WAL");
+
+	return db;
+}
+
+/* Keep committing transactions that insert a new row and update a running
+ * total, checkpointing the WAL every few of them. */
+static void *__stress_writer(void *arg)
+{
+	struct stress *s = arg;
+	sqlite3 *db = __db_open_threaded();
+	char sql[128];
+	int i;
+
+	__db_exec(db, "PRAGMA wal_autocheckpoint=20");
+	for (i = 1; i <= N_WRITES; i++) {
+		sprintf(sql,
+			"BEGIN; INSERT INTO test(n) VALUES(%d); "
+			"UPDATE total SET n = n + %d; COMMIT",
+			i, i);
+		__db_exec(db, sql);
+	}
+	__atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+
+	__db_close(db);
+
+	return NULL;
+}
+
+/* Keep checking that the running total always matches the committed rows. */
+static void *__stress_reader(void *arg)
+{
+	struct stress *s = arg;
+	sqlite3 *db = __db_open_threaded();
+	sqlite3_stmt *stmt;
+	int rv;
+
+	rv = sqlite3_prepare_v2(db,
+				"SELECT (SELECT coalesce(sum(n), 0) FROM test), "
+				"(SELECT n FROM total)",
+				-1, &stmt, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	while (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) {
+		rv = sqlite3_step(stmt);
+		munit_assert_int(rv, ==, SQLITE_ROW);
+		munit_assert_int(sqlite3_column_int(stmt, 0), ==,
+				 sqlite3_column_int(stmt, 1));
+		rv = sqlite3_reset(stmt);
+		munit_assert_int(rv, ==, SQLITE_OK);
+		__atomic_add_fetch(&s->n, 1, __ATOMIC_RELAXED);
+	}
+
+	sqlite3_finalize(stmt);
+	__db_close(db);
+
+	return NULL;
+}
+
+/* Readers running on their own threads always see a consistent database while
+ * a writer on another thread keeps committing and checkpointing. */
+TEST(VfsEnableThreadSafety, stress, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	struct stress s = {false, 0};
+	pthread_t writer;
+	pthread_t readers[N_READERS];
+	sqlite3 *db;
+	int i;
+	int rv;
+
+	(void)params;
+
+	VfsEnableThreadSafety(&f->vfs);
+
+	db = __db_open_threaded();
+	__db_exec(db, "CREATE TABLE test (n INT)");
+	__db_exec(db, "CREATE TABLE total (n INT)");
+	__db_exec(db, "INSERT INTO total(n) VALUES(0)");
+
+	for (i = 0; i < N_READERS; i++) {
+		rv = pthread_create(&readers[i], NULL, __stress_reader, &s);
+		munit_assert_int(rv, ==, 0);
+	}
+	rv = pthread_create(&writer, NULL, __stress_writer, &s);
+	munit_assert_int(rv, ==, 0);
+
+	rv = pthread_join(writer, NULL);
+	munit_assert_int(rv, ==, 0);
+	for (i = 0; i < N_READERS; i++) {
+		rv = pthread_join(readers[i], NULL);
+		munit_assert_int(rv, ==, 0);
+	}
+
+	munit_assert_int(s.n, >, 0);
+	munit_assert_int(__db_count(db), ==, N_WRITES);
+
+	__db_close(db);
+
+	return MUNIT_OK;
+}